@@ -49,7 +49,7 @@ rec {
 
   buildDeps =
     [ curl
-      bzip2 xz brotli editline
+      bzip2 xz brotli zlib editline
       openssl pkgconfig sqlite boehmgc
       boost
 
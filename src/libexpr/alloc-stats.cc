@@ -0,0 +1,276 @@
+#include "alloc-stats.hh"
+#include "eval.hh"
+#include "json.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <unordered_set>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+namespace nix {
+
+
+static const char * kindNames[] = { "values", "envs", "sets", "listElems" };
+
+
+static uintptr_t hidePointer(const void * p)
+{
+    return ~(uintptr_t) p;
+}
+
+
+template<typename T>
+AllocStats::ObjectMap<T>::~ObjectMap()
+{
+#if HAVE_BOEHMGC
+    for (auto & i : entries)
+        if (i.second.link)
+            GC_unregister_disappearing_link((void * *) &i.second.link);
+#endif
+}
+
+
+template<typename T>
+void AllocStats::ObjectMap<T>::insert(const void * obj, T data)
+{
+    auto & entry = entries[hidePointer(obj)];
+    entry.data = data;
+
+    /* A non-zero link means that this is still the same object. */
+    if (entry.link) return;
+
+    entry.link = hidePointer(obj);
+#if HAVE_BOEHMGC
+    if (GC_base((void *) obj) == obj)
+        GC_general_register_disappearing_link((void * *) &entry.link, obj);
+#endif
+
+    if (entries.size() >= pruneAt) {
+        for (auto i = entries.begin(); i != entries.end(); )
+            if (i->second.link) ++i; else i = entries.erase(i);
+        pruneAt = std::max(pruneAt, 2 * entries.size());
+    }
+}
+
+
+template<typename T>
+T * AllocStats::ObjectMap<T>::find(const void * obj)
+{
+    auto i = entries.find(hidePointer(obj));
+    if (i == entries.end()) return nullptr;
+    if (!i->second.link) {
+        /* The object was freed, and 'obj' is a new one. */
+        entries.erase(i);
+        return nullptr;
+    }
+    return &i->second.data;
+}
+
+
+template<typename T>
+void AllocStats::ObjectMap<T>::erase(const void * obj)
+{
+    auto i = entries.find(hidePointer(obj));
+    if (i != entries.end()) erase(i);
+}
+
+
+template<typename T>
+void AllocStats::ObjectMap<T>::erase(typename std::unordered_map<uintptr_t, Entry>::iterator i)
+{
+#if HAVE_BOEHMGC
+    if (i->second.link)
+        GC_unregister_disappearing_link((void * *) &i->second.link);
+#endif
+    entries.erase(i);
+}
+
+
+AllocStats::AllocStats(const Path & snapshotFile)
+    : snapshotFile(snapshotFile)
+{
+}
+
+
+void AllocStats::record(const Pos & pos, Kind kind, const void * obj, size_t count, size_t bytes)
+{
+    auto & site = sites[pos];
+    site.counts[kind] += count;
+    site.bytes += bytes;
+    if (!snapshotFile.empty() && obj)
+        objects.insert(obj, &site);
+}
+
+
+void AllocStats::recordThunk(const Value * v, const Pos & pos)
+{
+    if (pos)
+        thunks.insert(v, &sites.try_emplace(pos).first->first);
+    else
+        thunks.erase(v);
+}
+
+
+const Pos * AllocStats::thunkPos(const Value * v, const Pos * def)
+{
+    auto pos = thunks.find(v);
+    if (!pos) return def;
+    auto res = *pos;
+    thunks.erase(v);
+    return res;
+}
+
+
+std::vector<AllocStats::Sites::value_type *> AllocStats::sorted(
+    std::function<uint64_t(const Site &)> key, size_t max)
+{
+    std::vector<Sites::value_type *> res;
+    for (auto & i : sites)
+        if (key(i.second)) res.push_back(&i);
+    std::sort(res.begin(), res.end(), [&](Sites::value_type * a, Sites::value_type * b) {
+        return key(a->second) > key(b->second);
+    });
+    if (res.size() > max) res.resize(max);
+    return res;
+}
+
+
+static void posToJSON(JSONObject & obj, const Pos & pos)
+{
+    if (pos) {
+        obj.attr("file", (const string &) pos.file);
+        obj.attr("line", pos.line);
+        obj.attr("column", pos.column);
+    }
+}
+
+
+void AllocStats::toJSON(JSONList & list, size_t max)
+{
+    for (auto i : sorted([](const Site & site) { return site.bytes; }, max)) {
+        auto obj = list.object();
+        posToJSON(obj, i->first);
+        for (size_t n = 0; n < 4; ++n)
+            obj.attr(kindNames[n], i->second.counts[n]);
+        obj.attr("bytes", i->second.bytes);
+    }
+}
+
+
+void AllocStats::writeHeapSnapshot(Value & root)
+{
+    if (snapshotFile.empty()) return;
+
+    for (auto & i : sites)
+        i.second.retainedObjects = i.second.retainedBytes = 0;
+
+    /* Objects that weren't allocated by allocValue() etc. (such as
+       values on the stack) are attributed to the unknown position. */
+    auto & unknown = sites[noPos];
+    uint64_t totalObjects = 0, totalBytes = 0;
+
+    std::unordered_set<const void *> seen;
+
+    auto add = [&](const void * obj, size_t bytes) -> bool {
+        if (!seen.insert(obj).second) return false;
+        auto i = objects.find(obj);
+        auto & site = i ? **i : unknown;
+        site.retainedObjects++;
+        site.retainedBytes += bytes;
+        totalObjects++;
+        totalBytes += bytes;
+        return true;
+    };
+
+    /* Walk the heap without recursion, since deeply nested values
+       are common. */
+    std::vector<Value *> values{&root};
+    std::vector<Bindings *> bindings;
+
+    auto doEnv = [&](Env * env) {
+        for (; env; env = env->up) {
+            if (!add(env, sizeof(Env) + sizeof(Value *) * env->size)) break;
+            if (env->type != Env::HasWithExpr)
+                for (size_t n = 0; n < env->size; ++n)
+                    if (env->values[n]) values.push_back(env->values[n]);
+        }
+    };
+
+    while (!values.empty() || !bindings.empty()) {
+
+        if (!bindings.empty()) {
+            auto b = bindings.back();
+            bindings.pop_back();
+            if (b->layered()) {
+                /* Don't flatten the set, since that would allocate. */
+                if (!add(b, sizeof(Bindings) + sizeof(Bindings::Layer))) continue;
+                auto & l = b->layer();
+                for (auto b2 : {l.base, l.top, l.flat})
+                    if (b2) bindings.push_back(b2);
+            } else {
+                if (!add(b, sizeof(Bindings) + sizeof(Attr) * b->capacity()
+                        + Bindings::indexBytes(b->capacity()))) continue;
+                for (auto & i : *b)
+                    values.push_back(i.value);
+            }
+            continue;
+        }
+
+        auto & v = *values.back();
+        values.pop_back();
+        if (!add(&v, sizeof(Value))) continue;
+
+        switch (v.type) {
+        case tAttrs:
+            bindings.push_back(v.attrs);
+            break;
+        case tListN:
+            if (v.listSize() && !add(v.listElems(), v.listSize() * sizeof(Value *)))
+                break;
+            /* fall through */
+        case tList1:
+        case tList2:
+            for (size_t n = 0; n < v.listSize(); ++n)
+                values.push_back(v.listElems()[n]);
+            break;
+        case tThunk:
+            doEnv(v.thunk.env);
+            break;
+        case tLambda:
+            doEnv(v.lambda.env);
+            break;
+        case tApp:
+            values.push_back(v.app.left);
+            values.push_back(v.app.right);
+            break;
+        case tPrimOpApp:
+            values.push_back(v.primOpApp.left);
+            values.push_back(v.primOpApp.right);
+            break;
+        default:
+            ;
+        }
+    }
+
+    std::ofstream str(snapshotFile);
+    {
+        JSONObject obj(str, true);
+        obj.attr("objects", totalObjects);
+        obj.attr("bytes", totalBytes);
+        auto list = obj.list("sites");
+        for (auto i : sorted([](const Site & site) { return site.retainedBytes; }, sites.size())) {
+            auto obj2 = list.object();
+            posToJSON(obj2, i->first);
+            obj2.attr("objects", i->second.retainedObjects);
+            obj2.attr("bytes", i->second.retainedBytes);
+        }
+    }
+    str << "\n";
+    if (!str) throw SysError("writing heap snapshot to '%s'", snapshotFile);
+}
+
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+#include <functional>
+#include <unordered_map>
+
+namespace nix {
+
+
+class JSONList;
+struct Value;
+
+
+/* Allocation accounting for the evaluator, enabled by setting
+   NIX_COUNT_ALLOCS.  Every value, environment, attribute set and list
+   allocated is attributed to the position of the innermost function
+   call, primop call or operator ('//', '++', '+') being evaluated.
+   Allocations made while forcing a thunk are attributed to the
+   position that was current when the thunk was created, so that they
+   are charged to the code that delayed them rather than to the code
+   that happened to force them.  The sites that allocated the most
+   bytes are included in the NIX_SHOW_STATS output.
+
+   If NIX_HEAP_SNAPSHOT is set to a file name, the site of every
+   object is remembered as well, so that writeHeapSnapshot() can
+   attribute the objects reachable from a (deeply forced) value to
+   the sites that allocated them. */
+class AllocStats
+{
+public:
+
+    enum Kind { kValue, kEnv, kBindings, kListElems };
+
+    AllocStats(const Path & snapshotFile);
+
+    void record(const Pos & pos, Kind kind, const void * obj, size_t count, size_t bytes);
+
+    /* Remember that the thunk 'v' was created at 'pos'. */
+    void recordThunk(const Value * v, const Pos & pos);
+
+    /* Return the position at which the thunk 'v' was created, or
+       'def' if unknown, and forget about 'v'. */
+    const Pos * thunkPos(const Value * v, const Pos * def);
+
+    /* Add the top sites by number of bytes allocated to 'list'. */
+    void toJSON(JSONList & list, size_t max);
+
+    /* Write the sites of the objects reachable from 'v' to the
+       snapshot file, if any. */
+    void writeHeapSnapshot(Value & v);
+
+private:
+
+    struct PosHash
+    {
+        size_t operator () (const Pos & pos) const
+        {
+            return pos.file.id() ^ ((size_t) pos.line << 16) ^ pos.column;
+        }
+    };
+
+    struct PosEq
+    {
+        bool operator () (const Pos & a, const Pos & b) const
+        {
+            return a.file == b.file && a.line == b.line && a.column == b.column;
+        }
+    };
+
+    struct Site
+    {
+        uint64_t counts[4] = {0, 0, 0, 0};
+        uint64_t bytes = 0;
+        /* Filled in by writeHeapSnapshot(). */
+        uint64_t retainedObjects = 0, retainedBytes = 0;
+    };
+
+    typedef std::unordered_map<Pos, Site, PosHash, PosEq> Sites;
+    Sites sites;
+
+    Path snapshotFile;
+
+    /* A map from objects to 'T' that forgets objects once they have
+       been freed, so that it doesn't grow without bound and a new
+       object at the same address doesn't inherit the entry of the old
+       one.  With Boehm GC, every entry has a disappearing link to its
+       object, which the collector clears when it frees the object.
+       Such entries are ignored, and pruned whenever the map has
+       doubled in size.  Addresses are stored hidden, so that the map
+       never keeps an object alive.  Objects that the collector doesn't
+       free individually (e.g. those in an arena) stay valid until the
+       end of the evaluation anyway. */
+    template<typename T>
+    class ObjectMap
+    {
+    public:
+        ~ObjectMap();
+        void insert(const void * obj, T data);
+        T * find(const void * obj);
+        void erase(const void * obj);
+    private:
+        struct Entry
+        {
+            uintptr_t link = 0;
+            T data;
+        };
+        std::unordered_map<uintptr_t, Entry> entries;
+        size_t pruneAt = 1 << 16;
+        void erase(typename std::unordered_map<uintptr_t, Entry>::iterator i);
+    };
+
+    /* The site of every object allocated, if a snapshot was
+       requested. */
+    ObjectMap<Site *> objects;
+
+    /* The positions of the thunks that haven't been forced yet.
+       These point to the keys of 'sites', which are stable. */
+    ObjectMap<const Pos *> thunks;
+
+    std::vector<Sites::value_type *> sorted(std::function<uint64_t(const Site &)> key, size_t max);
+};
+
+
+}
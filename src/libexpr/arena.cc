@@ -0,0 +1,51 @@
+#include "arena.hh"
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+#include <cstdlib>
+
+namespace nix {
+
+
+Arena::~Arena()
+{
+    for (auto p : chunks) {
+#if HAVE_BOEHMGC
+        GC_FREE(p);
+#else
+        free(p);
+#endif
+    }
+}
+
+
+void * Arena::allocChunk(size_t n)
+{
+    /* Objects that would waste much of a chunk get a chunk of their
+       own, leaving the current one in place. */
+    bool own = n > chunkSize / 4;
+    size_t size = own ? n : chunkSize;
+
+    void * p;
+#if HAVE_BOEHMGC
+    p = GC_MALLOC_UNCOLLECTABLE(size);
+#else
+    p = calloc(size, 1);
+#endif
+    if (!p) throw std::bad_alloc();
+
+    chunks.push_back(p);
+    nrChunks++;
+    bytesAllocated += size;
+
+    if (own) return p;
+
+    ptr = (char *) p + n;
+    end = (char *) p + size;
+    return p;
+}
+
+
+}
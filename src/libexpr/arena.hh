@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.hh"
+
+namespace nix {
+
+/* A bump allocator for the evaluator's values, environments and
+   attribute sets (see the 'eval-arena' setting).  Objects are never
+   freed individually; all the memory is released at once when the
+   arena is destroyed, together with its EvalState.  Like allocBytes(),
+   it returns zeroed memory.
+
+   With Boehm GC, the chunks are allocated as uncollectable objects,
+   so the collector still scans them for pointers to collectable
+   objects (such as strings and list elements).
+
+   Arenas are not thread-safe, like the evaluator itself. */
+class Arena
+{
+public:
+
+    Arena() { }
+    Arena(const Arena &) = delete;
+    Arena & operator = (const Arena &) = delete;
+    ~Arena();
+
+    void * alloc(size_t n)
+    {
+        n = (n + alignment - 1) & ~(alignment - 1);
+        nrAllocs++;
+        bytesUsed += n;
+        if (n > (size_t) (end - ptr)) return allocChunk(n);
+        auto p = ptr;
+        ptr += n;
+        return p;
+    }
+
+    uint64_t nrAllocs = 0;
+    uint64_t nrChunks = 0;
+    uint64_t bytesAllocated = 0; // in chunks
+    uint64_t bytesUsed = 0;
+
+private:
+
+    /* Enough for every type allocated in an arena (Value contains
+       doubles and 64-bit integers). */
+    static const size_t alignment = 8;
+
+    static const size_t chunkSize = 1 << 20;
+
+    char * ptr = nullptr, * end = nullptr;
+
+    std::vector<void *> chunks;
+
+    void * allocChunk(size_t n);
+};
+
+}
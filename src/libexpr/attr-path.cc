@@ -1,5 +1,8 @@
 #include "attr-path.hh"
 #include "eval-inline.hh"
+#include "eval-cache.hh"
+#include "globals.hh"
+#include "store-api.hh"
 #include "util.hh"
 
 
@@ -93,4 +96,42 @@ Value * findAlongAttrPath(EvalState & state, const string & attrPath,
 }
 
 
+AttrPathCache::AttrPathCache(EvalState & state, const string & exprId, Bindings & autoArgs)
+    : state(state), exprId(exprId)
+    , enabled(evalSettings.evalCache && !exprId.empty() && autoArgs.empty())
+{
+}
+
+
+Hash AttrPathCache::key(const string & attrPath)
+{
+    std::ostringstream str;
+    str << "attr-path-1" << '\0'
+        << nixVersion << '\0'
+        << state.store->storeDir << '\0'
+        << settings.thisSystem << '\0'
+        << evalSettings.pureEval << evalSettings.restrictEval << '\0'
+        << exprId << '\0'
+        << attrPath << '\0';
+    for (auto & i : state.getSearchPath())
+        str << i.first << '=' << i.second << '\0';
+    return hashString(htSHA256, str.str());
+}
+
+
+bool AttrPathCache::lookup(const string & attrPath, Value & v)
+{
+    if (!enabled || !getEvalCache()->lookup(state, key(attrPath), v, fingerprints)) return false;
+    debug("using cached evaluation result for attribute path '%s'", attrPath);
+    return true;
+}
+
+
+void AttrPathCache::insert(const string & attrPath, const Value & v)
+{
+    if (enabled && !state.impure && EvalCache::isCacheable(v))
+        getEvalCache()->insert(state, key(attrPath), v);
+}
+
+
 }
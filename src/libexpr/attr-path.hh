@@ -1,6 +1,7 @@
 #pragma once
 
 #include "eval.hh"
+#include "eval-cache.hh"
 
 #include <string>
 #include <map>
@@ -10,4 +11,34 @@ namespace nix {
 Value * findAlongAttrPath(EvalState & state, const string & attrPath,
     Bindings & autoArgs, Value & vIn);
 
+/* Looks up and records the values of attribute paths of the
+   expression identified by 'exprId' (e.g. "file:" followed by its
+   file name) in the persistent evaluation cache (see eval-cache.hh).
+   It does nothing unless the 'eval-cache' option is set, 'exprId' is
+   non-empty and there are no automatic arguments, since those are not
+   part of the key. */
+class AttrPathCache
+{
+    EvalState & state;
+    string exprId;
+    bool enabled;
+
+    /* Commands like 'nix-env -qa' look up many entries that share
+       most of their inputs. */
+    EvalCache::Fingerprints fingerprints;
+
+    Hash key(const string & attrPath);
+
+public:
+
+    AttrPathCache(EvalState & state, const string & exprId, Bindings & autoArgs);
+
+    /* Set 'v' to the cached value of 'attrPath', if any. */
+    bool lookup(const string & attrPath, Value & v);
+
+    /* Record 'v' as the value of 'attrPath', unless it can't be
+       cached or the evaluation so far has been impure. */
+    void insert(const string & attrPath, const Value & v);
+};
+
 }
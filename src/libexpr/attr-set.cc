@@ -1,7 +1,10 @@
 #include "attr-set.hh"
+#include "arena.hh"
+#include "alloc-stats.hh"
 #include "eval-inline.hh"
 
 #include <algorithm>
+#include <cstring>
 
 
 namespace nix {
@@ -14,7 +17,10 @@ Bindings * EvalState::allocBindings(size_t capacity)
 {
     if (capacity > std::numeric_limits<Bindings::size_t>::max())
         throw Error("attribute set of size %d is too big", capacity);
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    size_t n = sizeof(Bindings) + sizeof(Attr) * capacity + Bindings::indexBytes(capacity);
+    auto bindings = new (arena ? arena->alloc(n) : allocBytes(n)) Bindings((Bindings::size_t) capacity);
+    if (allocStats) allocStats->record(*allocPos, AllocStats::kBindings, bindings, 1, n);
+    return bindings;
 }
 
 
@@ -29,6 +35,41 @@ void EvalState::mkAttrs(Value & v, size_t capacity)
     v.attrs = allocBindings(capacity);
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
+    nrAttrsetIndexBytes += Bindings::indexBytes(capacity);
+}
+
+
+/* Make 'v' the set 'base // top', without copying the attributes of
+   either set.  Only the attributes of 'top' are visited, to compute
+   the size of the result. */
+void EvalState::mkLayeredAttrs(Value & v, Bindings * base, Bindings * top)
+{
+    if (base->depth() >= Bindings::maxLayerDepth) base = base->flatten();
+    if (top->depth() >= Bindings::maxLayerDepth) top = top->flatten();
+
+    size_t size = base->size();
+    for (auto & i : *top)
+        if (!base->get(i.name)) size++;
+    if (size > std::numeric_limits<Bindings::size_t>::max())
+        throw Error("attribute set of size %d is too big", size);
+
+    size_t n = sizeof(Bindings) + sizeof(Bindings::Layer);
+    auto bindings = new (arena ? arena->alloc(n) : allocBytes(n)) Bindings(0);
+    bindings->size_ = size;
+    if (allocStats) allocStats->record(*allocPos, AllocStats::kBindings, bindings, 1, n);
+
+    auto & layer = bindings->layer();
+    layer.base = base;
+    layer.top = top;
+    layer.flat = nullptr;
+    layer.depth = std::max(base->depth(), top->depth()) + 1;
+    layer.state = this;
+
+    clearValue(v);
+    v.type = tAttrs;
+    v.attrs = bindings;
+    nrAttrsets++;
+    nrLayeredAttrsets++;
 }
 
 
@@ -45,7 +86,149 @@ Value * EvalState::allocAttr(Value & vAttrs, const Symbol & name)
 
 void Bindings::sort()
 {
+    if (layered()) return;
     std::sort(begin(), end());
+    if (hasIndex()) indexed() = 0;
+}
+
+
+unsigned long Bindings::nrIndexHits = 0;
+unsigned long Bindings::nrIndexMisses = 0;
+unsigned long Bindings::nrIndexBuilds = 0;
+unsigned long Bindings::nrIndexProbes[Bindings::maxProbeBucket];
+unsigned long Bindings::nrFlattened = 0;
+unsigned long Bindings::nrAttrsFlattened = 0;
+
+
+/* Return the first slot to probe for 'name'.  Symbols are typically
+   allocated at regular intervals, so their addresses are mixed
+   thoroughly (using the MurmurHash3 finaliser) to avoid clustering.
+   'slots' must be a power of two. */
+static inline uint64_t firstSlot(const Symbol & name, uint64_t slots)
+{
+    uint64_t h = name.id();
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h & (slots - 1);
+}
+
+
+/* Add the attributes that were pushed since the index was last
+   updated.  If the attributes have been reordered (i.e. the index
+   covers no attributes), the index is rebuilt from scratch. */
+void Bindings::buildIndex()
+{
+    auto slots = indexSlots(capacity_);
+    auto mask = slots - 1;
+    auto idx = index();
+
+    if (indexed() == 0) {
+        memset(idx, 0, sizeof(uint32_t) * slots);
+        nrIndexBuilds++;
+    }
+
+    for (size_t n = indexed(); n < size_; n++) {
+        auto i = firstSlot(attrs[n].name, slots);
+        /* If there are duplicate names, the first one wins. */
+        while (idx[i] && attrs[idx[i] - 1].name != attrs[n].name)
+            i = (i + 1) & mask;
+        if (!idx[i]) idx[i] = n + 1;
+    }
+
+    indexed() = size_;
+}
+
+
+Attr * Bindings::findIndexed(const Symbol & name)
+{
+    if (indexed() != size_) buildIndex();
+
+    auto slots = indexSlots(capacity_);
+    auto mask = slots - 1;
+    auto idx = index();
+
+    unsigned int probes = 1;
+    for (auto i = firstSlot(name, slots); ; i = (i + 1) & mask, probes++) {
+        auto n = idx[i];
+        if (!n || attrs[n - 1].name == name) {
+            nrIndexProbes[std::min(probes, maxProbeBucket) - 1]++;
+            if (!n) {
+                nrIndexMisses++;
+                return end();
+            }
+            nrIndexHits++;
+            return &attrs[n - 1];
+        }
+    }
+}
+
+
+Attr * Bindings::getLayered(const Symbol & name)
+{
+    auto & l = layer();
+    if (l.flat) return l.flat->get(name);
+    if (auto a = l.top->get(name)) return a;
+    return l.base->get(name);
+}
+
+
+Bindings * Bindings::flattenLayers()
+{
+    /* Collect the chain of layers down to the first set that is
+       already flat, so that the intermediate layers don't get
+       flattened (and kept alive) as well. */
+    std::vector<Bindings *> tops;
+    Bindings * bottom = this;
+    while (bottom->layered() && !bottom->layer().flat) {
+        tops.push_back(bottom->layer().top);
+        bottom = bottom->layer().base;
+    }
+
+    /* Merge the layers bottom-up, preferring attributes from the
+       upper layers. */
+    std::vector<Attr> res(bottom->begin(), bottom->end()), tmp;
+    for (auto t = tops.rbegin(); t != tops.rend(); ++t) {
+        tmp.clear();
+        tmp.reserve(res.size() + (*t)->size());
+        auto i = res.begin();
+        auto j = (*t)->begin();
+        while (i != res.end() && j != (*t)->end()) {
+            if (i->name == j->name) {
+                tmp.push_back(*j);
+                ++i; ++j;
+            }
+            else if (i->name < j->name)
+                tmp.push_back(*i++);
+            else
+                tmp.push_back(*j++);
+        }
+        tmp.insert(tmp.end(), i, res.end());
+        tmp.insert(tmp.end(), j, (*t)->end());
+        std::swap(res, tmp);
+    }
+
+    assert(res.size() == size_);
+
+    auto & l = layer();
+    auto & state = *l.state;
+
+    auto flat = state.allocBindings(size_);
+    for (auto & i : res)
+        flat->push_back(i);
+    state.nrAttrsets++;
+    state.nrAttrsInAttrsets += size_;
+    state.nrAttrsetIndexBytes += indexBytes(size_);
+
+    l.flat = flat;
+    l.base = l.top = nullptr;
+
+    nrFlattened++;
+    nrAttrsFlattened += size_;
+
+    return flat;
 }
 
 
@@ -9,6 +9,7 @@ namespace nix {
 
 
 class EvalState;
+class AllocStats;
 struct Value;
 
 /* Map one attribute name to its value. */
@@ -29,12 +30,49 @@ struct Attr
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
-   the number of elements already inserted in this structure. */
+   the number of elements already inserted in this structure.
+
+   Attribute sets with a capacity of at least 'indexThreshold' also
+   have a hash index, stored after the Attr elements, that maps symbols
+   to positions in 'attrs'.  It's an open-addressing table with linear
+   probing, preceded by the number of attributes it covers, and is
+   (re)built by find() when attributes have been added or reordered
+   since it was last built.  Smaller sets are searched using binary
+   search.
+
+   A set can also be 'layered', i.e. represent the result of 'base //
+   top' without copying the attributes of either operand.  Such a set
+   has a capacity of 0 (but a non-zero size) and is followed by a
+   Layer rather than by Attr elements.  Lookups through get() search
+   'top' and then 'base'; everything that needs the attributes as an
+   array (iteration, find(), lexicographicOrder()) first flattens the
+   set into an ordinary one, which is cached in the Layer. */
 class Bindings
 {
 public:
     typedef uint32_t size_t;
 
+    static constexpr size_t indexThreshold = 32;
+
+    /* Statistics about lookups in hash indices, for
+       EvalState::printStats().  'nrIndexProbes[i]' is the number of
+       lookups that needed i + 1 probes (the last element counts all
+       longer sequences). */
+    static unsigned long nrIndexHits, nrIndexMisses, nrIndexBuilds;
+    static constexpr unsigned int maxProbeBucket = 8;
+    static unsigned long nrIndexProbes[maxProbeBucket];
+
+    /* '//' only creates a layered set if its left-hand side has at
+       least this many attributes; smaller sets are copied. */
+    static constexpr size_t minLayeredSize = 32;
+
+    /* The maximum number of layers in a chain of '//' operations.
+       Beyond this, the left-hand side is flattened first. */
+    static constexpr unsigned int maxLayerDepth = 8;
+
+    /* Statistics about flattening of layered sets. */
+    static unsigned long nrFlattened, nrAttrsFlattened;
+
 private:
     size_t size_, capacity_;
     Attr attrs[0];
@@ -42,6 +80,75 @@ private:
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    struct Layer
+    {
+        /* The operands of '//'.  Cleared once the set has been
+           flattened, so that they can be garbage-collected. */
+        Bindings * base, * top;
+        Bindings * flat;
+        unsigned int depth;
+        /* The evaluator that allocates the flattened set. */
+        EvalState * state;
+    };
+
+    bool layered() const
+    {
+        return !capacity_ && size_;
+    }
+
+    Layer & layer()
+    {
+        return *(Layer *) &attrs[0];
+    }
+
+    const Layer & layer() const
+    {
+        return *(const Layer *) &attrs[0];
+    }
+
+    Attr * getLayered(const Symbol & name);
+
+    Bindings * flattenLayers();
+
+    bool hasIndex() const
+    {
+        return capacity_ >= indexThreshold;
+    }
+
+    /* Return the number of slots in the index of a set with the given
+       capacity: the smallest power of two that keeps the load factor
+       at or below 1/2. */
+    static uint64_t indexSlots(uint64_t capacity)
+    {
+        return (uint64_t) 1 << (64 - __builtin_clzll(capacity * 2 - 1));
+    }
+
+    /* Return the number of bytes to allocate after the Attr elements
+       for the index. */
+    static uint64_t indexBytes(uint64_t capacity)
+    {
+        return capacity >= indexThreshold
+            ? sizeof(uint32_t) * (1 + indexSlots(capacity))
+            : 0;
+    }
+
+    /* The number of attributes covered by the index. */
+    uint32_t & indexed()
+    {
+        return *(uint32_t *) &attrs[capacity_];
+    }
+
+    /* The index slots, each containing 0 if unused, or 1 plus the
+       position of an attribute. */
+    uint32_t * index()
+    {
+        return &indexed() + 1;
+    }
+
+    void buildIndex();
+
+    Attr * findIndexed(const Symbol & name);
+
 public:
     size_t size() const { return size_; }
 
@@ -57,27 +164,56 @@ public:
 
     iterator find(const Symbol & name)
     {
+        if (layered()) return flatten()->find(name);
+        if (hasIndex()) return findIndexed(name);
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return i;
         return end();
     }
 
-    iterator begin() { return &attrs[0]; }
-    iterator end() { return &attrs[size_]; }
+    /* Return the attribute named 'name', or nullptr if there is no
+       such attribute.  Unlike find(), this doesn't flatten layered
+       sets, so it should be preferred for lookups. */
+    Attr * get(const Symbol & name)
+    {
+        if (layered()) return getLayered(name);
+        auto i = find(name);
+        return i == end() ? nullptr : i;
+    }
+
+    iterator begin() { return layered() ? flatten()->begin() : &attrs[0]; }
+    iterator end() { return layered() ? flatten()->end() : &attrs[size_]; }
 
     Attr & operator[](size_t pos)
     {
-        return attrs[pos];
+        return layered() ? (*flatten())[pos] : attrs[pos];
     }
 
     void sort();
 
     size_t capacity() { return capacity_; }
 
+    /* The number of layers in this set (0 if it's not layered). */
+    unsigned int depth() const
+    {
+        return layered() ? layer().depth : 0;
+    }
+
+    /* If this is a layered set, return an ordinary set with the same
+       attributes, otherwise return this set. */
+    Bindings * flatten()
+    {
+        if (!layered()) return this;
+        if (layer().flat) return layer().flat;
+        return flattenLayers();
+    }
+
     /* Returns the attributes in lexicographically sorted order. */
     std::vector<const Attr *> lexicographicOrder() const
     {
+        if (layered())
+            return const_cast<Bindings *>(this)->flatten()->lexicographicOrder();
         std::vector<const Attr *> res;
         res.reserve(size_);
         for (size_t n = 0; n < size_; n++)
@@ -89,6 +225,7 @@ public:
     }
 
     friend class EvalState;
+    friend class AllocStats;
 };
 
 
@@ -0,0 +1,566 @@
+#include "eval.hh"
+#include "eval-inline.hh"
+
+namespace nix {
+
+
+/* A stack-based bytecode for Nix expressions, used instead of
+   Expr::eval() if 'eval-bytecode' is enabled.
+
+   An expression is compiled into a sequence of instructions that
+   evaluate the parts of the expression that are evaluated strictly,
+   e.g. the operands of '==' or the function in a function call.
+   Subexpressions that are evaluated lazily (function arguments, list
+   elements, the values of attributes and 'let' bindings, and function
+   bodies) become thunks just like in the tree-walking evaluator, and
+   are compiled separately when they're forced.  Expressions that are
+   rare or complex (attribute set literals, string concatenation,
+   variables bound by 'with', ...) are evaluated by calling
+   Expr::eval(), and the instructions for selection and '?' share
+   their implementation with the tree-walking evaluator, so laziness,
+   errors and positions are the same in both evaluators.
+
+   Every expression leaves exactly one value on the stack. */
+
+typedef enum {
+    opConst,        // push the Value at 'p'
+    opVar,          // push the variable at level 'n', displacement 'm' ('p' is the ExprVar)
+    opSelectVar,    // push the selection 'p' (an ExprSelect) from the variable at ('n', 'm')
+    opSelect,       // pop a value, push the selection 'p' (an ExprSelect) from it
+    opHasAttr,      // pop a value, push whether it has the attribute path of 'p' (an ExprOpHasAttr)
+    opCall,         // pop a function, push the result of applying it to the arguments of
+                    // the 'n' ExprApps starting at 'callArgs[m]'
+    opLambda,       // push the function 'p' (an ExprLambda)
+    opList,         // push the list 'p' (an ExprList)
+    opTest,         // pop a Boolean and jump to 'n' if it equals 'm' ('p' is the Pos for errors, if any)
+    opJump,         // jump to 'n'
+    opBool,         // push the Boolean 'm'
+    opAssert,       // pop a Boolean and fail the assertion 'p' (an ExprAssert) if it's false
+    opEq,           // pop two values, push whether they're equal
+    opNEq,          // pop two values, push whether they're not equal
+    opCheckAttrs,   // check that the top of the stack is a set
+    opUpdate,       // pop two sets, push their update ('p' is the ExprOpUpdate)
+    opConcatLists,  // pop two lists, push their concatenation ('p' is the ExprOpConcatLists)
+    opCheckPlain,   // jump to 'n' unless the top of the stack is a number, string or path
+    opConcatStrings,// pop the values of the first 'n' elements of 'p' (an ExprConcatStrings),
+                    // push the result of concatenating all its elements
+    opLet,          // enter the environment of 'p' (an ExprLet)
+    opWith,         // enter the environment of 'p' (an ExprWith)
+    opLeave,        // return to the environment that was current before the last opLet or opWith
+    opEval,         // push the value of 'p' (an Expr) computed by Expr::eval()
+} Opcode;
+
+
+struct Instr
+{
+    Opcode op;
+    uint32_t n, m;
+    void * p;
+};
+
+
+struct Bytecode
+{
+    std::vector<Instr> code;
+    std::vector<ExprApp *> callArgs;
+    /* The maximum depth of the value stack and of the environment
+       stack. */
+    unsigned int maxStack = 0, maxEnvs = 0;
+};
+
+
+struct BytecodeCompiler
+{
+    Bytecode & bc;
+    unsigned int depth = 0, envDepth = 0;
+
+    BytecodeCompiler(Bytecode & bc) : bc(bc) { }
+
+    size_t emit(Opcode op, uint32_t n = 0, uint32_t m = 0, void * p = nullptr)
+    {
+        bc.code.push_back({op, n, m, p});
+        return bc.code.size() - 1;
+    }
+
+    /* Make the jump at 'instr' go to the next instruction. */
+    void patch(size_t instr)
+    {
+        bc.code[instr].n = bc.code.size();
+    }
+
+    void push()
+    {
+        if (++depth > bc.maxStack) bc.maxStack = depth;
+    }
+
+    void pop(unsigned int n = 1)
+    {
+        assert(depth >= n);
+        depth -= n;
+    }
+
+    /* Emit code that pushes the Boolean 'b' if execution falls
+       through, or '!b' if it jumps to one of 'jumps'. */
+    void boolResult(bool b, const std::vector<size_t> & jumps)
+    {
+        emit(opBool, 0, b);
+        auto end = emit(opJump);
+        for (auto j : jumps) patch(j);
+        emit(opBool, 0, !b);
+        patch(end);
+        push();
+    }
+
+    void compileBody(Expr * e, Opcode op)
+    {
+        emit(op, 0, 0, e);
+        if (++envDepth > bc.maxEnvs) bc.maxEnvs = envDepth;
+        compile(op == opLet ? ((ExprLet *) e)->body : ((ExprWith *) e)->body);
+        emit(opLeave);
+        envDepth--;
+    }
+
+    void compile(Expr * e);
+};
+
+
+void BytecodeCompiler::compile(Expr * e)
+{
+    if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+        emit(opConst, 0, 0, &e2->v);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+        emit(opConst, 0, 0, &e2->v);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+        emit(opConst, 0, 0, &e2->v);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+        emit(opConst, 0, 0, &e2->v);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+        if (e2->fromWith)
+            emit(opEval, 0, 0, e2);
+        else
+            emit(opVar, e2->level, e2->displ, e2);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+        auto var = dynamic_cast<ExprVar *>(e2->e);
+        if (var && !var->fromWith) {
+            emit(opSelectVar, var->level, var->displ, e2);
+            push();
+        } else {
+            compile(e2->e);
+            emit(opSelect, 0, 0, e2);
+        }
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        compile(e2->e);
+        emit(opHasAttr, 0, 0, e2);
+    }
+
+    else if (dynamic_cast<ExprApp *>(e)) {
+        /* Compile 'f a b c' into a single call instruction. */
+        std::vector<ExprApp *> apps;
+        Expr * fun = e;
+        while (auto app = dynamic_cast<ExprApp *>(fun)) {
+            apps.push_back(app);
+            fun = app->e1;
+        }
+        compile(fun);
+        emit(opCall, apps.size(), bc.callArgs.size());
+        bc.callArgs.insert(bc.callArgs.end(), apps.rbegin(), apps.rend());
+    }
+
+    else if (dynamic_cast<ExprLambda *>(e)) {
+        emit(opLambda, 0, 0, e);
+        push();
+    }
+
+    else if (dynamic_cast<ExprList *>(e)) {
+        emit(opList, 0, 0, e);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+        compile(e2->cond);
+        auto test = emit(opTest, 0, false);
+        pop();
+        compile(e2->then);
+        auto end = emit(opJump);
+        pop();
+        patch(test);
+        compile(e2->else_);
+        patch(end);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+        compile(e2->cond);
+        emit(opAssert, 0, 0, e2);
+        pop();
+        compile(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+        compile(e2->e);
+        auto test = emit(opTest, 0, true);
+        pop();
+        boolResult(true, {test});
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpAnd *>(e)) {
+        compile(e2->e1);
+        auto test1 = emit(opTest, 0, false, &e2->pos);
+        pop();
+        compile(e2->e2);
+        auto test2 = emit(opTest, 0, false, &e2->pos);
+        pop();
+        boolResult(true, {test1, test2});
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpOr *>(e)) {
+        compile(e2->e1);
+        auto test1 = emit(opTest, 0, true, &e2->pos);
+        pop();
+        compile(e2->e2);
+        auto test2 = emit(opTest, 0, true, &e2->pos);
+        pop();
+        boolResult(false, {test1, test2});
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpImpl *>(e)) {
+        compile(e2->e1);
+        auto test1 = emit(opTest, 0, false, &e2->pos);
+        pop();
+        compile(e2->e2);
+        auto test2 = emit(opTest, 0, true, &e2->pos);
+        pop();
+        boolResult(false, {test1, test2});
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpEq *>(e)) {
+        compile(e2->e1);
+        compile(e2->e2);
+        emit(opEq);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNEq *>(e)) {
+        compile(e2->e1);
+        compile(e2->e2);
+        emit(opNEq);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpUpdate *>(e)) {
+        compile(e2->e1);
+        emit(opCheckAttrs);
+        compile(e2->e2);
+        emit(opCheckAttrs);
+        emit(opUpdate, 0, 0, e2);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpConcatLists *>(e)) {
+        compile(e2->e1);
+        compile(e2->e2);
+        emit(opConcatLists, 0, 0, e2);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        /* ExprConcatStrings coerces each element before evaluating
+           the next one, so only evaluate the second element first if
+           coercing the first one can't fail or have side effects. */
+        if (e2->es->size() > 2) {
+            emit(opEval, 0, 0, e2);
+            push();
+        } else {
+            compile((*e2->es)[0]);
+            if (e2->es->size() == 2) {
+                auto check = emit(opCheckPlain);
+                compile((*e2->es)[1]);
+                emit(opConcatStrings, 2, 0, e2);
+                pop();
+                auto end = emit(opJump);
+                patch(check);
+                emit(opConcatStrings, 1, 0, e2);
+                patch(end);
+            } else
+                emit(opConcatStrings, 1, 0, e2);
+        }
+    }
+
+    else if (dynamic_cast<ExprLet *>(e))
+        compileBody(e, opLet);
+
+    else if (dynamic_cast<ExprWith *>(e))
+        compileBody(e, opWith);
+
+    else {
+        emit(opEval, 0, 0, e);
+        push();
+    }
+}
+
+
+LocalNoInlineNoReturn(void throwAssertionError(const char * s, const Pos & pos))
+{
+    throw AssertionError(format(s) % pos);
+}
+
+
+static inline void checkBool(const Value & v, const Pos * pos)
+{
+    if (v.type != tBool) {
+        if (pos)
+            throwTypeError("value is %1% while a Boolean was expected, at %2%", v, *pos);
+        else
+            throwTypeError("value is %1% while a Boolean was expected", v);
+    }
+}
+
+
+#if HAVE_BOEHMGC
+typedef std::vector<Value, traceable_allocator<Value> > BytecodeStack;
+typedef std::vector<Env *, traceable_allocator<Env *> > BytecodeEnvs;
+#else
+typedef std::vector<Value> BytecodeStack;
+typedef std::vector<Env *> BytecodeEnvs;
+#endif
+
+
+static inline Value * getVar(Env * env, uint32_t level, uint32_t displ)
+{
+    for (auto l = level; l; --l, env = env->up) ;
+    return env->values[displ];
+}
+
+
+void EvalState::runBytecode(Expr & e, Env & env, Value & v)
+{
+    if (!e.bytecode) {
+        auto bc = new Bytecode;
+        BytecodeCompiler(*bc).compile(&e);
+        assert(bc->maxStack >= 1);
+        e.bytecode = bc;
+        nrBytecodeCompiled++;
+        nrBytecodeInstrs += bc->code.size();
+    }
+
+    const Bytecode & bc(*e.bytecode);
+
+    /* The operand stack and the saved environments usually fit in
+       small buffers on the C stack.  Larger ones are allocated on the
+       heap in memory that the garbage collector scans. */
+    const unsigned int maxInlineStack = 16, maxInlineEnvs = 8;
+
+    Value stackBuf[maxInlineStack];
+    BytecodeStack stackHeap;
+    Value * stack = stackBuf;
+    if (bc.maxStack > maxInlineStack) {
+        stackHeap.resize(bc.maxStack);
+        stack = stackHeap.data();
+    }
+    Value * sp = stack;
+
+    Env * envsBuf[maxInlineEnvs];
+    BytecodeEnvs envsHeap;
+    Env * * envs = envsBuf;
+    if (bc.maxEnvs + 1 > maxInlineEnvs) {
+        envsHeap.resize(bc.maxEnvs + 1);
+        envs = envsHeap.data();
+    }
+    unsigned int nrEnvs = 0;
+    Env * cur = &env;
+
+    auto code = bc.code.data();
+    auto end = code + bc.code.size();
+
+    for (auto pc = code; pc != end; ) {
+        auto & i = *pc++;
+
+        switch (i.op) {
+
+        case opConst:
+            *sp++ = *(Value *) i.p;
+            break;
+
+        case opVar: {
+            Value * v2 = getVar(cur, i.n, i.m);
+            forceValue(*v2, ((ExprVar *) i.p)->pos);
+            *sp++ = *v2;
+            break;
+        }
+
+        case opSelectVar: {
+            Value * v2 = getVar(cur, i.n, i.m);
+            auto select = (ExprSelect *) i.p;
+            forceValue(*v2, ((ExprVar *) select->e)->pos);
+            Value vTmp = *v2;
+            select->select(*this, *cur, vTmp, *sp++);
+            break;
+        }
+
+        case opSelect: {
+            Value vTmp = sp[-1];
+            ((ExprSelect *) i.p)->select(*this, *cur, vTmp, sp[-1]);
+            break;
+        }
+
+        case opHasAttr: {
+            Value vTmp = sp[-1];
+            ((ExprOpHasAttr *) i.p)->hasAttr(*this, *cur, vTmp, sp[-1]);
+            break;
+        }
+
+        case opCall: {
+            auto apps = &bc.callArgs[i.m];
+            for (uint32_t n = 0; n < i.n; ++n) {
+                Value vFun = sp[-1];
+                callFunction(vFun, *(apps[n]->e2->maybeThunk(*this, *cur)), sp[-1], apps[n]->pos);
+            }
+            break;
+        }
+
+        case opLambda: {
+            Value & v2 = *sp++;
+            v2.type = tLambda;
+            v2.lambda.env = cur;
+            v2.lambda.fun = (ExprLambda *) i.p;
+            break;
+        }
+
+        case opList: {
+            auto & elems = ((ExprList *) i.p)->elems;
+            Value & v2 = *sp++;
+            mkList(v2, elems.size());
+            for (size_t n = 0; n < elems.size(); ++n)
+                v2.listElems()[n] = elems[n]->maybeThunk(*this, *cur);
+            break;
+        }
+
+        case opTest: {
+            Value & v2 = *--sp;
+            checkBool(v2, (Pos *) i.p);
+            if (v2.boolean == (bool) i.m) pc = code + i.n;
+            break;
+        }
+
+        case opJump:
+            pc = code + i.n;
+            break;
+
+        case opBool:
+            mkBool(*sp++, i.m);
+            break;
+
+        case opAssert: {
+            auto assert_ = (ExprAssert *) i.p;
+            Value & v2 = *--sp;
+            checkBool(v2, &assert_->pos);
+            if (!v2.boolean)
+                throwAssertionError("assertion failed at %1%", assert_->pos);
+            break;
+        }
+
+        case opEq:
+        case opNEq: {
+            bool eq = eqValues(sp[-2], sp[-1]);
+            --sp;
+            mkBool(sp[-1], i.op == opEq ? eq : !eq);
+            break;
+        }
+
+        case opCheckAttrs:
+            if (sp[-1].type != tAttrs)
+                throwTypeError("value is %1% while a set was expected", sp[-1]);
+            break;
+
+        case opUpdate: {
+            Value v1 = sp[-2], v2 = sp[-1];
+            --sp;
+            AllocSite site(*this, ((ExprOpUpdate *) i.p)->pos);
+            updateAttrs(v1, v2, sp[-1]);
+            break;
+        }
+
+        case opConcatLists: {
+            Value v1 = sp[-2], v2 = sp[-1];
+            Value * lists[2] = { &v1, &v2 };
+            --sp;
+            auto & pos = ((ExprOpConcatLists *) i.p)->pos;
+            AllocSite site(*this, pos);
+            concatLists(sp[-1], 2, lists, pos);
+            break;
+        }
+
+        case opCheckPlain: {
+            auto type = sp[-1].type;
+            if (type != tInt && type != tFloat && type != tString && type != tPath)
+                pc = code + i.n;
+            break;
+        }
+
+        case opConcatStrings: {
+            Value * values = sp - i.n;
+            Value vRes;
+            auto concat = (ExprConcatStrings *) i.p;
+            AllocSite site(*this, concat->pos);
+            concat->concat(*this, *cur, values, i.n, vRes);
+            sp = values;
+            *sp++ = vRes;
+            break;
+        }
+
+        case opLet: {
+            auto & attrs = ((ExprLet *) i.p)->attrs->attrs;
+            Env & env2(allocEnv(attrs.size()));
+            env2.up = cur;
+            size_t displ = 0;
+            for (auto & j : attrs)
+                env2.values[displ++] = j.second.e->maybeThunk(*this, j.second.inherited ? *cur : env2);
+            envs[nrEnvs++] = cur;
+            cur = &env2;
+            break;
+        }
+
+        case opWith: {
+            auto with = (ExprWith *) i.p;
+            Env & env2(allocEnv(1));
+            env2.up = cur;
+            env2.prevWith = with->prevWith;
+            env2.type = Env::HasWithExpr;
+            env2.values[0] = (Value *) with->attrs;
+            envs[nrEnvs++] = cur;
+            cur = &env2;
+            break;
+        }
+
+        case opLeave:
+            cur = envs[--nrEnvs];
+            break;
+
+        case opEval:
+            ((Expr *) i.p)->eval(*this, *cur, *sp++);
+            break;
+        }
+    }
+
+    assert(sp == stack + 1);
+    v = stack[0];
+}
+
+
+}
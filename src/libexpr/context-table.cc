@@ -0,0 +1,128 @@
+#include "context-table.hh"
+
+#include <cstring>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
+
+namespace nix {
+
+
+Sync<ContextTable::State> ContextTable::state;
+
+
+size_t ContextTable::KeyHash::operator () (const Key & key) const
+{
+    size_t h = key.size();
+    for (auto p : key)
+        h = h * 31 + std::hash<const char *>()(p);
+    return h;
+}
+
+
+size_t ContextTable::PairHash::operator () (const std::pair<Context, Context> & p) const
+{
+    return std::hash<Context>()(p.first) * 31 + std::hash<Context>()(p.second);
+}
+
+
+ContextTable::Context ContextTable::internKey(State & state, Key && key)
+{
+    if (key.size() > maxInternedSize + 1) {
+        state.stats.uninterned++;
+        size_t size = key.size() * sizeof(const char *);
+#if HAVE_BOEHMGC
+        /* The elements are not on the garbage collected heap, so
+           the array doesn't need to be scanned. */
+        auto res = (Context) GC_MALLOC_ATOMIC(size);
+#else
+        auto res = (Context) malloc(size);
+#endif
+        if (!res) throw std::bad_alloc();
+        memcpy(res, key.data(), size);
+        return res;
+    }
+
+    auto res = state.contexts.insert(std::move(key));
+    if (res.second) state.stats.contexts++;
+    /* The elements of an unordered_set never move, and neither does
+       the storage of a vector that isn't modified. */
+    return const_cast<Context>(res.first->data());
+}
+
+
+ContextTable::Context ContextTable::intern(const PathSet & context)
+{
+    if (context.empty()) return nullptr;
+
+    auto state_(state.lock());
+
+    /* Since 'context' is sorted, so is the key. */
+    Key key;
+    key.reserve(context.size() + 1);
+    for (auto & i : context) {
+        auto res = state_->elements.insert(i);
+        if (res.second) state_->stats.elements++;
+        key.push_back(res.first->c_str());
+    }
+    key.push_back(nullptr);
+
+    return internKey(*state_, std::move(key));
+}
+
+
+ContextTable::Context ContextTable::merge(Context a, Context b)
+{
+    if (!b || a == b) return a;
+    if (!a) return b;
+
+    /* Union is commutative. */
+    if (a > b) std::swap(a, b);
+
+    auto state_(state.lock());
+
+    state_->stats.merges++;
+
+    auto i = state_->merges.find({a, b});
+    if (i != state_->merges.end()) {
+        state_->stats.mergeHits++;
+        return i->second;
+    }
+
+    /* Merge the sorted arrays.  Elements are interned, so equal
+       elements are equal pointers. */
+    Key key;
+    auto p = a, q = b;
+    while (*p && *q) {
+        if (*p == *q) { key.push_back(*p++); q++; }
+        else if (strcmp(*p, *q) < 0) key.push_back(*p++);
+        else key.push_back(*q++);
+    }
+    while (*p) key.push_back(*p++);
+    while (*q) key.push_back(*q++);
+    key.push_back(nullptr);
+
+    /* Results that aren't interned may be freed, so they can't be
+       memoised.  (Their addresses never match a memoised pair, since
+       those consist of interned contexts.) */
+    if (key.size() > maxInternedSize + 1)
+        return internKey(*state_, std::move(key));
+
+    auto res = internKey(*state_, std::move(key));
+    if (state_->merges.size() >= maxMerges) {
+        state_->merges.clear();
+        state_->stats.mergeEvictions++;
+    }
+    state_->merges.emplace(std::make_pair(a, b), res);
+    return res;
+}
+
+
+ContextTable::Stats ContextTable::stats()
+{
+    return state.lock()->stats;
+}
+
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "types.hh"
+#include "sync.hh"
+
+namespace nix {
+
+/* The table of string contexts (see Value::string).  Contexts are
+   hash-consed: every context array stored in a value comes from
+   intern() or merge(), so equal contexts are represented by the same
+   pointer, and the context of a concatenation can be computed by
+   merging the contexts of its parts by pointer, with the result
+   memoised in a cache of bounded size.  This matters because
+   strings that refer to derivations drag their contexts through many
+   concatenations.
+
+   Like symbols, interned contexts and their elements live outside
+   the garbage collected heap and are never freed.  So that a long
+   chain of concatenations (e.g. a fold over many derivation paths)
+   doesn't keep every intermediate context alive, contexts with more
+   than 'maxInternedSize' elements are not interned: they are
+   allocated on the garbage collected heap, and merging them is not
+   memoised.  Only their elements are interned. */
+
+class ContextTable
+{
+public:
+
+    /* A null-terminated array of store paths in sorted order, or
+       null for the empty context. */
+    typedef const char * * Context;
+
+    /* Return an array for 'context', which is canonical if it has at
+       most 'maxInternedSize' elements. */
+    static Context intern(const PathSet & context);
+
+    /* Return the union of two contexts obtained from intern() or
+       merge(). */
+    static Context merge(Context a, Context b);
+
+    struct Stats
+    {
+        unsigned long contexts = 0;
+        unsigned long elements = 0;
+        unsigned long merges = 0;
+        unsigned long mergeHits = 0;
+        unsigned long mergeEvictions = 0;
+        unsigned long uninterned = 0;
+    };
+
+    static Stats stats();
+
+private:
+
+    typedef std::vector<const char *> Key; // null-terminated
+
+    struct KeyHash
+    {
+        size_t operator () (const Key & key) const;
+    };
+
+    struct PairHash
+    {
+        size_t operator () (const std::pair<Context, Context> & p) const;
+    };
+
+    struct State
+    {
+        std::unordered_set<std::string> elements;
+        std::unordered_set<Key, KeyHash> contexts;
+        std::unordered_map<std::pair<Context, Context>, Context, PairHash> merges;
+        Stats stats;
+    };
+
+    static Sync<State> state;
+
+    /* The maximum number of memoised merges.  When it is reached,
+       the memo is cleared; the merged contexts themselves stay
+       interned. */
+    static const size_t maxMerges = 1 << 16;
+
+    static const size_t maxInternedSize = 32;
+
+    /* Return the canonical array for 'key', or a fresh one on the
+       garbage collected heap if 'key' is too big to be interned. */
+    static Context internKey(State & state, Key && key);
+};
+
+}
@@ -0,0 +1,261 @@
+#include "eval-cache.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "store-api.hh"
+#include "globals.hh"
+#include "source-cache.hh"
+
+#include <sqlite3.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists Results (
+    id        integer primary key autoincrement not null,
+    key       text unique not null,
+    type      integer not null,
+    value     text not null,
+    context   text not null,
+    timestamp integer not null
+);
+
+create table if not exists Inputs (
+    result      integer not null,
+    input       text not null,
+    fingerprint text not null,
+    primary key (result, input),
+    foreign key (result) references Results(id) on delete cascade
+);
+
+)sql";
+
+
+std::string fingerprintInput(const std::string & input)
+{
+    if (hasPrefix(input, "$")) {
+        auto value = getenv(input.c_str() + 1);
+        return value ? "=" + hashString(htSHA256, value).to_string(Base32, false) : "unset";
+    }
+
+    if (hasPrefix(input, "@")) {
+        try {
+            return fingerprintSource(string(input, 1), true, defaultPathFilter).to_string(Base32, false);
+        } catch (Error & e) {
+            return "missing";
+        }
+    }
+
+    /* Fingerprint the file that 'input' resolves to rather than a
+       symlink pointing to it, and include the resolved path so that
+       retargeting a symlink anywhere along the path is noticed. */
+    Path path;
+    try {
+        path = canonPath(input, true);
+    } catch (Error & e) {
+        return "missing";
+    }
+
+    struct stat st;
+    if (lstat(path.c_str(), &st))
+        return "missing";
+
+    return fmt("%s:%o:%d:%d.%09d:%d:%d",
+        path, st.st_mode, st.st_size,
+        st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+        st.st_ino, st.st_dev);
+}
+
+
+bool EvalCache::isCacheable(const Value & v)
+{
+    switch (v.type) {
+        case tInt:
+        case tBool:
+        case tNull:
+        case tString:
+        case tPath:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+class EvalCacheImpl : public EvalCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertResult, queryResult, insertInput, queryInputs;
+    };
+
+    Sync<State> _state;
+
+    EvalCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/eval-cache-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        if (sqlite3_busy_timeout(state->db, 60 * 60 * 1000) != SQLITE_OK)
+            throwSQLiteError(state->db, "setting timeout");
+
+        // We can always reproduce the cache.
+        state->db.exec("pragma synchronous = off");
+        state->db.exec("pragma main.journal_mode = truncate");
+        state->db.exec("pragma foreign_keys = on");
+
+        state->db.exec(schema);
+
+        state->insertResult.create(state->db,
+            "insert or replace into Results(key, type, value, context, timestamp) values (?, ?, ?, ?, ?)");
+
+        state->queryResult.create(state->db,
+            "select id, type, value, context from Results where key = ?");
+
+        state->insertInput.create(state->db,
+            "insert or replace into Inputs(result, input, fingerprint) values (?, ?, ?)");
+
+        state->queryInputs.create(state->db,
+            "select input, fingerprint from Inputs where result = ?");
+    }
+
+    bool lookup(EvalState & evalState, const Hash & key, Value & v,
+        Fingerprints & fingerprints) override
+    {
+        auto type = tNull;
+        string value;
+        PathSet context;
+
+        bool found = retrySQLite<bool>([&]() {
+            auto state(_state.lock());
+
+            auto queryResult(state->queryResult.use()(key.to_string(Base32, false)));
+            if (!queryResult.next()) return false;
+
+            auto id = queryResult.getInt(0);
+            type = (ValueType) queryResult.getInt(1);
+            value = queryResult.getStr(2);
+            context = tokenizeString<PathSet>(queryResult.getStr(3), " ");
+
+            auto queryInputs(state->queryInputs.use()(id));
+            while (queryInputs.next()) {
+                auto input = queryInputs.getStr(0);
+                auto i = fingerprints.find(input);
+                if (i == fingerprints.end())
+                    i = fingerprints.emplace(input, fingerprintInput(input)).first;
+                if (i->second != queryInputs.getStr(1)) {
+                    debug("evaluation cache entry '%s' is stale because '%s' changed",
+                        key.to_string(Base32, false), input);
+                    return false;
+                }
+            }
+
+            return true;
+        });
+
+        if (!found) return false;
+
+        /* The result may refer to store paths (e.g. a .drv file) that
+           have been garbage-collected since.  Register them as
+           temporary roots first, so that they can't be collected
+           between this check and their use by the caller. */
+        for (auto & i : context) {
+            auto path = decodeContext(i).first;
+            if (!settings.readOnlyMode) evalState.store->addTempRoot(path);
+            if (!evalState.store->isValidPath(path))
+                return false;
+        }
+
+        switch (type) {
+            case tInt:
+                if (!string2Int(value, v.integer)) return false;
+                v.type = tInt;
+                break;
+            case tBool:
+                mkBool(v, value == "1");
+                break;
+            case tNull:
+                mkNull(v);
+                break;
+            case tString:
+                mkString(v, value, context);
+                break;
+            case tPath:
+                mkPath(v, value.c_str());
+                break;
+            default:
+                return false;
+        }
+
+        return true;
+    }
+
+    void insert(EvalState & evalState, const Hash & key, const Value & v) override
+    {
+        assert(isCacheable(v));
+
+        string value;
+        PathSet context;
+
+        switch (v.type) {
+            case tInt: value = std::to_string(v.integer); break;
+            case tBool: value = v.boolean ? "1" : "0"; break;
+            case tString: value = v.string.s; copyContext(v, context); break;
+            case tPath: value = v.path; break;
+            default: break;
+        }
+
+        auto & inputs = evalState.accessedInputs;
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            state->insertResult.use()
+                (key.to_string(Base32, false))
+                (v.type)
+                (value)
+                (concatStringsSep(" ", context))
+                (time(0)).exec();
+
+            auto id = sqlite3_last_insert_rowid(state->db);
+
+            for (auto & i : inputs)
+                state->insertInput.use()(id)(i.first)(i.second).exec();
+
+            txn.commit();
+        });
+    }
+};
+
+ref<EvalCache> getEvalCache()
+{
+    /* A forked evaluation worker (see queryDrvInfos()) can't use the
+       database connection of its parent, so it opens its own.  The
+       parent's object is leaked rather than destroyed, since closing
+       the connection in the child would interfere with the parent. */
+    static std::mutex lock;
+    static std::shared_ptr<EvalCache> cache;
+    static pid_t pid = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!cache || pid != getpid()) {
+        if (cache) new std::shared_ptr<EvalCache>(cache);
+        cache = std::make_shared<EvalCacheImpl>();
+        pid = getpid();
+    }
+    return ref<EvalCache>(cache);
+}
+
+}
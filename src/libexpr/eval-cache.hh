@@ -0,0 +1,56 @@
+#pragma once
+
+#include "eval.hh"
+#include "ref.hh"
+
+#include <map>
+#include <optional>
+
+namespace nix {
+
+/* A persistent cache of evaluation results.  Each entry maps a key
+   describing an evaluation (typically the top-level expression, the
+   search path and an attribute path) to the resulting value, plus
+   the set of files and environment variables that the evaluation
+   depended on, together with a fingerprint of their state at the
+   time.  An entry is only returned if all those inputs still have
+   the same fingerprint.  Evaluations that used impure inputs (see
+   EvalState::impure) must not be stored.  Only values that don't
+   refer to other values (i.e. strings, paths, integers, Booleans and
+   null) are cached. */
+class EvalCache
+{
+public:
+
+    virtual ~EvalCache() { }
+
+    /* Return whether 'v' is a value that can be stored in the
+       cache. */
+    static bool isCacheable(const Value & v);
+
+    /* The fingerprints of the inputs checked by lookup(), so that
+       lookups that share inputs don't fingerprint them again.  Since
+       inputs can change at any time, a memo must not outlive the
+       top-level evaluation it was created for. */
+    typedef std::map<std::string, std::string> Fingerprints;
+
+    /* Look up the value cached under 'key'. Entries whose inputs
+       have changed, or whose string context refers to store paths
+       that are no longer valid, are ignored. */
+    virtual bool lookup(EvalState & state, const Hash & key, Value & v,
+        Fingerprints & fingerprints) = 0;
+
+    /* Store 'v' under 'key', recording the inputs accessed by
+       'state' up to now. */
+    virtual void insert(EvalState & state, const Hash & key, const Value & v) = 0;
+};
+
+/* Return the cache object of the current process, which can be used
+   concurrently by multiple threads. */
+ref<EvalCache> getEvalCache();
+
+/* Return a cheap fingerprint of the current state of an input
+   recorded by EvalState::recordAccess(). */
+std::string fingerprintInput(const std::string & input);
+
+}
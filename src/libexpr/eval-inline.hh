@@ -1,6 +1,7 @@
 #pragma once
 
 #include "eval.hh"
+#include "alloc-stats.hh"
 
 #define LocalNoInline(f) static f __attribute__((noinline)); f
 #define LocalNoInlineNoReturn(f) static f __attribute__((noinline, noreturn)); f
@@ -24,21 +25,54 @@ LocalNoInlineNoReturn(void throwTypeError(const char * s, const Value & v, const
 }
 
 
+/* Attributes the allocations made while it's alive to 'pos', if
+   allocation accounting is enabled. */
+struct AllocSite
+{
+    EvalState & state;
+    const Pos * prev;
+    AllocSite(EvalState & state, const Pos & pos) : state(state), prev(state.allocPos)
+    {
+        if (state.allocStats && pos) state.allocPos = &pos;
+    }
+    ~AllocSite()
+    {
+        state.allocPos = prev;
+    }
+};
+
+
+void EvalState::evalIn(Expr * e, Env & env, Value & v)
+{
+    if (useBytecode)
+        runBytecode(*e, env, v);
+    else
+        e->eval(*this, env, v);
+}
+
+
 void EvalState::forceValue(Value & v, const Pos & pos)
 {
     if (v.type == tThunk) {
         Env * env = v.thunk.env;
         Expr * expr = v.thunk.expr;
+        const Pos * prevAllocPos = nullptr;
+        if (allocStats) {
+            prevAllocPos = allocPos;
+            allocPos = allocStats->thunkPos(&v, allocPos);
+        }
         try {
             v.type = tBlackhole;
             //checkInterrupt();
-            expr->eval(*this, *env, v);
+            evalIn(expr, *env, v);
         } catch (...) {
             v.type = tThunk;
             v.thunk.env = env;
             v.thunk.expr = expr;
+            if (allocStats) allocPos = prevAllocPos;
             throw;
         }
+        if (allocStats) allocPos = prevAllocPos;
     }
     else if (v.type == tApp)
         callFunction(*v.app.left, *v.app.right, v, noPos);
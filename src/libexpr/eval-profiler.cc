@@ -0,0 +1,150 @@
+#include "eval-profiler.hh"
+#include "eval.hh"
+#include "json.hh"
+
+#include <algorithm>
+#include <iomanip>
+
+namespace nix {
+
+
+EvalProfiler::EvalProfiler(EvalState & state, const std::string & format, const Path & file)
+    : state(state), file(file), start(Clock::now())
+{
+    if (format == "chrome")
+        chrome = true;
+    else if (format == "flamegraph")
+        chrome = false;
+    else
+        throw Error("unknown evaluation profile format '%s'; expected 'flamegraph' or 'chrome'", format);
+
+    if (chrome) {
+        trace = std::make_unique<std::ofstream>(file);
+        if (!*trace) throw SysError("opening file '%s'", file);
+        *trace << "[\n" << std::fixed << std::setprecision(3);
+    }
+}
+
+
+EvalProfiler::~EvalProfiler()
+{
+    try {
+        /* Account for calls that are still in progress (e.g. because
+           of an exception that's being propagated). */
+        while (!stack.empty()) leave();
+
+        if (chrome) {
+            *trace << "\n]\n";
+            trace->close();
+            return;
+        }
+
+        std::ofstream str(file);
+        writeCollapsed(str, root, "", [](const Node & node) {
+            auto self = node.time;
+            for (auto & i : node.children) self -= i.second->time;
+            return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(self).count();
+        });
+
+        std::ofstream strAlloc(file + ".alloc");
+        writeCollapsed(strAlloc, root, "", [](const Node & node) {
+            auto self = node.allocated.bytes();
+            for (auto & i : node.children) self -= i.second->allocated.bytes();
+            return self;
+        });
+
+        if (!str || !strAlloc) throw SysError("writing evaluation profile to '%s'", file);
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+EvalProfiler::Counters EvalProfiler::counters()
+{
+    Counters c;
+    c.values = state.nrValues * sizeof(Value);
+    c.envs = state.nrEnvs * sizeof(Env) + state.nrValuesInEnvs * sizeof(Value *);
+    c.attrsets = state.bytesInAttrsets();
+    return c;
+}
+
+
+const std::string & EvalProfiler::label(Node & node)
+{
+    if (node.label.empty()) {
+        if (node.primOp)
+            node.label = "primop " + (string) ((const PrimOp *) node.fun)->name;
+        else {
+            auto & lambda = *(const ExprLambda *) node.fun;
+            node.label = fmt("%s at %s:%d:%d",
+                lambda.name.set() ? (string) lambda.name : "anonymous function",
+                (string) lambda.pos.file, lambda.pos.line, lambda.pos.column);
+        }
+        /* Semicolons separate the frames in collapsed stacks. */
+        std::replace(node.label.begin(), node.label.end(), ';', ',');
+    }
+    return node.label;
+}
+
+
+void EvalProfiler::enter(const void * fun, bool primOp)
+{
+    auto parent = stack.empty() ? &root : stack.back().node;
+    auto & child = parent->children[fun];
+    if (!child) child = std::make_unique<Node>(fun, primOp);
+    stack.push_back({child.get(), Clock::now(), counters()});
+}
+
+
+void EvalProfiler::leave()
+{
+    assert(!stack.empty());
+    auto frame = stack.back();
+    stack.pop_back();
+
+    auto now = Clock::now();
+    auto c = counters();
+    auto & node = *frame.node;
+
+    node.calls++;
+    node.time += now - frame.start;
+    node.allocated.values += c.values - frame.counters.values;
+    node.allocated.envs += c.envs - frame.counters.envs;
+    node.allocated.attrsets += c.attrsets - frame.counters.attrsets;
+
+    if (chrome) {
+        auto us = [](Clock::duration d) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0;
+        };
+        auto & str = *trace;
+        if (!firstEvent) str << ",\n";
+        firstEvent = false;
+        str << "{\"name\":";
+        toJSON(str, label(node));
+        str << ",\"cat\":\"" << (node.primOp ? "primop" : "function") << "\""
+            << ",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+            << ",\"ts\":" << us(frame.start - start)
+            << ",\"dur\":" << us(now - frame.start)
+            << ",\"args\":{\"values\":" << c.values - frame.counters.values
+            << ",\"envs\":" << c.envs - frame.counters.envs
+            << ",\"attrsets\":" << c.attrsets - frame.counters.attrsets
+            << "}}";
+    }
+}
+
+
+void EvalProfiler::writeCollapsed(std::ostream & str, Node & node, const std::string & prefix,
+    std::function<uint64_t(const Node &)> self)
+{
+    for (auto & i : node.children) {
+        auto & child = *i.second;
+        auto path = prefix.empty() ? label(child) : prefix + ";" + label(child);
+        auto n = self(child);
+        if (n) str << path << " " << n << "\n";
+        writeCollapsed(str, child, path, self);
+    }
+}
+
+
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "types.hh"
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+namespace nix {
+
+
+class EvalState;
+struct ExprLambda;
+struct PrimOp;
+
+
+/* An instrumenting profiler for the evaluator.  It records every call
+   of a function or primop, and attributes the time spent in it and
+   the values, environments and attribute sets allocated by it to the
+   call stack.  If enabled by the 'eval-profiler' setting, the profile
+   is written to 'eval-profile-file' in one of these formats:
+
+   - 'flamegraph': collapsed stacks (as consumed by flamegraph.pl),
+     weighted by the self time in microseconds.  The allocations are
+     written in the same format to a file with the suffix '.alloc',
+     weighted by the number of bytes allocated.
+
+   - 'chrome': the Chrome trace event format (chrome://tracing), with
+     one event per call.  The allocations of each call, including
+     those of its callees, are recorded in the event's arguments. */
+class EvalProfiler
+{
+public:
+
+    EvalProfiler(EvalState & state, const std::string & format, const Path & file);
+
+    /* Writes the profile. */
+    ~EvalProfiler();
+
+    /* Records a call for as long as it's alive. */
+    struct Call
+    {
+        EvalProfiler & profiler;
+        Call(EvalProfiler & profiler, const ExprLambda & lambda) : profiler(profiler)
+        {
+            profiler.enter(&lambda, false);
+        }
+        Call(EvalProfiler & profiler, const PrimOp & primOp) : profiler(profiler)
+        {
+            profiler.enter(&primOp, true);
+        }
+        ~Call()
+        {
+            profiler.leave();
+        }
+    };
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Counters
+    {
+        uint64_t values = 0, envs = 0, attrsets = 0; // in bytes
+        uint64_t bytes() const { return values + envs + attrsets; }
+    };
+
+    /* A node in the call tree, i.e. a call stack. */
+    struct Node
+    {
+        const void * fun; // ExprLambda or PrimOp
+        bool primOp;
+        std::string label; // computed on demand
+        std::unordered_map<const void *, std::unique_ptr<Node>> children;
+        uint64_t calls = 0;
+        /* Inclusive of callees. */
+        Clock::duration time{0};
+        Counters allocated;
+
+        Node(const void * fun, bool primOp) : fun(fun), primOp(primOp) { }
+    };
+
+    struct Frame
+    {
+        Node * node;
+        Clock::time_point start;
+        Counters counters;
+    };
+
+    EvalState & state;
+    bool chrome;
+    Path file;
+
+    Node root{nullptr, false};
+    std::vector<Frame> stack;
+    Clock::time_point start;
+
+    std::unique_ptr<std::ofstream> trace;
+    bool firstEvent = true;
+
+    Counters counters();
+
+    const std::string & label(Node & node);
+
+    void enter(const void * fun, bool primOp);
+
+    void leave();
+
+    void writeCollapsed(std::ostream & str, Node & node, const std::string & prefix,
+        std::function<uint64_t(const Node &)> self);
+};
+
+
+}
@@ -1,10 +1,16 @@
 #include "eval.hh"
+#include "arena.hh"
 #include "hash.hh"
 #include "util.hh"
 #include "store-api.hh"
 #include "derivations.hh"
 #include "globals.hh"
 #include "eval-inline.hh"
+#include "context-table.hh"
+#include "eval-cache.hh"
+#include "source-cache.hh"
+#include "eval-profiler.hh"
+#include "alloc-stats.hh"
 #include "download.hh"
 #include "json.hh"
 
@@ -42,6 +48,21 @@ static char * dupString(const char * s)
 }
 
 
+static char * dupString(const char * s, size_t size)
+{
+    char * t;
+#if HAVE_BOEHMGC
+    t = (char *) GC_MALLOC_ATOMIC(size + 1);
+#else
+    t = (char *) malloc(size + 1);
+#endif
+    if (!t) throw std::bad_alloc();
+    memcpy(t, s, size);
+    t[size] = 0;
+    return t;
+}
+
+
 static void printValue(std::ostream & str, std::set<const Value *> & active, const Value & v)
 {
     checkInterrupt();
@@ -205,6 +226,10 @@ void initGC()
        there. */
     GC_set_no_dls(1);
 
+    /* Make the collector usable in forked children that keep
+       evaluating (see queryDrvInfos()). */
+    GC_set_handle_fork(1);
+
     GC_INIT();
 
     GC_set_oom_fn(oomHandler);
@@ -304,11 +329,23 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , sOutputHashMode(symbols.create("outputHashMode"))
     , repair(NoRepair)
     , store(store)
+    , valueArena(evalSettings.evalArena ? std::make_unique<Arena>() : nullptr)
+    , arena(evalSettings.evalArena ? std::make_unique<Arena>() : nullptr)
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
 {
     countCalls = getEnv("NIX_COUNT_CALLS", "0") != "0";
 
+    trackAccesses = evalSettings.evalCache;
+    useBytecode = evalSettings.evalBytecode;
+
+    if (evalSettings.evalProfiler != "")
+        profiler = std::make_unique<EvalProfiler>(*this, evalSettings.evalProfiler, evalSettings.evalProfileFile);
+
+    auto heapSnapshot = getEnv("NIX_HEAP_SNAPSHOT");
+    if (getEnv("NIX_COUNT_ALLOCS", "0") != "0" || heapSnapshot != "")
+        allocStats = std::make_unique<AllocStats>(heapSnapshot);
+
     assert(gcInitialised);
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
@@ -353,8 +390,17 @@ EvalState::~EvalState()
 }
 
 
+void EvalState::recordAccess(const std::string & input)
+{
+    if (accessedInputs.count(input)) return;
+    accessedInputs.emplace(input, fingerprintInput(input));
+}
+
+
 Path EvalState::checkSourcePath(const Path & path_)
 {
+    if (trackAccesses) recordAccess(path_);
+
     if (!allowedPaths) return path_;
 
     auto i = resolvedPaths.find(path_);
@@ -553,15 +599,8 @@ void mkString(Value & v, const char * s)
 
 Value & mkString(Value & v, const string & s, const PathSet & context)
 {
-    mkString(v, s.c_str());
-    if (!context.empty()) {
-        size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
-        for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
-        v.string.context[n] = 0;
-    }
+    mkStringNoCopy(v, dupString(s.data(), s.size()));
+    v.string.context = ContextTable::intern(context);
     return v;
 }
 
@@ -586,8 +625,7 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
             env->values[0] = v;
             env->type = Env::HasWithAttrs;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        if (auto j = env->values[0]->attrs->get(var.name)) {
             if (countCalls && j->pos) attrSelects[*j->pos]++;
             return j->value;
         }
@@ -608,8 +646,9 @@ void finalizeValue(void * obj, void * data)
 Value * EvalState::allocValue()
 {
     nrValues++;
-    auto v = (Value *) allocBytes(sizeof(Value));
+    auto v = (Value *) (valueArena ? valueArena->alloc(sizeof(Value)) : allocBytes(sizeof(Value)));
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
+    if (allocStats) allocStats->record(*allocPos, AllocStats::kValue, v, 1, sizeof(Value));
     return v;
 }
 
@@ -621,9 +660,11 @@ Env & EvalState::allocEnv(size_t size)
 
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+    size_t n = sizeof(Env) + size * sizeof(Value *);
+    Env * env = (Env *) (arena ? arena->alloc(n) : allocBytes(n));
     env->size = (decltype(Env::size)) size;
     env->type = Env::Plain;
+    if (allocStats) allocStats->record(*allocPos, AllocStats::kEnv, env, 1, n);
 
     /* We assume that env->values has been cleared by the allocator; maybeThunk() and lookupVar fromWith expect this. */
 
@@ -644,6 +685,9 @@ void EvalState::mkList(Value & v, size_t size)
         v.bigList.elems = size ? (Value * *) allocBytes(size * sizeof(Value *)) : 0;
     }
     nrListElems += size;
+    if (allocStats && size)
+        allocStats->record(*allocPos, AllocStats::kListElems,
+            v.type == tListN ? v.bigList.elems : nullptr, size, size * sizeof(Value *));
 }
 
 
@@ -685,6 +729,7 @@ Value * Expr::maybeThunk(EvalState & state, Env & env)
 {
     Value * v = state.allocValue();
     mkThunk(*v, env, this);
+    if (state.allocStats) state.allocStats->recordThunk(v, *state.allocPos);
     return v;
 }
 
@@ -775,7 +820,7 @@ void EvalState::resetFileCache()
 
 void EvalState::eval(Expr * e, Value & v)
 {
-    e->eval(*this, baseEnv, v);
+    evalIn(e, baseEnv, v);
 }
 
 
@@ -860,6 +905,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
             if (hasOverrides && !i.second.inherited) {
                 vAttr = state.allocValue();
                 mkThunk(*vAttr, env2, i.second.e);
+                if (state.allocStats) state.allocStats->recordThunk(vAttr, *state.allocPos);
             } else
                 vAttr = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
             env2.values[displ++] = vAttr;
@@ -974,28 +1020,33 @@ unsigned long nrLookups = 0;
 void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
+    e->eval(state, env, vTmp);
+    select(state, env, vTmp, v);
+}
+
+
+void ExprSelect::select(EvalState & state, Env & env, Value & vTmp, Value & v)
+{
     Pos * pos2 = 0;
     Value * vAttrs = &vTmp;
 
-    e->eval(state, env, vTmp);
-
     try {
 
         for (auto & i : attrPath) {
             nrLookups++;
-            Bindings::iterator j;
+            Attr * j;
             Symbol name = getName(i, state, env);
             if (def) {
                 state.forceValue(*vAttrs, pos);
                 if (vAttrs->type != tAttrs ||
-                    (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                    !(j = vAttrs->attrs->get(name)))
                 {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs, pos);
-                if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if (!(j = vAttrs->attrs->get(name)))
                     throwEvalError("attribute '%1%' missing, at %2%", name, pos);
             }
             vAttrs = j->value;
@@ -1019,16 +1070,21 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
-    Value * vAttrs = &vTmp;
-
     e->eval(state, env, vTmp);
+    hasAttr(state, env, vTmp, v);
+}
+
+
+void ExprOpHasAttr::hasAttr(EvalState & state, Env & env, Value & vTmp, Value & v)
+{
+    Value * vAttrs = &vTmp;
 
     for (auto & i : attrPath) {
         state.forceValue(*vAttrs);
-        Bindings::iterator j;
+        Attr * j;
         Symbol name = getName(i, state, env);
         if (vAttrs->type != tAttrs ||
-            (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+            !(j = vAttrs->attrs->get(name)))
         {
             mkBool(v, false);
             return;
@@ -1084,7 +1140,15 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
         /* And call the primop. */
         nrPrimOpCalls++;
         if (countCalls) primOpCalls[primOp->primOp->name]++;
-        primOp->primOp->fun(*this, pos, vArgs, v);
+        if (profiler) {
+            EvalProfiler::Call call(*profiler, *primOp->primOp);
+            AllocSite site(*this, pos);
+            primOp->primOp->fun(*this, pos, vArgs, v);
+        } else if (allocStats) {
+            AllocSite site(*this, pos);
+            primOp->primOp->fun(*this, pos, vArgs, v);
+        } else
+            primOp->primOp->fun(*this, pos, vArgs, v);
     } else {
         Value * fun2 = allocValue();
         *fun2 = fun;
@@ -1109,8 +1173,8 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     }
 
     if (fun.type == tAttrs) {
-      auto found = fun.attrs->find(sFunctor);
-      if (found != fun.attrs->end()) {
+      auto found = fun.attrs->get(sFunctor);
+      if (found) {
         /* fun may be allocated on the stack of the calling function,
          * but for functors we may keep a reference, so heap-allocate
          * a copy and use that instead.
@@ -1127,6 +1191,20 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     if (fun.type != tLambda)
         throwTypeError("attempt to call something which is not a function but %1%, at %2%", fun, pos);
 
+    /* Attribute the allocations made by the call, including its
+       environment, to the lambda.  This is a separate branch because
+       the AllocSite's destructor would make this function not
+       tail-recursive. */
+    if (allocStats) {
+        AllocSite site(*this, fun.lambda.fun->pos);
+        callLambda(fun, arg, v, pos);
+    } else
+        callLambda(fun, arg, v, pos);
+}
+
+
+void EvalState::callLambda(Value & fun, Value & arg, Value & v, const Pos & pos)
+{
     ExprLambda & lambda(*fun.lambda.fun);
 
     auto size =
@@ -1151,8 +1229,8 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
            argument has a default, use the default. */
         size_t attrsUsed = 0;
         for (auto & i : lambda.formals->formals) {
-            Bindings::iterator j = arg.attrs->find(i.name);
-            if (j == arg.attrs->end()) {
+            auto j = arg.attrs->get(i.name);
+            if (!j) {
                 if (!i.def) throwTypeError("%1% called without required argument '%2%', at %3%",
                     lambda, i.name, pos);
                 env2.values[displ++] = i.def->maybeThunk(*this, env2);
@@ -1177,17 +1255,21 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     nrFunctionCalls++;
     if (countCalls) incrFunctionCall(&lambda);
 
-    /* Evaluate the body.  This is conditional on showTrace, because
-       catching exceptions makes this function not tail-recursive. */
-    if (settings.showTrace)
+    /* Evaluate the body.  This is conditional on showTrace and the
+       profiler, because catching exceptions or doing anything after
+       the call returns makes this function not tail-recursive. */
+    if (settings.showTrace || profiler) {
+        std::optional<EvalProfiler::Call> call;
+        if (profiler) call.emplace(*profiler, lambda);
         try {
-            lambda.body->eval(*this, env2, v);
+            evalIn(lambda.body, env2, v);
         } catch (Error & e) {
-            addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
+            if (settings.showTrace)
+                addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
             throw;
         }
-    else
-        fun.lambda.fun->body->eval(*this, env2, v);
+    } else
+        evalIn(fun.lambda.fun->body, env2, v);
 }
 
 
@@ -1204,8 +1286,8 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
     forceValue(fun);
 
     if (fun.type == tAttrs) {
-        auto found = fun.attrs->find(sFunctor);
-        if (found != fun.attrs->end()) {
+        auto found = fun.attrs->get(sFunctor);
+        if (found) {
             Value * v = allocValue();
             callFunction(*found->value, fun, *v, noPos);
             forceValue(*v);
@@ -1306,13 +1388,27 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     Value v1, v2;
     state.evalAttrs(env, e1, v1);
     state.evalAttrs(env, e2, v2);
+    AllocSite site(state, pos);
+    state.updateAttrs(v1, v2, v);
+}
 
-    state.nrOpUpdates++;
+
+void EvalState::updateAttrs(Value & v1, Value & v2, Value & v)
+{
+    nrOpUpdates++;
 
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
-    state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
+    /* Updating a large set (e.g. a package set in an overlay) creates
+       a layered set on top of it, so that its attributes don't have
+       to be copied unless the result is iterated over. */
+    if (v1.attrs->size() >= Bindings::minLayeredSize) {
+        mkLayeredAttrs(v, v1.attrs, v2.attrs);
+        return;
+    }
+
+    mkAttrs(v, v1.attrs->size() + v2.attrs->size());
 
     /* Merge the sets, preferring values from the second set.  Make
        sure to keep the resulting vector in sorted order. */
@@ -1333,7 +1429,7 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     while (i != v1.attrs->end()) v.attrs->push_back(*i++);
     while (j != v2.attrs->end()) v.attrs->push_back(*j++);
 
-    state.nrOpUpdateValuesCopied += v.attrs->size();
+    nrOpUpdateValuesCopied += v.attrs->size();
 }
 
 
@@ -1342,6 +1438,7 @@ void ExprOpConcatLists::eval(EvalState & state, Env & env, Value & v)
     Value v1; e1->eval(state, env, v1);
     Value v2; e2->eval(state, env, v2);
     Value * lists[2] = { &v1, &v2 };
+    AllocSite site(state, pos);
     state.concatLists(v, 2, lists, pos);
 }
 
@@ -1377,8 +1474,18 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
-    PathSet context;
-    std::ostringstream s;
+    AllocSite site(state, pos);
+    concat(state, env, nullptr, 0, v);
+}
+
+
+void ExprConcatStrings::concat(EvalState & state, Env & env, Value * values, size_t nrValues, Value & v)
+{
+    /* The contexts of the parts are merged by pointer (see
+       ContextTable), and the parts are copied only once into 's'
+       before the result is allocated. */
+    ContextTable::Context context = nullptr;
+    string s;
     NixInt n = 0;
     NixFloat nf = 0;
 
@@ -1387,7 +1494,11 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 
     for (auto & i : *es) {
         Value vTmp;
-        i->eval(state, env, vTmp);
+        if (nrValues) {
+            vTmp = *values++;
+            nrValues--;
+        } else
+            i->eval(state, env, vTmp);
 
         /* If the first element is a path, then the result will also
            be a path, we don't copy anything (yet - that's done later,
@@ -1415,8 +1526,14 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf += vTmp.fpoint;
             } else
                 throwEvalError("cannot add %1% to a float, at %2%", showType(vTmp), pos);
-        } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
+        } else if (vTmp.type == tString) {
+            s.append(vTmp.string.s);
+            context = ContextTable::merge(context, vTmp.string.context);
+        } else {
+            PathSet context2;
+            s.append(state.coerceToString(pos, vTmp, context2, false, firstType == tString));
+            context = ContextTable::merge(context, ContextTable::intern(context2));
+        }
     }
 
     if (firstType == tInt)
@@ -1424,12 +1541,16 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     else if (firstType == tFloat)
         mkFloat(v, nf);
     else if (firstType == tPath) {
-        if (!context.empty())
+        if (context)
             throwEvalError("a string that refers to a store path cannot be appended to a path, at %1%", pos);
-        auto path = canonPath(s.str());
+        auto path = canonPath(s);
         mkPath(v, path.c_str());
-    } else
-        mkString(v, s.str(), context);
+    } else {
+        state.nrStringConcats++;
+        state.nrStringBytesCopied += s.size();
+        mkStringNoCopy(v, dupString(s.data(), s.size()));
+        v.string.context = context;
+    }
 }
 
 
@@ -1502,7 +1623,7 @@ bool EvalState::forceBool(Value & v, const Pos & pos)
 
 bool EvalState::isFunctor(Value & fun)
 {
-    return fun.type == tAttrs && fun.attrs->find(sFunctor) != fun.attrs->end();
+    return fun.type == tAttrs && fun.attrs->get(sFunctor);
 }
 
 
@@ -1561,8 +1682,8 @@ string EvalState::forceStringNoCtx(Value & v, const Pos & pos)
 bool EvalState::isDerivation(Value & v)
 {
     if (v.type != tAttrs) return false;
-    Bindings::iterator i = v.attrs->find(sType);
-    if (i == v.attrs->end()) return false;
+    auto i = v.attrs->get(sType);
+    if (!i) return false;
     forceValue(*i->value);
     if (i->value->type != tString) return false;
     return strcmp(i->value->string.s, "derivation") == 0;
@@ -1587,14 +1708,14 @@ string EvalState::coerceToString(const Pos & pos, Value & v, PathSet & context,
     }
 
     if (v.type == tAttrs) {
-        auto i = v.attrs->find(sToString);
-        if (i != v.attrs->end()) {
+        auto i = v.attrs->get(sToString);
+        if (i) {
             Value v1;
             callFunction(*i->value, v, v1, pos);
             return coerceToString(pos, v1, context, coerceMore, copyToStore);
         }
-        i = v.attrs->find(sOutPath);
-        if (i == v.attrs->end()) throwTypeError("cannot coerce a set to a string, at %1%", pos);
+        i = v.attrs->get(sOutPath);
+        if (!i) throwTypeError("cannot coerce a set to a string, at %1%", pos);
         return coerceToString(pos, *i->value, context, coerceMore, copyToStore);
     }
 
@@ -1638,9 +1759,7 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
     if (srcToStore[path] != "")
         dstPath = srcToStore[path];
     else {
-        dstPath = settings.readOnlyMode
-            ? store->computeStorePathForPath(baseNameOf(path), checkSourcePath(path)).first
-            : store->addToStore(baseNameOf(path), checkSourcePath(path), true, htSHA256, defaultPathFilter, repair);
+        dstPath = addSourceToStore(baseNameOf(path), checkSourcePath(path), true, defaultPathFilter);
         srcToStore[path] = dstPath;
         printMsg(lvlChatty, format("copied source '%1%' -> '%2%'")
             % path % dstPath);
@@ -1651,6 +1770,71 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
 }
 
 
+Path EvalState::addSourceToStore(const string & name, const Path & path,
+    bool recursive, PathFilter & filter)
+{
+    auto copy = [&](PathFilter & filter) {
+        return settings.readOnlyMode
+            ? store->computeStorePathForPath(name, path, recursive, htSHA256, filter).first
+            : store->addToStore(name, path, recursive, htSHA256, filter, repair);
+    };
+
+    if (trackAccesses && recursive) recordAccess("@" + path);
+
+    if (!evalSettings.sourceCache || repair) return copy(filter);
+
+    auto cache = getSourceCache();
+
+    /* Since the filter decides which files end up in the store path,
+       the fingerprint covers its result rather than its identity.
+       Remember its decisions, so that a copy doesn't have to call it
+       (e.g. a Nix function passed to builtins.filterSource) again. */
+    time_t newest;
+    PathSet selected;
+    bool replay = &filter != &defaultPathFilter;
+    auto key = hashString(htSHA256,
+        store->storeDir + '\0' + name + '\0' + path + '\0' + (recursive ? "r" : "f") + '\0'
+        + fingerprintSource(path, recursive, filter, &newest, replay ? &selected : nullptr).to_string(Base32, false));
+
+    auto cached = cache->lookup(key);
+
+    if (cached && !evalSettings.sourceCacheVerify) {
+        /* The path may have been garbage-collected since. */
+        if (!settings.readOnlyMode) store->addTempRoot(cached->storePath);
+        if (settings.readOnlyMode || store->isValidPath(cached->storePath)) {
+            nrSourceCacheHits++;
+            return cached->storePath;
+        }
+    }
+
+    nrSourceCacheMisses++;
+
+    PathFilter selectedFilter = [&](const Path & path) {
+        return selected.count(path) > 0;
+    };
+
+    SourceCache::Entry entry;
+    entry.storePath = copy(replay ? selectedFilter : filter);
+    if (store->isValidPath(entry.storePath))
+        entry.narHash = store->queryPathInfo(entry.storePath)->narHash.to_string();
+
+    if (cached && (cached->storePath != entry.storePath
+            || (cached->narHash != "" && entry.narHash != "" && cached->narHash != entry.narHash)))
+        printError("warning: source cache entry for '%s' is stale: it says '%s', but the path is '%s'",
+            path, cached->storePath, entry.storePath);
+
+    /* On file systems with coarse timestamps, a file can be modified
+       again within the same tick without changing its fingerprint.
+       So don't record trees with a file modified that recently. */
+    if (newest >= time(0) - 2)
+        debug("not caching the store path of '%s', since it was modified too recently", path);
+    else
+        cache->insert(key, entry);
+
+    return entry.storePath;
+}
+
+
 Path EvalState::coerceToPath(const Pos & pos, Value & v, PathSet & context)
 {
     string path = coerceToString(pos, v, context, false, false);
@@ -1688,10 +1872,10 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             return v1.boolean == v2.boolean;
 
         case tString:
-            return strcmp(v1.string.s, v2.string.s) == 0;
+            return v1.string.s == v2.string.s || strcmp(v1.string.s, v2.string.s) == 0;
 
         case tPath:
-            return strcmp(v1.path, v2.path) == 0;
+            return v1.path == v2.path || strcmp(v1.path, v2.path) == 0;
 
         case tNull:
             return true;
@@ -1700,6 +1884,8 @@ bool EvalState::eqValues(Value & v1, Value & v2)
         case tList2:
         case tListN:
             if (v1.listSize() != v2.listSize()) return false;
+            /* Copies of a list value share their elements. */
+            if (v1.listElems() == v2.listElems()) return true;
             for (size_t n = 0; n < v1.listSize(); ++n)
                 if (!eqValues(*v1.listElems()[n], *v2.listElems()[n])) return false;
             return true;
@@ -1708,9 +1894,9 @@ bool EvalState::eqValues(Value & v1, Value & v2)
             /* If both sets denote a derivation (type = "derivation"),
                then compare their outPaths. */
             if (isDerivation(v1) && isDerivation(v2)) {
-                Bindings::iterator i = v1.attrs->find(sOutPath);
-                Bindings::iterator j = v2.attrs->find(sOutPath);
-                if (i != v1.attrs->end() && j != v2.attrs->end())
+                auto i = v1.attrs->get(sOutPath);
+                auto j = v2.attrs->get(sOutPath);
+                if (i && j)
                     return eqValues(*i->value, *j->value);
             }
 
@@ -1742,6 +1928,58 @@ bool EvalState::eqValues(Value & v1, Value & v2)
     }
 }
 
+size_t EvalState::hashValue(Value & v)
+{
+    forceValue(v);
+
+    auto combine = [](size_t h, size_t h2) {
+        return h ^ (h2 + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    };
+
+    switch (v.type) {
+
+        /* Integers and floats that are equal must have the same
+           hash, so hash integers as floats.  (Distinct large
+           integers may collide, which is harmless.) */
+        case tInt:
+        case tFloat: {
+            double d = v.type == tInt ? (double) v.integer : v.fpoint;
+            return d == 0 ? 0 : std::hash<double>()(d);
+        }
+
+        case tBool:
+            return combine(tBool, v.boolean);
+
+        case tString:
+            return std::hash<std::string_view>()(v.string.s);
+
+        case tPath:
+            return combine(tPath, std::hash<std::string_view>()(v.path));
+
+        case tNull:
+            return tNull;
+
+        case tList1:
+        case tList2:
+        case tListN: {
+            size_t h = combine(tListN, v.listSize());
+            for (size_t n = 0; n < v.listSize(); ++n)
+                h = combine(h, hashValue(*v.listElems()[n]));
+            return h;
+        }
+
+        default:
+            throwEvalError("cannot hash %1%", showType(v));
+    }
+}
+
+uint64_t EvalState::bytesInAttrsets()
+{
+    return nrAttrsets * sizeof(Bindings) + nrAttrsInAttrsets * sizeof(Attr) + nrAttrsetIndexBytes
+        + nrLayeredAttrsets * sizeof(Bindings::Layer);
+}
+
+
 void EvalState::printStats()
 {
     bool showStats = getEnv("NIX_SHOW_STATS", "0") != "0";
@@ -1749,11 +1987,16 @@ void EvalState::printStats()
     struct rusage buf;
     getrusage(RUSAGE_SELF, &buf);
     float cpuTime = buf.ru_utime.tv_sec + ((float) buf.ru_utime.tv_usec / 1000000);
+#if __APPLE__
+    uint64_t maxRSS = buf.ru_maxrss;
+#else
+    uint64_t maxRSS = buf.ru_maxrss * 1024;
+#endif
 
     uint64_t bEnvs = nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *);
     uint64_t bLists = nrListElems * sizeof(Value *);
     uint64_t bValues = nrValues * sizeof(Value);
-    uint64_t bAttrsets = nrAttrsets * sizeof(Bindings) + nrAttrsInAttrsets * sizeof(Attr);
+    uint64_t bAttrsets = bytesInAttrsets();
 
 #if HAVE_BOEHMGC
     GC_word heapSize, totalBytes;
@@ -1766,6 +2009,7 @@ void EvalState::printStats()
             fs.open(outPath, std::fstream::out);
         JSONObject topObj(outPath == "-" ? std::cerr : fs, true);
         topObj.attr("cpuTime",cpuTime);
+        topObj.attr("maxRSS", maxRSS);
         {
             auto envs = topObj.object("envs");
             envs.attr("number", nrEnvs);
@@ -1793,6 +2037,9 @@ void EvalState::printStats()
             sets.attr("number", nrAttrsets);
             sets.attr("bytes", bAttrsets);
             sets.attr("elements", nrAttrsInAttrsets);
+            sets.attr("layered", nrLayeredAttrsets);
+            sets.attr("flattened", Bindings::nrFlattened);
+            sets.attr("elementsFlattened", Bindings::nrAttrsFlattened);
         }
         {
             auto sizes = topObj.object("sizes");
@@ -1808,6 +2055,58 @@ void EvalState::printStats()
         topObj.attr("nrLookups", nrLookups);
         topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
         topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        {
+            auto index = topObj.object("attrsetIndex");
+            index.attr("builds", Bindings::nrIndexBuilds);
+            index.attr("hits", Bindings::nrIndexHits);
+            index.attr("misses", Bindings::nrIndexMisses);
+            auto probes = index.list("probes");
+            for (auto n : Bindings::nrIndexProbes)
+                probes.elem(n);
+        }
+        if (evalSettings.parseCache) {
+            auto parseCache = topObj.object("parseCache");
+            parseCache.attr("hits", nrParseCacheHits);
+            parseCache.attr("misses", nrParseCacheMisses);
+        }
+        if (evalSettings.sourceCache) {
+            auto sourceCache = topObj.object("sourceCache");
+            sourceCache.attr("hits", nrSourceCacheHits);
+            sourceCache.attr("misses", nrSourceCacheMisses);
+        }
+        if (useBytecode) {
+            auto bytecode = topObj.object("bytecode");
+            bytecode.attr("compiled", nrBytecodeCompiled);
+            bytecode.attr("instructions", nrBytecodeInstrs);
+        }
+        {
+            auto strings = topObj.object("strings");
+            strings.attr("concats", nrStringConcats);
+            strings.attr("bytesCopied", nrStringBytesCopied);
+        }
+        {
+            auto contextStats = ContextTable::stats();
+            auto contexts = topObj.object("contexts");
+            contexts.attr("number", contextStats.contexts);
+            contexts.attr("elements", contextStats.elements);
+            contexts.attr("merges", contextStats.merges);
+            contexts.attr("mergeHits", contextStats.mergeHits);
+            contexts.attr("mergeEvictions", contextStats.mergeEvictions);
+            contexts.attr("uninterned", contextStats.uninterned);
+        }
+        {
+            auto regexCache = topObj.object("regexCache");
+            regexCache.attr("hits", nrRegexCacheHits);
+            regexCache.attr("misses", nrRegexCacheMisses);
+            regexCache.attr("compileTime", regexCompileTime);
+        }
+        if (arena) {
+            auto obj = topObj.object("arena");
+            obj.attr("allocations", valueArena->nrAllocs + arena->nrAllocs);
+            obj.attr("chunks", valueArena->nrChunks + arena->nrChunks);
+            obj.attr("bytes", valueArena->bytesAllocated + arena->bytesAllocated);
+            obj.attr("bytesUsed", valueArena->bytesUsed + arena->bytesUsed);
+        }
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
@@ -1852,6 +2151,13 @@ void EvalState::printStats()
             }
         }
 
+        if (allocStats) {
+            size_t max = 100;
+            string2Int(getEnv("NIX_COUNT_ALLOCS_TOP", "100"), max);
+            auto list = topObj.list("allocations");
+            allocStats->toJSON(list, max);
+        }
+
         if (getEnv("NIX_SHOW_SYMBOLS", "0") != "0") {
             auto list = topObj.list("symbols");
             symbols.dump([&](const std::string & s) { list.elem(s); });
@@ -1860,6 +2166,12 @@ void EvalState::printStats()
 }
 
 
+void EvalState::writeHeapSnapshot(Value & v)
+{
+    if (allocStats) allocStats->writeHeapSnapshot(v);
+}
+
+
 size_t valueSize(Value & v)
 {
     std::set<const void *> seen;
@@ -17,6 +17,10 @@ namespace nix {
 
 class Store;
 class EvalState;
+class Regex;
+class EvalProfiler;
+class AllocStats;
+class Arena;
 enum RepairFlag : bool;
 
 
@@ -86,7 +90,28 @@ public:
 
     Value vEmptySet;
 
-    const ref<Store> store;
+    ref<Store> store;
+
+    /* Whether to record the inputs (files and environment variables)
+       accessed during evaluation in 'accessedInputs'.  Set when the
+       evaluation cache is enabled. */
+    bool trackAccesses = false;
+
+    /* The inputs accessed so far, mapped to their fingerprint at the
+       time of the first access (see fingerprintInput()).  Files are
+       denoted by their absolute path, source trees copied to the
+       store by '@PATH' and environment variables by '$NAME'.  Files
+       probed while looking up a search path entry are recorded as
+       well, so that an entry appearing earlier in the search path is
+       noticed. */
+    std::map<std::string, std::string> accessedInputs;
+
+    void recordAccess(const std::string & input);
+
+    /* Set when the evaluation has used something that can't be
+       fingerprinted, such as the current time or a URL fetched
+       without a hash.  Its results must not be cached. */
+    bool impure = false;
 
 private:
     SrcToStore srcToStore;
@@ -114,6 +139,17 @@ private:
     /* Cache used by checkSourcePath(). */
     std::unordered_map<Path, Path> resolvedPaths;
 
+    /* Cache of compiled regular expressions used by builtins.match
+       and builtins.split. */
+    std::unordered_map<std::string, std::shared_ptr<Regex>> regexCache;
+
+    /* If 'eval-arena' is enabled, values, environments and attribute
+       sets are allocated from these arenas instead of by allocBytes().
+       Values have an arena of their own so that they're packed
+       densely.  Declared before 'baseEnv', which is allocated from
+       them. */
+    std::unique_ptr<Arena> valueArena, arena;
+
 public:
 
     EvalState(const Strings & _searchPath, ref<Store> store);
@@ -163,6 +199,10 @@ public:
        value `v'. */
     void eval(Expr * e, Value & v);
 
+    /* Evaluate 'e' in environment 'env', using either the tree-walking
+       evaluator or the bytecode interpreter. */
+    inline void evalIn(Expr * e, Env & env, Value & v);
+
     /* Evaluation the expression, then verify that it has the expected
        type. */
     inline bool evalBool(Env & env, Expr * e);
@@ -205,6 +245,12 @@ public:
 
     string copyPathToStore(PathSet & context, const Path & path);
 
+    /* Copy the source tree 'path', filtered by 'filter', to the store
+       (or only compute its store path in read-only mode), using the
+       source cache if enabled (see source-cache.hh). */
+    Path addSourceToStore(const string & name, const Path & path,
+        bool recursive, PathFilter & filter);
+
     /* Path coercion.  Converts strings, paths and derivations to a
        path.  The result is guaranteed to be a canonicalised, absolute
        path.  Nothing is copied to the store. */
@@ -245,17 +291,38 @@ private:
     Expr * parse(const char * text, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
+    /* Parse the contents of 'path' in the base environment, using
+       the on-disk parse cache (see parse-cache.cc). */
+    Expr * parseFileCached(const string & text, const Path & path);
+
+    /* Whether to evaluate using the bytecode interpreter (set from
+       'eval-bytecode'). */
+    bool useBytecode = false;
+
+    /* Evaluate 'e' in 'env' by compiling it to bytecode (if it hasn't
+       been already) and interpreting that (see bytecode.cc). */
+    void runBytecode(Expr & e, Env & env, Value & v);
+
 public:
 
     /* Do a deep equality test between two values.  That is, list
        elements and attributes are compared recursively. */
     bool eqValues(Value & v1, Value & v2);
 
+    /* Return a hash of a value that is consistent with eqValues()
+       (and with the equality implied by builtins.lessThan).  Only
+       supports numbers, strings, paths, Booleans, null and lists
+       thereof; list elements are forced. */
+    size_t hashValue(Value & v);
+
     bool isFunctor(Value & fun);
 
     void callFunction(Value & fun, Value & arg, Value & v, const Pos & pos);
     void callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos);
 
+    /* Call 'fun', which must be a lambda. */
+    void callLambda(Value & fun, Value & arg, Value & v, const Pos & pos);
+
     /* Automatically call a function for which each argument has a
        default value or has a binding in the `args' map. */
     void autoCallFunction(Bindings & args, Value & fun, Value & res);
@@ -270,16 +337,28 @@ public:
 
     void mkList(Value & v, size_t length);
     void mkAttrs(Value & v, size_t capacity);
+    void mkLayeredAttrs(Value & v, Bindings * base, Bindings * top);
     void mkThunk_(Value & v, Expr * expr);
     void mkPos(Value & v, Pos * pos);
 
     void concatLists(Value & v, size_t nrLists, Value * * lists, const Pos & pos);
 
+    /* Set 'v' to 'v1 // v2'. Both must be sets. */
+    void updateAttrs(Value & v1, Value & v2, Value & v);
+
     /* Print statistics. */
     void printStats();
 
+    /* Write a heap snapshot of the values reachable from 'v' if
+       requested by NIX_HEAP_SNAPSHOT (see AllocStats). */
+    void writeHeapSnapshot(Value & v);
+
     void realiseContext(const PathSet & context);
 
+    /* Return the compiled form of the regular expression 're'.
+       Throws BadRegex if it's invalid. */
+    std::shared_ptr<Regex> getRegex(const std::string & re);
+
 private:
 
     unsigned long nrEnvs = 0;
@@ -288,11 +367,24 @@ private:
     unsigned long nrListElems = 0;
     unsigned long nrAttrsets = 0;
     unsigned long nrAttrsInAttrsets = 0;
+    unsigned long nrAttrsetIndexBytes = 0;
+    unsigned long nrLayeredAttrsets = 0;
     unsigned long nrOpUpdates = 0;
     unsigned long nrOpUpdateValuesCopied = 0;
     unsigned long nrListConcats = 0;
+    unsigned long nrStringConcats = 0;
+    unsigned long nrStringBytesCopied = 0;
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
+    unsigned long nrParseCacheHits = 0;
+    unsigned long nrParseCacheMisses = 0;
+    unsigned long nrSourceCacheHits = 0;
+    unsigned long nrSourceCacheMisses = 0;
+    unsigned long nrBytecodeCompiled = 0;
+    unsigned long nrBytecodeInstrs = 0;
+    unsigned long nrRegexCacheHits = 0;
+    unsigned long nrRegexCacheMisses = 0;
+    double regexCompileTime = 0;
 
     bool countCalls;
 
@@ -307,8 +399,25 @@ private:
     typedef std::map<Pos, size_t> AttrSelects;
     AttrSelects attrSelects;
 
+    /* The number of bytes allocated for attribute sets so far. */
+    uint64_t bytesInAttrsets();
+
+    /* The evaluation profiler, if enabled by 'eval-profiler'. */
+    std::unique_ptr<EvalProfiler> profiler;
+
+    /* Allocation accounting, if enabled by NIX_COUNT_ALLOCS. */
+    std::unique_ptr<AllocStats> allocStats;
+
+    /* The position to which allocations are currently attributed. */
+    const Pos * allocPos = &noPos;
+
+    friend class EvalProfiler;
+    friend class Bindings;
+    friend struct AllocSite;
+    friend struct Expr;
     friend struct ExprOpUpdate;
     friend struct ExprOpConcatLists;
+    friend struct ExprConcatStrings;
     friend struct ExprSelect;
     friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
 };
@@ -351,6 +460,54 @@ struct EvalSettings : Config
     Setting<Strings> allowedUris{this, {}, "allowed-uris",
         "Prefixes of URIs that builtin functions such as fetchurl and fetchGit are allowed to fetch."};
 
+    Setting<bool> evalCache{this, false, "eval-cache",
+        "Whether to cache the values of attribute paths looked up by nix-instantiate, "
+        "nix-build, nix-env and nix search in ~/.cache/nix, "
+        "keyed by the expression and attribute path, and invalidated when any input "
+        "file or environment variable read during evaluation changes."};
+
+    Setting<bool> parseCache{this, false, "parse-cache",
+        "Whether to cache the parsed form of Nix expression files in ~/.cache/nix, "
+        "keyed by the hash of their contents."};
+
+    Setting<unsigned int> parseCacheMaxAge{this, 30 * 24 * 60 * 60, "parse-cache-max-age",
+        "The number of seconds after which an unused entry of the parse cache is deleted, "
+        "or 0 to keep entries forever."};
+
+    Setting<bool> sourceCache{this, false, "source-cache",
+        "Whether to cache the store paths of source trees copied to the store "
+        "in ~/.cache/nix, keyed by a fingerprint of the files' metadata."};
+
+    Setting<bool> sourceCacheVerify{this, false, "source-cache-verify",
+        "Whether to copy source trees even if they're in the source cache, "
+        "and report entries of the cache that are stale."};
+
+    Setting<bool> evalBytecode{this, false, "eval-bytecode",
+        "Whether to evaluate Nix expressions by compiling them to bytecode, "
+        "rather than by walking the syntax tree."};
+
+    Setting<std::string> evalProfiler{this, "", "eval-profiler",
+        "If set to 'flamegraph' or 'chrome', profile the evaluation and "
+        "write the profile in that format to 'eval-profile-file'."};
+
+    Setting<Path> evalProfileFile{this, "nix.profile", "eval-profile-file",
+        "The file to which the evaluation profile is written."};
+
+    Setting<bool> evalArena{this,
+#if HAVE_BOEHMGC
+        false,
+#else
+        true,
+#endif
+        "eval-arena",
+        "Whether to allocate values, environments and attribute sets from "
+        "an arena that is freed in bulk at the end of the evaluation, "
+        "rather than individually from the garbage collected heap."};
+
+    Setting<unsigned int> evalWorkers{this, 1, "eval-workers",
+        "The number of processes that 'nix-env -q' and 'nix-instantiate' use "
+        "to compute the requested attributes of derivations in parallel."};
+
     Setting<bool> traceFunctionCalls{this, false, "trace-function-calls",
         "Emit log messages for each function entry and exit at the 'vomit' log level (-vvvv)"};
 };
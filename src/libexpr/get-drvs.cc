@@ -1,9 +1,11 @@
 #include "get-drvs.hh"
+#include "attr-path.hh"
 #include "util.hh"
 #include "eval-inline.hh"
 #include "derivations.hh"
 
 #include <cstring>
+#include <iostream>
 #include <regex>
 
 
@@ -43,6 +45,24 @@ DrvInfo::DrvInfo(EvalState & state, ref<Store> store, const std::string & drvPat
 }
 
 
+bool DrvInfo::lookupCached(const string & attr, string & s) const
+{
+    if (!cache) return false;
+    Value v;
+    if (!cache->lookup(attrPath == "" ? attr : attrPath + "." + attr, v)) return false;
+    if (v.type == tString) s = v.string.s;
+    else if (v.type == tPath) s = v.path;
+    else return false;
+    return true;
+}
+
+
+void DrvInfo::insertCached(const string & attr, const Value & v) const
+{
+    if (cache) cache->insert(attrPath == "" ? attr : attrPath + "." + attr, v);
+}
+
+
 string DrvInfo::queryName() const
 {
     if (name == "" && attrs) {
@@ -66,10 +86,11 @@ string DrvInfo::querySystem() const
 
 string DrvInfo::queryDrvPath() const
 {
-    if (drvPath == "" && attrs) {
+    if (drvPath == "" && attrs && !lookupCached("drvPath", drvPath)) {
         Bindings::iterator i = attrs->find(state->sDrvPath);
         PathSet context;
         drvPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
+        if (i != attrs->end()) insertCached("drvPath", *i->value);
     }
     return drvPath;
 }
@@ -77,10 +98,11 @@ string DrvInfo::queryDrvPath() const
 
 string DrvInfo::queryOutPath() const
 {
-    if (outPath == "" && attrs) {
+    if (outPath == "" && attrs && !lookupCached("outPath", outPath)) {
         Bindings::iterator i = attrs->find(state->sOutPath);
         PathSet context;
         outPath = i != attrs->end() ? state->coerceToPath(*i->pos, *i->value, context) : "";
+        if (i != attrs->end()) insertCached("outPath", *i->value);
     }
     return outPath;
 }
@@ -194,8 +216,11 @@ Value * DrvInfo::queryMeta(const string & name)
 
 string DrvInfo::queryMetaString(const string & name)
 {
+    string s;
+    if (lookupCached("meta." + name, s)) return s;
     Value * v = queryMeta(name);
     if (!v || v->type != tString) return "";
+    insertCached("meta." + name, *v);
     return v->string.s;
 }
 
@@ -377,4 +402,303 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
 }
 
 
+/* Meta attributes are sent with their types, so that the parent's
+   checkMeta() sees the same values as in serial mode.  Values that
+   can't be meta attributes (such as functions) are sent as null,
+   which checkMeta() rejects as well. */
+enum { mNull, mInt, mFloat, mBool, mString, mPath, mList, mAttrs };
+
+
+static void writeMetaValue(EvalState & state, Value & v, Sink & sink)
+{
+    state.forceValue(v);
+    switch (v.type) {
+        case tInt:
+            sink << mInt << (uint64_t) v.integer;
+            break;
+        case tFloat: {
+            uint64_t n;
+            static_assert(sizeof(n) == sizeof(v.fpoint), "unexpected float size");
+            memcpy(&n, &v.fpoint, sizeof(n));
+            sink << mFloat << n;
+            break;
+        }
+        case tBool:
+            sink << mBool << v.boolean;
+            break;
+        case tString:
+            sink << mString << v.string.s;
+            break;
+        case tPath:
+            sink << mPath << v.path;
+            break;
+        case tList1: case tList2: case tListN:
+            sink << mList << v.listSize();
+            for (unsigned int n = 0; n < v.listSize(); ++n)
+                writeMetaValue(state, *v.listElems()[n], sink);
+            break;
+        case tAttrs:
+            sink << mAttrs << v.attrs->size();
+            for (auto & i : *v.attrs) {
+                sink << (const string &) i.name;
+                writeMetaValue(state, *i.value, sink);
+            }
+            break;
+        default:
+            sink << mNull;
+    }
+}
+
+
+static void readMetaValue(EvalState & state, Value & v, Source & source)
+{
+    switch (readNum<unsigned int>(source)) {
+        case mNull:
+            mkNull(v);
+            break;
+        case mInt:
+            mkInt(v, (NixInt) readNum<uint64_t>(source));
+            break;
+        case mFloat: {
+            auto n = readNum<uint64_t>(source);
+            NixFloat f;
+            memcpy(&f, &n, sizeof(f));
+            mkFloat(v, f);
+            break;
+        }
+        case mBool:
+            mkBool(v, readNum<unsigned int>(source));
+            break;
+        case mString:
+            mkString(v, readString(source));
+            break;
+        case mPath:
+            mkPath(v, readString(source).c_str());
+            break;
+        case mList: {
+            auto n = readNum<size_t>(source);
+            state.mkList(v, n);
+            for (size_t i = 0; i < n; ++i)
+                readMetaValue(state, *(v.listElems()[i] = state.allocValue()), source);
+            break;
+        }
+        case mAttrs: {
+            auto n = readNum<size_t>(source);
+            state.mkAttrs(v, n);
+            while (n--) {
+                auto name = state.symbols.create(readString(source));
+                readMetaValue(state, *state.allocAttr(v, name), source);
+            }
+            v.attrs->sort();
+            break;
+        }
+        default:
+            throw Error("invalid meta attribute from evaluation worker");
+    }
+}
+
+
+/* Write the fields of 'drv' selected by 'query'. */
+static void writeDrvInfo(EvalState & state, DrvInfo & drv,
+    const DrvInfoQuery & query, Sink & sink)
+{
+    if (query.system) sink << drv.querySystem();
+    if (query.drvPath) sink << drv.queryDrvPath();
+    if (query.outPath) sink << drv.queryOutPath();
+    if (query.outputs) {
+        auto outputs = drv.queryOutputs();
+        sink << outputs.size();
+        for (auto & i : outputs)
+            sink << i.first << i.second;
+    }
+    if (query.meta) {
+        StringSet names;
+        for (auto & name : drv.queryMetaNames())
+            if (query.metaNames.empty() || query.metaNames.count(name))
+                names.insert(name);
+        sink << names.size();
+        for (auto & name : names) {
+            sink << name;
+            Value * v = drv.queryMeta(name);
+            if (v) writeMetaValue(state, *v, sink); else sink << mNull;
+        }
+    }
+}
+
+
+static void readDrvInfo(EvalState & state, DrvInfo & drv,
+    const DrvInfoQuery & query, Source & source)
+{
+    if (query.system) drv.setSystem(readString(source));
+    if (query.drvPath) {
+        /* Take over the worker's temporary root before the worker
+           is allowed to exit. */
+        auto drvPath = readString(source);
+        if (drvPath != "") state.store->addTempRoot(drvPath);
+        drv.setDrvPath(drvPath);
+    }
+    if (query.outPath) drv.setOutPath(readString(source));
+    if (query.outputs) {
+        DrvInfo::Outputs outputs;
+        auto n = readNum<size_t>(source);
+        while (n--) {
+            auto name = readString(source);
+            outputs[name] = readString(source);
+        }
+        drv.setOutputs(outputs);
+    }
+    if (query.meta) {
+        Value v;
+        auto n = readNum<size_t>(source);
+        state.mkAttrs(v, n);
+        while (n--) {
+            auto name = state.symbols.create(readString(source));
+            readMetaValue(state, *state.allocAttr(v, name), source);
+        }
+        v.attrs->sort();
+        drv.setMetaAttrs(v.attrs);
+    }
+}
+
+
+/* Open the store that 'store' refers to again, with the same
+   settings.  A forked process must not use the database connection
+   or the daemon connections of its parent. */
+static ref<Store> reopenStore(ref<Store> store)
+{
+    std::map<std::string, Config::SettingInfo> settings;
+    store->getSettings(settings, true);
+    Store::Params params;
+    for (auto & i : settings)
+        params[i.first] = i.second.value;
+    return openStore(store->getUri(), params);
+}
+
+
+void queryDrvInfos(EvalState & state, DrvInfos & drvs,
+    const DrvInfoQuery & query, unsigned int workers)
+{
+    std::vector<DrvInfo *> elems;
+    for (auto & i : drvs) elems.push_back(&i);
+
+    workers = std::min((size_t) workers, elems.size());
+    if (workers < 2) return;
+
+    enum { rOk, rFailed, rError };
+
+    /* Don't let the workers write out our buffered output. */
+    std::cout.flush();
+    std::cerr.flush();
+
+    /* 'acks' tells a worker that the parent has registered the
+       paths it returned as temporary roots, so it can exit (which
+       releases its own temporary roots). */
+    std::vector<Pipe> pipes(workers), acks(workers);
+    std::vector<Pid> pids(workers);
+
+    ProcessOptions options;
+    options.allowVfork = false;
+
+    for (unsigned int w = 0; w < workers; ++w) {
+        pipes[w].create();
+        acks[w].create();
+        pids[w] = startProcess([&]() {
+            pipes[w].readSide = -1;
+            /* Also close the ones of earlier workers, so that they
+               see EOF if the parent dies. */
+            for (auto & ack : acks) ack.writeSide = -1;
+
+            /* Keep a reference to the parent's store, so that it's
+               not destroyed (which would e.g. delete the parent's
+               temporary roots file) before _exit(). */
+            auto parentStore = state.store;
+            state.store = reopenStore(state.store);
+            state.store->deferWrites();
+
+            /* Send the results only at the end, so that we don't
+               block on the pipe while the parent is reading the
+               results of another worker. */
+            StringSink res;
+            for (size_t n = w; n < elems.size(); n += workers) {
+                try {
+                    StringSink fields;
+                    writeDrvInfo(state, *elems[n], query, fields);
+                    res << rOk << *fields.s;
+                } catch (AssertionError &) {
+                    res << rFailed;
+                } catch (Error & e) {
+                    res << rError << e.msg();
+                }
+            }
+
+            /* Make sure that the derivations written by this worker
+               are valid before the parent sees their paths. */
+            state.store->flushWrites();
+
+            writeFull(pipes[w].writeSide.get(), *res.s);
+            pipes[w].writeSide = -1;
+
+            /* Keep our temporary roots until the parent has added
+               its own.  EOF means that the parent has gone away. */
+            unsigned char ack;
+            try {
+                readFull(acks[w].readSide.get(), &ack, 1);
+            } catch (EndOfFile &) { }
+            _exit(0);
+        }, options);
+        pipes[w].writeSide = -1;
+        acks[w].readSide = -1;
+    }
+
+    /* Merge the results, remembering the first error in the order of
+       'drvs'. */
+    std::optional<std::pair<size_t, string>> firstError;
+
+    for (unsigned int w = 0; w < workers; ++w) {
+        FdSource source(pipes[w].readSide.get());
+        bool truncated = false;
+        try {
+            for (size_t n = w; n < elems.size(); n += workers) {
+                auto & drv = *elems[n];
+                switch (readNum<unsigned int>(source)) {
+                case rOk: {
+                    auto s = readString(source);
+                    StringSource fields(s);
+                    readDrvInfo(state, drv, query, fields);
+                    break;
+                }
+                case rFailed:
+                    printMsg(lvlTalkative, "skipping derivation named '%s' which gives an assertion failure", drv.queryName());
+                    drv.setFailed();
+                    break;
+                case rError: {
+                    auto msg = readString(source);
+                    if (!firstError || n < firstError->first)
+                        firstError = {n, msg};
+                    break;
+                }
+                default:
+                    throw Error("invalid response from evaluation worker");
+                }
+            }
+        } catch (EndOfFile &) {
+            truncated = true;
+        }
+
+        if (!truncated) writeFull(acks[w].writeSide.get(), "1");
+        acks[w].writeSide = -1;
+
+        int status = pids[w].wait();
+        if (!statusOk(status))
+            throw Error("evaluation worker %s", statusToString(status));
+        if (truncated)
+            throw Error("evaluation worker exited prematurely");
+    }
+
+    if (firstError)
+        throw Error("while querying the derivation named '%s':\n%s",
+            elems[firstError->first]->queryName(), firstError->second);
+}
+
+
 }
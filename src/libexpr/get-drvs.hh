@@ -9,6 +9,9 @@
 namespace nix {
 
 
+class AttrPathCache;
+
+
 struct DrvInfo
 {
 public:
@@ -28,8 +31,15 @@ private:
 
     Bindings * attrs = nullptr, * meta = nullptr;
 
+    std::shared_ptr<AttrPathCache> cache;
+
     Bindings * getMeta();
 
+    /* Look up or record the value of the attribute 'attr' of this
+       derivation in 'cache'. */
+    bool lookupCached(const string & attr, string & s) const;
+    void insertCached(const string & attr, const Value & v) const;
+
     bool checkMeta(Value & v);
 
 public:
@@ -61,8 +71,15 @@ public:
     */
 
     void setName(const string & s) { name = s; }
+    void setSystem(const string & s) { system = s; }
     void setDrvPath(const string & s) { drvPath = s; }
     void setOutPath(const string & s) { outPath = s; }
+    void setOutputs(const Outputs & o) { outputs = o; }
+    void setMetaAttrs(Bindings * attrs) { meta = attrs; }
+
+    /* Use 'cache' for the derivation's path, output path and meta
+       strings, with the attribute paths relative to 'attrPath'. */
+    void setCache(std::shared_ptr<AttrPathCache> cache) { this->cache = cache; }
 
     void setFailed() { failed = true; };
     bool hasFailed() { return failed; };
@@ -86,4 +103,27 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     bool ignoreAssertionFailures);
 
 
+/* The fields of a DrvInfo that queryDrvInfos() should compute. */
+struct DrvInfoQuery
+{
+    bool system = false;
+    bool drvPath = false;
+    bool outPath = false;
+    bool outputs = false;
+    bool meta = false;
+    /* If non-empty, only these meta attributes are computed. */
+    StringSet metaNames;
+};
+
+/* Compute the fields selected by 'query' of the elements of 'drvs'
+   in 'workers' forked processes, each of which evaluates every
+   'workers'th element in its own copy of the heap.  The results are
+   stored in the DrvInfos (in the order of 'drvs'), so that querying
+   them afterwards doesn't require further evaluation.  Elements that
+   give an assertion failure are marked as failed.  Does nothing if
+   'workers' is less than 2. */
+void queryDrvInfos(EvalState & state, DrvInfos & drvs,
+    const DrvInfoQuery & query, unsigned int workers);
+
+
 }
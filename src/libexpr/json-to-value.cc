@@ -1,148 +1,353 @@
 #include "json-to-value.hh"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <cstring>
+#include <limits>
 
 namespace nix {
 
 
-static void skipWhitespace(const char * & s)
+/* A non-recursive JSON parser that builds Nix values as it goes.
+   The values of the arrays and objects being parsed are kept on a
+   single stack, so that each list and attribute set is allocated
+   with its final size once it is complete, without going through
+   intermediate containers. */
+class JSONParser
 {
-    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
-}
+    EvalState & state;
 
+    const char * s;
+    const char * end;
 
-static string parseJSONString(const char * & s)
-{
-    string res;
-    if (*s++ != '"') throw JSONParseError("expected JSON string");
-    while (*s != '"') {
-        if (!*s) throw JSONParseError("got end-of-string in JSON string");
-        if (*s == '\\') {
-            s++;
-            if (*s == '"') res += '"';
-            else if (*s == '\\') res += '\\';
-            else if (*s == '/') res += '/';
-            else if (*s == '/') res += '/';
-            else if (*s == 'b') res += '\b';
-            else if (*s == 'f') res += '\f';
-            else if (*s == 'n') res += '\n';
-            else if (*s == 'r') res += '\r';
-            else if (*s == 't') res += '\t';
-            else if (*s == 'u') throw JSONParseError("\\u characters in JSON strings are currently not supported");
-            else throw JSONParseError("invalid escaped character in JSON string");
-            s++;
-        } else
-            res += *s++;
+    /* The values parsed so far that are not yet part of a list or
+       attribute set. */
+    ValueVector values;
+
+    /* The keys of the object members on ‘values’. */
+    std::vector<Symbol> keys;
+
+    /* For each array or object being parsed, the position of its
+       first element in ‘values’ and, for objects, in ‘keys’. */
+    struct Frame
+    {
+        bool isObject;
+        size_t firstValue, firstKey;
+    };
+    std::vector<Frame> frames;
+
+    /* Scratch space for strings and for sorting object members. */
+    std::string buf;
+    std::vector<size_t> order;
+
+    /* Characters that end a run of plain characters in a string. */
+    bool special[256];
+
+public:
+
+    JSONParser(EvalState & state, const string & input)
+        : state(state), s(input.c_str()), end(input.c_str() + input.size())
+    {
+        values.reserve(1024);
+        for (unsigned int c = 0; c < 256; ++c)
+            special[c] = c == '"' || c == '\\' || c == 0;
     }
-    s++;
-    return res;
-}
 
+    void parse(Value & v)
+    {
+        parseValues();
+        skipWhitespace();
+        if (s != end) throw JSONParseError(format("expected end-of-string while parsing JSON value: %1%") % s);
+        assert(values.size() == 1);
+        v = *values[0];
+    }
 
-static void parseJSON(EvalState & state, const char * & s, Value & v)
-{
-    skipWhitespace(s);
+private:
+
+    void skipWhitespace()
+    {
+        while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
+    }
 
-    if (!*s) throw JSONParseError("expected JSON value");
+    Value & push()
+    {
+        Value * v = state.allocValue();
+        values.push_back(v);
+        return *v;
+    }
 
-    if (*s == '[') {
-        s++;
-        ValueVector values;
-        values.reserve(128);
-        skipWhitespace(s);
-        while (1) {
-            if (values.empty() && *s == ']') break;
-            Value * v2 = state.allocValue();
-            parseJSON(state, s, *v2);
-            values.push_back(v2);
-            skipWhitespace(s);
-            if (*s == ']') break;
-            if (*s != ',') throw JSONParseError("expected ',' or ']' after JSON array element");
-            s++;
+    void parseValues()
+    {
+        while (true) {
+            skipWhitespace();
+
+            switch (*s) {
+
+            case '{':
+                s++;
+                frames.push_back({true, values.size(), keys.size()});
+                skipWhitespace();
+                if (*s == '}') {
+                    s++;
+                    endObject();
+                    break;
+                }
+                parseKey();
+                continue;
+
+            case '[':
+                s++;
+                frames.push_back({false, values.size(), keys.size()});
+                skipWhitespace();
+                if (*s == ']') {
+                    s++;
+                    endArray();
+                    break;
+                }
+                continue;
+
+            case '"':
+                parseString();
+                mkString(push(), buf);
+                break;
+
+            case 't':
+                expectWord("true");
+                mkBool(push(), true);
+                break;
+
+            case 'f':
+                expectWord("false");
+                mkBool(push(), false);
+                break;
+
+            case 'n':
+                expectWord("null");
+                mkNull(push());
+                break;
+
+            case 0:
+                throw JSONParseError("expected JSON value");
+
+            default:
+                parseNumber();
+                break;
+            }
+
+            /* A value is complete, so close any arrays and objects
+               that end here. */
+            while (true) {
+                if (frames.empty()) return;
+                skipWhitespace();
+                if (frames.back().isObject) {
+                    if (*s == ',') { s++; parseKey(); break; }
+                    if (*s != '}') throw JSONParseError("expected ',' or '}' after JSON member");
+                    s++;
+                    endObject();
+                } else {
+                    if (*s == ',') { s++; break; }
+                    if (*s != ']') throw JSONParseError("expected ',' or ']' after JSON array element");
+                    s++;
+                    endArray();
+                }
+            }
         }
-        s++;
-        state.mkList(v, values.size());
-        for (size_t n = 0; n < values.size(); ++n)
-            v.listElems()[n] = values[n];
     }
 
-    else if (*s == '{') {
+    void expectWord(const char * word)
+    {
+        auto len = strlen(word);
+        if (strncmp(s, word, len) != 0)
+            throw JSONParseError("unrecognised JSON value");
+        s += len;
+    }
+
+    void parseKey()
+    {
+        skipWhitespace();
+        parseString();
+        keys.push_back(state.symbols.create(buf));
+        skipWhitespace();
+        if (*s != ':') throw JSONParseError("expected ':' in JSON object");
         s++;
-        ValueMap attrs;
-        while (1) {
-            skipWhitespace(s);
-            if (attrs.empty() && *s == '}') break;
-            string name = parseJSONString(s);
-            skipWhitespace(s);
-            if (*s != ':') throw JSONParseError("expected ':' in JSON object");
-            s++;
-            Value * v2 = state.allocValue();
-            parseJSON(state, s, *v2);
-            attrs[state.symbols.create(name)] = v2;
-            skipWhitespace(s);
-            if (*s == '}') break;
-            if (*s != ',') throw JSONParseError("expected ',' or '}' after JSON member");
+    }
+
+    /* Parse a JSON string into ‘buf’. */
+    void parseString()
+    {
+        buf.clear();
+        if (*s++ != '"') throw JSONParseError("expected JSON string");
+        while (true) {
+            auto start = s;
+            while (!special[(unsigned char) *s]) s++;
+            buf.append(start, s - start);
+            if (*s == '"') break;
+            if (!*s) {
+                /* Nix strings can't contain NUL characters. */
+                if (s == end) throw JSONParseError("got end-of-string in JSON string");
+                throw JSONParseError("NUL character in JSON string");
+            }
             s++;
+            switch (*s++) {
+            case '"': buf += '"'; break;
+            case '\\': buf += '\\'; break;
+            case '/': buf += '/'; break;
+            case 'b': buf += '\b'; break;
+            case 'f': buf += '\f'; break;
+            case 'n': buf += '\n'; break;
+            case 'r': buf += '\r'; break;
+            case 't': buf += '\t'; break;
+            case 'u': parseUnicodeEscape(); break;
+            default: throw JSONParseError("invalid escaped character in JSON string");
+            }
         }
-        state.mkAttrs(v, attrs.size());
-        for (auto & i : attrs)
-            v.attrs->push_back(Attr(i.first, i.second));
-        v.attrs->sort();
         s++;
     }
 
-    else if (*s == '"') {
-        mkString(v, parseJSONString(s));
+    unsigned int parseHex4()
+    {
+        unsigned int n = 0;
+        for (int i = 0; i < 4; ++i, ++s) {
+            n <<= 4;
+            if (*s >= '0' && *s <= '9') n |= *s - '0';
+            else if (*s >= 'a' && *s <= 'f') n |= *s - 'a' + 10;
+            else if (*s >= 'A' && *s <= 'F') n |= *s - 'A' + 10;
+            else throw JSONParseError("invalid \\u escape in JSON string");
+        }
+        return n;
     }
 
-    else if (isdigit(*s) || *s == '-' || *s == '.' ) {
-        // Buffer into a string first, then use built-in C++ conversions
-        std::string tmp_number;
-        ValueType number_type = tInt;
+    /* Append the character denoted by a \u escape (and, for a
+       surrogate pair, the one following it) as UTF-8. */
+    void parseUnicodeEscape()
+    {
+        unsigned int c = parseHex4();
 
-        while (isdigit(*s) || *s == '-' || *s == '.' || *s == 'e' || *s == 'E') {
-            if (*s == '.' || *s == 'e' || *s == 'E')
-                number_type = tFloat;
-            tmp_number += *s++;
-        }
+        if (c >= 0xd800 && c <= 0xdbff) {
+            if (s[0] != '\\' || s[1] != 'u')
+                throw JSONParseError("unpaired surrogate in JSON string");
+            s += 2;
+            unsigned int c2 = parseHex4();
+            if (c2 < 0xdc00 || c2 > 0xdfff)
+                throw JSONParseError("unpaired surrogate in JSON string");
+            c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+        } else if (c >= 0xdc00 && c <= 0xdfff)
+            throw JSONParseError("unpaired surrogate in JSON string");
+        else if (c == 0)
+            throw JSONParseError("NUL character in JSON string");
 
-        try {
-            if (number_type == tFloat)
-                mkFloat(v, stod(tmp_number));
-            else
-                mkInt(v, stol(tmp_number));
-        } catch (std::invalid_argument e) {
-            throw JSONParseError("invalid JSON number");
-        } catch (std::out_of_range e) {
-            throw JSONParseError("out-of-range JSON number");
+        if (c < 0x80)
+            buf += (char) c;
+        else if (c < 0x800) {
+            buf += (char) (0xc0 | (c >> 6));
+            buf += (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            buf += (char) (0xe0 | (c >> 12));
+            buf += (char) (0x80 | ((c >> 6) & 0x3f));
+            buf += (char) (0x80 | (c & 0x3f));
+        } else {
+            buf += (char) (0xf0 | (c >> 18));
+            buf += (char) (0x80 | ((c >> 12) & 0x3f));
+            buf += (char) (0x80 | ((c >> 6) & 0x3f));
+            buf += (char) (0x80 | (c & 0x3f));
         }
     }
 
-    else if (strncmp(s, "true", 4) == 0) {
-        s += 4;
-        mkBool(v, true);
-    }
+    void parseNumber()
+    {
+        auto start = s;
+        bool isFloat = false;
+
+        while (isdigit(*s) || *s == '-' || *s == '+' || *s == '.' || *s == 'e' || *s == 'E') {
+            if (*s == '.' || *s == 'e' || *s == 'E') isFloat = true;
+            s++;
+        }
+
+        if (s == start) throw JSONParseError("unrecognised JSON value");
+
+        if (isFloat) {
+            char * numEnd;
+            errno = 0;
+            double d = strtod(start, &numEnd);
+            if (numEnd != s) throw JSONParseError("invalid JSON number");
+            if (errno == ERANGE) throw JSONParseError("out-of-range JSON number");
+            mkFloat(push(), d);
+            return;
+        }
+
+        auto p = start;
+        bool negative = *p == '-';
+        if (negative) p++;
+        if (p == s) throw JSONParseError("invalid JSON number");
 
-    else if (strncmp(s, "false", 5) == 0) {
-        s += 5;
-        mkBool(v, false);
+        /* Accumulate negatively so that the minimum value can be
+           represented. */
+        NixInt n = 0;
+        for (; p < s; ++p) {
+            if (!isdigit(*p)) throw JSONParseError("invalid JSON number");
+            int digit = *p - '0';
+            if (n < (std::numeric_limits<NixInt>::min() + digit) / 10)
+                throw JSONParseError("out-of-range JSON number");
+            n = n * 10 - digit;
+        }
+        if (!negative) {
+            if (n == std::numeric_limits<NixInt>::min())
+                throw JSONParseError("out-of-range JSON number");
+            n = -n;
+        }
+
+        mkInt(push(), n);
     }
 
-    else if (strncmp(s, "null", 4) == 0) {
-        s += 4;
-        mkNull(v);
+    void endObject()
+    {
+        auto frame = frames.back();
+        frames.pop_back();
+
+        size_t size = values.size() - frame.firstValue;
+        assert(keys.size() - frame.firstKey == size);
+
+        /* Sort the members by name, keeping the last of any
+           duplicates. */
+        order.resize(size);
+        for (size_t n = 0; n < size; ++n) order[n] = n;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return keys[frame.firstKey + a] < keys[frame.firstKey + b];
+        });
+
+        Value & v = *state.allocValue();
+        state.mkAttrs(v, size);
+        for (size_t n = 0; n < size; ++n) {
+            auto i = order[n];
+            auto name = keys[frame.firstKey + i];
+            if (n + 1 < size && keys[frame.firstKey + order[n + 1]] == name) continue;
+            v.attrs->push_back(Attr(name, values[frame.firstValue + i]));
+        }
+
+        values.resize(frame.firstValue);
+        keys.resize(frame.firstKey);
+        values.push_back(&v);
     }
 
-    else throw JSONParseError("unrecognised JSON value");
-}
+    void endArray()
+    {
+        auto frame = frames.back();
+        frames.pop_back();
+
+        Value & v = *state.allocValue();
+        state.mkList(v, values.size() - frame.firstValue);
+        std::copy(values.begin() + frame.firstValue, values.end(), v.listElems());
+
+        values.resize(frame.firstValue);
+        values.push_back(&v);
+    }
+};
 
 
-void parseJSON(EvalState & state, const string & s_, Value & v)
+void parseJSON(EvalState & state, const string & s, Value & v)
 {
-    const char * s = s_.c_str();
-    parseJSON(state, s, v);
-    skipWhitespace(s);
-    if (*s) throw JSONParseError(format("expected end-of-string while parsing JSON value: %1%") % s);
+    JSONParser(state, s).parse(v);
 }
 
 
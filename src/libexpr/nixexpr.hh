@@ -54,6 +54,7 @@ struct Env;
 struct Value;
 class EvalState;
 struct StaticEnv;
+struct Bytecode;
 
 
 /* An attribute path is a sequence of attribute names. */
@@ -74,6 +75,10 @@ string showAttrPath(const AttrPath & attrPath);
 
 struct Expr
 {
+    /* The bytecode for evaluating this expression, compiled on demand
+       if 'eval-bytecode' is enabled (see bytecode.cc). */
+    Bytecode * bytecode = nullptr;
+
     virtual ~Expr() { };
     virtual void show(std::ostream & str) const;
     virtual void bindVars(const StaticEnv & env);
@@ -164,6 +169,8 @@ struct ExprSelect : Expr
     ExprSelect(const Pos & pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(attrPath) { };
     ExprSelect(const Pos & pos, Expr * e, const Symbol & name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
     COMMON_METHODS
+    /* Select the attribute path from 'vAttrs', the value of 'e'. */
+    void select(EvalState & state, Env & env, Value & vAttrs, Value & v);
 };
 
 struct ExprOpHasAttr : Expr
@@ -172,6 +179,9 @@ struct ExprOpHasAttr : Expr
     AttrPath attrPath;
     ExprOpHasAttr(Expr * e, const AttrPath & attrPath) : e(e), attrPath(attrPath) { };
     COMMON_METHODS
+    /* Check whether 'vAttrs', the value of 'e', has the attribute
+       path. */
+    void hasAttr(EvalState & state, Env & env, Value & vAttrs, Value & v);
 };
 
 struct ExprAttrs : Expr
@@ -181,7 +191,7 @@ struct ExprAttrs : Expr
         bool inherited;
         Expr * e;
         Pos pos;
-        unsigned int displ; // displacement
+        unsigned int displ = 0; // displacement
         AttrDef(Expr * e, const Pos & pos, bool inherited=false)
             : inherited(inherited), e(e), pos(pos) { };
         AttrDef() { };
@@ -316,6 +326,9 @@ struct ExprConcatStrings : Expr
     ExprConcatStrings(const Pos & pos, bool forceString, vector<Expr *> * es)
         : pos(pos), forceString(forceString), es(es) { };
     COMMON_METHODS
+    /* Concatenate the elements, the first 'nrValues' of which have
+       already been evaluated to 'values'. */
+    void concat(EvalState & state, Env & env, Value * values, size_t nrValues, Value & v);
 };
 
 struct ExprPos : Expr
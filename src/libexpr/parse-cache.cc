@@ -0,0 +1,691 @@
+#include "parse-cache.hh"
+#include "eval.hh"
+#include "globals.hh"
+#include "finally.hh"
+
+#include <cstring>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+
+/* Tags identifying the type of each serialised expression. */
+typedef enum {
+    tagNull = 0,
+    tagRef, // back-reference to a previously serialised expression
+    tagInt,
+    tagFloat,
+    tagString,
+    tagPath,
+    tagVar,
+    tagSelect,
+    tagOpHasAttr,
+    tagAttrs,
+    tagList,
+    tagLambda,
+    tagLet,
+    tagWith,
+    tagIf,
+    tagAssert,
+    tagOpNot,
+    tagApp,
+    tagOpEq,
+    tagOpNEq,
+    tagOpAnd,
+    tagOpOr,
+    tagOpImpl,
+    tagOpUpdate,
+    tagOpConcatLists,
+    tagConcatStrings,
+    tagPos,
+} ExprTag;
+
+
+#define FOR_EACH_BINOP(m) \
+    m(ExprApp, tagApp) \
+    m(ExprOpEq, tagOpEq) \
+    m(ExprOpNEq, tagOpNEq) \
+    m(ExprOpAnd, tagOpAnd) \
+    m(ExprOpOr, tagOpOr) \
+    m(ExprOpImpl, tagOpImpl) \
+    m(ExprOpUpdate, tagOpUpdate) \
+    m(ExprOpConcatLists, tagOpConcatLists)
+
+
+struct ExprWriter
+{
+    std::string out;
+    std::map<Symbol, uint64_t> symbolIds;
+    std::vector<Symbol> symbols;
+    std::unordered_map<Expr *, uint64_t> exprIds;
+
+    void writeNum(uint64_t n)
+    {
+        while (n >= 0x80) {
+            out.push_back((char) (n | 0x80));
+            n >>= 7;
+        }
+        out.push_back((char) n);
+    }
+
+    void writeTag(ExprTag tag)
+    {
+        out.push_back((char) tag);
+    }
+
+    void writeString(const string & s)
+    {
+        writeNum(s.size());
+        out.append(s);
+    }
+
+    void writeSymbol(const Symbol & sym)
+    {
+        if (!sym.set()) {
+            writeNum(0);
+            return;
+        }
+        auto i = symbolIds.find(sym);
+        if (i == symbolIds.end()) {
+            symbols.push_back(sym);
+            i = symbolIds.emplace(sym, symbols.size()).first;
+        }
+        writeNum(i->second);
+    }
+
+    void writePos(const Pos & pos)
+    {
+        writeSymbol(pos.file);
+        writeNum(pos.line);
+        writeNum(pos.column);
+    }
+
+    void writeAttrPath(const AttrPath & attrPath)
+    {
+        writeNum(attrPath.size());
+        for (auto & i : attrPath) {
+            writeSymbol(i.symbol);
+            if (!i.symbol.set()) writeExpr(i.expr);
+        }
+    }
+
+    void writeExprs(const std::vector<Expr *> & es)
+    {
+        writeNum(es.size());
+        for (auto & e : es) writeExpr(e);
+    }
+
+    void writeExpr(Expr * e);
+};
+
+
+void ExprWriter::writeExpr(Expr * e)
+{
+    if (!e) {
+        writeTag(tagNull);
+        return;
+    }
+
+    auto i = exprIds.find(e);
+    if (i != exprIds.end()) {
+        writeTag(tagRef);
+        writeNum(i->second);
+        return;
+    }
+
+    exprIds.emplace(e, exprIds.size());
+
+    if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+        writeTag(tagInt);
+        writeNum((uint64_t) e2->n);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+        writeTag(tagFloat);
+        uint64_t n;
+        static_assert(sizeof(n) == sizeof(e2->nf), "unexpected NixFloat size");
+        memcpy(&n, &e2->nf, sizeof(n));
+        writeNum(n);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+        writeTag(tagString);
+        writeSymbol(e2->s);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+        writeTag(tagPath);
+        writeString(e2->s);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+        writeTag(tagVar);
+        writePos(e2->pos);
+        writeSymbol(e2->name);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+        writeTag(tagSelect);
+        writePos(e2->pos);
+        writeExpr(e2->e);
+        writeExpr(e2->def);
+        writeAttrPath(e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        writeTag(tagOpHasAttr);
+        writeExpr(e2->e);
+        writeAttrPath(e2->attrPath);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+        writeTag(tagAttrs);
+        writeNum(e2->recursive);
+        writeNum(e2->attrs.size());
+        for (auto & i : e2->attrs) {
+            writeSymbol(i.first);
+            writeNum(i.second.inherited);
+            writeExpr(i.second.e);
+            writePos(i.second.pos);
+        }
+        writeNum(e2->dynamicAttrs.size());
+        for (auto & i : e2->dynamicAttrs) {
+            writeExpr(i.nameExpr);
+            writeExpr(i.valueExpr);
+            writePos(i.pos);
+        }
+    }
+
+    else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+        writeTag(tagList);
+        writeExprs(e2->elems);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+        writeTag(tagLambda);
+        writePos(e2->pos);
+        writeSymbol(e2->name);
+        writeSymbol(e2->arg);
+        writeNum(e2->matchAttrs);
+        writeNum(e2->formals != nullptr);
+        if (e2->formals) {
+            writeNum(e2->formals->formals.size());
+            for (auto & i : e2->formals->formals) {
+                writeSymbol(i.name);
+                writeExpr(i.def);
+            }
+            writeNum(e2->formals->ellipsis);
+        }
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+        writeTag(tagLet);
+        writeExpr(e2->attrs);
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+        writeTag(tagWith);
+        writePos(e2->pos);
+        writeExpr(e2->attrs);
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+        writeTag(tagIf);
+        writeExpr(e2->cond);
+        writeExpr(e2->then);
+        writeExpr(e2->else_);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+        writeTag(tagAssert);
+        writePos(e2->pos);
+        writeExpr(e2->cond);
+        writeExpr(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+        writeTag(tagOpNot);
+        writeExpr(e2->e);
+    }
+
+#define WRITE_BINOP(type, tag) \
+    else if (auto e2 = dynamic_cast<type *>(e)) { \
+        writeTag(tag); \
+        writePos(e2->pos); \
+        writeExpr(e2->e1); \
+        writeExpr(e2->e2); \
+    }
+    FOR_EACH_BINOP(WRITE_BINOP)
+#undef WRITE_BINOP
+
+    else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        writeTag(tagConcatStrings);
+        writePos(e2->pos);
+        writeNum(e2->forceString);
+        writeExprs(*e2->es);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+        writeTag(tagPos);
+        writePos(e2->pos);
+    }
+
+    else
+        throw Error("cannot serialise expression '%s'", *e);
+}
+
+
+std::string serialiseExpr(Expr * e)
+{
+    ExprWriter writer;
+    writer.writeExpr(e);
+
+    ExprWriter header;
+    header.writeNum(writer.symbols.size());
+    for (auto & sym : writer.symbols)
+        header.writeString(sym);
+
+    return header.out + writer.out;
+}
+
+
+struct ExprReader
+{
+    const char * p, * end;
+    SymbolTable & symbolTable;
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    ExprReader(SymbolTable & symbolTable, const char * data, size_t size)
+        : p(data), end(data + size), symbolTable(symbolTable)
+    { }
+
+    [[noreturn]] void corrupt()
+    {
+        throw Error("corrupt serialised expression");
+    }
+
+    uint64_t readNum()
+    {
+        uint64_t n = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            if (p == end || shift > 63) corrupt();
+            unsigned char c = *p++;
+            n |= (uint64_t) (c & 0x7f) << shift;
+            if (!(c & 0x80)) return n;
+        }
+    }
+
+    bool readBool()
+    {
+        return readNum() != 0;
+    }
+
+    string readString()
+    {
+        auto len = readNum();
+        if (len > (uint64_t) (end - p)) corrupt();
+        string s(p, len);
+        p += len;
+        return s;
+    }
+
+    Symbol readSymbol()
+    {
+        auto n = readNum();
+        if (!n) return Symbol();
+        if (n > symbols.size()) corrupt();
+        return symbols[n - 1];
+    }
+
+    Pos readPos()
+    {
+        auto file = readSymbol();
+        auto line = readNum();
+        auto column = readNum();
+        return Pos(file, line, column);
+    }
+
+    AttrPath readAttrPath()
+    {
+        AttrPath attrPath;
+        auto n = readNum();
+        while (n--) {
+            auto sym = readSymbol();
+            if (sym.set())
+                attrPath.push_back(AttrName(sym));
+            else
+                attrPath.push_back(AttrName(readNonNullExpr()));
+        }
+        return attrPath;
+    }
+
+    std::vector<Expr *> readExprs()
+    {
+        std::vector<Expr *> es;
+        auto n = readNum();
+        while (n--) es.push_back(readNonNullExpr());
+        return es;
+    }
+
+    Expr * readExpr();
+
+    Expr * readNonNullExpr()
+    {
+        auto e = readExpr();
+        if (!e) corrupt();
+        return e;
+    }
+
+    template<typename T>
+    T * readExprOfType()
+    {
+        auto e = dynamic_cast<T *>(readNonNullExpr());
+        if (!e) corrupt();
+        return e;
+    }
+};
+
+
+Expr * ExprReader::readExpr()
+{
+    if (p == end) corrupt();
+    auto tag = (ExprTag) *p++;
+
+    if (tag == tagNull) return nullptr;
+
+    if (tag == tagRef) {
+        auto n = readNum();
+        if (n >= exprs.size() || !exprs[n]) corrupt();
+        return exprs[n];
+    }
+
+    /* Reserve the ID of this expression before reading its children,
+       so that IDs are assigned in the same (pre-)order as by the
+       writer. */
+    auto id = exprs.size();
+    exprs.push_back(nullptr);
+
+    Expr * res;
+
+    switch (tag) {
+
+    case tagInt:
+        res = new ExprInt((NixInt) readNum());
+        break;
+
+    case tagFloat: {
+        uint64_t n = readNum();
+        NixFloat nf;
+        memcpy(&nf, &n, sizeof(nf));
+        res = new ExprFloat(nf);
+        break;
+    }
+
+    case tagString:
+        res = new ExprString(readSymbol());
+        break;
+
+    case tagPath:
+        res = new ExprPath(readString());
+        break;
+
+    case tagVar: {
+        auto pos = readPos();
+        res = new ExprVar(pos, readSymbol());
+        break;
+    }
+
+    case tagSelect: {
+        auto pos = readPos();
+        auto e = readNonNullExpr();
+        auto def = readExpr();
+        res = new ExprSelect(pos, e, readAttrPath(), def);
+        break;
+    }
+
+    case tagOpHasAttr: {
+        auto e = readNonNullExpr();
+        res = new ExprOpHasAttr(e, readAttrPath());
+        break;
+    }
+
+    case tagAttrs: {
+        auto e = new ExprAttrs;
+        e->recursive = readBool();
+        auto n = readNum();
+        while (n--) {
+            auto name = readSymbol();
+            auto inherited = readBool();
+            auto value = readNonNullExpr();
+            auto pos = readPos();
+            e->attrs[name] = ExprAttrs::AttrDef(value, pos, inherited);
+        }
+        n = readNum();
+        while (n--) {
+            auto nameExpr = readNonNullExpr();
+            auto valueExpr = readNonNullExpr();
+            e->dynamicAttrs.push_back(ExprAttrs::DynamicAttrDef(nameExpr, valueExpr, readPos()));
+        }
+        res = e;
+        break;
+    }
+
+    case tagList: {
+        auto e = new ExprList;
+        e->elems = readExprs();
+        res = e;
+        break;
+    }
+
+    case tagLambda: {
+        auto pos = readPos();
+        auto name = readSymbol();
+        auto arg = readSymbol();
+        auto matchAttrs = readBool();
+        Formals * formals = nullptr;
+        if (readBool()) {
+            formals = new Formals;
+            auto n = readNum();
+            while (n--) {
+                auto name = readSymbol();
+                formals->formals.emplace_back(name, readExpr());
+                formals->argNames.insert(name);
+            }
+            formals->ellipsis = readBool();
+        }
+        auto body = readNonNullExpr();
+        auto e = new ExprLambda(pos, arg, matchAttrs, formals, body);
+        e->name = name;
+        res = e;
+        break;
+    }
+
+    case tagLet: {
+        auto attrs = readExprOfType<ExprAttrs>();
+        res = new ExprLet(attrs, readNonNullExpr());
+        break;
+    }
+
+    case tagWith: {
+        auto pos = readPos();
+        auto attrs = readNonNullExpr();
+        res = new ExprWith(pos, attrs, readNonNullExpr());
+        break;
+    }
+
+    case tagIf: {
+        auto cond = readNonNullExpr();
+        auto then = readNonNullExpr();
+        res = new ExprIf(cond, then, readNonNullExpr());
+        break;
+    }
+
+    case tagAssert: {
+        auto pos = readPos();
+        auto cond = readNonNullExpr();
+        res = new ExprAssert(pos, cond, readNonNullExpr());
+        break;
+    }
+
+    case tagOpNot:
+        res = new ExprOpNot(readNonNullExpr());
+        break;
+
+#define READ_BINOP(type, tag) \
+    case tag: { \
+        auto pos = readPos(); \
+        auto e1 = readNonNullExpr(); \
+        res = new type(pos, e1, readNonNullExpr()); \
+        break; \
+    }
+    FOR_EACH_BINOP(READ_BINOP)
+#undef READ_BINOP
+
+    case tagConcatStrings: {
+        auto pos = readPos();
+        auto forceString = readBool();
+        res = new ExprConcatStrings(pos, forceString, new vector<Expr *>(readExprs()));
+        break;
+    }
+
+    case tagPos:
+        res = new ExprPos(readPos());
+        break;
+
+    default:
+        corrupt();
+    }
+
+    exprs[id] = res;
+    return res;
+}
+
+
+Expr * deserialiseExpr(SymbolTable & symbols, const char * data, size_t size)
+{
+    ExprReader reader(symbols, data, size);
+
+    auto nrSymbols = reader.readNum();
+    if (nrSymbols > size) reader.corrupt();
+    reader.symbols.reserve(nrSymbols);
+    while (nrSymbols--)
+        reader.symbols.push_back(symbols.create(reader.readString()));
+
+    auto e = reader.readNonNullExpr();
+    if (reader.p != reader.end) reader.corrupt();
+    return e;
+}
+
+
+/* The parse cache stores serialised expressions in
+   ~/.cache/nix/parse-cache-v1/<hash>, where <hash> is computed from
+   the file name and contents.  The modification time of an entry is
+   updated (at most once a day) when it's used, so that entries of
+   files that have since changed or disappeared can be evicted by
+   evictParseCache(). */
+
+static const string parseCacheMagic = "nix-parse-cache-2";
+
+static const time_t parseCacheTouchInterval = 24 * 60 * 60;
+
+
+/* Delete the entries that haven't been used for
+   'parse-cache-max-age' seconds.  Since this reads the whole
+   directory, it's done at most once a day, as recorded by the
+   modification time of a stamp file. */
+static void evictParseCache(const Path & cacheDir)
+{
+    time_t maxAge = evalSettings.parseCacheMaxAge;
+    if (!maxAge) return;
+
+    auto now = time(0);
+
+    Path stampFile = cacheDir + "/.last-eviction";
+    struct stat st;
+    if (stat(stampFile.c_str(), &st) == 0
+        && st.st_mtime + std::min(maxAge, parseCacheTouchInterval) > now)
+        return;
+    writeFile(stampFile, "");
+
+    for (auto & i : readDirectory(cacheDir)) {
+        Path path = cacheDir + "/" + i.name;
+        if (path == stampFile) continue;
+        if (lstat(path.c_str(), &st) == 0 && st.st_mtime + maxAge < now) {
+            debug("evicting parse cache entry '%s'", path);
+            unlink(path.c_str());
+        }
+    }
+}
+
+
+Expr * EvalState::parseFileCached(const string & text, const Path & path)
+{
+    /* '~/...' paths are expanded while parsing, so the AST depends
+       on the home directory as well. */
+    auto key = hashString(htSHA256,
+        parseCacheMagic + '\0' + nixVersion + '\0' + getHome() + '\0' + path + '\0' + text);
+    Path cacheDir = getCacheDir() + "/nix/parse-cache-v1";
+    Path cacheFile = cacheDir + "/" + key.to_string(Base32, false);
+
+    /* The key is repeated at the start of the cache file, guarding
+       against truncated or otherwise damaged files. */
+    string header = parseCacheMagic + ":" + key.to_string(Base32, false) + "\n";
+
+    AutoCloseFD fd = open(cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd) {
+        try {
+            struct stat st;
+            if (fstat(fd.get(), &st))
+                throw SysError("statting '%s'", cacheFile);
+
+            if ((size_t) st.st_size > header.size()) {
+                void * data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+                if (data == MAP_FAILED)
+                    throw SysError("mapping '%s'", cacheFile);
+                Finally unmap([&]() { munmap(data, st.st_size); });
+
+                auto p = (const char *) data;
+                if (string(p, header.size()) == header) {
+                    auto e = deserialiseExpr(symbols, p + header.size(), st.st_size - header.size());
+                    /* Variable bindings depend on the order of symbols
+                       in this process, so they can't be cached. */
+                    e->bindVars(staticBaseEnv);
+                    if (st.st_mtime + parseCacheTouchInterval < time(0))
+                        futimens(fd.get(), nullptr);
+                    nrParseCacheHits++;
+                    return e;
+                }
+            }
+        } catch (Error & e) {
+            printError("warning: ignoring parse cache entry '%s': %s", cacheFile, e.what());
+        }
+    }
+
+    nrParseCacheMisses++;
+
+    auto e = parse(text.c_str(), path, dirOf(path), staticBaseEnv);
+
+    try {
+        createDirs(cacheDir);
+        evictParseCache(cacheDir);
+        Path tmpFile = fmt("%s.tmp-%d", cacheFile, getpid());
+        writeFile(tmpFile, header + serialiseExpr(e));
+        if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpFile, cacheFile);
+    } catch (Error & e) {
+        printError("warning: cannot write parse cache entry '%s': %s", cacheFile, e.what());
+    }
+
+    return e;
+}
+
+
+}
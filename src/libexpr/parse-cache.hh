@@ -0,0 +1,20 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+/* Serialise a parsed expression into a compact binary form, including
+   all positions, symbols and function formals.  Expressions that are
+   shared within the tree (e.g. the 'e' in 'inherit (e) a b') remain
+   shared.  Variable bindings are not included, since displacements
+   depend on the order of symbols in the current process; call
+   bindVars() on the result of deserialiseExpr() before evaluating
+   it. */
+std::string serialiseExpr(Expr * e);
+
+/* Reconstruct an expression from the output of serialiseExpr().
+   Throws an Error if 'data' is corrupt. */
+Expr * deserialiseExpr(SymbolTable & symbols, const char * data, size_t size);
+
+}
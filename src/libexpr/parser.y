@@ -597,7 +597,10 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), path, dirOf(path), staticEnv);
+    auto text = readFile(path);
+    if (evalSettings.parseCache && &staticEnv == &staticBaseEnv)
+        return parseFileCached(text, path);
+    return parse(text.c_str(), path, dirOf(path), staticEnv);
 }
 
 
@@ -658,6 +661,7 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
         auto r = resolveSearchPathElem(i);
         if (!r.first) continue;
         Path res = r.second + suffix;
+        if (trackAccesses) recordAccess(res);
         if (pathExists(res)) return canonPath(res);
     }
     format f = format(
@@ -676,6 +680,7 @@ std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathEl
     std::pair<bool, std::string> res;
 
     if (isUri(elem.second)) {
+        impure = true;
         try {
             CachedDownloadRequest request(elem.second);
             request.unpack = true;
@@ -686,6 +691,7 @@ std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathEl
         }
     } else {
         auto path = absPath(elem.second);
+        if (trackAccesses) recordAccess(path);
         if (pathExists(path))
             res = { true, path };
         else {
@@ -12,15 +12,17 @@
 #include "value-to-json.hh"
 #include "value-to-xml.hh"
 #include "primops.hh"
+#include "regex.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
-#include <regex>
 #include <dlfcn.h>
+#include <unordered_set>
 
 
 namespace nix {
@@ -48,6 +50,10 @@ InvalidPathError::InvalidPathError(const Path & path) :
 
 void EvalState::realiseContext(const PathSet & context)
 {
+    /* The paths in the context (e.g. derivations) may not have been
+       written yet. */
+    if (!context.empty()) store->flushWrites();
+
     PathSet drvs;
 
     for (auto & i : context) {
@@ -171,6 +177,8 @@ void prim_importNative(EvalState & state, const Pos & pos, Value * * args, Value
 
     string sym = state.forceStringNoCtx(*args[1], pos);
 
+    state.impure = true;
+
     void *handle = dlopen(path.c_str(), RTLD_LAZY | RTLD_LOCAL);
     if (!handle)
         throw EvalError(format("could not open '%1%': %2%") % path % dlerror());
@@ -203,6 +211,7 @@ void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
     }
     PathSet context;
     auto program = state.coerceToString(pos, *elems[0], context, false, false);
+    state.impure = true;
     Strings commandArgs;
     for (unsigned int i = 1; i < args[0]->listSize(); ++i) {
         commandArgs.emplace_back(state.coerceToString(pos, *elems[i], context, false, false));
@@ -322,6 +331,19 @@ static void prim_isPath(EvalState & state, const Pos & pos, Value * * args, Valu
     mkBool(v, args[0]->type == tPath);
 }
 
+static bool isNumber(const Value & v)
+{
+    return v.type == tInt || v.type == tFloat;
+}
+
+
+/* Whether CompareValues supports values of this type. */
+static bool isComparable(const Value & v)
+{
+    return isNumber(v) || v.type == tString || v.type == tPath;
+}
+
+
 struct CompareValues
 {
     bool operator () (const Value * v1, const Value * v2) const
@@ -383,7 +405,14 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     ValueList res;
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
-    set<Value *, CompareValues> doneKeys;
+    auto hashKey = [&](Value * v) -> size_t {
+        return isComparable(*v) ? state.hashValue(*v) : 0;
+    };
+    auto eqKeys = [&](Value * v1, Value * v2) {
+        return state.eqValues(*v1, *v2);
+    };
+    std::unordered_set<Value *, decltype(hashKey), decltype(eqKeys)> doneKeys(0, hashKey, eqKeys);
+    Value * firstKey = nullptr;
     while (!workSet.empty()) {
         Value * e = *(workSet.begin());
         workSet.pop_front();
@@ -396,8 +425,16 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
             throw EvalError(format("attribute 'key' required, at %1%") % pos);
         state.forceValue(*key->value);
 
-        if (doneKeys.find(key->value) != doneKeys.end()) continue;
-        doneKeys.insert(key->value);
+        /* Keys that CompareValues can't order against each other
+           would never be compared for equality in the hash set, so
+           reject them here. */
+        if (!firstKey)
+            firstKey = key->value;
+        else if (!isComparable(*key->value) || !isComparable(*firstKey)
+            || (isNumber(*key->value) ? !isNumber(*firstKey) : key->value->type != firstKey->type))
+            throw EvalError(format("cannot compare %1% with %2%") % showType(*key->value) % showType(*firstKey));
+
+        if (!doneKeys.insert(key->value).second) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -428,6 +465,13 @@ static void prim_abort(EvalState & state, const Pos & pos, Value * * args, Value
 }
 
 
+static void prim_currentTime(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.impure = true;
+    v = *args[0];
+}
+
+
 static void prim_throw(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     PathSet context;
@@ -470,6 +514,7 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
+    if (state.trackAccesses) state.recordAccess("$" + name);
     mkString(v, evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name));
 }
 
@@ -762,8 +807,9 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
 
     /* Optimisation, but required in read-only mode! because in that
        case we don't actually write store derivations, so we can't
-       read them later. */
-    drvHashes[drvPath] = hashDerivationModulo(*state.store, drv);
+       read them later.  (Unlike the hash above, this covers the
+       output paths, but the inputs are memoised by now.) */
+    drvHashes.set(drvPath, hashDerivationModulo(*state.store, drv));
 
     state.mkAttrs(v, 1 + drv.outputs.size());
     mkString(*state.allocAttr(v, state.sDrvPath), drvPath, {"=" + drvPath});
@@ -1075,9 +1121,7 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
     }
     Path dstPath;
     if (!expectedHash || !state.store->isValidPath(expectedStorePath)) {
-        dstPath = settings.readOnlyMode
-            ? state.store->computeStorePathForPath(name, path, recursive, htSHA256, filter).first
-            : state.store->addToStore(name, path, recursive, htSHA256, filter, state.repair);
+        dstPath = state.addSourceToStore(name, path, recursive, filter);
         if (expectedHash && expectedStorePath != dstPath) {
             throw Error(format("store path mismatch in (possibly filtered) path added from '%1%'") % path);
         }
@@ -1187,8 +1231,8 @@ void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
     // !!! Should we create a symbol here or just do a lookup?
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    auto i = args[1]->attrs->get(state.symbols.create(attr));
+    if (!i)
         throw EvalError(format("attribute '%1%' missing, at %2%") % attr % pos);
     // !!! add to stack trace?
     if (state.countCalls && i->pos) state.attrSelects[*i->pos]++;
@@ -1215,7 +1259,7 @@ static void prim_hasAttr(EvalState & state, const Pos & pos, Value * * args, Val
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    mkBool(v, args[1]->attrs->find(state.symbols.create(attr)) != args[1]->attrs->end());
+    mkBool(v, args[1]->attrs->get(state.symbols.create(attr)));
 }
 
 
@@ -1298,8 +1342,8 @@ static void prim_intersectAttrs(EvalState & state, const Pos & pos, Value * * ar
     state.mkAttrs(v, std::min(args[0]->attrs->size(), args[1]->attrs->size()));
 
     for (auto & i : *args[0]->attrs) {
-        Bindings::iterator j = args[1]->attrs->find(i.name);
-        if (j != args[1]->attrs->end())
+        auto j = args[1]->attrs->get(i.name);
+        if (j)
             v.attrs->push_back(*j);
     }
 }
@@ -1323,8 +1367,7 @@ static void prim_catAttrs(EvalState & state, const Pos & pos, Value * * args, Va
     for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
         Value & v2(*args[1]->listElems()[n]);
         state.forceAttrs(v2, pos);
-        Bindings::iterator i = v2.attrs->find(attrName);
-        if (i != v2.attrs->end())
+        if (auto i = v2.attrs->get(attrName))
             res[found++] = i->value;
     }
 
@@ -1597,11 +1640,23 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
     }
 
 
+    /* Optimization: if the comparator is lessThan, bypass
+       callFunction, and if all elements have the same type, the type
+       checks of CompareValues. */
+    if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan) {
+        auto elems = v.listElems();
+        auto type = len ? elems[0]->type : tInt;
+        bool sameType = std::all_of(elems, elems + len, [&](Value * e) { return e->type == type; });
+        if (sameType && type == tInt)
+            std::stable_sort(elems, elems + len, [](Value * a, Value * b) { return a->integer < b->integer; });
+        else if (sameType && type == tString)
+            std::stable_sort(elems, elems + len, [](Value * a, Value * b) { return strcmp(a->string.s, b->string.s) < 0; });
+        else
+            std::stable_sort(elems, elems + len, CompareValues());
+        return;
+    }
+
     auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan)
-            return CompareValues()(a, b);
 
         Value vTmp1, vTmp2;
         state.callFunction(*args[0], *a, vTmp1, pos);
@@ -1821,43 +1876,70 @@ static void prim_hashString(EvalState & state, const Pos & pos, Value * * args,
 }
 
 
-/* Match a regular expression against a string and return either
-   ‘null’ or a list containing substring matches. */
-static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
+std::shared_ptr<Regex> EvalState::getRegex(const std::string & re)
 {
-    auto re = state.forceStringNoCtx(*args[0], pos);
+    auto i = regexCache.find(re);
+    if (i != regexCache.end()) {
+        nrRegexCacheHits++;
+        return i->second;
+    }
 
+    nrRegexCacheMisses++;
+    auto before = std::chrono::steady_clock::now();
+    auto regex = std::make_shared<Regex>(re);
+    regexCompileTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+
+    regexCache.emplace(re, regex);
+    return regex;
+}
+
+
+static std::shared_ptr<Regex> getRegex(EvalState & state, const string & re, const Pos & pos)
+{
     try {
+        return state.getRegex(re);
+    } catch (RegexTooComplex & e) {
+        throw EvalError("memory limit exceeded by regular expression '%s', at %s", re, pos);
+    } catch (BadRegex & e) {
+        throw EvalError("invalid regular expression '%s', at %s", re, pos);
+    }
+}
 
-        std::regex regex(re, std::regex::extended);
 
-        PathSet context;
-        const std::string str = state.forceString(*args[1], context, pos);
+/* Return a list of the groups in 'm', with null for the groups that
+   didn't participate in the match. */
+static void mkSubmatches(EvalState & state, Value & v, const string & str, const Regex::Submatches & m)
+{
+    const size_t len = m.size() / 2 - 1;
+    state.mkList(v, len);
+    for (size_t i = 0; i < len; ++i) {
+        auto begin = m[2 * i + 2], end = m[2 * i + 3];
+        if (begin == -1)
+            mkNull(*(v.listElems()[i] = state.allocValue()));
+        else
+            mkString(*(v.listElems()[i] = state.allocValue()), string(str, begin, end - begin));
+    }
+}
 
-        std::smatch match;
-        if (!std::regex_match(str, match, regex)) {
-            mkNull(v);
-            return;
-        }
 
-        // the first match is the whole string
-        const size_t len = match.size() - 1;
-        state.mkList(v, len);
-        for (size_t i = 0; i < len; ++i) {
-            if (!match[i+1].matched)
-                mkNull(*(v.listElems()[i] = state.allocValue()));
-            else
-                mkString(*(v.listElems()[i] = state.allocValue()), match[i + 1].str().c_str());
-        }
+/* Match a regular expression against a string and return either
+   ‘null’ or a list containing substring matches. */
+static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    auto re = state.forceStringNoCtx(*args[0], pos);
 
-    } catch (std::regex_error &e) {
-        if (e.code() == std::regex_constants::error_space) {
-          // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
-          throw EvalError("memory limit exceeded by regular expression '%s', at %s", re, pos);
-        } else {
-          throw EvalError("invalid regular expression '%s', at %s", re, pos);
-        }
+    auto regex = getRegex(state, re, pos);
+
+    PathSet context;
+    const std::string str = state.forceString(*args[1], context, pos);
+
+    Regex::Submatches match;
+    if (!regex->match(str, match)) {
+        mkNull(v);
+        return;
     }
+
+    mkSubmatches(state, v, str, match);
 }
 
 
@@ -1867,64 +1949,43 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
-    try {
+    auto regex = getRegex(state, re, pos);
 
-        std::regex regex(re, std::regex::extended);
+    PathSet context;
+    const std::string str = state.forceString(*args[1], context, pos);
 
-        PathSet context;
-        const std::string str = state.forceString(*args[1], context, pos);
+    std::vector<Regex::Submatches> matches;
+    try {
+        matches = regex->searchAll(str);
+    } catch (RegexTooComplex & e) {
+        throw EvalError("memory limit exceeded by regular expression '%s', at %s", re, pos);
+    }
 
-        auto begin = std::sregex_iterator(str.begin(), str.end(), regex);
-        auto end = std::sregex_iterator();
+    if (matches.empty()) {
+        state.mkList(v, 1);
+        v.listElems()[0] = args[1];
+        return;
+    }
 
-        // Any matches results are surrounded by non-matching results.
-        const size_t len = std::distance(begin, end);
-        state.mkList(v, 2 * len + 1);
-        size_t idx = 0;
-        Value * elem;
+    // Any matches results are surrounded by non-matching results.
+    state.mkList(v, 2 * matches.size() + 1);
+    size_t idx = 0;
+    size_t prevEnd = 0;
 
-        if (len == 0) {
-            v.listElems()[idx++] = args[1];
-            return;
-        }
+    for (auto & m : matches) {
+        // Add a string for non-matched characters.
+        mkString(*(v.listElems()[idx++] = state.allocValue()), string(str, prevEnd, m[0] - prevEnd));
 
-        for (std::sregex_iterator i = begin; i != end; ++i) {
-            assert(idx <= 2 * len + 1 - 3);
-            std::smatch match = *i;
-
-            // Add a string for non-matched characters.
-            elem = v.listElems()[idx++] = state.allocValue();
-            mkString(*elem, match.prefix().str().c_str());
-
-            // Add a list for matched substrings.
-            const size_t slen = match.size() - 1;
-            elem = v.listElems()[idx++] = state.allocValue();
-
-            // Start at 1, beacause the first match is the whole string.
-            state.mkList(*elem, slen);
-            for (size_t si = 0; si < slen; ++si) {
-                if (!match[si + 1].matched)
-                    mkNull(*(elem->listElems()[si] = state.allocValue()));
-                else
-                    mkString(*(elem->listElems()[si] = state.allocValue()), match[si + 1].str().c_str());
-            }
+        // Add a list for matched substrings.
+        mkSubmatches(state, *(v.listElems()[idx++] = state.allocValue()), str, m);
 
-            // Add a string for non-matched suffix characters.
-            if (idx == 2 * len) {
-                elem = v.listElems()[idx++] = state.allocValue();
-                mkString(*elem, match.suffix().str().c_str());
-            }
-        }
-        assert(idx == 2 * len + 1);
-
-    } catch (std::regex_error &e) {
-        if (e.code() == std::regex_constants::error_space) {
-          // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
-          throw EvalError("memory limit exceeded by regular expression '%s', at %s", re, pos);
-        } else {
-          throw EvalError("invalid regular expression '%s', at %s", re, pos);
-        }
+        prevEnd = m[1];
     }
+
+    // Add a string for non-matched suffix characters.
+    mkString(*(v.listElems()[idx++] = state.allocValue()), string(str, prevEnd));
+
+    assert(idx == 2 * matches.size() + 1);
 }
 
 
@@ -2089,6 +2150,8 @@ void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     if (evalSettings.pureEval && !request.expectedHash)
         throw Error("in pure evaluation mode, '%s' requires a 'sha256' argument", who);
 
+    if (!request.expectedHash) state.impure = true;
+
     Path res = getDownloader()->downloadCached(state.store, request).path;
 
     if (state.allowedPaths)
@@ -2156,6 +2219,16 @@ void EvalState::createBaseEnv()
 
     if (!evalSettings.pureEval) {
         mkInt(v, time(0));
+        if (trackAccesses) {
+            /* Make the current time a thunk, so that using it marks
+               the evaluation as impure. */
+            Value * vCurrentTime = allocValue();
+            vCurrentTime->type = tPrimOp;
+            vCurrentTime->primOp = new PrimOp(prim_currentTime, 1, symbols.create("currentTime"));
+            Value * vTime = allocValue();
+            *vTime = v;
+            mkApp(v, *vCurrentTime, *vTime);
+        }
         addConstant("__currentTime", v);
     }
 
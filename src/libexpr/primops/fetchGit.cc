@@ -4,6 +4,7 @@
 #include "store-api.hh"
 #include "pathlocks.hh"
 #include "hash.hh"
+#include "archive.hh"
 
 #include <sys/time.h>
 
@@ -25,6 +26,194 @@ struct GitInfo
 
 std::regex revRegex("^[0-9a-fA-F]{40}$");
 
+/* A reader of Git objects, using a 'git cat-file --batch' process. */
+class GitObjectReader
+{
+    Pid pid;
+    AutoCloseFD to;
+    FdSource from;
+    AutoCloseFD fromFd;
+
+public:
+
+    GitObjectReader(const Path & gitDir)
+    {
+        Pipe in, out;
+        in.create();
+        out.create();
+
+        pid = startProcess([&]() {
+            if (dup2(in.readSide.get(), STDIN_FILENO) == -1)
+                throw SysError("dupping stdin");
+            if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+                throw SysError("dupping stdout");
+            execlp("git", "git", "-C", gitDir.c_str(), "cat-file", "--batch", nullptr);
+            throw SysError("executing 'git'");
+        });
+
+        to = std::move(in.writeSide);
+        fromFd = std::move(out.readSide);
+        from.fd = fromFd.get();
+    }
+
+    ~GitObjectReader()
+    {
+        /* Closing both pipes makes git exit, even if we didn't read
+           all of its output (e.g. after an exception). */
+        try {
+            to = -1;
+            fromFd = -1;
+            pid.wait();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    /* Request 'object', which must have type 'type'.  Returns its
+       size; the contents must then be read with readContents() or
+       copyContents(). */
+    size_t request(const std::string & object, const std::string & type)
+    {
+        writeFull(to.get(), object + "\n");
+
+        std::string line;
+        while (true) {
+            char c = readChar();
+            if (c == '\n') break;
+            line += c;
+        }
+
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        if (fields.size() != 3 || fields[1] != type)
+            throw Error("Git object '%s' is not a %s ('%s')", object, type, line);
+
+        return std::stoull(fields[2]);
+    }
+
+    std::string readContents(size_t size)
+    {
+        std::string s(size, 0);
+        from((unsigned char *) s.data(), size);
+        readChar();
+        return s;
+    }
+
+    void copyContents(size_t size, Sink & sink)
+    {
+        std::vector<unsigned char> buf(65536);
+        while (size) {
+            auto n = std::min(size, buf.size());
+            from(buf.data(), n);
+            sink(buf.data(), n);
+            size -= n;
+        }
+        readChar();
+    }
+
+private:
+
+    char readChar()
+    {
+        unsigned char c;
+        from(&c, 1);
+        return c;
+    }
+};
+
+
+/* Thrown if a tree has a .gitattributes file, which may change how
+   'git archive' exports the tree (e.g. 'export-ignore' or 'eol'). */
+struct HasGitAttributes { };
+
+
+static void dumpGitTree(GitObjectReader & git, const std::string & tree, Sink & sink);
+
+static void dumpGitEntry(GitObjectReader & git, const std::string & mode,
+    const std::string & object, Sink & sink)
+{
+    checkInterrupt();
+
+    sink << "(";
+
+    if (mode == "40000") {
+        dumpGitTree(git, object, sink);
+    }
+
+    else if (mode == "160000") {
+        /* Submodules are exported as empty directories. */
+        sink << "type" << "directory";
+    }
+
+    else if (mode == "120000") {
+        auto size = git.request(object, "blob");
+        sink << "type" << "symlink" << "target" << git.readContents(size);
+    }
+
+    /* Besides 100644 and 100755, old versions of Git recorded other
+       permission bits (e.g. 100664).  As in 'git archive', only the
+       owner's execute bit matters. */
+    else if (mode.size() == 6 && hasPrefix(mode, "100")
+        && mode.find_first_not_of("01234567") == std::string::npos)
+    {
+        auto size = git.request(object, "blob");
+        sink << "type" << "regular";
+        if (std::stoul(mode, nullptr, 8) & 0100)
+            sink << "executable" << "";
+        sink << "contents" << size;
+        git.copyContents(size, sink);
+        writePadding(size, sink);
+    }
+
+    else throw Error("Git object '%s' has unsupported mode '%s'", object, mode);
+
+    sink << ")";
+}
+
+static void dumpGitTree(GitObjectReader & git, const std::string & tree, Sink & sink)
+{
+    auto size = git.request(tree, "tree");
+    auto data = git.readContents(size);
+
+    /* Tree entries have the form '<mode> <name>\0<20-byte hash>'.
+       Git orders them differently from NARs. */
+    std::map<std::string, std::pair<std::string, std::string>> entries;
+    size_t pos = 0;
+    while (pos < data.size()) {
+        auto space = data.find(' ', pos);
+        auto null = data.find('\0', pos);
+        if (space == std::string::npos || null == std::string::npos
+            || space > null || null + 21 > data.size())
+            throw Error("Git tree '%s' is corrupt", tree);
+        auto mode = data.substr(pos, space - pos);
+        auto name = data.substr(space + 1, null - space - 1);
+        if (name == ".gitattributes") throw HasGitAttributes();
+        Hash hash(htSHA1);
+        memcpy(hash.hash, data.data() + null + 1, hash.hashSize);
+        entries.emplace(name, std::make_pair(mode, hash.to_string(Base16, false)));
+        pos = null + 21;
+    }
+
+    sink << "type" << "directory";
+
+    for (auto & i : entries) {
+        sink << "entry" << "(" << "name" << i.first << "node";
+        dumpGitEntry(git, i.second.first, i.second.second, sink);
+        sink << ")";
+    }
+}
+
+/* Write the tree of 'rev' to 'sink' as a NAR, without checking it
+   out.  The result is the same as that of 'git archive' (which
+   exports submodules as empty directories), unless the tree has
+   .gitattributes files, in which case HasGitAttributes is thrown. */
+static void dumpGitRev(const Path & gitDir, const std::string & rev, Sink & sink)
+{
+    GitObjectReader git(gitDir);
+    sink << narVersionMagic1 << "(";
+    dumpGitTree(git, rev + "^{tree}", sink);
+    sink << ")";
+}
+
 GitInfo exportGit(ref<Store> store, const std::string & uri,
     std::optional<std::string> ref, std::string rev,
     const std::string & name)
@@ -150,15 +339,20 @@ GitInfo exportGit(ref<Store> store, const std::string & uri,
     Path storeLink = cacheDir + "/" + storeLinkName + ".link";
     PathLocks storeLinkLock({storeLink}, fmt("waiting for lock on '%1%'...", storeLink)); // FIXME: broken
 
+    /* The revision count of a revision never changes, so keep it
+       even if the store path has been garbage-collected. */
+    std::optional<uint64_t> revCount;
+
     try {
         auto json = nlohmann::json::parse(readFile(storeLink));
 
         assert(json["name"] == name && json["rev"] == gitInfo.rev);
 
         gitInfo.storePath = json["storePath"];
+        revCount = json["revCount"].get<uint64_t>();
 
         if (store->isValidPath(gitInfo.storePath)) {
-            gitInfo.revCount = json["revCount"];
+            gitInfo.revCount = *revCount;
             return gitInfo;
         }
 
@@ -166,18 +360,41 @@ GitInfo exportGit(ref<Store> store, const std::string & uri,
         if (e.errNo != ENOENT) throw;
     }
 
-    // FIXME: should pipe this, or find some better way to extract a
-    // revision.
-    auto tar = runProgram("git", true, { "-C", cacheDir, "archive", gitInfo.rev });
+    /* Compute the NAR hash of the tree first, so that it needn't be
+       copied into the store if the path is already valid. */
+    try {
+        HashSink hashSink(htSHA256);
+        dumpGitRev(cacheDir, gitInfo.rev, hashSink);
+        auto hash = hashSink.finish();
+
+        ValidPathInfo info;
+        info.path = store->makeFixedOutputPath(true, hash.first, name);
+        info.narHash = hash.first;
+        info.narSize = hash.second;
+        info.ca = makeFixedOutputCA(true, hash.first);
+
+        if (!store->isValidPath(info.path)) {
+            auto source = sinkToSource([&](Sink & sink) {
+                dumpGitRev(cacheDir, gitInfo.rev, sink);
+            });
+            store->addToStore(info, *source, NoRepair, NoCheckSigs);
+        }
+
+        gitInfo.storePath = info.path;
+
+    } catch (HasGitAttributes &) {
+        auto tar = runProgram("git", true, { "-C", cacheDir, "archive", gitInfo.rev });
 
-    Path tmpDir = createTempDir();
-    AutoDelete delTmpDir(tmpDir, true);
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
 
-    runProgram("tar", true, { "x", "-C", tmpDir }, tar);
+        runProgram("tar", true, { "x", "-C", tmpDir }, tar);
 
-    gitInfo.storePath = store->addToStore(name, tmpDir);
+        gitInfo.storePath = store->addToStore(name, tmpDir);
+    }
 
-    gitInfo.revCount = std::stoull(runProgram("git", true, { "-C", cacheDir, "rev-list", "--count", gitInfo.rev }));
+    gitInfo.revCount = revCount ? *revCount
+        : std::stoull(runProgram("git", true, { "-C", cacheDir, "rev-list", "--count", gitInfo.rev }));
 
     nlohmann::json json;
     json["storePath"] = gitInfo.storePath;
@@ -229,6 +446,8 @@ static void prim_fetchGit(EvalState & state, const Pos & pos, Value * * args, Va
     // whitelist. Ah well.
     state.checkURI(url);
 
+    if (rev == "") state.impure = true;
+
     auto gitInfo = exportGit(state.store, url, ref, rev, name);
 
     state.mkAttrs(v, 8);
@@ -0,0 +1,148 @@
+#include "source-cache.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "util.hh"
+
+#include <sqlite3.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists Sources (
+    key       text primary key not null,
+    path      text not null,
+    narHash   text not null,
+    timestamp integer not null
+);
+
+)sql";
+
+
+static void fingerprint(const Path & path, Sink & sink, bool recursive, PathFilter & filter,
+    time_t & newest, PathSet * selected)
+{
+    checkInterrupt();
+
+    auto st = lstat(path);
+
+    newest = std::max(newest, st.st_mtime);
+
+    sink << path
+         << (uint64_t) st.st_mode << (uint64_t) st.st_size
+         << (uint64_t) st.st_mtim.tv_sec << (uint64_t) st.st_mtim.tv_nsec
+         << (uint64_t) st.st_ctim.tv_sec << (uint64_t) st.st_ctim.tv_nsec
+         << (uint64_t) st.st_ino << (uint64_t) st.st_dev;
+
+    if (recursive && S_ISDIR(st.st_mode)) {
+        std::set<string> names;
+        for (auto & i : readDirectory(path))
+            names.insert(i.name);
+        for (auto & name : names) {
+            auto child = path + "/" + name;
+            if (filter(child)) {
+                if (selected) selected->insert(child);
+                fingerprint(child, sink, recursive, filter, newest, selected);
+            }
+        }
+    }
+}
+
+
+Hash fingerprintSource(const Path & path, bool recursive, PathFilter & filter,
+    time_t * newest, PathSet * selected)
+{
+    HashSink sink(htSHA256);
+    time_t newest_ = 0;
+    fingerprint(path, sink, recursive, filter, newest_, selected);
+    if (newest) *newest = newest_;
+    return sink.finish().first;
+}
+
+
+class SourceCacheImpl : public SourceCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertSource, querySource;
+    };
+
+    Sync<State> _state;
+
+    SourceCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/source-cache-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        if (sqlite3_busy_timeout(state->db, 60 * 60 * 1000) != SQLITE_OK)
+            throwSQLiteError(state->db, "setting timeout");
+
+        // We can always reproduce the cache.
+        state->db.exec("pragma synchronous = off");
+        state->db.exec("pragma main.journal_mode = truncate");
+
+        state->db.exec(schema);
+
+        state->insertSource.create(state->db,
+            "insert or replace into Sources(key, path, narHash, timestamp) values (?, ?, ?, ?)");
+
+        state->querySource.create(state->db,
+            "select path, narHash from Sources where key = ?");
+    }
+
+    std::optional<Entry> lookup(const Hash & key) override
+    {
+        return retrySQLite<std::optional<Entry>>([&]() -> std::optional<Entry> {
+            auto state(_state.lock());
+
+            auto querySource(state->querySource.use()(key.to_string(Base32, false)));
+            if (!querySource.next()) return {};
+
+            return Entry{querySource.getStr(0), querySource.getStr(1)};
+        });
+    }
+
+    void insert(const Hash & key, const Entry & entry) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            state->insertSource.use()
+                (key.to_string(Base32, false))
+                (entry.storePath)
+                (entry.narHash)
+                (time(0)).exec();
+        });
+    }
+};
+
+ref<SourceCache> getSourceCache()
+{
+    /* A forked evaluation worker (see queryDrvInfos()) can't use the
+       database connection of its parent, so it opens its own.  The
+       parent's object is leaked rather than destroyed, since closing
+       the connection in the child would interfere with the parent. */
+    static std::mutex lock;
+    static std::shared_ptr<SourceCache> cache;
+    static pid_t pid = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    if (!cache || pid != getpid()) {
+        if (cache) new std::shared_ptr<SourceCache>(cache);
+        cache = std::make_shared<SourceCacheImpl>();
+        pid = getpid();
+    }
+    return ref<SourceCache>(cache);
+}
+
+}
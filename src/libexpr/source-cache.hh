@@ -0,0 +1,50 @@
+#pragma once
+
+#include "hash.hh"
+#include "ref.hh"
+#include "archive.hh"
+
+#include <optional>
+
+namespace nix {
+
+/* A persistent cache of the store paths of source trees copied to the
+   store during evaluation (i.e. path literals, builtins.path and
+   builtins.filterSource), so that unchanged trees don't have to be
+   serialised and hashed again.  Entries are keyed by the source path,
+   the name and mode of the copy, and a fingerprint of the files
+   selected by the filter (see fingerprintSource()). */
+class SourceCache
+{
+public:
+
+    struct Entry
+    {
+        Path storePath;
+        /* The NAR hash of 'storePath', or empty if it wasn't valid
+           when the entry was created (in read-only mode). */
+        std::string narHash;
+    };
+
+    virtual ~SourceCache() { }
+
+    virtual std::optional<Entry> lookup(const Hash & key) = 0;
+
+    virtual void insert(const Hash & key, const Entry & entry) = 0;
+};
+
+/* Return the cache object of the current process, which can be used
+   concurrently by multiple threads. */
+ref<SourceCache> getSourceCache();
+
+/* Return a hash of the type, size, modification/change time and inode
+   of 'path' and, if 'recursive', of every file below it that is
+   selected by 'filter', in the order used by dumpPath().  File
+   contents are not read.  Note that this calls 'filter' for every
+   file.  If 'newest' is not null, it is set to the most recent
+   modification time of these files.  If 'selected' is not null, the
+   files below 'path' that 'filter' selected are added to it. */
+Hash fingerprintSource(const Path & path, bool recursive, PathFilter & filter,
+    time_t * newest = nullptr, PathSet * selected = nullptr);
+
+}
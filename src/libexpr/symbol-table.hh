@@ -53,6 +53,13 @@ public:
         return s->empty();
     }
 
+    /* An integer that uniquely identifies this symbol for the
+       lifetime of the symbol table, e.g. for use as a hash key. */
+    uintptr_t id() const
+    {
+        return (uintptr_t) s;
+    }
+
     friend std::ostream & operator << (std::ostream & str, const Symbol & sym);
 };
 
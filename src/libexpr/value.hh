@@ -119,10 +119,12 @@ struct Value
            derivation, and the other store paths in C will be added to
            the inputSrcs of the derivations.
 
-           For canonicity, the store paths should be in sorted order. */
+           For canonicity, the store paths should be in sorted order.
+           Contexts are managed by ContextTable, so values must only
+           get them from there (e.g. via mkString()). */
         struct {
             const char * s;
-            const char * * context; // must be in sorted order
+            const char * * context; // from ContextTable, in sorted order
         } string;
 
         const char * path;
@@ -4,7 +4,8 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "fs-accessor.hh"
-#include "istringstream_nocopy.hh"
+
+#include <string_view>
 
 namespace nix {
 
@@ -66,36 +67,48 @@ Path writeDerivation(ref<Store> store,
 }
 
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
+/* The parser below works directly on the contents of the .drv file.
+   It only allocates the strings that end up in the Derivation, which
+   matters when loading many thousands of derivations (e.g. in
+   queryMissing() or the garbage collector). */
+
+/* Skip over string `s' at the start of `str'. */
+static void expect(std::string_view & str, std::string_view s)
 {
-    char s2[s.size()];
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
-        throw FormatError(format("expected string '%1%'") % s);
+    if (str.compare(0, s.size(), s) != 0)
+        throw FormatError(format("expected string '%1%'") % std::string(s));
+    str.remove_prefix(s.size());
 }
 
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
+/* Read a C-style string from the start of `str'. */
+static string parseString(std::string_view & str)
 {
-    string res;
     expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
-            if (c == 'n') res += '\n';
-            else if (c == 'r') res += '\r';
-            else if (c == 't') res += '\t';
-            else res += c;
+    string res;
+    size_t start = 0;
+    while (true) {
+        /* Copy everything up to the next quote or backslash at
+           once. */
+        size_t i = str.find_first_of("\"\\", start);
+        if (i == std::string_view::npos || (str[i] == '\\' && i + 1 == str.size()))
+            throw FormatError("unterminated string in derivation");
+        res.append(str.data() + start, i - start);
+        if (str[i] == '"') {
+            str.remove_prefix(i + 1);
+            return res;
         }
+        char c = str[i + 1];
+        if (c == 'n') res += '\n';
+        else if (c == 'r') res += '\r';
+        else if (c == 't') res += '\t';
         else res += c;
-    return res;
+        start = i + 2;
+    }
 }
 
 
-static Path parsePath(std::istream & str)
+static Path parsePath(std::string_view & str)
 {
     string s = parseString(str);
     if (s.size() == 0 || s[0] != '/')
@@ -104,33 +117,32 @@ static Path parsePath(std::istream & str)
 }
 
 
-static bool endOfList(std::istream & str)
+static bool endOfList(std::string_view & str)
 {
-    if (str.peek() == ',') {
-        str.get();
+    if (!str.empty() && str[0] == ',') {
+        str.remove_prefix(1);
         return false;
     }
-    if (str.peek() == ']') {
-        str.get();
+    if (!str.empty() && str[0] == ']') {
+        str.remove_prefix(1);
         return true;
     }
     return false;
 }
 
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
+static StringSet parseStrings(std::string_view & str, bool arePaths)
 {
     StringSet res;
     while (!endOfList(str))
-        res.insert(arePaths ? parsePath(str) : parseString(str));
+        res.insert(res.end(), arePaths ? parsePath(str) : parseString(str));
     return res;
 }
 
 
-static Derivation parseDerivation(const string & s)
+static Derivation parseDerivation(std::string_view str)
 {
     Derivation drv;
-    istringstream_nocopy str(s);
     expect(str, "Derive([");
 
     /* Parse the list of outputs. */
@@ -141,7 +153,7 @@ static Derivation parseDerivation(const string & s)
         expect(str, ","); out.hashAlgo = parseString(str);
         expect(str, ","); out.hash = parseString(str);
         expect(str, ")");
-        drv.outputs[id] = out;
+        drv.outputs.emplace_hint(drv.outputs.end(), std::move(id), std::move(out));
     }
 
     /* Parse the list of input derivations. */
@@ -150,7 +162,7 @@ static Derivation parseDerivation(const string & s)
         expect(str, "(");
         Path drvPath = parsePath(str);
         expect(str, ",[");
-        drv.inputDrvs[drvPath] = parseStrings(str, false);
+        drv.inputDrvs.emplace_hint(drv.inputDrvs.end(), std::move(drvPath), parseStrings(str, false));
         expect(str, ")");
     }
 
@@ -169,7 +181,7 @@ static Derivation parseDerivation(const string & s)
         expect(str, "("); string name = parseString(str);
         expect(str, ","); string value = parseString(str);
         expect(str, ")");
-        drv.env[name] = value;
+        drv.env.emplace_hint(drv.env.end(), std::move(name), std::move(value));
     }
 
     expect(str, ")");
@@ -325,14 +337,18 @@ Hash hashDerivationModulo(Store & store, Derivation drv)
        calls to this function.*/
     DerivationInputs inputs2;
     for (auto & i : drv.inputDrvs) {
-        Hash h = drvHashes[i.first];
+        auto h = drvHashes.get(i.first);
         if (!h) {
-            assert(store.isValidPath(i.first));
-            Derivation drv2 = readDerivation(store.toRealPath(i.first));
-            h = hashDerivationModulo(store, drv2);
-            drvHashes[i.first] = h;
+            h = store.queryDerivationHash(i.first);
+            if (!h) {
+                assert(store.isValidPath(i.first));
+                Derivation drv2 = readDerivation(store.toRealPath(i.first));
+                h = hashDerivationModulo(store, drv2);
+                store.registerDerivationHash(i.first, *h);
+            }
+            drvHashes.set(i.first, *h);
         }
-        inputs2[h.to_string(Base16, false)] = i.second;
+        inputs2[h->to_string(Base16, false)] = i.second;
     }
     drv.inputDrvs = inputs2;
 
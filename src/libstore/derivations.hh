@@ -3,8 +3,12 @@
 #include "types.hh"
 #include "hash.hh"
 #include "store-api.hh"
+#include "sync.hh"
 
+#include <array>
 #include <map>
+#include <optional>
+#include <unordered_map>
 
 
 namespace nix {
@@ -93,10 +97,38 @@ bool isDerivation(const string & fileName);
 
 Hash hashDerivationModulo(Store & store, Derivation drv);
 
-/* Memoisation of hashDerivationModulo(). */
-typedef std::map<Path, Hash> DrvHashes;
+/* Memoisation of hashDerivationModulo().  This is split into shards
+   with a lock each so that concurrent evaluations and builds don't
+   contend on a single mutex.  Misses fall back to the table kept by
+   the store (see Store::queryDerivationHash()). */
+class DrvHashes
+{
+    static const size_t nrShards = 16;
+
+    std::array<Sync<std::unordered_map<Path, Hash>>, nrShards> shards;
+
+    Sync<std::unordered_map<Path, Hash>> & shard(const Path & drvPath)
+    {
+        return shards[std::hash<Path>()(drvPath) % nrShards];
+    }
+
+public:
+
+    std::optional<Hash> get(const Path & drvPath)
+    {
+        auto shard_(shard(drvPath).lock());
+        auto i = shard_->find(drvPath);
+        if (i == shard_->end()) return {};
+        return i->second;
+    }
+
+    void set(const Path & drvPath, const Hash & h)
+    {
+        shard(drvPath).lock()->emplace(drvPath, h);
+    }
+};
 
-extern DrvHashes drvHashes; // FIXME: global, not thread-safe
+extern DrvHashes drvHashes;
 
 /* Split a string specifying a derivation and a set of outputs
    (/nix/store/hash-foo!out1,out2,...) into the derivation path and
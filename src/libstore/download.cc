@@ -8,6 +8,7 @@
 #include "compression.hh"
 #include "pathlocks.hh"
 #include "finally.hh"
+#include "tarfile.hh"
 
 #ifdef ENABLE_S3
 #include <aws/core/client/ClientConfiguration.h>
@@ -42,6 +43,10 @@ std::string resolveUri(const std::string & uri)
         return uri;
 }
 
+/* The HTTP status codes of responses whose body is the requested
+   data (226 is used by FTP, and 0 by other protocols). */
+static const std::set<long> successfulStatuses {200, 201, 204, 206, 304, 226, 0};
+
 struct CurlDownloader : public Downloader
 {
     CURLM * curlm = 0;
@@ -86,8 +91,17 @@ struct CurlDownloader : public Downloader
             , callback(callback)
             , finalSink([this](const unsigned char * data, size_t len) {
                 if (this->request.dataCallback) {
-                    writtenToSink += len;
-                    this->request.dataCallback((char *) data, len);
+                    long httpStatus = 0;
+                    curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &httpStatus);
+
+                    /* Only pass the body of a successful response to
+                       the sink; an error page is not the data the
+                       caller asked for, and writing it would prevent
+                       retries. */
+                    if (successfulStatuses.count(httpStatus)) {
+                        writtenToSink += len;
+                        this->request.dataCallback((char *) data, len);
+                    }
                 } else
                     this->result.data->append((char *) data, len);
               })
@@ -338,8 +352,7 @@ struct CurlDownloader : public Downloader
             if (writeException)
                 failEx(writeException);
 
-            else if (code == CURLE_OK &&
-                (httpStatus == 200 || httpStatus == 201 || httpStatus == 204 || httpStatus == 206 || httpStatus == 304 || httpStatus == 226 /* FTP */ || httpStatus == 0 /* other protocol */))
+            else if (code == CURLE_OK && successfulStatuses.count(httpStatus))
             {
                 result.cached = httpStatus == 304;
                 done = true;
@@ -705,7 +718,7 @@ DownloadResult Downloader::download(const DownloadRequest & request)
     return enqueueDownload(request).get();
 }
 
-void Downloader::download(DownloadRequest && request, Sink & sink)
+DownloadResult Downloader::download(DownloadRequest && request, Sink & sink)
 {
     /* Note: we can't call 'sink' via request.dataCallback, because
        that would cause the sink to execute on the downloader
@@ -718,6 +731,7 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
     struct State {
         bool quit = false;
         std::exception_ptr exc;
+        DownloadResult result;
         std::string data;
         std::condition_variable avail, request;
     };
@@ -759,7 +773,7 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
             auto state(_state->lock());
             state->quit = true;
             try {
-                fut.get();
+                state->result = fut.get();
             } catch (...) {
                 state->exc = std::current_exception();
             }
@@ -781,7 +795,7 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
 
                 if (state->quit) {
                     if (state->exc) std::rethrow_exception(state->exc);
-                    return;
+                    return state->result;
                 }
 
                 state.wait(state->avail);
@@ -825,7 +839,13 @@ CachedDownloadResult Downloader::downloadCached(
     Path cacheDir = getCacheDir() + "/nix/tarballs";
     createDirs(cacheDir);
 
-    string urlHash = hashString(htSHA256, name + std::string("\0"s) + url).to_string(Base32, false);
+    /* Unless the user wants to keep the tarball, unpack it while
+       it's being downloaded, and record the unpacked store path
+       rather than the tarball. */
+    bool unpackStreaming = request.unpack && !downloadSettings.keepTarballs;
+
+    string urlHash = hashString(htSHA256, name + std::string("\0"s) + url
+        + (unpackStreaming ? "\0unpacked"s : ""s)).to_string(Base32, false);
 
     Path dataFile = cacheDir + "/" + urlHash + ".info";
     Path fileLink = cacheDir + "/" + urlHash + "-file";
@@ -840,6 +860,9 @@ CachedDownloadResult Downloader::downloadCached(
 
     CachedDownloadResult result;
 
+    /* Whether we had to give up on unpacking while downloading. */
+    bool unpackLater = false;
+
     if (pathExists(fileLink) && pathExists(dataFile)) {
         storePath = readLink(fileLink);
         store->addTempRoot(storePath);
@@ -865,35 +888,73 @@ CachedDownloadResult Downloader::downloadCached(
         try {
             DownloadRequest request2(url);
             request2.expectedETag = expectedETag;
-            auto res = download(request2);
-            result.effectiveUri = res.effectiveUri;
-            result.etag = res.etag;
 
-            if (!res.cached) {
-                ValidPathInfo info;
-                StringSink sink;
-                dumpString(*res.data, sink);
-                Hash hash = hashString(request.expectedHash ? request.expectedHash.type : htSHA256, *res.data);
-                info.path = store->makeFixedOutputPath(false, hash, name);
-                info.narHash = hashString(htSHA256, *sink.s);
-                info.narSize = sink.s->size();
-                info.ca = makeFixedOutputCA(false, hash);
-                store->addToStore(info, sink.s, NoRepair, NoCheckSigs);
-                storePath = info.path;
+            DownloadResult res;
+
+            bool streamed = false;
+
+            if (unpackStreaming) {
+                Path tmpDir = createTempDir();
+                AutoDelete autoDelete(tmpDir, true);
+
+                auto source = sinkToSource([&](Sink & sink) {
+                    auto decompressor = makeDecompressionSink("auto", sink);
+                    res = download(DownloadRequest(request2), *decompressor);
+                    decompressor->finish();
+                });
+
+                /* If the server says that the tarball hasn't changed,
+                   this unpacks an empty archive. If it's not a tarball
+                   we can unpack ourselves, download it as a file and
+                   unpack that below using an external tar. */
+                try {
+                    unpackTarfile(*source, tmpDir, 1);
+                    streamed = true;
+                } catch (UnsupportedTarball &) {
+                    debug("cannot unpack '%s' while downloading it", url);
+                    unpackStreaming = false;
+                    unpackLater = true;
+                    /* The cached result, if any, is an unpacked tree,
+                       so don't let the server tell us to reuse it. */
+                    request2.expectedETag = "";
+                }
+
+                if (streamed && !res.cached)
+                    storePath = store->addToStore(name, tmpDir, true, htSHA256, defaultPathFilter, NoRepair);
+            }
+
+            if (!streamed) {
+                res = download(request2);
+
+                if (!res.cached) {
+                    ValidPathInfo info;
+                    StringSink sink;
+                    dumpString(*res.data, sink);
+                    Hash hash = hashString(request.expectedHash ? request.expectedHash.type : htSHA256, *res.data);
+                    info.path = store->makeFixedOutputPath(false, hash, name);
+                    info.narHash = hashString(htSHA256, *sink.s);
+                    info.narSize = sink.s->size();
+                    info.ca = makeFixedOutputCA(false, hash);
+                    store->addToStore(info, sink.s, NoRepair, NoCheckSigs);
+                    storePath = info.path;
+                }
             }
 
+            result.effectiveUri = res.effectiveUri;
+            result.etag = res.etag;
+
             assert(!storePath.empty());
             replaceSymlink(storePath, fileLink);
 
             writeFile(dataFile, url + "\n" + res.etag + "\n" + std::to_string(time(0)) + "\n");
         } catch (DownloadError & e) {
-            if (storePath.empty()) throw;
+            if (storePath.empty() || unpackLater) throw;
             warn("warning: %s; using cached result", e.msg());
             result.etag = expectedETag;
         }
     }
 
-    if (request.unpack) {
+    if (request.unpack && !unpackStreaming) {
         Path unpackedLink = cacheDir + "/" + baseNameOf(storePath) + "-unpacked";
         PathLocks lock2({unpackedLink}, fmt("waiting for lock on '%1%'...", unpackedLink));
         Path unpackedStorePath;
@@ -907,12 +968,14 @@ CachedDownloadResult Downloader::downloadCached(
             printInfo(format("unpacking '%1%'...") % url);
             Path tmpDir = createTempDir();
             AutoDelete autoDelete(tmpDir, true);
-            // FIXME: this requires GNU tar for decompression.
-            runProgram("tar", true, {"xf", store->toRealPath(storePath), "-C", tmpDir, "--strip-components", "1"});
+            unpackTarfile(store->toRealPath(storePath), tmpDir, 1);
             unpackedStorePath = store->addToStore(name, tmpDir, true, htSHA256, defaultPathFilter, NoRepair);
         }
         replaceSymlink(unpackedStorePath, unpackedLink);
         storePath = unpackedStorePath;
+        /* Cache the unpacked tree under the streaming key, like a
+           streamed download would have. */
+        if (unpackLater) replaceSymlink(storePath, fileLink);
     }
 
     if (expectedStorePath != "" && storePath != expectedStorePath) {
@@ -29,6 +29,11 @@ struct DownloadSettings : Config
 
     Setting<unsigned int> tries{this, 5, "download-attempts",
         "How often Nix will attempt to download a file before giving up."};
+
+    Setting<bool> keepTarballs{this, false, "keep-tarballs",
+        "Whether to add tarballs fetched by fetchTarball and similar functions "
+        "to the Nix store before unpacking them, rather than unpacking them "
+        "while they are being downloaded."};
 };
 
 extern DownloadSettings downloadSettings;
@@ -103,8 +108,9 @@ struct Downloader
     DownloadResult download(const DownloadRequest & request);
 
     /* Download a file, writing its data to a sink. The sink will be
-       invoked on the thread of the caller. */
-    void download(DownloadRequest && request, Sink & sink);
+       invoked on the thread of the caller. The 'data' field of the
+       result is not set. */
+    DownloadResult download(DownloadRequest && request, Sink & sink);
 
     /* Check if the specified file is already in ~/.cache/nix/tarballs
        and is more recent than ‘tarball-ttl’ seconds. Otherwise,
@@ -2,12 +2,17 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "finally.hh"
+#include "ref-graph.hh"
+#include "thread-pool.hh"
+#include "json.hh"
 
 #include <functional>
 #include <queue>
 #include <algorithm>
 #include <regex>
 #include <random>
+#include <sstream>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -23,6 +28,13 @@ namespace nix {
 static string gcLockName = "gc.lock";
 static string gcRootsDir = "gcroots";
 
+/* The number of dead paths to invalidate in one transaction. */
+static const size_t gcBatchSize = 1000;
+
+/* The number of consecutive failed incremental collections after
+   which nix-daemon falls back to a normal one. */
+static const unsigned int gcMaxFailedCycles = 3;
+
 
 /* Acquire the global GC lock.  This is used to prevent new Nix
    processes from starting after the temporary root files have been
@@ -495,7 +507,12 @@ struct LocalStore::GCState
     bool gcKeepDerivations;
     unsigned long long bytesInvalidated;
     bool moveToTrash = true;
+    /* The directory to which deleted directories are moved. */
+    Path trashDir;
     bool shouldDelete;
+    /* Protects ‘results’ and ‘bytesInvalidated’ while paths are
+       deleted in parallel. */
+    std::mutex lock;
     GCState(GCResults & results_) : results(results_), bytesInvalidated(0) { }
 };
 
@@ -520,7 +537,7 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 {
     checkInterrupt();
 
-    unsigned long long size = 0;
+    uint64_t size = 0;
 
     if (isStorePath(path) && isValidPath(path)) {
         PathSet referrers;
@@ -531,6 +548,19 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         invalidatePathChecked(path);
     }
 
+    removeGarbage(state, path, size);
+
+    if (state.results.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
+        printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+        throw GCLimitReached();
+    }
+}
+
+
+/* Delete the file system object of a path that is not (or no longer)
+   valid.  This may be called by several threads at once. */
+void LocalStore::removeGarbage(GCState & state, const Path & path, uint64_t narSize)
+{
     Path realPath = realStoreDir + "/" + baseNameOf(path);
 
     struct stat st;
@@ -541,7 +571,7 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 
     printInfo(format("deleting '%1%'") % path);
 
-    state.results.paths.insert(path);
+    unsigned long long bytesFreed = 0, bytesInvalidated = 0;
 
     /* If the path is not a regular file or symlink, move it to the
        trash directory.  The move is to ensure that later (when we're
@@ -555,23 +585,202 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         try {
             if (chmod(realPath.c_str(), st.st_mode | S_IWUSR) == -1)
                 throw SysError(format("making '%1%' writable") % realPath);
-            Path tmp = trashDir + "/" + baseNameOf(path);
+            Path tmp = state.trashDir + "/" + baseNameOf(path);
             if (rename(realPath.c_str(), tmp.c_str()))
                 throw SysError(format("unable to rename '%1%' to '%2%'") % realPath % tmp);
-            state.bytesInvalidated += size;
+            bytesInvalidated = narSize;
         } catch (SysError & e) {
             if (e.errNo == ENOSPC) {
                 printInfo(format("note: can't create move '%1%': %2%") % realPath % e.msg());
-                deleteGarbage(state, realPath);
+                deletePath(realPath, bytesFreed);
             }
         }
     } else
-        deleteGarbage(state, realPath);
+        deletePath(realPath, bytesFreed);
 
-    if (state.results.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
-        printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
-        throw GCLimitReached();
+    std::lock_guard<std::mutex> lock(state.lock);
+    state.results.paths.insert(path);
+    state.results.bytesFreed += bytesFreed;
+    state.bytesInvalidated += bytesInvalidated;
+}
+
+
+typedef std::vector<std::pair<uint64_t, uint64_t>> KeepEdges;
+
+
+/* Mark the paths reachable from ‘todo’ that aren't marked yet.
+   ‘keepEdges’ must be sorted. */
+static void markLive(const RefGraph & graph, const KeepEdges & keepEdges,
+    std::vector<bool> & marked, std::vector<RefGraph::Id> todo)
+{
+    auto maxId = graph.maxId();
+    if (marked.size() < maxId) marked.resize(maxId);
+
+    auto mark = [&](uint64_t id) {
+        if (id < maxId && graph.isValid(id) && !marked[id]) todo.push_back(id);
+    };
+
+    while (!todo.empty()) {
+        auto id = todo.back();
+        todo.pop_back();
+        if (marked[id]) continue;
+        marked[id] = true;
+        graph.forEachEdge(id, false, mark);
+        for (auto i = std::lower_bound(keepEdges.begin(), keepEdges.end(), std::make_pair((uint64_t) id, (uint64_t) 0));
+             i != keepEdges.end() && i->first == id; ++i)
+            mark(i->second);
+    }
+}
+
+
+/* Return the valid paths that aren't marked in the order in which
+   they can be invalidated, i.e. referrers first.  All referrers of an
+   unmarked path are unmarked.  Paths without referrers come in random
+   order to make the collector less biased towards deleting paths that
+   come alphabetically first (e.g. /nix/store/000...).  This matters
+   when using --max-freed etc. */
+static std::vector<RefGraph::Id> sweepOrder(const RefGraph & graph, const std::vector<bool> & marked)
+{
+    typedef RefGraph::Id Id;
+
+    auto maxId = graph.maxId();
+
+    std::vector<uint32_t> nrReferrers(maxId);
+    std::vector<Id> order;
+
+    for (Id id = 0; id < maxId; ++id) {
+        if (!graph.isValid(id) || marked[id]) continue;
+        graph.forEachEdge(id, true, [&](Id id2) { if (id2 != id) nrReferrers[id]++; });
+        if (!nrReferrers[id]) order.push_back(id);
+    }
+
+    std::mt19937 gen(1);
+    std::shuffle(order.begin(), order.end(), gen);
+
+    for (size_t n = 0; n < order.size(); ++n) {
+        auto id = order[n];
+        graph.forEachEdge(id, false, [&](Id id2) {
+            if (id2 != id && !marked[id2] && !--nrReferrers[id2])
+                order.push_back(id2);
+        });
+    }
+
+    return order;
+}
+
+
+/* Invalidate a batch of dead paths and delete them from disk on
+   ‘pool’. */
+void LocalStore::deleteBatch(GCState & state, ThreadPool & pool,
+    const Paths & paths, const std::vector<uint64_t> & sizes)
+{
+    if (paths.empty()) return;
+    invalidatePaths(paths);
+    auto size = sizes.begin();
+    for (auto & path : paths)
+        pool.enqueue(std::bind(&LocalStore::removeGarbage, this, std::ref(state), path, *size++));
+}
+
+
+/* Determine the live paths by marking everything reachable from the
+   roots in the reference graph, and delete all other valid paths.
+   Unlike canReachRoot(), this needs no database queries per path. */
+void LocalStore::markAndSweep(GCState & state, RefGraph & graph)
+{
+    typedef RefGraph::Id Id;
+
+    auto keepEdges = queryKeepEdges(state.gcKeepOutputs, state.gcKeepDerivations);
+    std::sort(keepEdges.begin(), keepEdges.end());
+
+    uint64_t nextId = graph.maxId();
+
+    std::vector<Id> roots;
+    for (auto & root : state.roots)
+        if (auto id = graph.lookup(root)) roots.push_back(*id);
+
+    std::vector<bool> marked;
+    markLive(graph, keepEdges, marked, roots);
+
+    checkInterrupt();
+
+    auto maxId = graph.maxId();
+
+    if (state.options.action == GCOptions::gcReturnLive) {
+        for (Id id = 0; id < maxId; ++id)
+            if (marked[id]) state.alive.insert(graph.path(id));
+        return;
+    }
+
+    if (state.options.action == GCOptions::gcReturnDead) {
+        for (Id id = 0; id < maxId; ++id)
+            if (graph.isValid(id) && !marked[id]) state.dead.insert(graph.path(id));
+        return;
+    }
+
+    auto sizes = queryNarSizes();
+
+    /* Paths registered since the graph was loaded (e.g. by a process
+       that already had a temporary root) are live, and so is
+       everything they refer to.  Mark them before invalidating each
+       batch, as the incremental collector does, and skip the
+       candidates that have become live; since everything they refer
+       to is marked as well, the remaining order stays valid. */
+    auto markNewPaths = [&]() {
+        std::vector<Id> todo;
+        for (auto id : loadNewPaths(graph, nextId))
+            todo.push_back(id);
+        if (todo.empty()) return;
+        auto newEdges = queryKeepEdges(state.gcKeepOutputs, state.gcKeepDerivations, nextId);
+        if (!newEdges.empty()) {
+            std::sort(newEdges.begin(), newEdges.end());
+            auto middle = keepEdges.insert(keepEdges.end(), newEdges.begin(), newEdges.end());
+            std::inplace_merge(keepEdges.begin(), middle, keepEdges.end());
+        }
+        nextId = std::max(nextId, (uint64_t) graph.maxId());
+        markLive(graph, keepEdges, marked, todo);
+    };
+
+    /* Let the tests change the store while we're sweeping. */
+    static auto sweepHook = getEnv("_NIX_TEST_GC_SWEEP_HOOK", "");
+    if (!sweepHook.empty()) runProgram(sweepHook);
+
+    /* Invalidate the dead paths in batches, and delete them from
+       disk in parallel with invalidating the next batch. */
+    ThreadPool pool;
+    std::vector<Id> batch;
+
+    auto flushBatch = [&]() {
+        markNewPaths();
+        Paths paths;
+        std::vector<uint64_t> pathSizes;
+        for (auto id : batch) {
+            if (marked[id]) continue;
+            paths.push_back(graph.path(id));
+            pathSizes.push_back(id < sizes.size() ? sizes[id] : 0);
+        }
+        deleteBatch(state, pool, paths, pathSizes);
+        batch.clear();
+    };
+
+    uint64_t bytesScheduled = state.results.bytesFreed + state.bytesInvalidated;
+
+    for (auto id : sweepOrder(graph, marked)) {
+        checkInterrupt();
+
+        if (bytesScheduled > state.options.maxFreed) {
+            printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
+            break;
+        }
+
+        bytesScheduled += id < sizes.size() ? sizes[id] : 0;
+        batch.push_back(id);
+
+        if (batch.size() >= gcBatchSize) flushBatch();
     }
+
+    flushBatch();
+
+    pool.process();
 }
 
 
@@ -631,7 +840,7 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
     checkInterrupt();
 
     auto realPath = realStoreDir + "/" + baseNameOf(path);
-    if (realPath == linksDir || realPath == trashDir) return;
+    if (realPath == linksDir || realPath == trashDir || realPath == incrementalTrashDir) return;
 
     //Activity act(*logger, lvlDebug, format("considering whether to delete '%1%'") % path);
 
@@ -718,6 +927,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     GCState state(results);
     state.options = options;
+    state.trashDir = trashDir;
     state.gcKeepOutputs = settings.gcKeepOutputs;
     state.gcKeepDerivations = settings.gcKeepDerivations;
 
@@ -796,6 +1006,12 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
         try {
 
+            /* Load the reference graph of the valid paths.  Paths
+               that become valid after this point are not deleted:
+               tryToDelete() below checks them individually, and
+               markAndSweep() marks them as live. */
+            auto graph = loadRefGraph();
+
             AutoCloseDir dir(opendir(realStoreDir.c_str()));
             if (!dir) throw SysError(format("opening directory '%1%'") % realStoreDir);
 
@@ -805,32 +1021,20 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                paths, since unreachable paths could become reachable
                again.  We don't use readDirectory() here so that GCing
                can start faster. */
-            Paths entries;
             struct dirent * dirent;
             while (errno = 0, dirent = readdir(dir.get())) {
                 checkInterrupt();
                 string name = dirent->d_name;
                 if (name == "." || name == "..") continue;
                 Path path = storeDir + "/" + name;
-                if (isStorePath(path) && isValidPath(path))
-                    entries.push_back(path);
-                else
+                if (!graph->lookup(path))
                     tryToDelete(state, path);
             }
 
             dir.reset();
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
-            vector<Path> entries_(entries.begin(), entries.end());
-            std::mt19937 gen(1);
-            std::shuffle(entries_.begin(), entries_.end(), gen);
-
-            for (auto & i : entries_)
-                tryToDelete(state, i);
+            /* Now delete the unreachable valid paths. */
+            markAndSweep(state, *graph);
 
         } catch (GCLimitReached & e) {
         }
@@ -865,20 +1069,27 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 }
 
 
-void LocalStore::autoGC(bool sync)
+uint64_t LocalStore::getAvailableSpace()
 {
     static auto fakeFreeSpaceFile = getEnv("_NIX_TEST_FREE_SPACE_FILE", "");
 
-    auto getAvail = [this]() -> uint64_t {
-        if (!fakeFreeSpaceFile.empty())
-            return std::stoll(readFile(fakeFreeSpaceFile));
+    if (!fakeFreeSpaceFile.empty())
+        return std::stoll(readFile(fakeFreeSpaceFile));
 
-        struct statvfs st;
-        if (statvfs(realStoreDir.c_str(), &st))
-            throw SysError("getting filesystem info about '%s'", realStoreDir);
+    struct statvfs st;
+    if (statvfs(realStoreDir.c_str(), &st))
+        throw SysError("getting filesystem info about '%s'", realStoreDir);
+
+    return (uint64_t) st.f_bavail * st.f_bsize;
+}
 
-        return (uint64_t) st.f_bavail * st.f_bsize;
-    };
+
+void LocalStore::autoGC(bool sync)
+{
+    /* nix-daemon takes care of this. */
+    if (settings.gcIncremental) return;
+
+    auto getAvail = [this]() { return getAvailableSpace(); };
 
     std::shared_future<void> future;
 
@@ -946,4 +1157,303 @@ void LocalStore::autoGC(bool sync)
 }
 
 
+struct LocalStore::GCProgress
+{
+    std::string phase = "idle";
+    uint64_t available = 0;
+    uint64_t cycles = 0;
+    uint64_t pathsDeleted = 0;
+    uint64_t bytesFreed = 0;
+    uint64_t candidates = 0;
+    uint64_t lastPause = 0;
+    uint64_t fullCollections = 0;
+    std::string lastError;
+    uint64_t lastErrorTime = 0;
+};
+
+
+/* Write the progress of the incremental garbage collector to
+   ‘gc-status.json’ in the state directory. */
+void LocalStore::writeGCProgress(const GCProgress & progress)
+{
+    std::ostringstream str;
+    {
+        JSONObject obj(str);
+        obj.attr("phase", progress.phase);
+        obj.attr("available", progress.available);
+        obj.attr("minFree", settings.minFree.get());
+        obj.attr("maxFree", settings.maxFree.get());
+        obj.attr("cycles", progress.cycles);
+        obj.attr("pathsDeleted", progress.pathsDeleted);
+        obj.attr("bytesFreed", progress.bytesFreed);
+        obj.attr("candidates", progress.candidates);
+        obj.attr("lastPause", progress.lastPause);
+        obj.attr("fullCollections", progress.fullCollections);
+        if (progress.lastErrorTime) {
+            obj.attr("lastError", progress.lastError);
+            obj.attr("lastErrorTime", progress.lastErrorTime);
+        }
+        obj.attr("time", (uint64_t) time(0));
+    }
+    str << "\n";
+
+    Path statusFile = stateDir + "/gc-status.json";
+    Path tmp = statusFile + ".tmp";
+    writeFile(tmp, str.str());
+    if (rename(tmp.c_str(), statusFile.c_str()))
+        throw SysError("renaming '%s' to '%s'", tmp, statusFile);
+}
+
+
+void LocalStore::runIncrementalGC()
+{
+    printInfo("starting incremental garbage collector");
+
+    GCProgress progress;
+    unsigned int failures = 0;
+
+    auto recordError = [&](const std::exception & e) {
+        progress.phase = "error";
+        progress.lastError = e.what();
+        progress.lastErrorTime = time(0);
+        try {
+            writeGCProgress(progress);
+        } catch (...) {
+            ignoreException();
+        }
+    };
+
+    while (true) {
+        checkInterrupt();
+
+        try {
+            progress.phase = "idle";
+            progress.candidates = 0;
+            progress.available = getAvailableSpace();
+            writeGCProgress(progress);
+
+            /* Start a new cycle right away if the previous one freed
+               something but not enough. */
+            if (progress.available < settings.minFree && progress.available < settings.maxFree) {
+                progress.cycles++;
+                auto nrDeleted = collectGarbageIncremental(progress);
+                failures = 0;
+                if (nrDeleted) continue;
+            }
+        } catch (Interrupted &) {
+            throw;
+        } catch (std::exception & e) {
+            /* Errors such as a busy database or a full disk may go
+               away, and auto-GC is disabled while we're responsible
+               for collecting garbage, so try again later. */
+            printError("incremental garbage collection failed: %s", e.what());
+            recordError(e);
+            failures++;
+        }
+
+        /* Don't let the disk fill up if incremental collection keeps
+           failing; a normal collection may still work. */
+        if (failures >= gcMaxFailedCycles) {
+            failures = 0;
+            printError("falling back to a normal garbage collection after %d failed incremental ones",
+                gcMaxFailedCycles);
+            try {
+                progress.phase = "collecting";
+                progress.fullCollections++;
+                writeGCProgress(progress);
+                auto available = getAvailableSpace();
+                if (available < settings.maxFree) {
+                    GCOptions options;
+                    options.maxFreed = settings.maxFree - available;
+                    GCResults results;
+                    collectGarbage(options, results);
+                    progress.pathsDeleted += results.paths.size();
+                    progress.bytesFreed += results.bytesFreed;
+                }
+            } catch (Interrupted &) {
+                throw;
+            } catch (std::exception & e) {
+                printError("garbage collection failed: %s", e.what());
+                recordError(e);
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::seconds(settings.minFreeCheckInterval));
+    }
+}
+
+
+size_t LocalStore::collectGarbageIncremental(GCProgress & progress)
+{
+    typedef RefGraph::Id Id;
+
+    printInfo("running incremental GC to free %d bytes", settings.maxFree - progress.available);
+
+    progress.phase = "marking";
+    writeGCProgress(progress);
+
+    bool keepOutputs = settings.gcKeepOutputs;
+    bool keepDerivations = settings.gcKeepDerivations;
+
+    /* Mark the live paths without holding the GC lock, which would
+       block every process that wants to add a temporary root.  This
+       is safe because paths only become live by becoming reachable
+       from a new root, a new temporary root or a newly registered
+       path.  These are all marked before each batch below, while
+       holding the GC lock. */
+    auto graph = loadRefGraph();
+    uint64_t nextId = graph->maxId();
+
+    auto keepEdges = queryKeepEdges(keepOutputs, keepDerivations);
+    std::sort(keepEdges.begin(), keepEdges.end());
+
+    std::vector<bool> marked;
+
+    {
+        Roots roots;
+        findRootsNoTemp(roots, true);
+        FDs fds;
+        findTempRoots(fds, roots, true);
+        std::vector<Id> todo;
+        for (auto & root : roots)
+            if (auto id = graph->lookup(root.first)) todo.push_back(*id);
+        markLive(*graph, keepEdges, marked, todo);
+    }
+
+    auto candidates = sweepOrder(*graph, marked);
+    auto sizes = queryNarSizes();
+
+    printInfo("incremental GC found %d dead paths", candidates.size());
+
+    progress.phase = "deleting";
+
+    /* Let the tests change the store while a cycle is running. */
+    static auto sweepHook = getEnv("_NIX_TEST_GC_SWEEP_HOOK", "");
+    if (!sweepHook.empty()) runProgram(sweepHook);
+
+    size_t pos = 0, nrDeleted = 0;
+    bool warned = false;
+
+    while (pos < candidates.size()) {
+        checkInterrupt();
+
+        progress.available = getAvailableSpace();
+        progress.candidates = candidates.size() - pos;
+        writeGCProgress(progress);
+
+        if (progress.available >= settings.maxFree) break;
+
+        auto batchStart = std::chrono::steady_clock::now();
+
+        GCResults results;
+        GCState state(results);
+        state.options.maxFreed = std::numeric_limits<uint64_t>::max();
+        state.trashDir = incrementalTrashDir;
+        state.shouldDelete = true;
+        createDirs(incrementalTrashDir);
+
+        uint64_t bytes = 0;
+        std::chrono::milliseconds pause;
+
+        {
+            AutoCloseFD fdGCLock = openGCLock(ltWrite);
+
+            /* Only count the time we hold the lock, not the time we
+               waited for it. */
+            auto lockStart = std::chrono::steady_clock::now();
+            auto deadline = lockStart + std::chrono::milliseconds(settings.gcMaxPause);
+
+            /* After this point no new roots or temporary roots can
+               appear until we release the locks. */
+            Roots roots;
+            findRootsNoTemp(roots, true);
+            FDs fds;
+            findTempRoots(fds, roots, true);
+
+            std::vector<Id> todo;
+            for (auto id : loadNewPaths(*graph, nextId))
+                todo.push_back(id);
+
+            auto newEdges = queryKeepEdges(keepOutputs, keepDerivations, nextId);
+            if (!newEdges.empty()) {
+                std::sort(newEdges.begin(), newEdges.end());
+                auto middle = keepEdges.insert(keepEdges.end(), newEdges.begin(), newEdges.end());
+                std::inplace_merge(keepEdges.begin(), middle, keepEdges.end());
+            }
+
+            nextId = std::max(nextId, (uint64_t) graph->maxId());
+
+            for (auto & root : roots)
+                if (auto id = graph->lookup(root.first)) todo.push_back(*id);
+
+            markLive(*graph, keepEdges, marked, todo);
+
+            /* If finding the roots alone takes longer than we may hold
+               the lock, every batch overruns. Still delete one chunk
+               per batch, so that we keep making progress. */
+            auto scanTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - lockStart);
+            if (scanTime >= std::chrono::milliseconds(settings.gcMaxPause) && !warned) {
+                printError("warning: finding the garbage collector roots took %d ms, which exceeds 'gc-max-pause' (%d ms)",
+                    scanTime.count(), settings.gcMaxPause);
+                warned = true;
+            }
+
+            /* Delete candidates that are still dead, in chunks, until
+               we've held the lock for long enough. Marked paths are
+               skipped; since everything they refer to is marked as
+               well, the remaining order stays valid. */
+            ThreadPool pool;
+
+            do {
+                Paths batch;
+                std::vector<uint64_t> batchSizes;
+
+                for (; pos < candidates.size() && batch.size() < 100; ++pos) {
+                    auto id = candidates[pos];
+                    if (marked[id] || !graph->isValid(id)) continue;
+                    auto path = graph->path(id);
+                    /* Skip paths that were deleted and registered again. */
+                    if (graph->lookup(path) != id) continue;
+                    auto size = id < sizes.size() ? sizes[id] : 0;
+                    batch.push_back(path);
+                    batchSizes.push_back(size);
+                    bytes += size;
+                }
+
+                deleteBatch(state, pool, batch, batchSizes);
+                pool.process();
+            } while (pos < candidates.size() && std::chrono::steady_clock::now() < deadline);
+
+            pause = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - lockStart);
+        }
+
+        /* Delete the moved paths now that other processes can proceed. */
+        unsigned long long bytesFreed;
+        deletePath(incrementalTrashDir, bytesFreed);
+
+        nrDeleted += results.paths.size();
+        progress.pathsDeleted += results.paths.size();
+        progress.bytesFreed += results.bytesFreed + bytesFreed;
+        progress.lastPause = pause.count();
+
+        debug("incremental GC deleted %d paths while holding the GC lock for %d ms",
+            results.paths.size(), pause.count());
+
+        /* Wait before the next batch to let other processes take the
+           GC lock, and to stay within gc-max-rate. */
+        auto wait = std::chrono::milliseconds(10);
+        if (settings.gcMaxRate)
+            wait = std::max(wait, std::chrono::milliseconds(bytes * 1000 / settings.gcMaxRate)
+                - std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - batchStart));
+        std::this_thread::sleep_for(wait);
+    }
+
+    printInfo("incremental GC deleted %d paths", nrDeleted);
+
+    return nrDeleted;
+}
+
+
 }
@@ -133,6 +133,9 @@ public:
     Setting<bool> useSQLiteWAL{this, true, "use-sqlite-wal",
         "Whether SQLite should use WAL mode."};
 
+    Setting<bool> inMemoryRefGraph{this, false, "in-memory-ref-graph",
+        "Whether to keep a copy of the reference graph of the Nix store in memory."};
+
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
         "Whether to call sync() before registering a path as valid."};
 
@@ -348,6 +351,15 @@ public:
     Setting<uint64_t> minFreeCheckInterval{this, 5, "min-free-check-interval",
         "Number of seconds between checking free disk space."};
 
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        "Whether nix-daemon should keep free disk space between min-free and max-free by deleting garbage in the background in small batches."};
+
+    Setting<uint64_t> gcMaxPause{this, 100, "gc-max-pause",
+        "Number of milliseconds for which the incremental garbage collector may hold the GC lock at a time."};
+
+    Setting<uint64_t> gcMaxRate{this, 0, "gc-max-rate",
+        "Maximum number of bytes per second that the incremental garbage collector deletes (0 means no limit)."};
+
     Setting<Paths> pluginFiles{this, {}, "plugin-files",
         "Plugins to dynamically load at nix initialization time."};
 };
@@ -5,6 +5,8 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "nar-info.hh"
+#include "finally.hh"
+#include "ref-graph.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -51,6 +53,7 @@ LocalStore::LocalStore(const Params & params)
     , reservedPath(dbDir + "/reserved")
     , schemaPath(dbDir + "/schema")
     , trashDir(realStoreDir + "/trash")
+    , incrementalTrashDir(realStoreDir + "/trash-incremental")
     , tempRootsDir(stateDir + "/temproots")
     , fnTempRoots(fmt("%s/%d", tempRootsDir, getpid()))
 {
@@ -212,32 +215,38 @@ LocalStore::LocalStore(const Params & params)
 
     else openDB(*state, false);
 
+    /* The memo of hashDerivationModulo() is a cache, so it doesn't
+       need a schema upgrade that older versions of Nix would refuse
+       to open. */
+    state->db.exec("create table if not exists DerivationHashes (drv integer primary key not null, hash text not null, foreign key (drv) references ValidPaths(id) on delete cascade)");
+
     /* Prepare SQL statements. */
+    prepareQueries(*state);
     state->stmtRegisterValidPath.create(state->db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
     state->stmtUpdatePathInfo.create(state->db,
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
     state->stmtAddReference.create(state->db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
-    state->stmtQueryPathInfo.create(state->db,
-        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
-    state->stmtQueryReferences.create(state->db,
-        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
-    state->stmtQueryReferrers.create(state->db,
-        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
     state->stmtInvalidatePath.create(state->db,
         "delete from ValidPaths where path = ?;");
     state->stmtAddDerivationOutput.create(state->db,
         "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
-    state->stmtQueryValidDerivers.create(state->db,
-        "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
-    state->stmtQueryDerivationOutputs.create(state->db,
-        "select id, path from DerivationOutputs where drv = ?;");
-    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
-    // ensure efficient lookup.
-    state->stmtQueryPathFromHashPart.create(state->db,
-        "select path from ValidPaths where path >= ? limit 1;");
-    state->stmtQueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmtRegisterDerivationHash.create(state->db,
+        "insert or replace into DerivationHashes (drv, hash) select id, ? from ValidPaths where path = ?;");
+
+    if (settings.useSQLiteWAL && maxReadConnections > 0)
+        readConnections = std::make_unique<Pool<ReadConnection>>(
+            maxReadConnections,
+            [this]() { return openReadConnection(); },
+            [](const ref<ReadConnection> & r) {
+                if (r->pid == getpid()) return true;
+                /* Don't close the connections of our parent after a
+                   fork(), since closing a connection may e.g.
+                   checkpoint the WAL. Just leak them. */
+                new ref<ReadConnection>(r);
+                return false;
+            });
 }
 
 
@@ -354,6 +363,325 @@ void LocalStore::openDB(State & state, bool create)
 }
 
 
+/* The number of paths looked up by one execution of a batched query.
+   This must not exceed SQLite's limit on the number of parameters of
+   a statement (999 by default). */
+static const size_t queryBatchSize = 500;
+
+
+void LocalStore::prepareQueries(DBConnection & conn)
+{
+    conn.stmtDataVersion.create(conn.db, "pragma data_version;");
+    conn.stmtQueryPathInfo.create(conn.db,
+        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+    conn.stmtQueryReferences.create(conn.db,
+        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+    conn.stmtQueryReferrers.create(conn.db,
+        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+    conn.stmtQueryValidDerivers.create(conn.db,
+        "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
+    conn.stmtQueryDerivationOutputs.create(conn.db,
+        "select id, path from DerivationOutputs where drv = ?;");
+    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
+    // ensure efficient lookup.
+    conn.stmtQueryPathFromHashPart.create(conn.db,
+        "select path from ValidPaths where path >= ? limit 1;");
+    conn.stmtQueryValidPaths.create(conn.db, "select path from ValidPaths");
+    conn.stmtQueryDerivationHash.create(conn.db,
+        "select hash from DerivationHashes where drv = (select id from ValidPaths where path = ?);");
+
+    string params;
+    for (size_t n = 0; n < queryBatchSize; ++n)
+        params += n ? ", ?" : "?";
+    conn.stmtQueryValidPathsBatch.create(conn.db,
+        "select path from ValidPaths where path in (" + params + ");");
+    conn.stmtQueryPathInfoBatch.create(conn.db,
+        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca, path from ValidPaths where path in (" + params + ");");
+    conn.stmtQueryReferencesBatch.create(conn.db,
+        "select referrer, path from Refs join ValidPaths on reference = id where referrer in (select id from ValidPaths where path in (" + params + "));");
+}
+
+
+/* Split ‘paths’ into batches for the batched queries. */
+static std::vector<Paths> makeBatches(const PathSet & paths)
+{
+    std::vector<Paths> batches;
+    for (auto & path : paths) {
+        if (batches.empty() || batches.back().size() == queryBatchSize)
+            batches.emplace_back();
+        batches.back().push_back(path);
+    }
+    return batches;
+}
+
+
+/* Bind a batch of paths to the parameters of a batched query, padding
+   it with NULLs, which don't match anything. */
+static void bindBatch(SQLiteStmt::Use & use, const Paths & batch)
+{
+    for (auto & path : batch) use(path);
+    for (size_t n = batch.size(); n < queryBatchSize; ++n) use.bind();
+}
+
+
+ref<LocalStore::ReadConnection> LocalStore::openReadConnection()
+{
+    auto conn = make_ref<ReadConnection>();
+
+    /* The connection is opened read-write because readers in WAL mode
+       need write access to the shared-memory index, but it refuses
+       to modify the database. */
+    string dbPath = dbDir + "/db.sqlite";
+    if (sqlite3_open_v2(dbPath.c_str(), &conn->db.db, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+        throw Error(format("cannot open Nix database '%1%'") % dbPath);
+
+    if (sqlite3_busy_timeout(conn->db, 60 * 60 * 1000) != SQLITE_OK)
+        throwSQLiteError(conn->db, "setting timeout");
+
+    conn->db.exec("pragma query_only = 1");
+
+    prepareQueries(*conn);
+
+    return conn;
+}
+
+
+thread_local std::pair<LocalStore *, LocalStore::State *> LocalStore::writeTxn;
+
+
+template<typename T>
+T LocalStore::withReadConnection(std::function<T(DBConnection & conn)> fun)
+{
+    /* Don't retry here; the caller of the write transaction does. */
+    if (auto state = writeTxnState())
+        return fun(*state);
+
+    return retrySQLite<T>([&]() {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return fun(*conn);
+        }
+        auto state(_state.lock());
+        return fun(*state);
+    });
+}
+
+
+std::unique_ptr<RefGraph> LocalStore::loadRefGraph()
+{
+    debug("loading the reference graph");
+
+    return withReadConnection<std::unique_ptr<RefGraph>>([&](DBConnection & conn) {
+        auto graph = std::make_unique<RefGraph>(storeDir);
+
+        /* Read both tables from the same snapshot. */
+        SQLiteTxn txn(conn.db);
+
+        SQLiteStmt stmtPaths, stmtRefs;
+        stmtPaths.create(conn.db, "select id, path from ValidPaths order by id;");
+        stmtRefs.create(conn.db, "select referrer, reference from Refs;");
+
+        {
+            auto use(stmtPaths.use());
+            while (use.next())
+                graph->loadPath(use.getInt(0), use.getStr(1));
+        }
+
+        {
+            auto use(stmtRefs.use());
+            while (use.next())
+                graph->loadRef(use.getInt(0), use.getInt(1));
+        }
+
+        graph->finishLoading();
+
+        return graph;
+    });
+}
+
+
+std::vector<std::pair<uint64_t, uint64_t>> LocalStore::queryKeepEdges(
+    bool keepOutputs, bool keepDerivations, uint64_t minId)
+{
+    typedef std::vector<std::pair<uint64_t, uint64_t>> Edges;
+
+    return withReadConnection<Edges>([&](DBConnection & conn) {
+        Edges edges;
+
+        /* A derivation is kept if any of its outputs are, provided
+           that the output's deriver is that derivation. */
+        if (keepDerivations) {
+            SQLiteStmt stmt;
+            stmt.create(conn.db,
+                "select v.id, d.drv from DerivationOutputs d "
+                "join ValidPaths v on v.path = d.path "
+                "join ValidPaths v2 on v2.id = d.drv and v2.path = v.deriver "
+                "where v.id >= ?;");
+            auto use(stmt.use()((int64_t) minId));
+            while (use.next())
+                edges.emplace_back(use.getInt(0), use.getInt(1));
+        }
+
+        /* The valid outputs of a derivation are kept if it is. */
+        if (keepOutputs) {
+            SQLiteStmt stmt;
+            stmt.create(conn.db,
+                "select d.drv, v.id from DerivationOutputs d "
+                "join ValidPaths v on v.path = d.path "
+                "where d.drv >= ?;");
+            auto use(stmt.use()((int64_t) minId));
+            while (use.next())
+                edges.emplace_back(use.getInt(0), use.getInt(1));
+        }
+
+        return edges;
+    });
+}
+
+
+static std::vector<uint64_t> addNewPaths(SQLite & db, RefGraph & graph, uint64_t minId)
+{
+    std::vector<uint64_t> ids;
+
+    SQLiteStmt stmtPaths, stmtRefs;
+    stmtPaths.create(db, "select id, path from ValidPaths where id >= ? order by id;");
+    stmtRefs.create(db, "select referrer, reference from Refs where referrer >= ?;");
+
+    {
+        auto use(stmtPaths.use()((int64_t) minId));
+        while (use.next()) {
+            ids.push_back(use.getInt(0));
+            graph.addPath(ids.back(), use.getStr(1), {});
+        }
+    }
+
+    {
+        auto use(stmtRefs.use()((int64_t) minId));
+        while (use.next())
+            graph.addRef(use.getInt(0), use.getInt(1));
+    }
+
+    return ids;
+}
+
+
+std::vector<uint64_t> LocalStore::loadNewPaths(RefGraph & graph, uint64_t minId)
+{
+    return withReadConnection<std::vector<uint64_t>>([&](DBConnection & conn) {
+        SQLiteTxn txn(conn.db);
+        return addNewPaths(conn.db, graph, minId);
+    });
+}
+
+
+bool LocalStore::refreshRefGraph(DBConnection & conn, RefGraph & graph)
+{
+    SQLiteTxn txn(conn.db);
+
+    addNewPaths(conn.db, graph, graph.maxId());
+
+    /* Ids are assigned in commit order, so if the number of paths
+       still matches, nothing has been invalidated. */
+    SQLiteStmt stmt;
+    stmt.create(conn.db, "select count(*) from ValidPaths;");
+    auto use(stmt.use());
+    if (!use.next()) throw Error("cannot count the valid paths");
+    return (uint64_t) use.getInt(0) == graph.nrValid();
+}
+
+
+std::vector<uint64_t> LocalStore::queryNarSizes()
+{
+    return withReadConnection<std::vector<uint64_t>>([&](DBConnection & conn) {
+        std::vector<uint64_t> sizes;
+        SQLiteStmt stmt;
+        stmt.create(conn.db, "select id, narSize from ValidPaths where narSize is not null;");
+        auto use(stmt.use());
+        while (use.next()) {
+            auto id = use.getInt(0);
+            if (id < 0) continue;
+            if ((uint64_t) id >= sizes.size()) sizes.resize(id + 1);
+            sizes[id] = use.getInt(1);
+        }
+        return sizes;
+    });
+}
+
+
+bool LocalStore::withRefGraph(std::function<void(RefGraph & graph)> fun)
+{
+    if (!settings.inMemoryRefGraph || writeTxnState()) return false;
+
+    while (true) {
+        uint64_t generation;
+        std::optional<uint64_t> upToDate;
+
+        std::unique_ptr<RefGraph> graph;
+        try {
+            /* ‘pragma data_version’ only says whether the database
+               has changed since it was last queried on the same
+               connection, so every connection remembers when it last
+               brought the graph up to date. If the database has
+               changed since then, it has most likely only gained new
+               paths, which we can add to the graph. Only reload it
+               if paths have been invalidated. */
+            upToDate = withReadConnection<std::optional<uint64_t>>([&](DBConnection & conn) -> std::optional<uint64_t> {
+                int64_t dataVersion;
+                {
+                    auto use(conn.stmtDataVersion.use());
+                    if (!use.next()) throw Error("cannot query the database version");
+                    dataVersion = use.getInt(0);
+                }
+                auto refGraph(_refGraph.lock());
+                generation = refGraph->generation;
+                auto & graph(refGraph->graph);
+                if (refGraph->failed || !graph
+                    || graph->overlaySize() > std::max((size_t) 65536, graph->size() / 4))
+                    return {};
+                std::pair<uint64_t, int64_t> version{refGraph->loads, dataVersion};
+                if (conn.refGraphVersion != version) {
+                    if (!refreshRefGraph(conn, *graph)) return {};
+                    conn.refGraphVersion = version;
+                }
+                return refGraph->loads;
+            });
+
+            if (upToDate) {
+                auto refGraph(_refGraph.lock());
+                if (!refGraph->graph || refGraph->loads != *upToDate) continue;
+                fun(*refGraph->graph);
+                return true;
+            }
+
+            if (_refGraph.lock()->failed) return false;
+
+            graph = loadRefGraph();
+        } catch (Error & e) {
+            printError("warning: not using the in-memory reference graph: %s", e.what());
+            _refGraph.lock()->failed = true;
+            return false;
+        }
+
+        auto refGraph(_refGraph.lock());
+        /* Discard the graph if this process changed the database while
+           we were loading it. */
+        if (refGraph->generation != generation) continue;
+        refGraph->graph = std::move(graph);
+        refGraph->loads++;
+        fun(*refGraph->graph);
+        return true;
+    }
+}
+
+
+void LocalStore::updateRefGraph(std::function<void(RefGraph & graph)> fun)
+{
+    auto refGraph(_refGraph.lock());
+    refGraph->generation++;
+    if (refGraph->graph) fun(*refGraph->graph);
+}
+
+
 /* To improve purity, users may want to make the Nix store a read-only
    bind mount.  So make the Nix store writable for this process. */
 void LocalStore::makeStoreWritable()
@@ -628,6 +956,36 @@ uint64_t LocalStore::addValidPath(State & state,
 }
 
 
+/* Fill in ‘info’ from the current row of a query whose first columns
+   are those of stmtQueryPathInfo. */
+static void readPathInfo(SQLiteStmt & stmt, SQLiteStmt::Use & use, ValidPathInfo & info)
+{
+    info.id = use.getInt(0);
+
+    try {
+        info.narHash = Hash(use.getStr(1));
+    } catch (BadHash & e) {
+        throw Error("in valid-path entry for '%s': %s", info.path, e.what());
+    }
+
+    info.registrationTime = use.getInt(2);
+
+    auto s = (const char *) sqlite3_column_text(stmt, 3);
+    if (s) info.deriver = s;
+
+    /* Note that narSize = NULL yields 0. */
+    info.narSize = use.getInt(4);
+
+    info.ultimate = use.getInt(5) == 1;
+
+    s = (const char *) sqlite3_column_text(stmt, 6);
+    if (s) info.sigs = tokenizeString<StringSet>(s, " ");
+
+    s = (const char *) sqlite3_column_text(stmt, 7);
+    if (s) info.ca = s;
+}
+
+
 void LocalStore::queryPathInfoUncached(const Path & path,
     Callback<std::shared_ptr<ValidPathInfo>> callback)
 {
@@ -637,49 +995,95 @@ void LocalStore::queryPathInfoUncached(const Path & path,
 
         assertStorePath(path);
 
-        callback(retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
-            auto state(_state.lock());
-
+        callback(withReadConnection<std::shared_ptr<ValidPathInfo>>([&](DBConnection & conn) {
             /* Get the path info. */
-            auto useQueryPathInfo(state->stmtQueryPathInfo.use()(path));
+            auto useQueryPathInfo(conn.stmtQueryPathInfo.use()(path));
 
             if (!useQueryPathInfo.next())
                 return std::shared_ptr<ValidPathInfo>();
 
-            info->id = useQueryPathInfo.getInt(0);
+            readPathInfo(conn.stmtQueryPathInfo, useQueryPathInfo, *info);
 
-            try {
-                info->narHash = Hash(useQueryPathInfo.getStr(1));
-            } catch (BadHash & e) {
-                throw Error("in valid-path entry for '%s': %s", path, e.what());
-            }
+            /* Get the references. */
+            auto useQueryReferences(conn.stmtQueryReferences.use()(info->id));
+
+            while (useQueryReferences.next())
+                info->references.insert(useQueryReferences.getStr(0));
+
+            return info;
+        }));
 
-            info->registrationTime = useQueryPathInfo.getInt(2);
+    } catch (...) { callback.rethrow(); }
+}
 
-            auto s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 3);
-            if (s) info->deriver = s;
 
-            /* Note that narSize = NULL yields 0. */
-            info->narSize = useQueryPathInfo.getInt(4);
+PathInfoMap LocalStore::queryPathInfos(const PathSet & paths)
+{
+    PathInfoMap res;
+    PathSet missing;
 
-            info->ultimate = useQueryPathInfo.getInt(5) == 1;
+    {
+        auto state_(Store::state.lock());
+        for (auto & path : paths) {
+            assertStorePath(path);
+            auto info = state_->pathInfoCache.get(storePathToHash(path));
+            if (!info) {
+                missing.insert(path);
+                continue;
+            }
+            stats.narInfoReadAverted++;
+            if (*info && (*info)->path == path)
+                res.emplace(path, ref<ValidPathInfo>(*info));
+        }
+    }
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 6);
-            if (s) info->sigs = tokenizeString<StringSet>(s, " ");
+    if (missing.empty()) return res;
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 7);
-            if (s) info->ca = s;
+    typedef std::map<Path, std::shared_ptr<ValidPathInfo>> Infos;
 
-            /* Get the references. */
-            auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
+    auto infos = withReadConnection<Infos>([&](DBConnection & conn) {
+        Infos infos;
 
-            while (useQueryReferences.next())
-                info->references.insert(useQueryReferences.getStr(0));
+        for (auto & batch : makeBatches(missing)) {
+            std::unordered_map<uint64_t, ValidPathInfo *> byId;
 
-            return info;
-        }));
+            {
+                auto use(conn.stmtQueryPathInfoBatch.use());
+                bindBatch(use, batch);
+                while (use.next()) {
+                    auto info = std::make_shared<ValidPathInfo>();
+                    info->path = use.getStr(8);
+                    readPathInfo(conn.stmtQueryPathInfoBatch, use, *info);
+                    byId[info->id] = &*info;
+                    infos[info->path] = info;
+                }
+            }
 
-    } catch (...) { callback.rethrow(); }
+            auto use(conn.stmtQueryReferencesBatch.use());
+            bindBatch(use, batch);
+            while (use.next()) {
+                auto i = byId.find(use.getInt(0));
+                if (i != byId.end())
+                    i->second->references.insert(use.getStr(1));
+            }
+        }
+
+        return infos;
+    });
+
+    auto state_(Store::state.lock());
+    for (auto & path : missing) {
+        auto i = infos.find(path);
+        if (i == infos.end()) {
+            stats.narInfoMissing++;
+            state_->pathInfoCache.upsert(storePathToHash(path), 0);
+        } else {
+            state_->pathInfoCache.upsert(storePathToHash(path), i->second);
+            res.emplace(path, ref<ValidPathInfo>(i->second));
+        }
+    }
+
+    return res;
 }
 
 
@@ -697,44 +1101,47 @@ void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 }
 
 
-uint64_t LocalStore::queryValidPathId(State & state, const Path & path)
+uint64_t LocalStore::queryValidPathId(DBConnection & conn, const Path & path)
 {
-    auto use(state.stmtQueryPathInfo.use()(path));
+    auto use(conn.stmtQueryPathInfo.use()(path));
     if (!use.next())
         throw Error(format("path '%1%' is not valid") % path);
     return use.getInt(0);
 }
 
 
-bool LocalStore::isValidPath_(State & state, const Path & path)
+bool LocalStore::isValidPath_(DBConnection & conn, const Path & path)
 {
-    return state.stmtQueryPathInfo.use()(path).next();
+    return conn.stmtQueryPathInfo.use()(path).next();
 }
 
 
 bool LocalStore::isValidPathUncached(const Path & path)
 {
-    return retrySQLite<bool>([&]() {
-        auto state(_state.lock());
-        return isValidPath_(*state, path);
+    return withReadConnection<bool>([&](DBConnection & conn) {
+        return isValidPath_(conn, path);
     });
 }
 
 
 PathSet LocalStore::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
-    PathSet res;
-    for (auto & i : paths)
-        if (isValidPath(i)) res.insert(i);
-    return res;
+    return withReadConnection<PathSet>([&](DBConnection & conn) {
+        PathSet res;
+        for (auto & batch : makeBatches(paths)) {
+            auto use(conn.stmtQueryValidPathsBatch.use());
+            bindBatch(use, batch);
+            while (use.next()) res.insert(use.getStr(0));
+        }
+        return res;
+    });
 }
 
 
 PathSet LocalStore::queryAllValidPaths()
 {
-    return retrySQLite<PathSet>([&]() {
-        auto state(_state.lock());
-        auto use(state->stmtQueryValidPaths.use());
+    return withReadConnection<PathSet>([&](DBConnection & conn) {
+        auto use(conn.stmtQueryValidPaths.use());
         PathSet res;
         while (use.next()) res.insert(use.getStr(0));
         return res;
@@ -742,9 +1149,9 @@ PathSet LocalStore::queryAllValidPaths()
 }
 
 
-void LocalStore::queryReferrers(State & state, const Path & path, PathSet & referrers)
+void LocalStore::queryReferrers(DBConnection & conn, const Path & path, PathSet & referrers)
 {
-    auto useQueryReferrers(state.stmtQueryReferrers.use()(path));
+    auto useQueryReferrers(conn.stmtQueryReferrers.use()(path));
 
     while (useQueryReferrers.next())
         referrers.insert(useQueryReferrers.getStr(0));
@@ -754,21 +1161,42 @@ void LocalStore::queryReferrers(State & state, const Path & path, PathSet & refe
 void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 {
     assertStorePath(path);
-    return retrySQLite<void>([&]() {
-        auto state(_state.lock());
-        queryReferrers(*state, path, referrers);
+
+    bool found = false;
+    if (withRefGraph([&](RefGraph & graph) {
+        found = graph.queryReferrers(path, referrers);
+    }) && found)
+        return;
+
+    return withReadConnection<void>([&](DBConnection & conn) {
+        queryReferrers(conn, path, referrers);
     });
 }
 
 
+void LocalStore::computeFSClosure(const PathSet & startPaths,
+    PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* The graph has no outputs or derivers, so only plain closures
+       are computed from it. */
+    bool done = false;
+    if (!includeOutputs && !includeDerivers
+        && withRefGraph([&](RefGraph & graph) {
+            done = graph.computeClosure(startPaths, paths, flipDirection);
+        })
+        && done)
+        return;
+
+    Store::computeFSClosure(startPaths, paths, flipDirection, includeOutputs, includeDerivers);
+}
+
+
 PathSet LocalStore::queryValidDerivers(const Path & path)
 {
     assertStorePath(path);
 
-    return retrySQLite<PathSet>([&]() {
-        auto state(_state.lock());
-
-        auto useQueryValidDerivers(state->stmtQueryValidDerivers.use()(path));
+    return withReadConnection<PathSet>([&](DBConnection & conn) {
+        auto useQueryValidDerivers(conn.stmtQueryValidDerivers.use()(path));
 
         PathSet derivers;
         while (useQueryValidDerivers.next())
@@ -781,11 +1209,9 @@ PathSet LocalStore::queryValidDerivers(const Path & path)
 
 PathSet LocalStore::queryDerivationOutputs(const Path & path)
 {
-    return retrySQLite<PathSet>([&]() {
-        auto state(_state.lock());
-
-        auto useQueryDerivationOutputs(state->stmtQueryDerivationOutputs.use()
-            (queryValidPathId(*state, path)));
+    return withReadConnection<PathSet>([&](DBConnection & conn) {
+        auto useQueryDerivationOutputs(conn.stmtQueryDerivationOutputs.use()
+            (queryValidPathId(conn, path)));
 
         PathSet outputs;
         while (useQueryDerivationOutputs.next())
@@ -798,11 +1224,9 @@ PathSet LocalStore::queryDerivationOutputs(const Path & path)
 
 StringSet LocalStore::queryDerivationOutputNames(const Path & path)
 {
-    return retrySQLite<StringSet>([&]() {
-        auto state(_state.lock());
-
-        auto useQueryDerivationOutputs(state->stmtQueryDerivationOutputs.use()
-            (queryValidPathId(*state, path)));
+    return withReadConnection<StringSet>([&](DBConnection & conn) {
+        auto useQueryDerivationOutputs(conn.stmtQueryDerivationOutputs.use()
+            (queryValidPathId(conn, path)));
 
         StringSet outputNames;
         while (useQueryDerivationOutputs.next())
@@ -819,19 +1243,51 @@ Path LocalStore::queryPathFromHashPart(const string & hashPart)
 
     Path prefix = storeDir + "/" + hashPart;
 
-    return retrySQLite<Path>([&]() -> std::string {
-        auto state(_state.lock());
-
-        auto useQueryPathFromHashPart(state->stmtQueryPathFromHashPart.use()(prefix));
+    return withReadConnection<Path>([&](DBConnection & conn) -> std::string {
+        auto useQueryPathFromHashPart(conn.stmtQueryPathFromHashPart.use()(prefix));
 
         if (!useQueryPathFromHashPart.next()) return "";
 
-        const char * s = (const char *) sqlite3_column_text(state->stmtQueryPathFromHashPart, 0);
+        const char * s = (const char *) sqlite3_column_text(conn.stmtQueryPathFromHashPart, 0);
         return s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0 ? s : "";
     });
 }
 
 
+std::optional<Hash> LocalStore::queryDerivationHash(const Path & path)
+{
+    return withReadConnection<std::optional<Hash>>([&](DBConnection & conn) -> std::optional<Hash> {
+        auto useQueryDerivationHash(conn.stmtQueryDerivationHash.use()(path));
+
+        if (!useQueryDerivationHash.next()) return {};
+
+        return Hash(useQueryDerivationHash.getStr(0));
+    });
+}
+
+
+void LocalStore::registerDerivationHash(const Path & path, const Hash & hash)
+{
+    if (settings.readOnlyMode) return;
+
+    auto doRegister = [&](State & state) {
+        state.stmtRegisterDerivationHash.use()
+            (hash.to_string(Base16))
+            (path)
+            .exec();
+    };
+
+    /* Called by checkDerivationOutputs() while registering paths. */
+    if (auto state = writeTxnState())
+        return doRegister(*state);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        doRegister(*state);
+    });
+}
+
+
 PathSet LocalStore::querySubstitutablePaths(const PathSet & paths)
 {
     if (!settings.useSubstitutes) return PathSet();
@@ -914,6 +1370,9 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         SQLiteTxn txn(state->db);
         PathSet paths;
 
+        writeTxn = {this, &*state};
+        Finally resetWriteTxn([&]() { writeTxn = {nullptr, nullptr}; });
+
         for (auto & i : infos) {
             assert(i.narHash.type == htSHA256);
             if (isValidPath_(*state, i.path))
@@ -923,8 +1382,11 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
             paths.insert(i.path);
         }
 
+        std::vector<uint64_t> ids;
+
         for (auto & i : infos) {
             auto referrer = queryValidPathId(*state, i.path);
+            ids.push_back(referrer);
             for (auto & j : i.references)
                 state->stmtAddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
         }
@@ -947,6 +1409,15 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         topoSortPaths(paths);
 
         txn.commit();
+
+        updateRefGraph([&](RefGraph & graph) {
+            auto id = ids.begin();
+            for (auto & i : infos)
+                graph.addPath(*id++, i.path, {});
+            id = ids.begin();
+            for (auto & i : infos)
+                graph.addPath(*id++, i.path, i.references);
+        });
     });
 }
 
@@ -1190,6 +1661,7 @@ void LocalStore::invalidatePathChecked(const Path & path)
 
         SQLiteTxn txn(state->db);
 
+        bool invalidated = false;
         if (isValidPath_(*state, path)) {
             PathSet referrers; queryReferrers(*state, path, referrers);
             referrers.erase(path); /* ignore self-references */
@@ -1197,9 +1669,33 @@ void LocalStore::invalidatePathChecked(const Path & path)
                 throw PathInUse(format("cannot delete path '%1%' because it is in use by %2%")
                     % path % showPaths(referrers));
             invalidatePath(*state, path);
+            invalidated = true;
         }
 
         txn.commit();
+
+        if (invalidated)
+            updateRefGraph([&](RefGraph & graph) { graph.removePath(path); });
+    });
+}
+
+
+void LocalStore::invalidatePaths(const Paths & paths)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+
+        SQLiteTxn txn(state->db);
+
+        for (auto & path : paths)
+            invalidatePath(*state, path);
+
+        txn.commit();
+
+        updateRefGraph([&](RefGraph & graph) {
+            for (auto & path : paths)
+                graph.removePath(path);
+        });
     });
 }
 
@@ -1299,6 +1795,7 @@ void LocalStore::verifyPath(const Path & path, const PathSet & store,
         printError(format("path '%1%' is not in the Nix store") % path);
         auto state(_state.lock());
         invalidatePath(*state, path);
+        updateRefGraph([&](RefGraph & graph) { graph.removePath(path); });
         return;
     }
 
@@ -1318,6 +1815,7 @@ void LocalStore::verifyPath(const Path & path, const PathSet & store,
             printError(format("path '%1%' disappeared, removing from database...") % path);
             auto state(_state.lock());
             invalidatePath(*state, path);
+            updateRefGraph([&](RefGraph & graph) { graph.removePath(path); });
         } else {
             printError(format("path '%1%' disappeared, but it still has valid referrers!") % path);
             if (repair)
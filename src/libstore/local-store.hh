@@ -3,6 +3,7 @@
 #include "sqlite.hh"
 
 #include "pathlocks.hh"
+#include "pool.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
@@ -10,6 +11,7 @@
 #include <chrono>
 #include <future>
 #include <string>
+#include <thread>
 #include <unordered_set>
 
 
@@ -24,6 +26,8 @@ const int nixSchemaVersion = 10;
 
 
 struct Derivation;
+class RefGraph;
+class ThreadPool;
 
 
 struct OptimiseStats
@@ -41,25 +45,47 @@ private:
     /* Lock file used for upgrading. */
     AutoCloseFD globalLock;
 
-    struct State
+    /* A connection to the database, together with the precompiled
+       statements used by queries. */
+    struct DBConnection
     {
         /* The SQLite database object. */
         SQLite db;
 
-        /* Some precompiled SQLite statements. */
-        SQLiteStmt stmtRegisterValidPath;
-        SQLiteStmt stmtUpdatePathInfo;
-        SQLiteStmt stmtAddReference;
         SQLiteStmt stmtQueryPathInfo;
         SQLiteStmt stmtQueryReferences;
         SQLiteStmt stmtQueryReferrers;
-        SQLiteStmt stmtInvalidatePath;
-        SQLiteStmt stmtAddDerivationOutput;
         SQLiteStmt stmtQueryValidDerivers;
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
+        SQLiteStmt stmtQueryDerivationHash;
         SQLiteStmt stmtQueryValidPaths;
 
+        /* Statements that look up ‘queryBatchSize’ paths at once. */
+        SQLiteStmt stmtQueryValidPathsBatch;
+        SQLiteStmt stmtQueryPathInfoBatch;
+        SQLiteStmt stmtQueryReferencesBatch;
+
+        SQLiteStmt stmtDataVersion;
+
+        /* The number of the reference graph load (see
+           RefGraphState::loads) and the value of ‘pragma
+           data_version’ on this connection when this connection last
+           brought the graph up to date. */
+        std::pair<uint64_t, int64_t> refGraphVersion{0, -1};
+    };
+
+    /* The main connection, which is the only one used for writing. */
+    struct State : DBConnection
+    {
+        /* Some precompiled SQLite statements. */
+        SQLiteStmt stmtRegisterValidPath;
+        SQLiteStmt stmtUpdatePathInfo;
+        SQLiteStmt stmtAddReference;
+        SQLiteStmt stmtInvalidatePath;
+        SQLiteStmt stmtAddDerivationOutput;
+        SQLiteStmt stmtRegisterDerivationHash;
+
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
 
@@ -83,6 +109,34 @@ private:
 
     Sync<State, std::recursive_mutex> _state;
 
+    /* Read-only connections used by queries, so that queries from
+       different threads don't have to wait for each other or for the
+       main connection.  Only used in WAL mode, since otherwise
+       readers and writers exclude each other anyway. */
+    struct ReadConnection : DBConnection
+    {
+        pid_t pid = getpid();
+    };
+
+    std::unique_ptr<Pool<ReadConnection>> readConnections;
+
+    /* The in-memory reference graph, if enabled and loaded. */
+    struct RefGraphState
+    {
+        std::unique_ptr<RefGraph> graph;
+
+        /* Incremented whenever the graph is loaded from scratch. */
+        uint64_t loads = 0;
+
+        /* Incremented whenever this process changes the graph, so
+           that a graph loaded concurrently can be discarded. */
+        uint64_t generation = 0;
+
+        bool failed = false;
+    };
+
+    Sync<RefGraphState> _refGraph;
+
 public:
 
     PathSetting realStoreDir_;
@@ -93,6 +147,7 @@ public:
     const Path reservedPath;
     const Path schemaPath;
     const Path trashDir;
+    const Path incrementalTrashDir;
     const Path tempRootsDir;
     const Path fnTempRoots;
 
@@ -102,6 +157,10 @@ private:
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    const Setting<int> maxReadConnections{(Store*) this,
+        (int) std::thread::hardware_concurrency(),
+        "max-read-connections", "maximum number of concurrent read-only database connections"};
+
     const PublicKeys & getPublicKeys();
 
 public:
@@ -129,8 +188,16 @@ public:
     void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<ValidPathInfo>> callback) override;
 
+    PathInfoMap queryPathInfos(const PathSet & paths) override;
+
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
@@ -139,6 +206,10 @@ public:
 
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    std::optional<Hash> queryDerivationHash(const Path & path) override;
+
+    void registerDerivationHash(const Path & path, const Hash & hash) override;
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
@@ -223,15 +294,72 @@ public:
        garbage until it exceeds maxFree. */
     void autoGC(bool sync = true);
 
+    /* Keep free disk space between minFree and maxFree by deleting
+       garbage in small batches, without blocking other processes
+       for long. This is run by nix-daemon if ‘gc-incremental’ is
+       set, and does not return. */
+    void runIncrementalGC();
+
 private:
 
     int getSchema();
 
     void openDB(State & state, bool create);
 
+    ref<ReadConnection> openReadConnection();
+
+    void prepareQueries(DBConnection & conn);
+
+    /* Run the query ‘fun’ on a read-only connection if possible, and
+       on the main connection otherwise. */
+    template<typename T>
+    T withReadConnection(std::function<T(DBConnection & conn)> fun);
+
+    /* The store and locked main connection on which the current
+       thread has a write transaction open, if any.  Queries made
+       during such a transaction must use that connection, both to
+       see its uncommitted changes and because it is already locked. */
+    static thread_local std::pair<LocalStore *, State *> writeTxn;
+
+    State * writeTxnState()
+    {
+        return writeTxn.first == this ? writeTxn.second : nullptr;
+    }
+
+    std::unique_ptr<RefGraph> loadRefGraph();
+
+    /* Return the pairs of ids (a, b), with a ≥ ‘minId’, such that b
+       must be kept if a is kept because of the ‘keep-outputs’ and
+       ‘keep-derivations’ settings. */
+    std::vector<std::pair<uint64_t, uint64_t>> queryKeepEdges(
+        bool keepOutputs, bool keepDerivations, uint64_t minId = 0);
+
+    /* Add the paths with an id of at least ‘minId’ to ‘graph’, and
+       return their ids. These are the paths registered after the
+       graph was loaded. */
+    std::vector<uint64_t> loadNewPaths(RefGraph & graph, uint64_t minId);
+
+    /* Add the paths registered by other processes to ‘graph’. Return
+       false if the graph must be reloaded because paths have been
+       invalidated. */
+    bool refreshRefGraph(DBConnection & conn, RefGraph & graph);
+
+    /* Return the NAR sizes of all valid paths, indexed by id. */
+    std::vector<uint64_t> queryNarSizes();
+
+    /* Call ‘fun’ on the in-memory reference graph, loading it if
+       necessary. Return false if the graph is not available, in
+       which case the caller should query the database. The database
+       must not be accessed from ‘fun’. */
+    bool withRefGraph(std::function<void(RefGraph & graph)> fun);
+
+    /* Apply a change that has been committed to the database to the
+       reference graph, if loaded. */
+    void updateRefGraph(std::function<void(RefGraph & graph)> fun);
+
     void makeStoreWritable();
 
-    uint64_t queryValidPathId(State & state, const Path & path);
+    uint64_t queryValidPathId(DBConnection & conn, const Path & path);
 
     uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
@@ -240,6 +368,10 @@ private:
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const Path & path);
 
+    /* Invalidate a set of paths in one transaction. Referrers must
+       come before the paths they refer to. */
+    void invalidatePaths(const Paths & paths);
+
     void verifyPath(const Path & path, const PathSet & store,
         PathSet & done, PathSet & validPaths, RepairFlag repair, bool & errors);
 
@@ -251,6 +383,7 @@ private:
     ValidPathInfo queryPathInfoOld(const Path & path);
 
     struct GCState;
+    struct GCProgress;
 
     void deleteGarbage(GCState & state, const Path & path);
 
@@ -260,6 +393,21 @@ private:
 
     void deletePathRecursive(GCState & state, const Path & path);
 
+    void removeGarbage(GCState & state, const Path & path, uint64_t narSize);
+
+    void deleteBatch(GCState & state, ThreadPool & pool,
+        const Paths & paths, const std::vector<uint64_t> & sizes);
+
+    void markAndSweep(GCState & state, RefGraph & graph);
+
+    /* Run one cycle of incremental garbage collection. Return the
+       number of paths deleted. */
+    size_t collectGarbageIncremental(GCProgress & progress);
+
+    void writeGCProgress(const GCProgress & progress);
+
+    uint64_t getAvailableSpace();
+
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
 
@@ -284,8 +432,8 @@ private:
     void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
 
     // Internal versions that are not wrapped in retry_sqlite.
-    bool isValidPath_(State & state, const Path & path);
-    void queryReferrers(State & state, const Path & path, PathSet & referrers);
+    bool isValidPath_(DBConnection & conn, const Path & path);
+    void queryReferrers(DBConnection & conn, const Path & path, PathSet & referrers);
 
     /* Add signatures to a ValidPathInfo using the secret keys
        specified by the ‘secret-key-files’ option. */
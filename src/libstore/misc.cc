@@ -24,6 +24,8 @@ void Store::computeFSClosure(const PathSet & startPaths,
 
     std::condition_variable done;
 
+    ThreadPool pool;
+
     enqueue = [&](const Path & path) -> void {
         {
             auto state(state_.lock());
@@ -33,62 +35,77 @@ void Store::computeFSClosure(const PathSet & startPaths,
             state->pending++;
         }
 
-        queryPathInfo(path, {[&, path](std::future<ref<ValidPathInfo>> fut) {
-            // FIXME: calls to isValidPath() should be async
-
-            try {
-                auto info = fut.get();
+        auto query = [&, path]() {
+            queryPathInfo(path, {[&, path](std::future<ref<ValidPathInfo>> fut) {
+                // FIXME: calls to isValidPath() should be async
 
-                if (flipDirection) {
+                try {
+                    auto info = fut.get();
 
-                    PathSet referrers;
-                    queryReferrers(path, referrers);
-                    for (auto & ref : referrers)
-                        if (ref != path)
-                            enqueue(ref);
+                    if (flipDirection) {
 
-                    if (includeOutputs)
-                        for (auto & i : queryValidDerivers(path))
-                            enqueue(i);
+                        PathSet referrers;
+                        queryReferrers(path, referrers);
+                        for (auto & ref : referrers)
+                            if (ref != path)
+                                enqueue(ref);
 
-                    if (includeDerivers && isDerivation(path))
-                        for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i) && queryPathInfo(i)->deriver == path)
+                        if (includeOutputs)
+                            for (auto & i : queryValidDerivers(path))
                                 enqueue(i);
 
-                } else {
+                        if (includeDerivers && isDerivation(path))
+                            for (auto & i : queryDerivationOutputs(path))
+                                if (isValidPath(i) && queryPathInfo(i)->deriver == path)
+                                    enqueue(i);
 
-                    for (auto & ref : info->references)
-                        if (ref != path)
-                            enqueue(ref);
+                    } else {
 
-                    if (includeOutputs && isDerivation(path))
-                        for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i)) enqueue(i);
+                        for (auto & ref : info->references)
+                            if (ref != path)
+                                enqueue(ref);
 
-                    if (includeDerivers && isValidPath(info->deriver))
-                        enqueue(info->deriver);
+                        if (includeOutputs && isDerivation(path))
+                            for (auto & i : queryDerivationOutputs(path))
+                                if (isValidPath(i)) enqueue(i);
 
-                }
+                        if (includeDerivers && isValidPath(info->deriver))
+                            enqueue(info->deriver);
+
+                    }
 
-                {
+                    {
+                        auto state(state_.lock());
+                        assert(state->pending);
+                        if (!--state->pending) done.notify_one();
+                    }
+
+                } catch (...) {
                     auto state(state_.lock());
+                    if (!state->exc) state->exc = std::current_exception();
                     assert(state->pending);
                     if (!--state->pending) done.notify_one();
-                }
-
-            } catch (...) {
-                auto state(state_.lock());
-                if (!state->exc) state->exc = std::current_exception();
-                assert(state->pending);
-                if (!--state->pending) done.notify_one();
-            };
-        }});
+                };
+            }});
+        };
+
+        /* Stores that answer queries synchronously, such as the local
+           store, would otherwise do the whole traversal in the
+           calling thread.  Asynchronous stores may call back after
+           the pool has drained, in which case the query is started
+           from the callback as before. */
+        try {
+            pool.enqueue(query);
+        } catch (ThreadPoolShutDown &) {
+            query();
+        }
     };
 
     for (auto & startPath : startPaths)
         enqueue(startPath);
 
+    pool.process();
+
     {
         auto state(state_.lock());
         while (state->pending) state.wait(done);
@@ -244,6 +261,8 @@ Paths Store::topoSortPaths(const PathSet & paths)
     Paths sorted;
     PathSet visited, parents;
 
+    auto infos = queryPathInfos(paths);
+
     std::function<void(const Path & path, const Path * parent)> dfsVisit;
 
     dfsVisit = [&](const Path & path, const Path * parent) {
@@ -254,17 +273,13 @@ Paths Store::topoSortPaths(const PathSet & paths)
         visited.insert(path);
         parents.insert(path);
 
-        PathSet references;
-        try {
-            references = queryPathInfo(path)->references;
-        } catch (InvalidPath &) {
-        }
-
-        for (auto & i : references)
-            /* Don't traverse into paths that don't exist.  That can
-               happen due to substitutes for non-existent paths. */
-            if (i != path && paths.find(i) != paths.end())
-                dfsVisit(i, &path);
+        auto info = infos.find(path);
+        if (info != infos.end())
+            for (auto & i : info->second->references)
+                /* Don't traverse into paths that don't exist.  That can
+                   happen due to substitutes for non-existent paths. */
+                if (i != path && paths.find(i) != paths.end())
+                    dfsVisit(i, &path);
 
         sorted.push_front(path);
         parents.erase(path);
@@ -0,0 +1,226 @@
+#include "ref-graph.hh"
+
+#include <algorithm>
+#include <limits>
+
+namespace nix {
+
+
+RefGraph::RefGraph(const Path & storeDir)
+    : storeDir(storeDir)
+{
+}
+
+
+RefGraph::Id RefGraph::checkId(uint64_t id) const
+{
+    if (id >= std::numeric_limits<Id>::max())
+        throw Error("store path id %d is too large for the in-memory reference graph", id);
+    return id;
+}
+
+
+std::string_view RefGraph::baseName(const Path & path) const
+{
+    if (path.size() <= storeDir.size() + 1
+        || path.compare(0, storeDir.size(), storeDir) != 0
+        || path[storeDir.size()] != '/')
+        throw Error("path '%s' is not in the Nix store", path);
+    return std::string_view(path).substr(storeDir.size() + 1);
+}
+
+
+void RefGraph::loadPath(uint64_t id_, const std::string & path)
+{
+    auto id = checkId(id_);
+    assert(id >= nameStart.size());
+    while (nameStart.size() <= id)
+        nameStart.push_back(names.size());
+    valid.resize(id + 1);
+    valid[id] = true;
+    names.append(baseName(path));
+    if (names.size() >= std::numeric_limits<uint32_t>::max())
+        throw Error("the store has too many paths for the in-memory reference graph");
+}
+
+
+void RefGraph::loadRef(uint64_t referrer, uint64_t reference)
+{
+    loadedRefs.emplace_back(checkId(referrer), checkId(reference));
+}
+
+
+void RefGraph::finishLoading()
+{
+    nrLoaded = nameStart.size();
+    nameStart.push_back(names.size());
+
+    for (Id id = 0; id < nrLoaded; ++id)
+        if (valid[id]) ids.emplace(name(id), id);
+
+    /* Count the edges of every path, then put them in place. */
+    refsStart.assign(nrLoaded + 1, 0);
+    referrersStart.assign(nrLoaded + 1, 0);
+
+    loadedRefs.erase(std::remove_if(loadedRefs.begin(), loadedRefs.end(),
+            [&](const std::pair<Id, Id> & edge) {
+                return edge.first >= nrLoaded || edge.second >= nrLoaded;
+            }),
+        loadedRefs.end());
+
+    for (auto & edge : loadedRefs) {
+        refsStart[edge.first + 1]++;
+        referrersStart[edge.second + 1]++;
+    }
+
+    for (Id id = 0; id < nrLoaded; ++id) {
+        refsStart[id + 1] += refsStart[id];
+        referrersStart[id + 1] += referrersStart[id];
+    }
+
+    refs.resize(loadedRefs.size());
+    referrers.resize(loadedRefs.size());
+
+    std::vector<uint32_t> refsPos(refsStart.begin(), refsStart.end() - 1);
+    std::vector<uint32_t> referrersPos(referrersStart.begin(), referrersStart.end() - 1);
+
+    for (auto & edge : loadedRefs) {
+        refs[refsPos[edge.first]++] = edge.second;
+        referrers[referrersPos[edge.second]++] = edge.first;
+    }
+
+    loadedRefs.clear();
+    loadedRefs.shrink_to_fit();
+}
+
+
+void RefGraph::addPath(uint64_t id_, const Path & path, const PathSet & references)
+{
+    auto id = checkId(id_);
+
+    if (!isValid(id)) {
+        if (id < nrLoaded) return;
+        auto & s = addedNames.emplace(id, std::string(baseName(path))).first->second;
+        ids.insert_or_assign(s, id);
+        overlaySize_++;
+    }
+
+    for (auto & ref : references)
+        if (auto ref2 = lookup(ref))
+            addRef(id, *ref2);
+}
+
+
+void RefGraph::addRef(uint64_t referrer_, uint64_t reference_)
+{
+    auto referrer = checkId(referrer_);
+    auto reference = checkId(reference_);
+
+    if (!isValid(referrer) || !isValid(reference)) return;
+
+    bool exists = false;
+    forEachEdge(referrer, false, [&](Id id2) { if (id2 == reference) exists = true; });
+    if (exists) return;
+
+    addedRefs[referrer].push_back(reference);
+    addedReferrers[reference].push_back(referrer);
+    overlaySize_++;
+}
+
+
+void RefGraph::removePath(const Path & path)
+{
+    auto id_ = lookup(path);
+    if (!id_) return;
+    auto id = *id_;
+    ids.erase(name(id));
+
+    if (id < nrLoaded)
+        valid[id] = false;
+    else {
+        addedNames.erase(id);
+        addedRefs.erase(id);
+        addedReferrers.erase(id);
+    }
+    overlaySize_++;
+}
+
+
+std::optional<RefGraph::Id> RefGraph::lookup(const Path & path) const
+{
+    if (path.size() <= storeDir.size() + 1) return {};
+    auto i = ids.find(std::string_view(path).substr(storeDir.size() + 1));
+    if (i == ids.end() || path.compare(0, storeDir.size(), storeDir) != 0) return {};
+    return i->second;
+}
+
+
+std::string_view RefGraph::name(Id id) const
+{
+    if (id < nrLoaded)
+        return std::string_view(names).substr(nameStart[id], nameStart[id + 1] - nameStart[id]);
+    auto i = addedNames.find(id);
+    assert(i != addedNames.end());
+    return i->second;
+}
+
+
+Path RefGraph::path(Id id) const
+{
+    auto n = name(id);
+    Path res;
+    res.reserve(storeDir.size() + 1 + n.size());
+    res.append(storeDir);
+    res.push_back('/');
+    res.append(n);
+    return res;
+}
+
+
+RefGraph::Id RefGraph::maxId() const
+{
+    Id res = nrLoaded;
+    for (auto & i : addedNames)
+        res = std::max(res, i.first + 1);
+    return res;
+}
+
+
+bool RefGraph::computeClosure(const PathSet & startPaths, PathSet & paths, bool flipDirection) const
+{
+    std::vector<Id> todo;
+    for (auto & path : startPaths) {
+        auto id = lookup(path);
+        if (!id) return false;
+        todo.push_back(*id);
+    }
+
+    std::vector<bool> visited(maxId());
+
+    while (!todo.empty()) {
+        auto id = todo.back();
+        todo.pop_back();
+        if (visited[id]) continue;
+        visited[id] = true;
+        if (!paths.insert(path(id)).second) continue;
+        forEachEdge(id, flipDirection, [&](Id id2) {
+            if (!visited[id2]) todo.push_back(id2);
+        });
+    }
+
+    return true;
+}
+
+
+bool RefGraph::queryReferrers(const Path & path, PathSet & referrers) const
+{
+    auto id = lookup(path);
+    if (!id) return false;
+    forEachEdge(*id, true, [&](Id id2) {
+        referrers.insert(this->path(id2));
+    });
+    return true;
+}
+
+
+}
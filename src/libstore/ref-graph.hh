@@ -0,0 +1,123 @@
+#pragma once
+
+#include "types.hh"
+
+#include <string_view>
+#include <unordered_map>
+#include <optional>
+
+namespace nix {
+
+
+/* A compact in-memory copy of the reference graph of a local store,
+   i.e. of its ValidPaths and Refs tables, for queries that would
+   otherwise need a database lookup for every path. Paths are
+   identified by their database id. The references and referrers
+   are kept in compressed sparse row form: the references of path
+   ‘id’ are refs[refsStart[id]] up to refs[refsStart[id + 1]], and
+   likewise for referrers. Paths registered or invalidated after the
+   graph was loaded are kept in a small overlay. */
+class RefGraph
+{
+public:
+
+    typedef uint32_t Id;
+
+    RefGraph(const Path & storeDir);
+
+    /* Loading the graph. Paths must be loaded in increasing order of
+       their id, and before any references. */
+    void loadPath(uint64_t id, const std::string & path);
+    void loadRef(uint64_t referrer, uint64_t reference);
+    void finishLoading();
+
+    /* Keep the graph in sync with changes to the database. */
+    void addPath(uint64_t id, const Path & path, const PathSet & references);
+    void addRef(uint64_t referrer, uint64_t reference);
+    void removePath(const Path & path);
+
+    /* The number of changes in the overlay, and the size of the
+       graph, so that the caller can decide when to reload it. */
+    size_t overlaySize() const { return overlaySize_; }
+    size_t size() const { return refs.size() + nameStart.size(); }
+
+    /* The number of valid paths. */
+    size_t nrValid() const { return ids.size(); }
+
+    std::optional<Id> lookup(const Path & path) const;
+
+    bool isValid(Id id) const
+    {
+        return id < nrLoaded ? (bool) valid[id] : addedNames.count(id) != 0;
+    }
+
+    Path path(Id id) const;
+
+    /* Call ‘fun’ on the valid references (or, if ‘referrers’ is set,
+       the referrers) of ‘id’. */
+    template<typename F>
+    void forEachEdge(Id id, bool referrers, F fun) const
+    {
+        if (id < nrLoaded) {
+            auto & start(referrers ? referrersStart : refsStart);
+            auto & edges(referrers ? this->referrers : refs);
+            for (auto i = start[id]; i < start[id + 1]; ++i)
+                if (isValid(edges[i])) fun(edges[i]);
+        }
+        auto & added(referrers ? addedReferrers : addedRefs);
+        auto i = added.find(id);
+        if (i != added.end())
+            for (auto id2 : i->second)
+                if (isValid(id2)) fun(id2);
+    }
+
+    /* Add the closure of ‘startPaths’ under the references relation
+       (or, if ‘flipDirection’ is set, the referrers relation) to
+       ‘paths’. As in Store::computeFSClosure(), paths that are
+       already in ‘paths’ are not traversed. Return false, without
+       changing ‘paths’, if a start path is not in the graph. */
+    bool computeClosure(const PathSet & startPaths, PathSet & paths, bool flipDirection) const;
+
+    /* Add the referrers of ‘path’ to ‘referrers’. Return false if
+       ‘path’ is not in the graph. */
+    bool queryReferrers(const Path & path, PathSet & referrers) const;
+
+    /* The number of ids, i.e. one more than the highest id. */
+    Id maxId() const;
+
+private:
+
+    Path storeDir;
+
+    /* The base names of the paths loaded from the database,
+       concatenated. The name of path ‘id’ starts at
+       names[nameStart[id]]. */
+    std::string names;
+    std::vector<uint32_t> nameStart;
+    std::vector<bool> valid;
+    Id nrLoaded = 0;
+
+    std::vector<uint32_t> refsStart, referrersStart;
+    std::vector<Id> refs, referrers;
+
+    /* The references passed to loadRef(). */
+    std::vector<std::pair<Id, Id>> loadedRefs;
+
+    /* Maps base names to ids. The keys point into ‘names’ and
+       ‘addedNames’. */
+    std::unordered_map<std::string_view, Id> ids;
+
+    /* The overlay. */
+    std::unordered_map<Id, std::string> addedNames;
+    std::unordered_map<Id, std::vector<Id>> addedRefs, addedReferrers;
+    size_t overlaySize_ = 0;
+
+    std::string_view name(Id id) const;
+
+    std::string_view baseName(const Path & path) const;
+
+    Id checkId(uint64_t id) const;
+};
+
+
+}
@@ -50,6 +50,7 @@ RemoteStore::RemoteStore(const Params & params)
                 return
                     r->to.good()
                     && r->from.good()
+                    && r->pid == getpid()
                     && std::chrono::duration_cast<std::chrono::seconds>(
                         std::chrono::steady_clock::now() - r->startTime).count() < maxConnectionAge;
             }
@@ -88,6 +89,18 @@ UDSRemoteStore::UDSRemoteStore(std::string socket_path, const Params & params)
 }
 
 
+UDSRemoteStore::~UDSRemoteStore()
+{
+    /* This can't be done in ~RemoteStore(), since by then we can't
+       open a connection anymore. */
+    try {
+        flushWrites();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
 std::string UDSRemoteStore::getUri()
 {
     if (path) {
@@ -144,11 +157,15 @@ void RemoteStore::initConnection(Connection & conn)
         if (magic != WORKER_MAGIC_2) throw Error("protocol mismatch");
 
         conn.from >> conn.daemonVersion;
+        conn.daemonFeatures = conn.daemonVersion & PROTOCOL_FEATURES_MASK;
+        conn.daemonVersion &= ~PROTOCOL_FEATURES_MASK;
+        daemonFeatures = conn.daemonFeatures;
+        daemonFeaturesKnown = true;
         if (GET_PROTOCOL_MAJOR(conn.daemonVersion) != GET_PROTOCOL_MAJOR(PROTOCOL_VERSION))
             throw Error("Nix daemon protocol version not supported");
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) < 10)
             throw Error("the Nix daemon version is too old");
-        conn.to << PROTOCOL_VERSION;
+        conn.to << (PROTOCOL_VERSION | PROTOCOL_FEATURES);
 
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 14) {
             int cpu = settings.lockCPU ? lockToCurrentCPU() : -1;
@@ -242,6 +259,8 @@ struct ConnectionHandle
 
 ConnectionHandle RemoteStore::getConnection()
 {
+    /* Any operation may depend on the deferred writes. */
+    flushWrites();
     return ConnectionHandle(connections->get());
 }
 
@@ -428,6 +447,21 @@ Path RemoteStore::queryPathFromHashPart(const string & hashPart)
 }
 
 
+std::optional<Hash> RemoteStore::queryDerivationHash(const Path & path)
+{
+    /* Hashes are only queried, not registered: the daemon records
+       them itself when it registers derivations, and it can't trust
+       the ones computed by a client. */
+    if (!daemonSupports(PROTOCOL_FEATURE_DRV_HASHES)) return {};
+    auto conn(getConnection());
+    conn->to << wopQueryDerivationHash << path;
+    conn.processStderr();
+    auto s = readString(conn->from);
+    if (s.empty()) return {};
+    return Hash(s);
+}
+
+
 void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
     RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
 {
@@ -512,6 +546,18 @@ Path RemoteStore::addTextToStore(const string & name, const string & s,
 {
     if (repair) throw Error("repairing is not supported when building through the Nix daemon");
 
+    if (writeBehind && writesDeferred && daemonSupports(PROTOCOL_FEATURE_ADD_TEXTS)) {
+        auto path = computeStorePathForText(name, s, references);
+        bool flush;
+        {
+            auto pendingTexts_(pendingTexts.lock());
+            pendingTexts_->push_back({name, s, references, path});
+            flush = pendingTexts_->size() >= maxPendingTexts;
+        }
+        if (flush) flushWrites();
+        return path;
+    }
+
     auto conn(getConnection());
     conn->to << wopAddTextToStore << name << s << references;
 
@@ -520,6 +566,41 @@ Path RemoteStore::addTextToStore(const string & name, const string & s,
 }
 
 
+void RemoteStore::deferWrites()
+{
+    writesDeferred = true;
+}
+
+
+void RemoteStore::flushWrites()
+{
+    /* Keep the queue locked until the daemon is done, so that other
+       threads don't proceed before the writes are. */
+    auto pendingTexts_(pendingTexts.lock());
+    if (pendingTexts_->empty()) return;
+
+    auto texts(std::move(*pendingTexts_));
+    pendingTexts_->clear();
+
+    ConnectionHandle conn(connections->get());
+    conn->to << wopAddTextsToStore << texts.size();
+    for (auto & i : texts)
+        conn->to << i.name << i.s << i.references;
+
+    conn.processStderr();
+    auto paths = readStorePaths<Paths>(*this, conn->from);
+    if (paths.size() != texts.size())
+        throw Error("daemon added %d paths, but %d were sent", paths.size(), texts.size());
+
+    auto i = texts.begin();
+    for (auto & path : paths) {
+        if (path != i->path)
+            throw Error("daemon added '%s' as path '%s', but '%s' was expected", i->name, path, i->path);
+        ++i;
+    }
+}
+
+
 void RemoteStore::buildPaths(const PathSet & drvPaths, BuildMode buildMode)
 {
     auto conn(getConnection());
@@ -700,6 +781,14 @@ unsigned int RemoteStore::getProtocol()
 }
 
 
+bool RemoteStore::daemonSupports(unsigned int feature)
+{
+    /* Only open a connection if none has been opened yet. */
+    if (!daemonFeaturesKnown) connections->get();
+    return daemonFeatures & feature;
+}
+
+
 void RemoteStore::flushBadConnections()
 {
     connections->flushBad();
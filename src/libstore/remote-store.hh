@@ -29,6 +29,9 @@ public:
     const Setting<unsigned int> maxConnectionAge{(Store*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
 
+    const Setting<bool> writeBehind{(Store*) this, true, "write-behind",
+            "whether to send the files added by addTextToStore() (such as derivations) to the daemon in batches, in commands that support this"};
+
     RemoteStore(const Params & params);
 
     /* Implementations of abstract store API methods. */
@@ -53,6 +56,8 @@ public:
 
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    std::optional<Hash> queryDerivationHash(const Path & path) override;
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
@@ -69,6 +74,10 @@ public:
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair) override;
 
+    void deferWrites() override;
+
+    void flushWrites() override;
+
     void buildPaths(const PathSet & paths, BuildMode buildMode) override;
 
     BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
@@ -110,7 +119,13 @@ protected:
         FdSink to;
         FdSource from;
         unsigned int daemonVersion;
+        /* The protocol extensions that the daemon supports. */
+        unsigned int daemonFeatures = 0;
         std::chrono::time_point<std::chrono::steady_clock> startTime;
+        /* The process that opened the connection.  A forked child
+           must not use it, since that would interleave its messages
+           with those of the parent. */
+        pid_t pid = getpid();
 
         virtual ~Connection();
 
@@ -125,6 +140,14 @@ protected:
 
     ref<Pool<Connection>> connections;
 
+    /* Whether the daemon supports the protocol extension 'feature'
+       (one of the PROTOCOL_FEATURE_* flags). */
+    bool daemonSupports(unsigned int feature);
+
+    /* The features of the daemon, recorded by initConnection(). */
+    std::atomic<unsigned int> daemonFeatures{0};
+    std::atomic_bool daemonFeaturesKnown{false};
+
     virtual void setOptions(Connection & conn);
 
     ConnectionHandle getConnection();
@@ -135,6 +158,29 @@ private:
 
     std::atomic_bool failed{false};
 
+    /* Whether deferWrites() has been called. */
+    std::atomic_bool writesDeferred{false};
+
+    /* The files added by addTextToStore() that haven't been sent to
+       the daemon yet.  Writes are only deferred after deferWrites()
+       has been called.  They're sent by flushWrites(), which is done
+       when there are enough of them, before any other operation on
+       the daemon, and when the store is destroyed.  Since their paths
+       can be computed locally, this saves a round trip per file
+       (e.g. per derivation written during evaluation). */
+    struct PendingText
+    {
+        string name, s;
+        PathSet references;
+        /* The path computed by addTextToStore(), which the daemon
+           must agree with. */
+        Path path;
+    };
+
+    Sync<std::vector<PendingText>> pendingTexts;
+
+    static const size_t maxPendingTexts = 1024;
+
 };
 
 class UDSRemoteStore : public LocalFSStore, public RemoteStore
@@ -144,6 +190,8 @@ public:
     UDSRemoteStore(const Params & params);
     UDSRemoteStore(std::string path, const Params & params);
 
+    ~UDSRemoteStore();
+
     std::string getUri() override;
 
 private:
@@ -40,3 +40,11 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- Memoisation of hashDerivationModulo(), which otherwise has to read
+-- the entire closure of input derivations.
+create table if not exists DerivationHashes (
+    drv  integer primary key not null,
+    hash text not null,
+    foreign key (drv) references ValidPaths(id) on delete cascade
+);
@@ -30,6 +30,15 @@ public:
     {
     }
 
+    ~SSHStore()
+    {
+        try {
+            flushWrites();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
     std::string getUri() override
     {
         return uriScheme + host;
@@ -435,6 +435,52 @@ PathSet Store::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubsti
 }
 
 
+PathInfoMap Store::queryPathInfos(const PathSet & paths)
+{
+    struct State
+    {
+        size_t left;
+        PathInfoMap infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size(), PathInfoMap()});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const Path & path) {
+        checkInterrupt();
+        queryPathInfo(path, {[path, &state_, &wakeup](std::future<ref<ValidPathInfo>> fut) {
+            auto state(state_.lock());
+            try {
+                state->infos.emplace(path, fut.get());
+            } catch (InvalidPath &) {
+            } catch (...) {
+                state->exc = std::current_exception();
+            }
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->infos);
+        }
+        state.wait(wakeup);
+    }
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -443,10 +489,13 @@ string Store::makeValidityRegistration(const PathSet & paths,
 {
     string s = "";
 
+    auto infos = queryPathInfos(paths);
+
     for (auto & i : paths) {
         s += i + "\n";
 
-        auto info = queryPathInfo(i);
+        auto i2 = infos.find(i);
+        auto info = i2 != infos.end() ? i2->second : queryPathInfo(i);
 
         if (showHash) {
             s += info->narHash.to_string(Base16, false) + "\n";
@@ -471,12 +520,15 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const PathSet & storePaths
 {
     auto jsonList = jsonOut.list();
 
+    auto infos = queryPathInfos(storePaths);
+
     for (auto storePath : storePaths) {
         auto jsonPath = jsonList.object();
         jsonPath.attr("path", storePath);
 
         try {
-            auto info = queryPathInfo(storePath);
+            auto i = infos.find(storePath);
+            auto info = i != infos.end() ? i->second : queryPathInfo(storePath);
             storePath = info->path;
 
             jsonPath
@@ -543,8 +595,8 @@ std::pair<uint64_t, uint64_t> Store::getClosureSize(const Path & storePath)
     uint64_t totalNarSize = 0, totalDownloadSize = 0;
     PathSet closure;
     computeFSClosure(storePath, closure, false, false);
-    for (auto & p : closure) {
-        auto info = queryPathInfo(p);
+    for (auto & i : queryPathInfos(closure)) {
+        auto & info = i.second;
         totalNarSize += info->narSize;
         auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
             std::shared_ptr<const ValidPathInfo>(info));
@@ -195,6 +195,8 @@ struct ValidPathInfo
 
 typedef list<ValidPathInfo> ValidPathInfos;
 
+typedef std::map<Path, ref<const ValidPathInfo>> PathInfoMap;
+
 
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 
@@ -362,6 +364,13 @@ public:
     void queryPathInfo(const Path & path,
         Callback<ref<ValidPathInfo>> callback);
 
+    /* Query information about several paths at once. Paths that are
+       not valid are omitted from the result. The default
+       implementation calls queryPathInfo() for every path in
+       parallel; stores that can look up many paths in a single
+       request override it. */
+    virtual PathInfoMap queryPathInfos(const PathSet & paths);
+
 protected:
 
     virtual void queryPathInfoUncached(const Path & path,
@@ -388,6 +397,17 @@ public:
     virtual StringSet queryDerivationOutputNames(const Path & path)
     { unsupported("queryDerivationOutputNames"); }
 
+    /* Query the result of hashDerivationModulo() for the derivation
+       denoted by `path', if the store has recorded it. */
+    virtual std::optional<Hash> queryDerivationHash(const Path & path)
+    { return {}; }
+
+    /* Record the result of hashDerivationModulo() for the valid
+       derivation denoted by `path'.  Stores that don't keep such a
+       table ignore this. */
+    virtual void registerDerivationHash(const Path & path, const Hash & hash)
+    { }
+
     /* Query the full store path given the hash part of a valid store
        path, or "" if the path doesn't exist. */
     virtual Path queryPathFromHashPart(const string & hashPart) = 0;
@@ -426,6 +446,18 @@ public:
     virtual Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair = NoRepair) = 0;
 
+    /* Allow the store to defer the writes done by addTextToStore()
+       until flushWrites() (see RemoteStore).  A caller that enables
+       this must call flushWrites() before the returned paths are
+       used outside this process, e.g. before exiting after printing
+       them. */
+    virtual void deferWrites() { }
+
+    /* Wait until the deferred writes are done, i.e. until the paths
+       returned so far are valid.  Note that a deferred write may
+       fail here rather than in addTextToStore(). */
+    virtual void flushWrites() { }
+
     /* Write a NAR dump of a store path. */
     virtual void narFromPath(const Path & path, Sink & sink) = 0;
 
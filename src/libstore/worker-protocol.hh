@@ -10,6 +10,16 @@ namespace nix {
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
+/* Protocol extensions that upstream Nix doesn't have.  Both sides
+   advertise them in the upper 16 bits of the version they send in
+   the greeting, which upstream ignores, and an extension is only
+   used if the other side advertised it.  So they can't clash with
+   the protocol versions and operations that upstream adds. */
+#define PROTOCOL_FEATURES_MASK 0xffff0000
+#define PROTOCOL_FEATURE_ADD_TEXTS 0x10000 // wopAddTextsToStore
+#define PROTOCOL_FEATURE_DRV_HASHES 0x20000 // wopQueryDerivationHash
+#define PROTOCOL_FEATURES (PROTOCOL_FEATURE_ADD_TEXTS | PROTOCOL_FEATURE_DRV_HASHES)
+
 
 typedef enum {
     wopIsValidPath = 1,
@@ -49,6 +59,11 @@ typedef enum {
     wopNarFromPath = 38,
     wopAddToStoreNar = 39,
     wopQueryMissing = 40,
+
+    /* Operations of the extensions above, numbered far away from
+       upstream's. */
+    wopAddTextsToStore = 1000,
+    wopQueryDerivationHash = 1001,
 } WorkerOp;
 
 
@@ -5,6 +5,7 @@
 
 #include <lzma.h>
 #include <bzlib.h>
+#include <zlib.h>
 #include <cstdio>
 #include <cstring>
 
@@ -198,6 +199,107 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+struct GzipDecompressionSink : ChunkedCompressionSink
+{
+    Sink & nextSink;
+    z_stream strm;
+    bool finished = false;
+
+    GzipDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    {
+        memset(&strm, 0, sizeof(strm));
+        /* Only accept the gzip format. */
+        if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+            throw CompressionError("unable to initialise gzip decoder");
+
+        strm.next_out = outbuf;
+        strm.avail_out = sizeof(outbuf);
+    }
+
+    ~GzipDecompressionSink()
+    {
+        inflateEnd(&strm);
+    }
+
+    void finish() override
+    {
+        flush();
+        if (!finished)
+            throw CompressionError("gzip data is truncated");
+    }
+
+    void writeInternal(const unsigned char * data, size_t len) override
+    {
+        strm.next_in = (Bytef *) data;
+        strm.avail_in = len;
+
+        while (strm.avail_in) {
+            checkInterrupt();
+
+            /* A gzip file may consist of several members. */
+            if (finished) {
+                if (inflateReset(&strm) != Z_OK)
+                    throw CompressionError("unable to reset gzip decoder");
+                finished = false;
+            }
+
+            int ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END)
+                throw CompressionError("error %d while decompressing gzip file", ret);
+
+            finished = ret == Z_STREAM_END;
+
+            if (strm.avail_out < sizeof(outbuf) || strm.avail_in == 0) {
+                nextSink(outbuf, sizeof(outbuf) - strm.avail_out);
+                strm.next_out = outbuf;
+                strm.avail_out = sizeof(outbuf);
+            }
+        }
+    }
+};
+
+/* Determine the compression method from the first few bytes of the
+   data, then pass the data to the corresponding decompressor. */
+struct AutoDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    std::string head;
+    std::shared_ptr<CompressionSink> sink;
+
+    AutoDecompressionSink(Sink & nextSink) : nextSink(nextSink) { }
+
+    void start()
+    {
+        auto method =
+            hasPrefix(head, std::string("\xfd" "7zXZ\0", 6)) ? "xz" :
+            hasPrefix(head, "\x1f\x8b") ? "gzip" :
+            hasPrefix(head, "BZh") ? "bzip2" :
+            "none";
+        sink = makeDecompressionSink(method, nextSink);
+        (*sink)((const unsigned char *) head.data(), head.size());
+    }
+
+    void finish() override
+    {
+        flush();
+        if (!sink) start();
+        sink->finish();
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        if (!sink) {
+            auto n = std::min(len, 6 - head.size());
+            head.append((const char *) data, n);
+            data += n;
+            len -= n;
+            if (head.size() < 6) return;
+            start();
+        }
+        (*sink)(data, len);
+    }
+};
+
 ref<std::string> decompress(const std::string & method, const std::string & in)
 {
     StringSink ssink;
@@ -217,6 +319,10 @@ ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & ne
         return make_ref<BzipDecompressionSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliDecompressionSink>(nextSink);
+    else if (method == "gzip")
+        return make_ref<GzipDecompressionSink>(nextSink);
+    else if (method == "auto")
+        return make_ref<AutoDecompressionSink>(nextSink);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -15,6 +15,9 @@ struct CompressionSink : BufferedSink
 
 ref<std::string> decompress(const std::string & method, const std::string & in);
 
+/* Besides the methods supported by makeCompressionSink(), this
+   supports "gzip", and "auto", which detects xz, gzip and bzip2 data
+   by their magic numbers and passes anything else through. */
 ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
 
 ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
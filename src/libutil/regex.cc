@@ -0,0 +1,752 @@
+#include "regex.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace nix {
+
+
+/* The maximum number of instructions in a compiled regular
+   expression, to bound the expansion of intervals like 'a{1,1000}'. */
+static const size_t maxInstructions = 100000;
+
+/* The maximum nesting depth of parenthesised groups. */
+static const size_t maxDepth = 1000;
+
+
+struct Node;
+typedef std::unique_ptr<Node> NodePtr;
+
+struct Node
+{
+    enum Kind { Char, Any, Class, Bol, Eol, Group, Concat, Alt, Repeat } kind;
+    unsigned char c = 0;
+    uint32_t n = 0; // class or group index
+    int min = 0, max = 0; // for Repeat; -1 means unbounded
+    std::vector<NodePtr> children;
+
+    Node(Kind kind) : kind(kind) { }
+
+    /* Whether this node can match the empty string. */
+    bool nullable() const
+    {
+        switch (kind) {
+        case Char: case Any: case Class: return false;
+        case Bol: case Eol: return true;
+        case Alt:
+            for (auto & i : children)
+                if (i->nullable()) return true;
+            return false;
+        case Repeat:
+            if (min == 0) return true;
+            /* fall through */
+        default:
+            for (auto & i : children)
+                if (!i->nullable()) return false;
+            return true;
+        }
+    }
+};
+
+
+static bool isClass(const std::string & name, unsigned char c)
+{
+    bool lower = c >= 'a' && c <= 'z';
+    bool upper = c >= 'A' && c <= 'Z';
+    bool digit = c >= '0' && c <= '9';
+    bool space = c == ' ' || (c >= '\t' && c <= '\r');
+    bool cntrl = c < 0x20 || c == 0x7f;
+    bool graph = c > 0x20 && c < 0x7f;
+
+    if (name == "alpha") return lower || upper;
+    if (name == "lower") return lower;
+    if (name == "upper") return upper;
+    if (name == "digit" || name == "d") return digit;
+    if (name == "alnum") return lower || upper || digit;
+    if (name == "w") return lower || upper || digit || c == '_';
+    if (name == "xdigit") return digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    if (name == "space" || name == "s") return space;
+    if (name == "blank") return c == ' ' || c == '\t';
+    if (name == "cntrl") return cntrl;
+    if (name == "graph") return graph;
+    if (name == "print") return graph || c == ' ';
+    if (name == "punct") return graph && !lower && !upper && !digit;
+    throw BadRegex("unknown character class '%s'", name);
+}
+
+
+struct RegexParser
+{
+    const std::string & re;
+    size_t pos = 0, depth = 0;
+    std::vector<std::bitset<256>> & classes;
+    size_t nrGroups = 0;
+
+    /* Set if the expression uses a construct that the VM doesn't
+       match exactly like libstdc++. */
+    bool unsupported = false;
+
+    RegexParser(const std::string & re, std::vector<std::bitset<256>> & classes)
+        : re(re), classes(classes) { }
+
+    bool atEnd() { return pos == re.size(); }
+
+    NodePtr parse()
+    {
+        auto n = parseAlt();
+        if (!atEnd())
+            throw BadRegex("unmatched ')' in regular expression");
+        return n;
+    }
+
+    NodePtr parseAlt()
+    {
+        auto n = std::make_unique<Node>(Node::Alt);
+        n->children.push_back(parseConcat());
+        while (!atEnd() && re[pos] == '|') {
+            pos++;
+            n->children.push_back(parseConcat());
+        }
+        if (n->children.size() == 1) return std::move(n->children[0]);
+        return n;
+    }
+
+    NodePtr parseConcat()
+    {
+        auto n = std::make_unique<Node>(Node::Concat);
+        while (!atEnd() && re[pos] != '|' && re[pos] != ')')
+            n->children.push_back(parsePiece());
+        return n;
+    }
+
+    NodePtr parsePiece()
+    {
+        /* Anchors can't be repeated. */
+        if (re[pos] == '^') { pos++; return std::make_unique<Node>(Node::Bol); }
+        if (re[pos] == '$') { pos++; return std::make_unique<Node>(Node::Eol); }
+
+        auto n = parseAtom();
+
+        while (!atEnd()) {
+            int min, max;
+            char c = re[pos];
+            if (c == '*') { min = 0; max = -1; pos++; }
+            else if (c == '+') { min = 1; max = -1; pos++; }
+            else if (c == '?') { min = 0; max = 1; pos++; }
+            else if (c == '{') { pos++; parseInterval(min, max); }
+            else break;
+            auto rep = std::make_unique<Node>(Node::Repeat);
+            rep->min = min;
+            rep->max = max;
+            /* libstdc++ gives repetitions of a body that can be empty
+               submatches that depend on how deeply such loops are
+               nested, which the VM doesn't reproduce. */
+            if (max != 1 && n->nullable())
+                unsupported = true;
+            rep->children.push_back(std::move(n));
+            n = std::move(rep);
+        }
+
+        return n;
+    }
+
+    int parseNumber()
+    {
+        if (atEnd() || re[pos] < '0' || re[pos] > '9')
+            throw BadRegex("invalid interval in regular expression");
+        int n = 0;
+        while (!atEnd() && re[pos] >= '0' && re[pos] <= '9') {
+            n = n * 10 + (re[pos++] - '0');
+            if (n > (int) maxInstructions)
+                throw RegexTooComplex("interval in regular expression is too large");
+        }
+        return n;
+    }
+
+    void parseInterval(int & min, int & max)
+    {
+        min = max = parseNumber();
+        if (!atEnd() && re[pos] == ',') {
+            pos++;
+            max = !atEnd() && re[pos] == '}' ? -1 : parseNumber();
+        }
+        if (atEnd() || re[pos] != '}')
+            throw BadRegex("unmatched '{' in regular expression");
+        pos++;
+        if (max != -1 && max < min)
+            throw BadRegex("invalid interval in regular expression");
+    }
+
+    NodePtr parseAtom()
+    {
+        char c = re[pos++];
+
+        if (c == '(') {
+            if (++depth > maxDepth)
+                throw RegexTooComplex("regular expression is nested too deeply");
+            auto n = std::make_unique<Node>(Node::Group);
+            n->n = ++nrGroups;
+            n->children.push_back(parseAlt());
+            if (atEnd())
+                throw BadRegex("unmatched '(' in regular expression");
+            pos++;
+            depth--;
+            return n;
+        }
+
+        if (c == '.')
+            return std::make_unique<Node>(Node::Any);
+
+        if (c == '[')
+            return parseBracket();
+
+        if (c == '\\') {
+            if (atEnd() || !re[pos] || !strchr(".[\\()*+?{|^$", re[pos]))
+                throw BadRegex("invalid escape in regular expression");
+            c = re[pos++];
+        }
+
+        else if (c == '*' || c == '+' || c == '?' || c == '{')
+            throw BadRegex("repetition operator without operand in regular expression");
+
+        auto n = std::make_unique<Node>(Node::Char);
+        n->c = c;
+        return n;
+    }
+
+    /* Parse a character in a bracket expression, returning it, or -1
+       if it was a character class (which is added to 'set'). */
+    int parseBracketChar(std::bitset<256> & set)
+    {
+        if (atEnd())
+            throw BadRegex("unmatched '[' in regular expression");
+
+        if (re[pos] == '[' && pos + 1 < re.size() && re[pos + 1] && strchr(":=.", re[pos + 1])) {
+            char kind = re[pos + 1];
+            auto end = re.find(std::string(1, kind) + "]", pos + 2);
+            if (end == std::string::npos)
+                throw BadRegex("unmatched '[' in regular expression");
+            auto name = std::string(re, pos + 2, end - pos - 2);
+            pos = end + 2;
+            if (kind == ':') {
+                for (unsigned int c = 0; c < 256; ++c)
+                    if (isClass(name, c)) set.set(c);
+                return -1;
+            }
+            /* Named collating elements like '[.hyphen.]' are left to
+               std::regex. */
+            if (name.size() != 1) {
+                unsupported = true;
+                return 0;
+            }
+            return (unsigned char) name[0];
+        }
+
+        return (unsigned char) re[pos++];
+    }
+
+    NodePtr parseBracket()
+    {
+        bool negated = false;
+        if (!atEnd() && re[pos] == '^') { negated = true; pos++; }
+
+        std::bitset<256> set;
+
+        /* A ']' at the start is a literal. */
+        for (bool first = true; ; first = false) {
+            if (atEnd())
+                throw BadRegex("unmatched '[' in regular expression");
+            if (re[pos] == ']' && !first) { pos++; break; }
+            int lo = parseBracketChar(set);
+            if (lo < 0) continue;
+            if (pos + 1 < re.size() && re[pos] == '-' && re[pos + 1] != ']') {
+                pos++;
+                int hi = parseBracketChar(set);
+                if (hi < lo)
+                    throw BadRegex("invalid range in regular expression");
+                for (int c = lo; c <= hi; ++c) set.set(c);
+            } else
+                set.set(lo);
+        }
+
+        if (negated) set.flip();
+
+        auto n = std::make_unique<Node>(Node::Class);
+        n->n = classes.size();
+        classes.push_back(set);
+        return n;
+    }
+};
+
+
+struct RegexCompiler
+{
+    std::vector<Regex::Inst> & prog;
+
+    RegexCompiler(std::vector<Regex::Inst> & prog) : prog(prog) { }
+
+    size_t emit(Regex::Op op, uint32_t x = 0, uint32_t y = 0, unsigned char c = 0)
+    {
+        if (prog.size() >= maxInstructions)
+            throw RegexTooComplex("regular expression is too large");
+        prog.push_back({op, c, x, y});
+        return prog.size() - 1;
+    }
+
+    void compile(Node & n)
+    {
+        switch (n.kind) {
+
+        case Node::Char:
+            emit(Regex::Op::Char, 0, 0, n.c);
+            break;
+
+        case Node::Any:
+            emit(Regex::Op::Any);
+            break;
+
+        case Node::Class:
+            emit(Regex::Op::Class, n.n);
+            break;
+
+        case Node::Bol:
+            emit(Regex::Op::Bol);
+            break;
+
+        case Node::Eol:
+            emit(Regex::Op::Eol);
+            break;
+
+        case Node::Group:
+            emit(Regex::Op::Save, 2 * n.n);
+            compile(*n.children[0]);
+            emit(Regex::Op::Save, 2 * n.n + 1);
+            break;
+
+        case Node::Concat:
+            for (auto & i : n.children)
+                compile(*i);
+            break;
+
+        case Node::Alt: {
+            std::vector<size_t> jumps;
+            for (size_t i = 0; i + 1 < n.children.size(); ++i) {
+                auto split = emit(Regex::Op::Split, prog.size() + 1);
+                compile(*n.children[i]);
+                jumps.push_back(emit(Regex::Op::Jump));
+                prog[split].y = prog.size();
+            }
+            compile(*n.children.back());
+            for (auto j : jumps)
+                prog[j].x = prog.size();
+            break;
+        }
+
+        case Node::Repeat: {
+            auto & body = *n.children[0];
+            if (n.max == -1) {
+                for (int i = 1; i < n.min; ++i)
+                    compile(body);
+                if (n.min) {
+                    /* 'body+' */
+                    auto start = prog.size();
+                    compile(body);
+                    emit(Regex::Op::Loop, start, prog.size() + 1);
+                } else {
+                    /* 'body*' */
+                    auto loop = emit(Regex::Op::Loop, prog.size() + 1);
+                    compile(body);
+                    emit(Regex::Op::Jump, loop);
+                    prog[loop].y = prog.size();
+                }
+            } else {
+                for (int i = 0; i < n.min; ++i)
+                    compile(body);
+                /* Emit 'body{0,k}' as 'body?' k times, where each
+                   optional copy skips all the following ones. */
+                std::vector<size_t> splits;
+                for (int i = n.min; i < n.max; ++i) {
+                    splits.push_back(emit(Regex::Op::Opt, prog.size() + 1));
+                    compile(body);
+                }
+                for (auto s : splits)
+                    prog[s].y = prog.size();
+            }
+            break;
+        }
+        }
+    }
+};
+
+
+Regex::Regex(const std::string & re)
+{
+    RegexParser parser(re, classes);
+    auto root = parser.parse();
+    nrGroups = parser.nrGroups;
+
+    if (parser.unsupported) {
+        try {
+            fallback = std::make_shared<std::regex>(re, std::regex::extended);
+        } catch (std::regex_error & e) {
+            if (e.code() == std::regex_constants::error_space)
+                throw RegexTooComplex("regular expression is too large");
+            throw BadRegex("invalid regular expression");
+        }
+        return;
+    }
+
+    RegexCompiler compiler(prog);
+    compiler.emit(Op::Save, 0);
+    compiler.compile(*root);
+    compiler.emit(Op::Save, 1);
+    compiler.emit(Op::Match);
+}
+
+
+/* Convert the submatches of a std::regex match in 's' to offsets. */
+static void fromSmatch(const std::string & s, const std::smatch & sm, Regex::Submatches & m)
+{
+    m.clear();
+    for (auto & i : sm) {
+        m.push_back(i.matched ? i.first - s.begin() : -1);
+        m.push_back(i.matched ? i.second - s.begin() : -1);
+    }
+}
+
+
+bool Regex::match(const std::string & s, Submatches & m) const
+{
+    if (fallback) {
+        std::smatch sm;
+        if (!std::regex_match(s, sm, *fallback)) return false;
+        fromSmatch(s, sm, m);
+        return true;
+    }
+    return run(s, 0, m, flagFull | flagContinuous, nullptr);
+}
+
+
+bool Regex::search(const std::string & s, size_t from, Submatches & m,
+    bool notNull, bool continuous) const
+{
+    auto live = liveness(s, from);
+    return search(s, from, m, notNull, continuous, live.get());
+}
+
+
+bool Regex::search(const std::string & s, size_t from, Submatches & m,
+    bool notNull, bool continuous, const Liveness * live) const
+{
+    if (fallback) {
+        auto flags = std::regex_constants::match_default;
+        if (notNull) flags |= std::regex_constants::match_not_null;
+        if (continuous) flags |= std::regex_constants::match_continuous;
+        if (from) flags |= std::regex_constants::match_prev_avail;
+        std::smatch sm;
+        if (!std::regex_search(s.begin() + from, s.end(), sm, *fallback, flags)) return false;
+        fromSmatch(s, sm, m);
+        return true;
+    }
+    return run(s, from, m, (notNull ? flagNotNull : 0) | (continuous ? flagContinuous : 0), live);
+}
+
+
+std::vector<Regex::Submatches> Regex::searchAll(const std::string & s) const
+{
+    auto live = liveness(s, 0);
+
+    std::vector<Submatches> matches;
+    Submatches m;
+    bool found = search(s, 0, m, false, false, live.get());
+    while (found) {
+        matches.push_back(m);
+        size_t start = m[1];
+        if (m[0] == m[1]) {
+            if (start == s.size()) break;
+            if (search(s, start, m, true, true, live.get())) continue;
+            start++;
+        }
+        found = search(s, start, m, false, false, live.get());
+    }
+
+    return matches;
+}
+
+
+/* The maximum size in bits of the liveness table of a subject. */
+static const size_t maxLivenessBits = (size_t) 1 << 30;
+
+struct Regex::Liveness
+{
+    const std::vector<Inst> & prog;
+    const std::vector<std::bitset<256>> & classes;
+    const std::string & s;
+    size_t from, words;
+
+    /* Bit 'pc' of row 'pos - from' is set iff there is a path from the
+       instruction at 'pc' at position 'pos' to Match. */
+    std::vector<uint64_t> bits;
+
+    /* The instructions that reach each instruction without consuming
+       input. */
+    std::vector<std::vector<uint32_t>> preds;
+
+    Liveness(const Regex & regex, const std::string & s, size_t from)
+        : prog(regex.prog), classes(regex.classes), s(s), from(from)
+        , words((prog.size() + 63) / 64), preds(prog.size())
+    {
+        if ((s.size() - from + 1) * words * 64 > maxLivenessBits)
+            throw RegexTooComplex("regular expression is too large for a string of length %d", s.size());
+
+        for (uint32_t pc = 0; pc < prog.size(); ++pc) {
+            auto & inst = prog[pc];
+            switch (inst.op) {
+            case Op::Split: case Op::Opt: case Op::Loop:
+                preds[inst.y].push_back(pc);
+                /* fall through */
+            case Op::Jump:
+                preds[inst.x].push_back(pc);
+                break;
+            case Op::Save: case Op::Bol: case Op::Eol:
+                preds[pc + 1].push_back(pc);
+                break;
+            default:
+                break;
+            }
+        }
+
+        bits.resize((s.size() - from + 1) * words);
+        for (size_t pos = s.size() + 1; pos-- > from; )
+            fill(pos, &bits[(pos - from) * words], pos < s.size() ? row(pos + 1) : nullptr, true);
+    }
+
+    const uint64_t * row(size_t pos) const { return &bits[(pos - from) * words]; }
+
+    static bool get(const uint64_t * row, uint32_t pc)
+    {
+        return row[pc / 64] >> (pc % 64) & 1;
+    }
+
+    /* Compute the row for 'pos' from the one for 'pos + 1', going
+       backwards from the instructions that reach Match right away.
+       If 'seedMatch' is not set, empty matches at 'pos' are ignored. */
+    void fill(size_t pos, uint64_t * row, const uint64_t * next, bool seedMatch) const
+    {
+        std::vector<uint32_t> todo;
+
+        auto set = [&](uint32_t pc) {
+            if (get(row, pc)) return;
+            row[pc / 64] |= (uint64_t) 1 << (pc % 64);
+            todo.push_back(pc);
+        };
+
+        for (uint32_t pc = 0; pc < prog.size(); ++pc) {
+            auto & inst = prog[pc];
+            bool step = false;
+            switch (inst.op) {
+            case Op::Char:
+                step = pos < s.size() && (unsigned char) s[pos] == inst.c;
+                break;
+            case Op::Any:
+                step = pos < s.size();
+                break;
+            case Op::Class:
+                step = pos < s.size() && classes[inst.x][(unsigned char) s[pos]];
+                break;
+            case Op::Match:
+                if (seedMatch) set(pc);
+                break;
+            default:
+                break;
+            }
+            if (step && get(next, pc + 1)) set(pc);
+        }
+
+        while (!todo.empty()) {
+            auto pc = todo.back();
+            todo.pop_back();
+            for (auto p : preds[pc]) {
+                auto op = prog[p].op;
+                if ((op == Op::Bol && pos != 0) || (op == Op::Eol && pos != s.size())) continue;
+                set(p);
+            }
+        }
+    }
+};
+
+
+std::unique_ptr<Regex::Liveness> Regex::liveness(const std::string & s, size_t from) const
+{
+    /* Only needed to decide whether to skip the body of a Loop or
+       Opt. */
+    if (fallback || std::none_of(prog.begin(), prog.end(),
+            [](const Inst & i) { return i.op == Op::Opt || i.op == Op::Loop; }))
+        return nullptr;
+    return std::make_unique<Liveness>(*this, s, from);
+}
+
+
+namespace {
+
+/* The threads of the Pike VM at some position in the subject, in
+   order of decreasing priority. */
+struct Threads
+{
+    size_t nrCaps;
+    std::vector<uint32_t> pcs;
+    std::vector<ptrdiff_t> caps;
+    /* marks[pc] == gen iff the instruction at 'pc' has been visited
+       at this position; marks2[pc] == gen iff a Loop instruction has
+       been visited twice. */
+    std::vector<uint32_t> marks, marks2;
+    uint32_t gen = 1;
+
+    Threads(size_t progSize, size_t nrCaps)
+        : nrCaps(nrCaps), marks(progSize, 0), marks2(progSize, 0) { }
+
+    void clear()
+    {
+        pcs.clear();
+        caps.clear();
+        gen++;
+    }
+};
+
+struct Frame
+{
+    uint32_t pc;
+    bool restore; // if set, restore caps['slot'] to 'old'
+    uint32_t slot;
+    ptrdiff_t old;
+};
+
+}
+
+
+bool Regex::run(const std::string & s, size_t from, Submatches & m, int flags,
+    const Liveness * live) const
+{
+    size_t nrCaps = 2 * (nrGroups + 1);
+    Threads clist(prog.size(), nrCaps), nlist(prog.size(), nrCaps);
+    std::vector<ptrdiff_t> caps(nrCaps);
+    std::vector<Frame> stack;
+    bool found = false;
+
+    /* Add a thread at 'pc0' at position 'pos' to 'list', following
+       all the instructions that don't consume input, in order of
+       priority.  'row' is the liveness of the instructions at 'pos',
+       if any. */
+    auto addThread = [&](Threads & list, uint32_t pc0, size_t pos, const uint64_t * row) {
+        stack.push_back({pc0, false, 0, 0});
+        while (!stack.empty()) {
+            auto f = stack.back();
+            stack.pop_back();
+            if (f.restore) { caps[f.slot] = f.old; continue; }
+            auto & inst = prog[f.pc];
+            if (list.marks[f.pc] != list.gen)
+                list.marks[f.pc] = list.gen;
+            else if (inst.op >= Op::Split && inst.op <= Op::Eol && list.marks2[f.pc] != list.gen)
+                list.marks2[f.pc] = list.gen;
+            else
+                continue;
+            switch (inst.op) {
+            case Op::Jump:
+                stack.push_back({inst.x, false, 0, 0});
+                break;
+            case Op::Split:
+                stack.push_back({inst.y, false, 0, 0});
+                stack.push_back({inst.x, false, 0, 0});
+                break;
+            case Op::Opt:
+            case Op::Loop:
+                if (!row || !Liveness::get(row, inst.x))
+                    stack.push_back({inst.y, false, 0, 0});
+                stack.push_back({inst.x, false, 0, 0});
+                break;
+            case Op::Save:
+                stack.push_back({0, true, inst.x, caps[inst.x]});
+                caps[inst.x] = pos;
+                stack.push_back({f.pc + 1, false, 0, 0});
+                break;
+            case Op::Bol:
+                if (pos == 0) stack.push_back({f.pc + 1, false, 0, 0});
+                break;
+            case Op::Eol:
+                if (pos == s.size()) stack.push_back({f.pc + 1, false, 0, 0});
+                break;
+            default:
+                list.pcs.push_back(f.pc);
+                list.caps.insert(list.caps.end(), caps.begin(), caps.end());
+            }
+        }
+    };
+
+    for (size_t pos = from; ; ++pos) {
+
+        /* Start a new thread at this position, with the lowest
+           priority, unless we already have a match (which would be
+           further to the left). */
+        if (!found && (pos == from || !(flags & flagContinuous))) {
+            std::fill(caps.begin(), caps.end(), -1);
+            if (live && (flags & flagNotNull)) {
+                /* This thread can't end with an empty match. */
+                std::vector<uint64_t> row(live->words);
+                if (pos < s.size()) live->fill(pos, row.data(), live->row(pos + 1), false);
+                addThread(clist, 0, pos, row.data());
+            } else
+                addThread(clist, 0, pos, live ? live->row(pos) : nullptr);
+        }
+
+        if (clist.pcs.empty() && (found || (flags & flagContinuous))) break;
+
+        for (size_t i = 0; i < clist.pcs.size(); ++i) {
+            const ptrdiff_t * tcaps = &clist.caps[i * nrCaps];
+
+            /* Threads that started to the right of the current match
+               can't beat it. */
+            if (found && tcaps[0] > m[0]) continue;
+
+            auto & inst = prog[clist.pcs[i]];
+            bool step = false;
+
+            switch (inst.op) {
+            case Op::Char:
+                step = pos < s.size() && (unsigned char) s[pos] == inst.c;
+                break;
+            case Op::Any:
+                step = pos < s.size();
+                break;
+            case Op::Class:
+                step = pos < s.size() && classes[inst.x][(unsigned char) s[pos]];
+                break;
+            case Op::Match:
+                if ((flags & flagFull) && pos != s.size()) break;
+                if ((flags & flagNotNull) && tcaps[0] == (ptrdiff_t) pos) break;
+                if (!found || tcaps[0] < m[0] || (tcaps[0] == m[0] && tcaps[1] > m[1])) {
+                    m.assign(tcaps, tcaps + nrCaps);
+                    found = true;
+                }
+                break;
+            default:
+                abort();
+            }
+
+            if (step) {
+                std::copy(tcaps, tcaps + nrCaps, caps.begin());
+                addThread(nlist, clist.pcs[i] + 1, pos + 1, live ? live->row(pos + 1) : nullptr);
+            }
+        }
+
+        if (pos == s.size()) break;
+
+        std::swap(clist, nlist);
+        nlist.clear();
+    }
+
+    return found;
+}
+
+
+}
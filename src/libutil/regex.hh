@@ -0,0 +1,108 @@
+#pragma once
+
+#include "types.hh"
+
+#include <bitset>
+#include <regex>
+
+namespace nix {
+
+
+MakeError(BadRegex, Error);
+MakeError(RegexTooComplex, BadRegex);
+
+
+/* A POSIX extended regular expression, compiled to a program for a
+   Pike VM.  Matching takes time linear in the length of the subject
+   (times the size of the program), and uses no recursion, so unlike
+   std::regex it cannot overflow the stack on long strings.  search()
+   additionally uses a table of one bit per instruction per character
+   of the subject.
+
+   The syntax and submatch semantics are those of
+   std::regex::extended in libstdc++: the match that starts leftmost
+   wins, then the longest one (among those that libstdc++ considers;
+   see Op below), and among those the one that prefers earlier
+   alternatives and longer repetitions.  POSIX extended regular
+   expressions have no back-references, which is what makes a linear
+   time engine possible.
+
+   The VM doesn't reproduce libstdc++'s submatches for repetitions of
+   a body that can match the empty string (like '(a*)*'), or support
+   named collating elements (like '[[.hyphen.]]').  Such expressions
+   are matched by std::regex instead. */
+class Regex
+{
+public:
+
+    /* The begin and end offsets of the whole match, followed by those
+       of every parenthesised group, or -1 for groups that didn't
+       participate in the match. */
+    typedef std::vector<ptrdiff_t> Submatches;
+
+    /* Compile 're'.  Throws BadRegex if it's not a valid regular
+       expression. */
+    Regex(const std::string & re);
+
+    /* The number of parenthesised groups. */
+    size_t groups() const { return nrGroups; }
+
+    /* Match the entire string 's'. */
+    bool match(const std::string & s, Submatches & m) const;
+
+    /* Find the first match in 's' that starts at or after 'from'.  If
+       'notNull' is set, empty matches are ignored; if 'continuous' is
+       set, the match must start at 'from'.  '^' only matches at the
+       start of 's'. */
+    bool search(const std::string & s, size_t from, Submatches & m,
+        bool notNull = false, bool continuous = false) const;
+
+    /* Find all matches in 's', like std::sregex_iterator: after an
+       empty match, look for a non-empty match at the same position
+       before moving on to the next one. */
+    std::vector<Submatches> searchAll(const std::string & s) const;
+
+    /* A Loop is a Split at the head or tail of an unbounded
+       repetition.  Like in libstdc++, it may be entered twice at the
+       same position, so that a greedy repetition prefers to end with
+       an empty iteration (which matters for submatches).  An Opt is a
+       Split that skips an optional copy of the body of a bounded
+       repetition.
+
+       Loop and Opt are greedy: like libstdc++'s depth-first search,
+       search() only skips the body if no match can be found by
+       entering it, even if skipping it would give a longer match. */
+    enum class Op : uint8_t { Char, Any, Class, Split, Opt, Loop, Jump, Save, Bol, Eol, Match };
+
+    struct Inst
+    {
+        Op op;
+        unsigned char c; // for Char
+        uint32_t x, y; // class index, jump targets or submatch slot
+    };
+
+private:
+
+    std::vector<Inst> prog;
+    std::vector<std::bitset<256>> classes;
+    size_t nrGroups = 0;
+
+    std::shared_ptr<std::regex> fallback;
+
+    enum { flagFull = 1, flagNotNull = 2, flagContinuous = 4 };
+
+    /* For every position in a subject, the instructions from which
+       the rest of the subject has a match. */
+    struct Liveness;
+
+    std::unique_ptr<Liveness> liveness(const std::string & s, size_t from) const;
+
+    bool search(const std::string & s, size_t from, Submatches & m,
+        bool notNull, bool continuous, const Liveness * live) const;
+
+    bool run(const std::string & s, size_t from, Submatches & m, int flags,
+        const Liveness * live) const;
+};
+
+
+}
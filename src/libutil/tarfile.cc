@@ -0,0 +1,415 @@
+#include "tarfile.hh"
+#include "compression.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string_view>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const size_t blockSize = 512;
+
+/* Offsets and sizes of the fields in a ustar header block. */
+namespace field {
+    const size_t name = 0, nameLen = 100;
+    const size_t mode = 100, modeLen = 8;
+    const size_t size = 124, sizeLen = 12;
+    const size_t checksum = 148, checksumLen = 8;
+    const size_t type = 156;
+    const size_t linkName = 157, linkNameLen = 100;
+    const size_t magic = 257;
+    const size_t prefix = 345, prefixLen = 155;
+}
+
+/* Don't read more than this amount of metadata (GNU long names, pax
+   headers) into memory. */
+static const uint64_t maxMetadataSize = 1024 * 1024;
+
+
+static std::string getString(const unsigned char * block, size_t offset, size_t len)
+{
+    auto s = (const char *) block + offset;
+    return std::string(s, strnlen(s, len));
+}
+
+
+static uint64_t getNumber(const unsigned char * block, size_t offset, size_t len)
+{
+    auto p = block + offset, end = p + len;
+
+    /* GNU tar uses a base-256 encoding for numbers that don't fit in
+       the octal field. */
+    if (*p & 0x80) {
+        if (*p != 0x80)
+            throw TarError("tar archive contains an unsupported number");
+        uint64_t n = 0;
+        for (p++; p < end; p++) {
+            if (n >> 56) throw TarError("tar archive contains a number that is too large");
+            n = (n << 8) | *p;
+        }
+        return n;
+    }
+
+    while (p < end && (*p == ' ' || *p == 0)) p++;
+
+    uint64_t n = 0;
+    for (; p < end && *p != ' ' && *p != 0; p++) {
+        if (*p < '0' || *p > '7')
+            throw TarError("tar archive contains an invalid number");
+        if (n >> 61) throw TarError("tar archive contains a number that is too large");
+        n = (n << 3) | (*p - '0');
+    }
+    return n;
+}
+
+
+static bool checksumMatches(const unsigned char * block)
+{
+    uint64_t expected;
+    try {
+        expected = getNumber(block, field::checksum, field::checksumLen);
+    } catch (TarError &) {
+        return false;
+    }
+
+    /* The checksum is computed with the checksum field set to
+       spaces. Some old tars summed signed chars. */
+    uint64_t sum = 0;
+    int64_t signedSum = 0;
+    for (size_t i = 0; i < blockSize; i++) {
+        bool inField = i >= field::checksum && i < field::checksum + field::checksumLen;
+        unsigned char c = inField ? ' ' : block[i];
+        sum += c;
+        signedSum += (signed char) c;
+    }
+
+    return sum == expected || (uint64_t) signedSum == expected;
+}
+
+
+static size_t padding(uint64_t size)
+{
+    return (blockSize - size % blockSize) % blockSize;
+}
+
+
+struct TarUnpacker
+{
+    Source & source;
+    Path destDir;
+    unsigned int stripComponents;
+
+    /* Directories below ‘destDir’ that we have created or verified
+       not to be symlinks. */
+    std::set<Path> knownDirs;
+
+    std::vector<unsigned char> buf;
+
+    TarUnpacker(Source & source, const Path & destDir, unsigned int stripComponents)
+        : source(source), destDir(destDir), stripComponents(stripComponents), buf(64 * 1024)
+    { }
+
+    void skip(uint64_t len)
+    {
+        while (len) {
+            auto n = std::min((uint64_t) buf.size(), len);
+            source(buf.data(), n);
+            len -= n;
+        }
+    }
+
+    std::string readData(uint64_t size)
+    {
+        if (size > maxMetadataSize)
+            throw TarError("tar archive contains an oversized header");
+        std::string s(size, 0);
+        source((unsigned char *) s.data(), size);
+        skip(padding(size));
+        return s;
+    }
+
+    /* Turn the path ‘name’ from the archive into a path relative to
+       ‘destDir’, or return an empty string if all of it is
+       stripped. */
+    Path relPath(const std::string & name)
+    {
+        Path res;
+        unsigned int n = 0;
+        for (auto & c : tokenizeString<Strings>(name, "/")) {
+            if (c == ".") continue;
+            if (c == "..")
+                throw TarError("tar archive contains the illegal path '%s'", name);
+            if (n++ < stripComponents) continue;
+            res += (res.empty() ? "" : "/") + c;
+        }
+        return res;
+    }
+
+    /* Remove any existing file at ‘path’, forgetting about any
+       directories below it. */
+    void removeExisting(const Path & path)
+    {
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1) {
+            if (errno == ENOENT) return;
+            throw SysError("getting status of '%s'", path);
+        }
+        deletePath(path);
+        knownDirs.erase(path);
+        knownDirs.erase(knownDirs.lower_bound(path + "/"), knownDirs.lower_bound(path + "0"));
+    }
+
+    /* Make sure that the parent directories of ‘rel’ are real
+       directories, so that we don't write outside of ‘destDir’ by
+       following a symlink from the archive. */
+    void ensureParents(const Path & rel)
+    {
+        auto slash = rel.find('/');
+        while (slash != std::string::npos) {
+            Path dir = destDir + "/" + std::string(rel, 0, slash);
+            if (!knownDirs.count(dir)) {
+                struct stat st;
+                if (lstat(dir.c_str(), &st) == -1) {
+                    if (errno != ENOENT)
+                        throw SysError("getting status of '%s'", dir);
+                    if (mkdir(dir.c_str(), 0755) == -1)
+                        throw SysError("creating directory '%s'", dir);
+                } else if (!S_ISDIR(st.st_mode))
+                    throw TarError("tar archive member '%s' is below a non-directory", rel);
+                knownDirs.insert(dir);
+            }
+            slash = rel.find('/', slash + 1);
+        }
+    }
+
+    void createRegularFile(const Path & path, uint64_t size, bool executable)
+    {
+        removeExisting(path);
+
+        AutoCloseFD fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW,
+            executable ? 0755 : 0644);
+        if (!fd) throw SysError("creating file '%s'", path);
+
+        uint64_t left = size;
+        while (left) {
+            auto n = std::min((uint64_t) buf.size(), left);
+            source(buf.data(), n);
+            writeFull(fd.get(), buf.data(), n);
+            left -= n;
+        }
+
+        skip(padding(size));
+    }
+
+    void createDirectory(const Path & path)
+    {
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+            removeExisting(path);
+            if (mkdir(path.c_str(), 0755) == -1)
+                throw SysError("creating directory '%s'", path);
+        }
+        knownDirs.insert(path);
+    }
+
+    void unpack()
+    {
+        std::string longName, longLinkName;
+        std::map<std::string, std::string> pax;
+        bool first = true;
+
+        while (true) {
+            checkInterrupt();
+
+            unsigned char block[blockSize];
+
+            /* Like GNU tar, accept archives that end without a
+               zero block. */
+            try {
+                source(block, 1);
+            } catch (EndOfFile &) {
+                break;
+            }
+
+            /* If the input doesn't even start with a tar header,
+               it's probably compressed in a format that we don't
+               decode ourselves (e.g. zstd or lzip). Let the caller
+               fall back to an external tar. */
+            try {
+                source(block + 1, blockSize - 1);
+            } catch (EndOfFile &) {
+                if (first) throw UnsupportedTarball("not a tar archive");
+                throw;
+            }
+
+            if (std::all_of(block, block + blockSize, [](unsigned char c) { return c == 0; }))
+                break;
+
+            if (!checksumMatches(block)) {
+                if (first) throw UnsupportedTarball("not a tar archive");
+                throw TarError("tar archive is corrupt (header checksum mismatch)");
+            }
+
+            first = false;
+
+            char type = block[field::type];
+
+            uint64_t size = getNumber(block, field::size, field::sizeLen);
+            auto i = pax.find("size");
+            if (i != pax.end() && type != 'x' && type != 'g') {
+                if (!string2Int(i->second, size))
+                    throw TarError("tar archive contains an invalid pax size '%s'", i->second);
+            }
+
+            if (type == 'L') { longName = readData(size); longName = longName.c_str(); continue; }
+            if (type == 'K') { longLinkName = readData(size); longLinkName = longLinkName.c_str(); continue; }
+            if (type == 'g') { skip(size + padding(size)); continue; }
+
+            if (type == 'x' || type == 'X') {
+                auto data = readData(size);
+                std::string_view s(data);
+                while (!s.empty()) {
+                    /* Records have the form "<len> <key>=<value>\n",
+                       where <len> includes itself. */
+                    auto sp = s.find(' ');
+                    size_t len;
+                    if (sp == s.npos || !string2Int(std::string(s.substr(0, sp)), len)
+                        || len <= sp + 1 || len > s.size() || s[len - 1] != '\n')
+                        throw TarError("tar archive contains an invalid pax header");
+                    auto record = s.substr(sp + 1, len - sp - 2);
+                    auto eq = record.find('=');
+                    if (eq == record.npos)
+                        throw TarError("tar archive contains an invalid pax header");
+                    pax[std::string(record.substr(0, eq))] = std::string(record.substr(eq + 1));
+                    s.remove_prefix(len);
+                }
+                continue;
+            }
+
+            std::string name;
+            if (!longName.empty())
+                name = longName;
+            else if (pax.count("path"))
+                name = pax["path"];
+            else {
+                name = getString(block, field::name, field::nameLen);
+                if (memcmp(block + field::magic, "ustar", 5) == 0) {
+                    auto prefix = getString(block, field::prefix, field::prefixLen);
+                    if (!prefix.empty()) name = prefix + "/" + name;
+                }
+            }
+
+            std::string linkName =
+                !longLinkName.empty() ? longLinkName
+                : pax.count("linkpath") ? pax["linkpath"]
+                : getString(block, field::linkName, field::linkNameLen);
+
+            longName.clear();
+            longLinkName.clear();
+            pax.clear();
+
+            /* Hard links, symlinks and directories have no contents,
+               but skip whatever the size field claims. */
+            auto skipData = [&]() { skip(size + padding(size)); };
+
+            auto rel = relPath(name);
+            if (rel.empty()) { skipData(); continue; }
+
+            ensureParents(rel);
+            Path path = destDir + "/" + rel;
+
+            /* Old tars mark directories with a trailing slash. */
+            if ((type == '0' || type == 0) && hasSuffix(name, "/"))
+                type = '5';
+
+            switch (type) {
+
+            case '1': {
+                auto target = relPath(linkName);
+                skipData();
+                if (target.empty()) continue;
+                ensureParents(target);
+                removeExisting(path);
+                if (linkat(AT_FDCWD, (destDir + "/" + target).c_str(), AT_FDCWD, path.c_str(), 0) == -1)
+                    throw SysError("creating hard link from '%s' to '%s'", path, target);
+                break;
+            }
+
+            case '2':
+                skipData();
+                removeExisting(path);
+                createSymlink(linkName, path);
+                break;
+
+            case '5':
+                skipData();
+                createDirectory(path);
+                break;
+
+            case '3': case '4': case '6':
+                throw TarError("tar archive member '%s' is a device or FIFO, which is not supported", name);
+
+            case 'S':
+                throw TarError("tar archive member '%s' is a sparse file, which is not supported", name);
+
+            case 'V':
+                skipData();
+                break;
+
+            default:
+                /* POSIX says to treat unknown types (including
+                   contiguous files) as regular files. */
+                createRegularFile(path, size,
+                    getNumber(block, field::mode, field::modeLen) & S_IXUSR);
+                break;
+            }
+        }
+
+        /* Consume any trailing blocks so that the producer of
+           ‘source’ runs to completion. */
+        try {
+            while (true) source.read(buf.data(), buf.size());
+        } catch (EndOfFile &) {
+        }
+    }
+};
+
+
+void unpackTarfile(Source & source, const Path & destDir, unsigned int stripComponents)
+{
+    try {
+        TarUnpacker(source, destDir, stripComponents).unpack();
+    } catch (EndOfFile &) {
+        throw TarError("tar archive is truncated");
+    }
+}
+
+
+void unpackTarfile(const Path & tarFile, const Path & destDir, unsigned int stripComponents)
+{
+    auto source = sinkToSource([&](Sink & sink) {
+        auto decompressor = makeDecompressionSink("auto", sink);
+        readFile(tarFile, *decompressor);
+        decompressor->finish();
+    });
+    try {
+        unpackTarfile(*source, destDir, stripComponents);
+    } catch (UnsupportedTarball &) {
+        /* Nothing has been written to ‘destDir’ yet, so let tar
+           have a go at it; it knows about other compression
+           methods such as zstd, lzip and lzma. */
+        debug("unpacking '%s' using tar", tarFile);
+        runProgram("tar", true, {"xf", tarFile, "-C", destDir,
+            "--strip-components", std::to_string(stripComponents)});
+    }
+}
+
+}
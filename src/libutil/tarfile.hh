@@ -0,0 +1,29 @@
+#pragma once
+
+#include "types.hh"
+#include "serialise.hh"
+
+namespace nix {
+
+MakeError(TarError, Error);
+
+/* Thrown by unpackTarfile() if the input doesn't start with a tar
+   header, before anything has been unpacked. */
+MakeError(UnsupportedTarball, TarError);
+
+/* Unpack the (uncompressed) tar archive read from ‘source’ into the
+   existing directory ‘destDir’. The first ‘stripComponents’
+   components of every path in the archive are dropped, like GNU
+   tar's ‘--strip-components’. Only regular files, directories,
+   symlinks and hard links are supported. Paths that would end up
+   outside of ‘destDir’ are rejected. */
+void unpackTarfile(Source & source, const Path & destDir,
+    unsigned int stripComponents = 0);
+
+/* Unpack the tarball ‘tarFile’, which may be compressed using xz,
+   gzip or bzip2. Tarballs in any other format are handed to an
+   external ‘tar’. */
+void unpackTarfile(const Path & tarFile, const Path & destDir,
+    unsigned int stripComponents = 0);
+
+}
@@ -267,15 +267,17 @@ static void _main(int argc, char * * argv)
 
     DrvInfos drvs;
 
-    /* Parse the expressions. */
-    std::vector<Expr *> exprs;
+    /* Parse the expressions, together with the identifiers under
+       which their attributes are stored in the evaluation cache. */
+    std::vector<std::pair<Expr *, string>> exprs;
 
     if (readStdin)
-        exprs = {state->parseStdin()};
+        exprs = {{state->parseStdin(), ""}};
     else
         for (auto i : left) {
             if (fromArgs)
-                exprs.push_back(state->parseExprFromString(i, absPath(".")));
+                exprs.emplace_back(state->parseExprFromString(i, absPath(".")),
+                    "expr:" + absPath(".") + ":" + i);
             else {
                 auto absolute = i;
                 try {
@@ -283,25 +285,35 @@ static void _main(int argc, char * * argv)
                 } catch (Error e) {};
                 if (store->isStorePath(absolute) && std::regex_match(absolute, std::regex(".*\\.drv(!.*)?")))
                 drvs.push_back(DrvInfo(*state, store, absolute));
-            else
+            else {
                 /* If we're in a #! script, interpret filenames
                    relative to the script. */
-                exprs.push_back(state->parseExprFromFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state,
-                    inShebang && !packages ? absPath(i, absPath(dirOf(script))) : i)))));
+                Path path = resolveExprPath(state->checkSourcePath(lookupFileArg(*state,
+                    inShebang && !packages ? absPath(i, absPath(dirOf(script))) : i)));
+                if (state->trackAccesses) state->recordAccess(path);
+                exprs.emplace_back(state->parseExprFromFile(path), "file:" + path);
+            }
             }
         }
 
     /* Evaluate them into derivations. */
     if (attrPaths.empty()) attrPaths = {""};
 
-    for (auto e : exprs) {
+    for (auto & e : exprs) {
         Value vRoot;
-        state->eval(e, vRoot);
+        state->eval(e.first, vRoot);
+
+        auto cache = std::make_shared<AttrPathCache>(*state, e.second, autoArgs);
 
         for (auto & i : attrPaths) {
             Value & v(*findAlongAttrPath(*state, i, autoArgs, vRoot));
             state->forceValue(v);
-            getDerivations(*state, v, "", autoArgs, drvs, false);
+            DrvInfos drvs2;
+            getDerivations(*state, v, i, autoArgs, drvs2, false);
+            for (auto & drv : drvs2) {
+                drv.setCache(cache);
+                drvs.push_back(drv);
+            }
         }
     }
 
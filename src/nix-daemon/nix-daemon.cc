@@ -235,7 +235,7 @@ struct RetrieveRegularNARSink : ParseSink
 
 
 static void performOp(TunnelLogger * logger, ref<Store> store,
-    bool trusted, unsigned int clientVersion,
+    bool trusted, unsigned int clientVersion, unsigned int clientFeatures,
     Source & from, Sink & to, unsigned int op)
 {
     switch (op) {
@@ -338,6 +338,17 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryDerivationHash: {
+        if (!(clientFeatures & PROTOCOL_FEATURE_DRV_HASHES))
+            throw Error(format("invalid operation %1%") % op);
+        Path path = readStorePath(*store, from);
+        logger->startWork();
+        auto hash = store->queryDerivationHash(path);
+        logger->stopWork();
+        to << (hash ? hash->to_string(Base16) : "");
+        break;
+    }
+
     case wopAddToStore: {
         bool fixed, recursive;
         std::string s, baseName;
@@ -385,6 +396,32 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddTextsToStore: {
+        if (!(clientFeatures & PROTOCOL_FEATURE_ADD_TEXTS))
+            throw Error(format("invalid operation %1%") % op);
+        struct Text
+        {
+            string suffix, s;
+            PathSet refs;
+        };
+        std::vector<Text> texts;
+        auto n = readNum<size_t>(from);
+        while (n--) {
+            Text text;
+            text.suffix = readString(from);
+            text.s = readString(from);
+            text.refs = readStorePaths<PathSet>(*store, from);
+            texts.push_back(std::move(text));
+        }
+        logger->startWork();
+        Paths paths;
+        for (auto & i : texts)
+            paths.push_back(store->addTextToStore(i.suffix, i.s, i.refs, NoRepair));
+        logger->stopWork();
+        to << paths;
+        break;
+    }
+
     case wopExportPath: {
         Path path = readStorePath(*store, from);
         readInt(from); // obsolete
@@ -749,9 +786,11 @@ static void processConnection(bool trusted)
     /* Exchange the greeting. */
     unsigned int magic = readInt(from);
     if (magic != WORKER_MAGIC_1) throw Error("protocol mismatch");
-    to << WORKER_MAGIC_2 << PROTOCOL_VERSION;
+    to << WORKER_MAGIC_2 << (PROTOCOL_VERSION | PROTOCOL_FEATURES);
     to.flush();
     unsigned int clientVersion = readInt(from);
+    unsigned int clientFeatures = clientVersion & PROTOCOL_FEATURES_MASK;
+    clientVersion &= ~PROTOCOL_FEATURES_MASK;
 
     if (clientVersion < 0x10a)
         throw Error("the Nix client version is too old");
@@ -810,7 +849,7 @@ static void processConnection(bool trusted)
             opCount++;
 
             try {
-                performOp(tunnelLogger, store, trusted, clientVersion, from, to, op);
+                performOp(tunnelLogger, store, trusted, clientVersion, clientFeatures, from, to, op);
             } catch (Error & e) {
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
@@ -988,6 +1027,25 @@ static void daemonLoop(char * * argv)
 
     closeOnExec(fdSocket.get());
 
+    /* Run the incremental garbage collector in a child process. */
+    if (settings.gcIncremental) {
+        ProcessOptions options;
+        options.errorPrefix = "incremental garbage collector: ";
+        options.dieWithParent = true;
+        options.runExitHandlers = true;
+        options.allowVfork = false;
+        startProcess([&]() {
+            fdSocket = -1;
+
+            setSigChldAction(false);
+
+            auto store = openStore().dynamic_pointer_cast<LocalStore>();
+            if (!store)
+                throw Error("incremental garbage collection requires a local store");
+            store->runIncrementalGC();
+        }, options);
+    }
+
     /* Loop accepting connections. */
     while (1) {
 
@@ -183,6 +183,9 @@ static void loadDerivations(EvalState & state, Path nixExprPath,
 
     getDerivations(state, v, pathPrefix, autoArgs, elems, true);
 
+    auto cache = std::make_shared<AttrPathCache>(state, "file:" + nixExprPath, autoArgs);
+    for (auto & i : elems) i.setCache(cache);
+
     /* Filter out all derivations not applicable to the current
        system. */
     for (DrvInfos::iterator i = elems.begin(), j; i != elems.end(); i = j) {
@@ -944,6 +947,21 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     DrvInfos & otherElems(source == sInstalled ? availElems : installedElems);
 
 
+    /* Compute the requested columns in parallel, if enabled.  This
+       is done before sorting, so that the derivations are evaluated
+       in attribute order, and on 'elems_', so that the computed meta
+       attributes remain visible to the garbage collector. */
+    DrvInfoQuery query;
+    query.system = xmlOutput || jsonOutput || printSystem;
+    query.drvPath = printDrvPath;
+    query.outPath = printStatus || globals.prebuiltOnly;
+    query.outputs = printOutPath && !jsonOutput;
+    bool allMeta = (printMeta && xmlOutput) || jsonOutput;
+    query.meta = allMeta || printDescription;
+    if (!allMeta && printDescription) query.metaNames = {"description"};
+    queryDrvInfos(*globals.state, elems_, query, evalSettings.evalWorkers);
+
+
     /* Sort them by name. */
     /* !!! */
     vector<DrvInfo> elems;
@@ -1412,6 +1430,10 @@ static int _main(int argc, char * * argv)
 
         auto store = openStore();
 
+        /* The derivations written during evaluation are flushed
+           below. */
+        store->deferWrites();
+
         globals.state = std::shared_ptr<EvalState>(new EvalState(myArgs.searchPath, store));
         globals.state->repair = repair;
 
@@ -1432,6 +1454,8 @@ static int _main(int argc, char * * argv)
 
         op(globals, opFlags, opArgs);
 
+        store->flushWrites();
+
         globals.state->printStats();
 
         return 0;
@@ -26,20 +26,55 @@ static bool indirectRoot = false;
 enum OutputKind { okPlain, okXML, okJSON };
 
 
+static void printResult(EvalState & state, Value & vRes,
+    bool strict, OutputKind output, bool location)
+{
+    PathSet context;
+    if (output == okXML)
+        printValueAsXML(state, strict, location, vRes, std::cout, context);
+    else if (output == okJSON)
+        printValueAsJSON(state, strict, vRes, std::cout, context);
+    else {
+        if (strict) state.forceValueDeep(vRes);
+        std::cout << vRes << std::endl;
+    }
+    if (strict) state.writeHeapSnapshot(vRes);
+}
+
+
+/* Evaluate the attribute paths 'attrPaths' in the expression 'e'.
+   'exprId' uniquely identifies 'e' (e.g. its file name) for the
+   purpose of the evaluation cache; if empty, the cache is not
+   used. */
 void processExpr(EvalState & state, const Strings & attrPaths,
     bool parseOnly, bool strict, Bindings & autoArgs,
-    bool evalOnly, OutputKind output, bool location, Expr * e)
+    bool evalOnly, OutputKind output, bool location, Expr * e,
+    const string & exprId = "")
 {
     if (parseOnly) {
         std::cout << format("%1%\n") % *e;
         return;
     }
 
-    Value vRoot;
-    state.eval(e, vRoot);
+    auto cache = std::make_shared<AttrPathCache>(state, exprId, autoArgs);
+
+    std::optional<Value> vRoot;
 
     for (auto & i : attrPaths) {
-        Value & v(*findAlongAttrPath(state, i, autoArgs, vRoot));
+        if (evalOnly) {
+            Value vRes;
+            if (cache->lookup(i, vRes)) {
+                printResult(state, vRes, strict, output, location);
+                continue;
+            }
+        }
+
+        if (!vRoot) {
+            vRoot.emplace();
+            state.eval(e, *vRoot);
+        }
+
+        Value & v(*findAlongAttrPath(state, i, autoArgs, *vRoot));
         state.forceValue(v);
 
         PathSet context;
@@ -49,17 +84,18 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                 vRes = v;
             else
                 state.autoCallFunction(autoArgs, v, vRes);
-            if (output == okXML)
-                printValueAsXML(state, strict, location, vRes, std::cout, context);
-            else if (output == okJSON)
-                printValueAsJSON(state, strict, vRes, std::cout, context);
-            else {
-                if (strict) state.forceValueDeep(vRes);
-                std::cout << vRes << std::endl;
-            }
+            printResult(state, vRes, strict, output, location);
+            cache->insert(i, vRes);
         } else {
             DrvInfos drvs;
-            getDerivations(state, v, "", autoArgs, drvs, false);
+            getDerivations(state, v, i, autoArgs, drvs, false);
+            for (auto & i : drvs) i.setCache(cache);
+
+            /* Instantiate the derivations in parallel, if enabled. */
+            DrvInfoQuery query;
+            query.drvPath = true;
+            queryDrvInfos(state, drvs, query, evalSettings.evalWorkers);
+
             for (auto & i : drvs) {
                 Path drvPath = i.queryDrvPath();
 
@@ -156,6 +192,10 @@ static int _main(int argc, char * * argv)
 
         auto store = openStore();
 
+        /* The derivations written during evaluation are flushed
+           below. */
+        store->deferWrites();
+
         auto state = std::make_unique<EvalState>(myArgs.searchPath, store);
         state->repair = repair;
 
@@ -180,13 +220,25 @@ static int _main(int argc, char * * argv)
             files.push_back("./default.nix");
 
         for (auto & i : files) {
-            Expr * e = fromArgs
-                ? state->parseExprFromString(i, absPath("."))
-                : state->parseExprFromFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state, i))));
+            Expr * e;
+            string exprId;
+            if (fromArgs) {
+                e = state->parseExprFromString(i, absPath("."));
+                exprId = "expr:" + absPath(".") + ":" + i;
+            } else {
+                Path path = resolveExprPath(state->checkSourcePath(lookupFileArg(*state, i)));
+                if (state->trackAccesses) state->recordAccess(path);
+                e = state->parseExprFromFile(path);
+                exprId = "file:" + path;
+            }
             processExpr(*state, attrPaths, parseOnly, strict, autoArgs,
-                evalOnly, outputKind, xmlOutputSourceLocation, e);
+                evalOnly, outputKind, xmlOutputSourceLocation, e, exprId);
         }
 
+        /* Make sure that the derivations we printed are valid, and
+           report any errors in writing them. */
+        store->flushWrites();
+
         state->printStats();
 
         return 0;
@@ -556,15 +556,19 @@ static void opCheckValidity(Strings opFlags, Strings opArgs)
         if (i == "--print-invalid") printInvalid = true;
         else throw UsageError(format("unknown flag '%1%'") % i);
 
-    for (auto & i : opArgs) {
-        Path path = store->followLinksToStorePath(i);
-        if (!store->isValidPath(path)) {
+    Paths paths;
+    for (auto & i : opArgs)
+        paths.push_back(store->followLinksToStorePath(i));
+
+    auto valid = store->queryValidPaths(PathSet(paths.begin(), paths.end()));
+
+    for (auto & path : paths)
+        if (!valid.count(path)) {
             if (printInvalid)
                 cout << format("%1%\n") % path;
             else
                 throw Error(format("path '%1%' is not valid") % path);
         }
-    }
 }
 
 
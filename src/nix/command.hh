@@ -84,6 +84,10 @@ struct SourceExprCommand : virtual Args, StoreCommand, MixEvalArgs
        = import ...; bla = import ...; }’. */
     Value * getSourceExpr(EvalState & state);
 
+    /* Return the identifier under which the attributes of the source
+       expression are stored in the evaluation cache. */
+    std::string getSourceExprId(EvalState & state);
+
     ref<EvalState> getEvalState();
 
 private:
@@ -67,9 +67,11 @@ struct CmdEval : MixJSON, InstallableCommand
         } else if (json) {
             JSONPlaceholder jsonOut(std::cout);
             printValueAsJSON(*state, true, *v, jsonOut, context);
+            state->writeHeapSnapshot(*v);
         } else {
             state->forceValueDeep(*v);
             std::cout << *v << "\n";
+            state->writeHeapSnapshot(*v);
         }
     }
 };
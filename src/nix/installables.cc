@@ -71,6 +71,12 @@ Value * SourceExprCommand::getSourceExpr(EvalState & state)
     return vSourceExpr;
 }
 
+std::string SourceExprCommand::getSourceExprId(EvalState & state)
+{
+    /* The search path is part of the key anyway. */
+    return file != "" ? "file:" + lookupFileArg(state, file) : "nix-path";
+}
+
 ref<EvalState> SourceExprCommand::getEvalState()
 {
     if (!evalState)
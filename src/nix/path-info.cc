@@ -99,8 +99,11 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
 
         else {
 
+            auto infos = store->queryPathInfos(PathSet(storePaths.begin(), storePaths.end()));
+
             for (auto storePath : storePaths) {
-                auto info = store->queryPathInfo(storePath);
+                auto i = infos.find(storePath);
+                auto info = i != infos.end() ? i->second : store->queryPathInfo(storePath);
                 storePath = info->path; // FIXME: screws up padding
 
                 std::cout << storePath;
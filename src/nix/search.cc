@@ -4,6 +4,7 @@
 #include "eval-inline.hh"
 #include "names.hh"
 #include "get-drvs.hh"
+#include "attr-path.hh"
 #include "common-args.hh"
 #include "json.hh"
 #include "json-to-value.hh"
@@ -117,6 +118,8 @@ struct CmdSearch : SourceExprCommand, MixJSON
 
         std::map<std::string, std::string> results;
 
+        auto evalCache = std::make_shared<AttrPathCache>(*state, getSourceExprId(*state), *state->allocBindings(0));
+
         std::function<void(Value *, std::string, bool, JSONObject *)> doExpr;
 
         doExpr = [&](Value * v, std::string attrPath, bool toplevel, JSONObject * cache) {
@@ -137,6 +140,7 @@ struct CmdSearch : SourceExprCommand, MixJSON
                 if (state->isDerivation(*v)) {
 
                     DrvInfo drv(*state, attrPath, v->attrs);
+                    drv.setCache(evalCache);
                     std::string description;
                     std::smatch attrPathMatch;
                     std::smatch descriptionMatch;
@@ -107,8 +107,8 @@ struct CmdWhyDepends : SourceExprCommand
 
         std::map<Path, Node> graph;
 
-        for (auto & path : closure)
-            graph.emplace(path, Node{path, store->queryPathInfo(path)->references});
+        for (auto & i : store->queryPathInfos(closure))
+            graph.emplace(i.first, Node{i.first, i.second->references});
 
         // Transpose the graph.
         for (auto & node : graph)
@@ -0,0 +1,71 @@
+source common.sh
+
+cat > $TEST_ROOT/alloc.nix <<EOF2
+let
+  mkSet = i: { x = i; y = [ i i i ]; };
+  mkSets = n: builtins.genList mkSet n;
+  garbage = builtins.length (builtins.genList (i: { z = i; }) 1000);
+in { sets = mkSets 1000; inherit garbage; }
+EOF2
+
+rm -f $TEST_ROOT/stats.json $TEST_ROOT/snapshot.json
+
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats.json \
+NIX_COUNT_ALLOCS=1 NIX_COUNT_ALLOCS_TOP=3 NIX_HEAP_SNAPSHOT=$TEST_ROOT/snapshot.json \
+    nix-instantiate --eval --strict $TEST_ROOT/alloc.nix > /dev/null
+
+# The report lists the top allocation sites, and 'mkSet' allocated
+# an attribute set and a three-element list for every call.
+nix-instantiate --eval --strict -E "
+  let
+    stats = builtins.fromJSON (builtins.readFile $TEST_ROOT/stats.json);
+    sites = stats.allocations;
+    mkSet = builtins.head (builtins.filter (s: s.line or 0 == 2) sites);
+  in
+    assert builtins.length sites == 3;
+    assert mkSet.file == \"$TEST_ROOT/alloc.nix\" && mkSet.column == 11;
+    assert mkSet.sets == 1000 && mkSet.listElems == 3000;
+    assert mkSet.bytes >= mkSet.values * stats.sizes.Value;
+    true"
+
+# The snapshot attributes the retained objects to 'mkSet', but not to
+# the function whose sets were garbage.
+nix-instantiate --eval --strict -E "
+  let
+    snapshot = builtins.fromJSON (builtins.readFile $TEST_ROOT/snapshot.json);
+    at = line: builtins.filter (s: s.line or 0 == line) snapshot.sites;
+  in
+    assert builtins.length (at 2) == 1 && (builtins.head (at 2)).objects >= 2000;
+    assert at 4 == [];
+    assert builtins.foldl' (n: s: n + s.bytes) 0 snapshot.sites == snapshot.bytes;
+    true"
+
+# Without NIX_COUNT_ALLOCS, there is no report.
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats.json \
+    nix-instantiate --eval --strict $TEST_ROOT/alloc.nix > /dev/null
+(! grep -q '"allocations"' $TEST_ROOT/stats.json)
+
+# The bytecode interpreter attributes the results of '//' and '++' to
+# the operators, like the tree-walking evaluator.
+cat > $TEST_ROOT/alloc-ops.nix <<EOF2
+let
+  f = i:
+    { a = i; } // { b = i; };
+  g = i:
+    [ i ] ++ [ i ];
+in { sets = builtins.genList f 100; lists = builtins.genList g 100; }
+EOF2
+
+for bytecode in false true; do
+    NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats-$bytecode.json \
+    NIX_COUNT_ALLOCS=1 NIX_COUNT_ALLOCS_TOP=100 \
+        nix-instantiate --eval --strict --option eval-bytecode $bytecode $TEST_ROOT/alloc-ops.nix > /dev/null
+    nix-instantiate --eval --strict -E "
+      let
+        sites = (builtins.fromJSON (builtins.readFile $TEST_ROOT/stats-$bytecode.json)).allocations;
+        at = line: builtins.head (builtins.filter (s: s.line or 0 == line) sites);
+      in
+        assert (at 3).sets == 100;
+        assert (at 5).listElems == 200;
+        true"
+done
@@ -0,0 +1,41 @@
+source common.sh
+
+# Attribute lookups in a set that is large enough to be indexed. Each
+# round looks up every attribute once, and tests for two missing ones
+# with '?' and 'or'. The default size only needs to exceed
+# Bindings::indexThreshold (32); NIX_BENCH_ATTRS=100000 and
+# NIX_BENCH_ROUNDS=5 make the timings meaningful.
+n=${NIX_BENCH_ATTRS:-1000}
+rounds=${NIX_BENCH_ROUNDS:-2}
+
+dir=$TEST_ROOT/attr-lookup
+rm -rf $dir
+mkdir -p $dir
+
+cat > $dir/lookup.nix <<EOF2
+{ size }:
+let
+  names = builtins.genList (i: "a\${toString i}") size;
+  set = builtins.listToAttrs (map (name: { inherit name; value = 1; }) names);
+  round = acc: _: builtins.foldl'
+    (acc: name: acc + set.\${name} + (if set ? "x\${name}" then 1 else 0) + (set."y\${name}" or 0))
+    acc names;
+in builtins.foldl' round 0 (builtins.genList (i: i) $rounds)
+EOF2
+
+# Below the index threshold, lookups use binary search. Compare the
+# time per lookup with that of the large set.
+for size in 16 $n; do
+    NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$dir/stats-$size.json \
+        timeCommand "$((rounds * size * 3)) lookups in a set of $size attributes" \
+        nix-instantiate --eval --arg size $size $dir/lookup.nix > $dir/result-$size
+    [[ $(cat $dir/result-$size) = $((rounds * size)) ]]
+done
+
+indexStat() {
+    nix-instantiate --eval -E "(builtins.fromJSON (builtins.readFile $dir/stats-$n.json)).attrsetIndex.$1"
+}
+
+echo "attribute set index: $(indexStat hits) hits, $(indexStat misses) misses"
+(( $(indexStat hits) >= rounds * n ))
+(( $(indexStat misses) >= 2 * rounds * n ))
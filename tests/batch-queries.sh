@@ -0,0 +1,32 @@
+source common.sh
+
+# Batched path info and validity queries ('nix path-info',
+# 'nix-store --check-validity') give the same results as a loop of
+# per-path queries ('nix-store -q --size'), and are timed against it.
+n=${NIX_BENCH_PATHS:-10000}
+
+dir=$TEST_ROOT/batch-queries
+rm -rf $dir
+mkdir -p $dir
+export NIX_REMOTE="local?real=$dir/store&state=$dir/state"
+
+makeSyntheticStore batch $n 1 > $dir/paths
+
+timeCommand "per-path queries of $n paths" \
+    xargs nix-store -q --size < $dir/paths > $dir/sizes-loop
+timeCommand "batched queries of $n paths" \
+    xargs nix path-info --size < $dir/paths > $dir/sizes-batch
+
+awk '{print $2}' < $dir/sizes-batch | diff - $dir/sizes-loop
+[[ $(wc -l < $dir/sizes-batch) = $n ]]
+
+# References come from the batched query as well.
+ref=$(nix path-info --json $(syntheticPath batch 7) | grep -o '"references":\[[^]]*\]')
+[[ $ref = "\"references\":[\"$(syntheticPath batch 14)\",\"$(syntheticPath batch 15)\",\"$(syntheticPath batch 21)\"]" ]]
+
+# Validity checks of valid and invalid paths.
+invalid=$(syntheticPath batch $((n + 1)))
+timeCommand "validity checks of $n paths" \
+    xargs nix-store --check-validity < $dir/paths
+[[ $( (cat $dir/paths; echo $invalid) | xargs nix-store --check-validity --print-invalid) = $invalid ]]
+(! nix-store --check-validity $invalid)
@@ -0,0 +1,31 @@
+source common.sh
+
+# Registering a derivation hashes its input derivations and records the
+# hashes in the database, while the write transaction is open. Check
+# this for a fresh daemon worker and for 'nix-store --load-db'.
+clearStore
+
+startDaemon
+
+drvPath=$(nix-instantiate dependencies.nix)
+nix-store -qR $drvPath | grep -q 'dependencies-input-1\.drv$'
+
+# A client gets the hashes of input derivations that it didn't evaluate
+# itself from the daemon, so it doesn't need to read them.
+input=$(nix-store -qR $drvPath | grep 'dependencies-input-1\.drv$')
+chmod a-r $input
+nix-instantiate -E "with import ./config.nix; mkDerivation {
+  name = \"dependencies-user\";
+  builder = ./dependencies.builder0.sh;
+  input = builtins.appendContext \"\" { \"$input\".outputs = [ \"out\" ]; };
+}"
+chmod a+r $input
+
+killDaemon
+
+nix-store --dump-db > $TEST_ROOT/drv-hashes-db
+
+store="local?state=$TEST_ROOT/drv-hashes-state"
+rm -rf $TEST_ROOT/drv-hashes-state
+NIX_REMOTE=$store nix-store --load-db < $TEST_ROOT/drv-hashes-db
+[[ $(NIX_REMOTE=$store nix-store -qR $drvPath) = $(nix-store -qR $drvPath) ]]
@@ -0,0 +1,16 @@
+with import ./config.nix;
+
+let
+
+  weird = "quote \" backslash \\ newline \n tab \t return \r dollar \${x}";
+
+  mk = n: dep: mkDerivation {
+    name = "drv-parse-${toString n}";
+    builder = builtins.toFile "builder.sh" "mkdir $out";
+    inherit weird dep;
+    flags = builtins.genList (i: "--flag-${toString i}") 20;
+  };
+
+  chain = n: if n == 0 then mk 0 "" else mk n (chain (n - 1));
+
+in chain 1000
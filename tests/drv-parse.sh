@@ -0,0 +1,15 @@
+source common.sh
+
+clearStore
+
+# Parse and unparse a corpus of 1001 derivations.
+drvPath=$(nix-instantiate drv-parse.nix)
+
+timeCommand "parsing 1001 derivations" nix show-derivation -r $drvPath > $TEST_ROOT/drvs.json
+
+drvs="builtins.fromJSON (builtins.readFile $TEST_ROOT/drvs.json)"
+
+[[ $(nix-instantiate --eval -E "builtins.length (builtins.attrNames ($drvs))") = 1001 ]]
+
+# Escaped characters survive unparsing and parsing.
+[[ $(nix-instantiate --eval -E "($drvs).\"$drvPath\".env.weird == (import ./drv-parse.nix).weird") = true ]]
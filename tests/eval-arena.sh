@@ -0,0 +1,22 @@
+source common.sh
+
+# An allocation-heavy evaluation gives the same result with and without
+# the arena. The "cpuTime", "maxRSS" and "arena" statistics of both
+# runs are printed for comparison.
+cat > $TEST_ROOT/arena.nix <<EOF2
+let
+  f = n: { inherit n; a = n + 1; b = [ n n ]; c = { x = n; }; };
+in builtins.foldl' (acc: x: acc + x.a + x.c.x) 0 (builtins.genList f 100000)
+EOF2
+
+for arena in true false; do
+    NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats-$arena.json \
+        nix-instantiate --option eval-arena $arena --eval $TEST_ROOT/arena.nix > $TEST_ROOT/result-$arena
+    grep '"cpuTime"\|"maxRSS"' $TEST_ROOT/stats-$arena.json
+done
+
+[[ $(cat $TEST_ROOT/result-true) = 10000000000 ]]
+cmp $TEST_ROOT/result-true $TEST_ROOT/result-false
+
+grep -q '"arena"' $TEST_ROOT/stats-true.json
+(! grep -q '"arena"' $TEST_ROOT/stats-false.json)
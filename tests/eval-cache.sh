@@ -0,0 +1,83 @@
+source common.sh
+
+clearStore
+
+rm -rf $TEST_HOME/.cache/nix/eval-cache-v1.sqlite
+
+mkdir -p $TEST_ROOT/eval-cache
+cat > $TEST_ROOT/eval-cache/default.nix <<EOF2
+{ x = import ./x.nix; env = builtins.getEnv "EVAL_CACHE_TEST"; set = { a = 1; };
+  link = import ./link.nix; time = builtins.currentTime;
+  searchPath = import <eval-cache/y.nix>; }
+EOF2
+echo '"foo"' > $TEST_ROOT/eval-cache/x.nix
+echo '"target"' > $TEST_ROOT/eval-cache/target.nix
+ln -sfn target.nix $TEST_ROOT/eval-cache/link.nix
+mkdir -p $TEST_ROOT/eval-cache/sp1 $TEST_ROOT/eval-cache/sp2
+echo '"sp2"' > $TEST_ROOT/eval-cache/sp2/y.nix
+export NIX_PATH=eval-cache=$TEST_ROOT/eval-cache/sp1:eval-cache=$TEST_ROOT/eval-cache/sp2
+
+evalCached() {
+    nix-instantiate --option eval-cache true --eval -vvvv $TEST_ROOT/eval-cache "$@"
+}
+
+# The first evaluation populates the cache, the second one uses it.
+[[ $(evalCached -A x 2> $TEST_ROOT/log) == '"foo"' ]]
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+[[ $(evalCached -A x 2> $TEST_ROOT/log) == '"foo"' ]]
+grep -q 'using cached evaluation result' $TEST_ROOT/log
+
+# Changing a file read during evaluation invalidates the entry.
+echo '"barbaz"' > $TEST_ROOT/eval-cache/x.nix
+[[ $(evalCached -A x 2> $TEST_ROOT/log) == '"barbaz"' ]]
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+
+# So does changing an environment variable read by builtins.getEnv.
+[[ $(EVAL_CACHE_TEST=1 evalCached -A env 2> /dev/null) == '"1"' ]]
+[[ $(EVAL_CACHE_TEST=2 evalCached -A env 2> /dev/null) == '"2"' ]]
+
+# Changing the target of a symlink invalidates the entry.
+[[ $(evalCached -A link 2> /dev/null) == '"target"' ]]
+echo '"new target"' > $TEST_ROOT/eval-cache/target.nix
+[[ $(evalCached -A link 2> $TEST_ROOT/log) == '"new target"' ]]
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+
+# A file appearing earlier in the search path invalidates the entry.
+[[ $(evalCached -A searchPath 2> /dev/null) == '"sp2"' ]]
+[[ $(evalCached -A searchPath 2> $TEST_ROOT/log) == '"sp2"' ]]
+grep -q 'using cached evaluation result' $TEST_ROOT/log
+echo '"sp1"' > $TEST_ROOT/eval-cache/sp1/y.nix
+[[ $(evalCached -A searchPath 2> /dev/null) == '"sp1"' ]]
+
+# Results that depend on the current time are never cached.
+evalCached -A time > /dev/null 2>&1
+evalCached -A time 2> $TEST_ROOT/log > /dev/null
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+
+# Non-scalar results are never cached.
+evalCached -A set > /dev/null 2>&1
+evalCached -A set 2> $TEST_ROOT/log > /dev/null
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+
+# Derivation paths are cached as well, and shared between
+# nix-instantiate, nix-build and nix-env.
+cp config.nix $TEST_ROOT/eval-cache/
+cat > $TEST_ROOT/eval-cache/drv.nix <<EOF2
+with import ./config.nix;
+{ drv = mkDerivation { name = "eval-cache-drv"; buildCommand = "mkdir \$out"; }; }
+EOF2
+drvPath=$(nix-instantiate --option eval-cache true -vvvv $TEST_ROOT/eval-cache/drv.nix -A drv 2> $TEST_ROOT/log)
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+[[ $(nix-instantiate --option eval-cache true -vvvv $TEST_ROOT/eval-cache/drv.nix -A drv 2> $TEST_ROOT/log) == $drvPath ]]
+grep -q "using cached evaluation result for attribute path 'drv.drvPath'" $TEST_ROOT/log
+nix-build --option eval-cache true -vvvv --dry-run $TEST_ROOT/eval-cache/drv.nix -A drv 2> $TEST_ROOT/log
+grep -q "using cached evaluation result for attribute path 'drv.drvPath'" $TEST_ROOT/log
+[[ $(nix-env --option eval-cache true -vvvv -f $TEST_ROOT/eval-cache/drv.nix -qa --drv-path 2> $TEST_ROOT/log) =~ $drvPath ]]
+grep -q "using cached evaluation result for attribute path 'drv.drvPath'" $TEST_ROOT/log
+
+# A cached derivation path is not used once the derivation has been
+# garbage-collected.
+nix-store --delete $drvPath
+[[ $(nix-instantiate --option eval-cache true -vvvv $TEST_ROOT/eval-cache/drv.nix -A drv 2> $TEST_ROOT/log) == $drvPath ]]
+(! grep -q 'using cached evaluation result' $TEST_ROOT/log)
+[[ -e $drvPath ]]
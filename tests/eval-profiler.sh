@@ -0,0 +1,32 @@
+source common.sh
+
+cat > $TEST_ROOT/profile.nix <<EOF2
+let
+  fib = n: if n < 2 then n else fib (n - 1) + fib (n - 2);
+  mkSets = n: builtins.genList (i: { x = i; }) n;
+in [ (fib 10) (mkSets 10) ]
+EOF2
+
+rm -f $TEST_ROOT/profile $TEST_ROOT/profile.alloc
+
+nix-instantiate --option eval-profiler flamegraph --option eval-profile-file $TEST_ROOT/profile \
+    --eval --strict $TEST_ROOT/profile.nix
+
+# Every line is a semicolon-separated call stack followed by a weight.
+# Stacks whose weight is zero are omitted, so check the structure in
+# the allocation profile, where every call has a weight: each call of
+# 'fib' allocates an environment. Self times of a few calls can round
+# down to 0 microseconds.
+(! grep -v " [0-9]*$" $TEST_ROOT/profile)
+grep -q "^fib at $TEST_ROOT/profile.nix:2:9 [0-9]*$" $TEST_ROOT/profile.alloc
+grep -q "^fib at $TEST_ROOT/profile.nix:2:9;fib at $TEST_ROOT/profile.nix:2:9;fib at $TEST_ROOT/profile.nix:2:9 [0-9]*$" $TEST_ROOT/profile.alloc
+grep -q "^mkSets at $TEST_ROOT/profile.nix:3:12;primop genList [0-9]*$" $TEST_ROOT/profile.alloc
+
+nix-instantiate --option eval-profiler chrome --option eval-profile-file $TEST_ROOT/profile.json \
+    --eval --strict $TEST_ROOT/profile.nix
+[[ $(grep -c '"name":"primop genList"' $TEST_ROOT/profile.json) = 1 ]]
+
+# The profile is also written if evaluation fails.
+(! nix-instantiate --option eval-profiler chrome --option eval-profile-file $TEST_ROOT/profile.json \
+    --eval -E 'let f = x: throw "foo"; in f 1')
+grep -q '"name":"f at (string):1:9","cat":"function"' $TEST_ROOT/profile.json
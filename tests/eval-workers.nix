@@ -0,0 +1,31 @@
+{ withError ? false }:
+
+with import ./config.nix;
+
+let
+
+  mkPkg = name: meta: mkDerivation {
+    inherit name meta;
+    buildCommand = "mkdir $out";
+  };
+
+in
+
+rec {
+  a = mkPkg "a-1.0" { description = "Package A"; priority = 5; };
+  b = mkPkg "b-2.0" { description = "Package B"; license = { shortName = "mit"; free = true; }; };
+  c = mkPkg "c-0.1" { maintainers = [ "alice" "bob" ]; weight = 1.5; broken = false; };
+  aliasOfA = a;
+  invalidMeta = mkPkg "invalid-1" { description = "Invalid"; f = x: x; };
+  typedMeta = mkPkg "typed-1" { weight = 1.0; file = ./eval-workers.nix; files = [ ./config.nix ]; };
+  failing = mkPkg "failing-1" {} // { outPath = assert false; "/nowhere"; drvPath = assert false; "/nowhere"; };
+  multi = mkDerivation {
+    name = "multi-1";
+    outputs = [ "out" "dev" ];
+    buildCommand = "mkdir $out $dev";
+    meta.description = "Multiple outputs";
+  };
+  nested = { recurseForDerivations = true; d = mkPkg "d-3" { description = "Nested"; }; };
+} // (if withError then {
+  error = mkPkg "error-1" {} // { drvPath = throw "oops"; };
+} else {})
@@ -0,0 +1,64 @@
+source common.sh
+
+# Querying with several evaluation workers gives the same results as
+# querying serially.
+for flags in "" "--json" "--json --meta" "--xml --meta --out-path --drv-path" \
+    "--out-path --drv-path --system --description" "--attr-path --status"; do
+    nix-env -f ./eval-workers.nix -qa $flags > $TEST_ROOT/serial 2> $TEST_ROOT/serial.err
+    nix-env -f ./eval-workers.nix -qa $flags --option eval-workers 3 > $TEST_ROOT/parallel 2> $TEST_ROOT/parallel.err
+    diff -u $TEST_ROOT/serial $TEST_ROOT/parallel
+    diff -u $TEST_ROOT/serial.err $TEST_ROOT/parallel.err
+done
+
+# 'aliasOfA' is the same derivation as 'a', and 'failing' is skipped
+# when its output path is needed.
+nix-env -f ./eval-workers.nix -qa --out-path --option eval-workers 3 > $TEST_ROOT/parallel
+[[ $(grep -c '^a-1.0 ' $TEST_ROOT/parallel) = 1 ]]
+(! grep -q failing $TEST_ROOT/parallel)
+grep -q '^multi-1 *dev=.*;.*-multi-1$' $TEST_ROOT/parallel
+
+# JSON output always includes the meta attributes.
+nix-env -f ./eval-workers.nix -qa --json --option eval-workers 3 > $TEST_ROOT/parallel 2> $TEST_ROOT/parallel.err
+grep -q '"shortName": "mit"' $TEST_ROOT/parallel
+grep -q '"f": null' $TEST_ROOT/parallel
+grep -q "invalid meta attribute 'f'" $TEST_ROOT/parallel.err
+
+# Meta attributes keep their types: floats stay floats, and paths are
+# rejected rather than copied to the store.
+nix-env -f ./eval-workers.nix -qa --xml --meta --option eval-workers 3 > $TEST_ROOT/parallel 2> $TEST_ROOT/parallel.err
+grep -q 'name="weight" type="float"' $TEST_ROOT/parallel
+grep -q "invalid meta attribute 'file'" $TEST_ROOT/parallel.err
+grep -q "invalid meta attribute 'files'" $TEST_ROOT/parallel.err
+
+# Evaluation errors are reported as in serial mode.
+for workers in 1 3; do
+    (! nix-env -f ./eval-workers.nix --arg withError true -qa --drv-path \
+        --option eval-workers $workers 2> $TEST_ROOT/err)
+    grep -q "while querying the derivation named 'error-1'" $TEST_ROOT/err
+    grep -q "oops" $TEST_ROOT/err
+done
+
+# nix-instantiate instantiates the elements of a list in parallel.
+expr='with import ./eval-workers.nix {}; [ a b c multi nested.d ]'
+nix-instantiate -E "$expr" > $TEST_ROOT/serial
+nix-instantiate -E "$expr" --option eval-workers 3 > $TEST_ROOT/parallel
+diff -u $TEST_ROOT/serial $TEST_ROOT/parallel
+[[ $(wc -l < $TEST_ROOT/parallel) = 5 ]]
+
+# The derivations written by the workers are valid once their paths
+# have been printed, both with a local store (where each worker opens
+# its own database connection) and with the daemon (where the workers
+# must flush their queued writes before exiting).
+clearStore
+nix-env -f ./eval-workers.nix -qa --drv-path --no-name --option eval-workers 3 > $TEST_ROOT/drv-paths
+[[ $(wc -l < $TEST_ROOT/drv-paths) -ge 3 ]]
+nix-store --check-validity $(cat $TEST_ROOT/drv-paths)
+
+clearStore
+startDaemon
+nix-env -f ./eval-workers.nix -qa --drv-path --no-name --option eval-workers 3 > $TEST_ROOT/drv-paths
+[[ $(wc -l < $TEST_ROOT/drv-paths) -ge 3 ]]
+nix-store --check-validity $(cat $TEST_ROOT/drv-paths)
+nix-instantiate -E "$expr" --option eval-workers 3 > $TEST_ROOT/drv-paths
+nix-store --check-validity $(cat $TEST_ROOT/drv-paths)
+killDaemon
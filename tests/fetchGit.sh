@@ -139,3 +139,45 @@ NIX=$(command -v nix)
 # Try again, with 'git' available.  This should work.
 path5=$(nix eval --raw "(builtins.fetchGit { url = $repo; ref = \"dev\"; }).outPath")
 [[ $path3 = $path5 ]]
+
+# Executables, symlinks and subdirectories are exported as by 'git
+# archive', both with and without a .gitattributes file (which makes
+# fetchGit fall back to 'git archive').
+mkdir -p $repo/sub
+echo 'echo hi' > $repo/sub/run.sh
+chmod +x $repo/sub/run.sh
+ln -s sub/run.sh $repo/link
+git -C $repo add sub link
+git -C $repo commit -m 'Bla6'
+rev4=$(git -C $repo rev-parse HEAD)
+path6=$(nix eval --raw "(builtins.fetchGit { url = $repo; rev = \"$rev4\"; }).outPath")
+[[ -x $path6/sub/run.sh ]]
+[[ $(readlink $path6/link) = sub/run.sh ]]
+[[ $path6 = $(nix eval --raw "(builtins.fetchGit $repo).outPath") ]]
+
+echo 'ignored export-ignore' > $repo/.gitattributes
+echo foo > $repo/ignored
+git -C $repo add .gitattributes ignored
+git -C $repo commit -m 'Bla7'
+path7=$(nix eval --raw "(builtins.fetchGit { url = $repo; ref = \"dev\"; }).outPath")
+[[ -e $path7/.gitattributes ]]
+[[ ! -e $path7/ignored ]]
+
+# The revision count is kept after the store path is garbage-collected.
+nix-store --delete $path6
+[[ $(nix eval "(builtins.fetchGit { url = $repo; rev = \"$rev4\"; }).revCount") = 4 ]]
+
+# Old versions of Git recorded other permission bits than 644 and 755.
+legacy=$TEST_ROOT/git-legacy-modes
+rm -rf $legacy
+git init $legacy
+git -C $legacy config user.email "foobar@example.com"
+git -C $legacy config user.name "Foobar"
+blob=$(echo foo | git -C $legacy hash-object -w --stdin)
+tree=$(printf "100664 blob $blob\tfile\n100775 blob $blob\texe\n" | git -C $legacy mktree)
+rev5=$(git -C $legacy commit-tree -m legacy $tree)
+git -C $legacy update-ref refs/heads/master $rev5
+path8=$(nix eval --raw "(builtins.fetchGit { url = $legacy; rev = \"$rev5\"; }).outPath")
+[[ $(cat $path8/file) = foo ]]
+[[ ! -x $path8/file ]]
+[[ -x $path8/exe ]]
@@ -0,0 +1,29 @@
+source common.sh
+
+# Parse a multi-megabyte JSON document resembling a lock file.
+nix-instantiate --eval --strict --json -E '
+  builtins.listToAttrs (builtins.genList (n: {
+    name = "node-${toString n}";
+    value = {
+      inputs = { nixpkgs = "nixpkgs_${toString (n / 50)}"; utils = "utils"; };
+      locked = {
+        lastModified = 1600000000 + n;
+        narHash = builtins.hashString "sha256" (toString n);
+        rev = builtins.hashString "sha1" (toString n);
+        type = "github";
+      };
+      flake = n / 2 * 2 == n;
+      weight = n * 0.5;
+    };
+  }) 50000)' > $TEST_ROOT/big.json
+
+timeCommand "parsing big.json" nix-instantiate --eval -E "builtins.length (builtins.attrNames (builtins.fromJSON (builtins.readFile $TEST_ROOT/big.json)))" > $TEST_ROOT/count
+
+[[ $(cat $TEST_ROOT/count) = 50000 ]]
+
+# The result is the same as the value that was serialised.
+[[ $(nix-instantiate --eval -E "
+  let v = builtins.fromJSON (builtins.readFile $TEST_ROOT/big.json); in
+  v.\"node-4321\".locked.rev == builtins.hashString \"sha1\" \"4321\"
+  && v.\"node-4321\".weight == 2160.5
+  && builtins.toJSON v == builtins.readFile $TEST_ROOT/big.json") = true ]]
@@ -0,0 +1,132 @@
+source common.sh
+
+# nix-daemon collects garbage incrementally in the background when free
+# disk space drops below min-free.
+n=${NIX_BENCH_PATHS:-2000}
+
+dir=$TEST_ROOT/gc-incremental
+rm -rf $dir
+mkdir -p $dir/store $dir/state/gcroots
+store="local?real=$dir/store&state=$dir/state"
+export NIX_REMOTE=$store
+
+# Each path has a NAR size of 1.
+makeSyntheticStore inc $n 1 | sed "s|^$NIX_STORE_DIR/|$dir/store/|" | xargs mkdir
+
+p() { syntheticPath inc $1; }
+
+ln -s $(p 2) $dir/state/gcroots/root
+
+nix-store -qR $(p 2) | sort > $dir/live
+nrLive=$(wc -l < $dir/live)
+
+echo 0 > $dir/free
+
+startGC() {
+    rm -f $NIX_STATE_DIR/daemon-socket/socket $dir/state/gc-status.json
+    _NIX_TEST_FREE_SPACE_FILE=$dir/free nix-daemon \
+        --option gc-incremental true \
+        --option min-free 1000 \
+        --option min-free-check-interval 1 "$@" 2> $dir/daemon.log &
+    pidDaemon=$!
+    trap "kill -9 $pidDaemon" EXIT
+}
+
+stopGC() {
+    kill -9 $pidDaemon
+    wait $pidDaemon || true
+    trap "" EXIT
+}
+
+waitForStatus() {
+    for ((i = 0; i < 60; i++)); do
+        if [[ -e $dir/state/gc-status.json ]] && grep -q "$1" $dir/state/gc-status.json; then
+            return
+        fi
+        sleep 1
+    done
+    cat $dir/state/gc-status.json
+    false
+}
+
+# Make every incremental collection fail. The collector records the
+# error and keeps running, and after a few failures it falls back to a
+# normal collection, which leaves the incremental trash directory
+# alone.
+touch $dir/store/trash-incremental
+
+startGC
+
+waitForStatus '"lastError":"[^"]*is not a directory'
+waitForStatus '"fullCollections":[1-9]'
+waitForStatus "\"pathsDeleted\":$((n - nrLive)),"
+kill -0 $pidDaemon
+grep -q 'falling back to a normal garbage collection' $dir/daemon.log
+[[ -f $dir/store/trash-incremental ]]
+
+stopGC
+rm $dir/store/trash-incremental
+
+[[ -z $(nix-store --gc --print-dead | grep -- -inc-) ]]
+nix-store --gc --print-live | sort | diff - $dir/live
+[[ $(ls $dir/store | grep -c -- -inc-) = $nrLive ]]
+
+# Paths that become rooted, temporarily rooted or referenced by a newly
+# registered path while a cycle is running survive it. With
+# gc-max-pause set to 0, finding the roots always takes too long, but
+# every batch still deletes some paths, at no more than gc-max-rate
+# bytes per second.
+m=600
+makeSyntheticStore mid $m 1 | sed "s|^$NIX_STORE_DIR/|$dir/store/|" | xargs mkdir
+
+q() { syntheticPath mid $1; }
+
+extra=$(syntheticPath extra 1)
+survivors="$(q 10) $(q 12)"
+
+cat > $dir/hook <<EOF
+#! /bin/sh -e
+ln -sfn $(q 10) $dir/state/gcroots/mid
+mkdir -p $dir/store/$(basename $extra)
+printf "%s\\n%s\\n1\\n\\n1\\n%s\\n" $extra $(printf %064d 0) $(q 12) | nix-store --load-db
+EOF
+
+# A temporary root is a locked file in the temproots directory.
+if type -p python3 > /dev/null; then
+    survivors="$survivors $(q 11)"
+    cat > $dir/holder.py <<'EOF'
+import fcntl, os, sys, time
+f = open(os.path.join(sys.argv[1], str(os.getpid())), 'w+')
+fcntl.lockf(f, fcntl.LOCK_SH)
+f.write(sys.argv[2] + '\0')
+f.flush()
+open(sys.argv[3], 'w').close()
+time.sleep(3600)
+EOF
+    cat >> $dir/hook <<EOF
+if [ ! -e $dir/holder.pid ]; then
+    mkdir -p $dir/state/temproots
+    python3 $dir/holder.py $dir/state/temproots $(q 11) $dir/holder.ready > /dev/null 2>&1 &
+    echo \$! > $dir/holder.pid
+    while [ ! -e $dir/holder.ready ]; do sleep 0.1; done
+fi
+EOF
+fi
+
+chmod +x $dir/hook
+
+nrSurvivors=$(nix-store -qR $survivors | grep -c -- -mid-)
+
+start=$SECONDS
+_NIX_TEST_GC_SWEEP_HOOK=$dir/hook startGC --option gc-max-pause 0 --option gc-max-rate 100
+
+waitForStatus "\"pathsDeleted\":$((m - nrSurvivors)),"
+(( SECONDS - start >= 2 ))
+(! grep -q lastError $dir/state/gc-status.json)
+grep -q "exceeds 'gc-max-pause'" $dir/daemon.log
+
+stopGC
+if [[ -e $dir/holder.pid ]]; then kill $(cat $dir/holder.pid); fi
+
+nix-store --check-validity $extra $(nix-store -qR $survivors)
+[[ $(ls $dir/store | grep -c -- -mid-) = $nrSurvivors ]]
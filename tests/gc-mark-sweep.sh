@@ -0,0 +1,98 @@
+source common.sh
+
+# Garbage collection of a large store, timing the mark and sweep
+# phases together.
+n=${NIX_BENCH_PATHS:-10000}
+
+dir=$TEST_ROOT/gc-mark-sweep
+rm -rf $dir
+mkdir -p $dir/store $dir/state/gcroots
+export NIX_REMOTE="local?real=$dir/store&state=$dir/state"
+
+# Each path has a NAR size of 1.
+makeSyntheticStore gc $n 1 | sed "s|^$NIX_STORE_DIR/|$dir/store/|" | xargs mkdir
+
+p() { syntheticPath gc $1; }
+
+# An invalid path, which is always garbage.
+junk=$(printf "%032d-junk" 0)
+mkdir $dir/store/$junk
+
+ln -s $(p 2) $dir/state/gcroots/root
+
+nix-store -qR $(p 2) | sort > $dir/live
+nrLive=$(wc -l < $dir/live)
+
+nix-store --gc --print-live | sort | diff - $dir/live
+nix-store --gc --print-dead > $dir/dead
+[[ $(grep -c -- -gc- $dir/dead) = $((n - nrLive)) ]]
+grep -q -- $junk $dir/dead
+(! grep -q "^$(p 2)\$" $dir/dead)
+
+# Stop after deleting about 100 bytes, i.e. 100 paths. The paths are
+# invalidated in an order that keeps the database consistent.
+nix-store --gc --max-freed 100 > /dev/null
+[[ ! -e $dir/store/$junk ]]
+nrDead=$(nix-store --gc --print-dead | grep -c -- -gc-)
+(( nrDead >= n - nrLive - 102 && nrDead <= n - nrLive - 100 ))
+
+timeCommand "garbage collection of $n paths" nix-store --gc > /dev/null
+
+[[ -z $(nix-store --gc --print-dead | grep -- -gc-) ]]
+nix-store --gc --print-live | sort | diff - $dir/live
+[[ $(ls $dir/store | grep -c -- -gc-) = $nrLive ]]
+
+# With keep-derivations, the deriver of a live path is live, and with
+# keep-outputs, the outputs of a live derivation are.
+drvExpr='derivation { name = "keep"; system = "x"; builder = "/bin/sh"; }'
+drv=$(nix-instantiate -E "$drvExpr")
+out=$(nix-store -q --outputs $drv)
+
+registerOutput() {
+    mkdir -p $dir/store/$(basename $out)
+    printf "%s\n%s\n0\n%s\n0\n" $out $(printf %064d 0) $drv | nix-store --load-db
+}
+
+registerOutput
+
+ln -sfn $out $dir/state/gcroots/keep
+(! nix-store --gc --print-live --option keep-derivations false | grep -q "^$drv\$")
+nix-store --gc --print-live --option keep-derivations true | grep -q "^$drv\$"
+
+ln -sfn $drv $dir/state/gcroots/keep
+(! nix-store --gc --print-live --option keep-outputs false | grep -q "^$out\$")
+nix-store --gc --print-live --option keep-outputs true | grep -q "^$out\$"
+nix-store --gc --option keep-outputs true > /dev/null
+nix-store --check-validity $drv $out
+
+rm $dir/state/gcroots/keep
+nix-store --gc > /dev/null
+(! nix-store --check-validity $drv)
+(! nix-store --check-validity $out)
+
+# Paths registered during the sweep are live, and so is everything
+# they refer to and, with keep-derivations, their derivers.
+drv=$(nix-instantiate -E "$drvExpr")
+dead=$(syntheticPath gc $((n + 1)))
+printf "%s\n%s\n1\n\n0\n" $dead $(printf %064d 0) | nix-store --load-db
+mkdir $dir/store/$(basename $dead)
+new=$(syntheticPath new 1)
+
+cat > $dir/hook <<EOF2
+#! /bin/sh -e
+mkdir $dir/store/$(basename $out) $dir/store/$(basename $new)
+printf "%s\\n%s\\n0\\n%s\\n0\\n" $out $(printf %064d 0) $drv | nix-store --load-db
+printf "%s\\n%s\\n1\\n\\n1\\n%s\\n" $new $(printf %064d 0) $dead | nix-store --load-db
+EOF2
+chmod +x $dir/hook
+
+_NIX_TEST_GC_SWEEP_HOOK=$dir/hook nix-store --gc --option keep-derivations true > /dev/null
+nix-store --check-validity $new $dead $out $drv
+[[ -e $dir/store/$(basename $dead) ]]
+
+# They are garbage for the next collection.
+nix-store --gc > /dev/null
+(! nix-store --check-validity $new)
+(! nix-store --check-validity $dead)
+(! nix-store --check-validity $out)
+(! nix-store --check-validity $drv)
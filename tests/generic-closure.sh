@@ -0,0 +1,19 @@
+source common.sh
+
+# genericClosure over a large dependency graph, with integer and with
+# string keys. The CPU time is printed from the statistics.
+cat > $TEST_ROOT/closure.nix <<EOF2
+let
+  deps = n: if n < 2 then [] else [ (n / 2) (n - 1) (n / 3) ];
+  closure = mkKey: builtins.genericClosure {
+    startSet = [ { key = mkKey 100000; n = 100000; } ];
+    operator = x: map (n: { key = mkKey n; inherit n; }) (deps x.n);
+  };
+in map (mkKey: builtins.length (closure mkKey)) [ (n: n) (n: "pkg-\${toString n}") ]
+EOF2
+
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats.json \
+    nix-instantiate --eval --strict $TEST_ROOT/closure.nix > $TEST_ROOT/result
+grep '"cpuTime"' $TEST_ROOT/stats.json
+
+[[ $(cat $TEST_ROOT/result) = '[ 100000 100000 ]' ]]
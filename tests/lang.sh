@@ -10,6 +10,11 @@ set +x
 
 fail=0
 
+# The parse cache is tested with an empty cache (cold) and after the
+# files have been added to it (warm).
+export XDG_CACHE_HOME=$TEST_ROOT/lang-cache
+rm -rf $XDG_CACHE_HOME
+
 for i in lang/parse-fail-*.nix; do
     echo "parsing $i (should fail)";
     i=$(basename $i .nix)
@@ -26,6 +31,16 @@ for i in lang/parse-okay-*.nix; do
         echo "FAIL: $i should parse"
         fail=1
     fi
+    nix-instantiate --parse lang/$i.nix > lang/$i.out
+    for cache in cold warm; do
+        if ! nix-instantiate --option parse-cache true --parse lang/$i.nix > lang/$i.out.cache; then
+            echo "FAIL: $i should parse using the parse cache ($cache)"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.out.cache; then
+            echo "FAIL: parse result of $i using the parse cache ($cache) not as expected"
+            fail=1
+        fi
+    done
 done
 
 for i in lang/eval-fail-*.nix; do
@@ -35,6 +50,10 @@ for i in lang/eval-fail-*.nix; do
         echo "FAIL: $i shouldn't evaluate"
         fail=1
     fi
+    if nix-instantiate --option eval-bytecode true --eval lang/$i.nix; then
+        echo "FAIL: $i shouldn't evaluate using bytecode"
+        fail=1
+    fi
 done
 
 for i in lang/eval-okay-*.nix; do
@@ -52,6 +71,22 @@ for i in lang/eval-okay-*.nix; do
         elif ! diff lang/$i.out lang/$i.exp; then
             echo "FAIL: evaluation result of $i not as expected"
             fail=1
+        elif ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option eval-bytecode true --eval --strict lang/$i.nix > lang/$i.out; then
+            echo "FAIL: $i should evaluate using bytecode"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: evaluation result of $i using bytecode not as expected"
+            fail=1
+        else
+            for cache in cold warm; do
+                if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option parse-cache true --eval --strict lang/$i.nix > lang/$i.out; then
+                    echo "FAIL: $i should evaluate using the parse cache ($cache)"
+                    fail=1
+                elif ! diff lang/$i.out lang/$i.exp; then
+                    echo "FAIL: evaluation result of $i using the parse cache ($cache) not as expected"
+                    fail=1
+                fi
+            done
         fi
     fi
 
@@ -0,0 +1,38 @@
+# Attribute sets large enough to be looked up through a hash index.
+with builtins;
+
+let
+
+  names = genList (n: "a${toString n}") 1000;
+
+  big = listToAttrs (map (name: { inherit name; value = name; }) names);
+
+  big2 = big // { a5 = "x"; b = "y"; };
+
+  small = removeAttrs big (genList (n: "a${toString (n + 10)}") 990);
+
+  rec1 = rec {
+    x00 = 0;  x01 = x00 + 1; x02 = x01 + 1; x03 = x02 + 1; x04 = x03 + 1;
+    x05 = x04 + 1; x06 = x05 + 1; x07 = x06 + 1; x08 = x07 + 1; x09 = x08 + 1;
+    x10 = x09 + 1; x11 = x10 + 1; x12 = x11 + 1; x13 = x12 + 1; x14 = x13 + 1;
+    x15 = x14 + 1; x16 = x15 + 1; x17 = x16 + 1; x18 = x17 + 1; x19 = x18 + 1;
+    x20 = x19 + 1; x21 = x20 + 1; x22 = x21 + 1; x23 = x22 + 1; x24 = x23 + 1;
+    x25 = x24 + 1; x26 = x25 + 1; x27 = x26 + 1; x28 = x27 + 1; x29 = x28 + 1;
+    x30 = x29 + 1; x31 = x30 + 1; x32 = x31 + 1; x33 = x32 + 1; x34 = x33 + 1;
+    ${"dyn"} = x34 * 2;
+    __overrides = { x00 = 100; };
+  };
+
+in [
+  (all (name: big.${name} == name) names)
+  (all (name: big ? ${name}) names)
+  (big ? b)
+  (big.b or "default")
+  big2.a5
+  big2.b
+  big2.a999
+  (attrNames small)
+  rec1.x34
+  rec1.dyn
+  (({ a500, a501 ? "unused", ... }: a500 + a501) big)
+]
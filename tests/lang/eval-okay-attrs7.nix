@@ -0,0 +1,33 @@
+# Chains of '//' on large attribute sets.
+with builtins;
+
+let
+
+  big = listToAttrs (genList (n: { name = "a${toString n}"; value = n; }) 100);
+
+  # More updates than the maximum number of layers.
+  chain = foldl' (s: n: s // { "a${toString n}" = -n; "b${toString n}" = n; }) big (genList (n: n * 7) 20);
+
+  nested = big // (big // { a1 = "x"; }) // { c = 1; };
+
+  sum = foldl' (x: y: x + y) 0;
+
+in [
+  chain.a0
+  chain.a7
+  chain.a8
+  chain.b133
+  (chain ? b134)
+  (chain.b134 or "default")
+  (length (attrNames chain))
+  (sum (attrValues chain))
+  (attrNames (removeAttrs chain (attrNames big)))
+  (chain == (chain // {}))
+  (chain == (chain // { a0 = 1; }))
+  (intersectAttrs { a7 = null; b7 = null; z = null; } chain)
+  (({ a9, b14 ? 0, ... }: a9 + b14) chain)
+  nested.a1
+  nested.c
+  (length (attrNames nested))
+  (mapAttrs (n: v: v + 1) (removeAttrs nested (attrNames big)))
+]
@@ -0,0 +1,14 @@
+with builtins;
+
+let
+
+  keys = startSet: map (x: x.key) (genericClosure { inherit startSet; operator = x: []; });
+
+in [
+  # Integers and floats that are equal are the same key.
+  (keys [ { key = 1; } { key = 1.0; } { key = 2.5; } { key = 2; } ])
+  (keys [ { key = "a"; } { key = "b"; } { key = "a"; } ])
+  (keys [ { key = /foo; } { key = /foo; } ])
+  (sort lessThan [ 3 1.5 2 ])
+  ([ 1 2 ] == [ 1.0 2.0 ])
+]
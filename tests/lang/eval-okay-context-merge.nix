@@ -0,0 +1,47 @@
+let
+  drv = name: derivation {
+    inherit name;
+    builder = "/bin/false";
+    system = "x86_64-linux";
+    outputs = [ "out" "dev" ];
+  };
+
+  a = drv "a";
+  b = drv "b";
+  c = drv "c";
+
+  strip = builtins.unsafeDiscardStringContext;
+
+  # Strings whose contexts overlap, concatenated in different ways.
+  ab = "${a}${b}";
+  bc = "${b.dev}:${c}";
+  abc1 = "${ab} ${bc} ${ab}";
+  abc2 = ab + bc;
+  abc3 = builtins.concatStringsSep "/" [ bc ab bc "x" ];
+
+  # Enough contexts that the intermediate results are too big to be
+  # interned.
+  many = builtins.genList (i: drv "d${toString i}") 40;
+  manyStr = builtins.foldl' (s: d: s + "${d}") "" many;
+  manyStr2 = builtins.foldl' (s: d: "${d}" + s) "" many;
+
+  expected = {
+    "${strip a.drvPath}" = { outputs = [ "out" ]; };
+    "${strip b.drvPath}" = { outputs = [ "dev" "out" ]; };
+    "${strip c.drvPath}" = { outputs = [ "out" ]; };
+  };
+
+in [
+  (builtins.getContext ab == {
+    "${strip a.drvPath}" = { outputs = [ "out" ]; };
+    "${strip b.drvPath}" = { outputs = [ "out" ]; };
+  })
+  (builtins.getContext abc1 == expected)
+  (builtins.getContext abc2 == expected)
+  (builtins.getContext abc3 == expected)
+  (builtins.getContext "${abc1}${abc2}" == expected)
+  (builtins.getContext (strip abc1 + bc) == builtins.getContext bc)
+  (builtins.length (builtins.attrNames (builtins.getContext manyStr)) == 40)
+  (builtins.getContext manyStr == builtins.getContext manyStr2)
+  (builtins.getContext "${manyStr}${ab}${manyStr2}" == builtins.getContext manyStr // builtins.getContext ab)
+]
@@ -0,0 +1,9 @@
+# Unicode escapes, duplicate keys (the last one wins) and the range of
+# integers.
+builtins.fromJSON
+  ''
+    { "a": "\u00e9\u20ac\ud83d\ude00\u0041",
+      "b": [ -9223372036854775808, 9223372036854775807, 1.5e3, [ [ ] ] ],
+      "c": 1, "d": { }, "c": 2
+    }
+  ''
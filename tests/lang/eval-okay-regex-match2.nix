@@ -0,0 +1,21 @@
+with builtins;
+
+let
+
+  # Long enough to overflow the stack of a backtracking matcher.
+  long = concatStringsSep "" (genList (i: "ab") 100000);
+
+in [
+  (match "(a|b)*" long != null)
+  (stringLength (head (match "(.*)b" long)))
+  (length (split "(b)" long))
+
+  # Leftmost, then longest, then the earliest alternative.
+  (match "(a|ab)(c|bcd)(d*)" "abcd")
+  (match "(a*)+" "aa")
+  (match "(a|b)*" "ab")
+  (split "x*" "abc")
+  (split "(^a)" "aaa")
+  (match "[]a-]+" "a]-")
+  (match "[[:upper:]]+\\.[^[:space:]]*" "FOO.bar")
+]
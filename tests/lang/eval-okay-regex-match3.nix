@@ -0,0 +1,18 @@
+with builtins;
+
+[
+  # Repetitions of a body that can match the empty string.
+  (match "(a*)*" "aaa")
+  (match "b+b{0,2}((a{0,2})*)+" "bbba")
+  (match "(a|)*" "aa")
+  (split "((b+)?)*" "abba")
+
+  # Named collating elements.
+  (match "[[.hyphen.]]([[.period.]]|x)" "-.")
+  (split "[[.space.]]" "a b")
+
+  # A greedy repetition doesn't skip its body if a match can be found
+  # by entering it, even if skipping it gives a longer match.
+  (split "(a[ab]?){0,2}" "aabba")
+  (split "(a[ab]?)?(a[ab]?)?" "aabba")
+]
@@ -30,7 +30,25 @@ nix_tests = \
   search.sh \
   nix-copy-ssh.sh \
   post-hook.sh \
-  function-trace.sh
+  function-trace.sh \
+  eval-cache.sh \
+  eval-profiler.sh \
+  eval-arena.sh \
+  drv-parse.sh \
+  generic-closure.sh \
+  source-cache.sh \
+  from-json.sh \
+  alloc-stats.sh \
+  eval-workers.sh \
+  read-connections.sh \
+  batch-queries.sh \
+  ref-graph.sh \
+  gc-mark-sweep.sh \
+  gc-incremental.sh \
+  daemon-drv-hashes.sh \
+  write-behind.sh \
+  parse-cache.sh \
+  attr-lookup.sh
   # parallel.sh
 
 install-tests += $(foreach x, $(nix_tests), tests/$(x))
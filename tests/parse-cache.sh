@@ -0,0 +1,57 @@
+source common.sh
+
+# Evaluation with a cold and a warm parse cache gives the same result
+# as without the cache. The three evaluations of a large file are
+# timed.
+n=${NIX_BENCH_ATTRS:-20000}
+
+dir=$TEST_ROOT/parse-cache
+rm -rf $dir
+mkdir -p $dir
+
+export XDG_CACHE_HOME=$dir/cache
+cacheDir=$XDG_CACHE_HOME/nix/parse-cache-v1
+
+awk -v n=$n 'BEGIN {
+    print "rec {";
+    for (i = 0; i < n; i++)
+        printf "  a%d = { x ? %d, ... }: if x > 0 then [ \"a%d-${toString x}\" ] ++ (a%d { x = x - 1; }) else [ ];\n", i, i % 5, i, i;
+    print "}";
+}' > $dir/big.nix
+
+echo "let s = import ./big.nix; in builtins.length (s.a$((n - 1)) {}) + builtins.length (builtins.attrNames s)" > $dir/main.nix
+
+hits() {
+    nix-instantiate --eval -E "(builtins.fromJSON (builtins.readFile $dir/stats.json)).parseCache.hits"
+}
+
+evalTimed() {
+    NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$dir/stats.json \
+        timeCommand "evaluation of $n attributes with parse-cache = $1 ($2)" \
+        nix-instantiate --eval --strict --option parse-cache $1 $dir/main.nix > $dir/result-$2
+}
+
+evalTimed false none
+[[ $(nix-instantiate --eval -E "(builtins.fromJSON (builtins.readFile $dir/stats.json)) ? parseCache") = false ]]
+evalTimed true cold
+[[ $(hits) = 0 ]]
+evalTimed true warm
+[[ $(hits) = 2 ]]
+
+[[ $(cat $dir/result-none) = $((n + (n - 1) % 5)) ]]
+cmp $dir/result-none $dir/result-cold
+cmp $dir/result-none $dir/result-warm
+
+# Entries that haven't been used for 'parse-cache-max-age' seconds are
+# evicted when a new entry is added.
+[[ $(ls $cacheDir | wc -l) = 2 ]]
+touch -d '3 days ago' $cacheDir/* $cacheDir/.last-eviction
+echo 1 > $dir/unused.nix
+nix-instantiate --eval --option parse-cache true --option parse-cache-max-age $((2 * 24 * 60 * 60)) $dir/unused.nix
+[[ $(ls $cacheDir | wc -l) = 1 ]]
+
+# '~/' paths are expanded while parsing, so entries aren't shared
+# between home directories.
+echo '~/foo' > $dir/home.nix
+[[ $(HOME=$dir/home-a nix-instantiate --eval --option parse-cache true $dir/home.nix) = $dir/home-a/foo ]]
+[[ $(HOME=$dir/home-b nix-instantiate --eval --option parse-cache true $dir/home.nix) = $dir/home-b/foo ]]
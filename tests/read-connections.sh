@@ -0,0 +1,27 @@
+source common.sh
+
+# Closure queries give the same results with any number of read-only
+# database connections. They are timed for each number; set
+# NIX_BENCH_PATHS to e.g. 1000000 to see a difference.
+n=${NIX_BENCH_PATHS:-10000}
+
+dir=$TEST_ROOT/read-connections
+rm -rf $dir
+mkdir -p $dir
+store="local?real=$dir/store&state=$dir/state"
+export NIX_REMOTE=$store
+
+makeSyntheticStore bench $n > /dev/null
+
+top=$(syntheticPath bench 1)
+bottom=$(syntheticPath bench $n)
+
+for conns in 0 1 2 4 8; do
+    export NIX_REMOTE="$store&max-read-connections=$conns"
+    timeCommand "closure of $n paths with $conns read connections" \
+        nix-store -qR $top > $dir/closure
+    [[ $(wc -l < $dir/closure) = $n ]]
+
+    nix-store -q --referrers-closure $bottom > $dir/closure
+    grep -q "^$top\$" $dir/closure
+done
@@ -0,0 +1,92 @@
+source common.sh
+
+# Closure and referrer queries on the in-memory reference graph give
+# the same results as database queries.
+n=${NIX_BENCH_PATHS:-10000}
+
+dir=$TEST_ROOT/ref-graph
+rm -rf $dir
+mkdir -p $dir
+export NIX_REMOTE="local?real=$dir/store&state=$dir/state"
+
+makeSyntheticStore graph $n > /dev/null
+
+p() { syntheticPath graph $1; }
+
+for graph in false true; do
+    timeCommand "closure of $n paths with in-memory-ref-graph = $graph" \
+        nix-store --option in-memory-ref-graph $graph -qR $(p 1) > $dir/closure-$graph
+    sort -o $dir/closure-$graph $dir/closure-$graph
+
+    nix-store --option in-memory-ref-graph $graph -q --referrers-closure $(p $n) | sort > $dir/referrers-closure-$graph
+    nix-store --option in-memory-ref-graph $graph -q --referrers $(p 12) | sort > $dir/referrers-$graph
+done
+
+[[ $(wc -l < $dir/closure-true) = $n ]]
+diff $dir/closure-false $dir/closure-true
+diff $dir/referrers-closure-false $dir/referrers-closure-true
+diff $dir/referrers-false $dir/referrers-true
+[[ $(cat $dir/referrers-true) = $(printf "%s\n" $(p 4) $(p 6) | sort) ]]
+
+# Unknown paths fall back to the database, which reports the error.
+(! nix-store --option in-memory-ref-graph true -qR $(p $((n + 1))))
+
+# Deleting paths updates the graph, so that a path can be deleted once
+# its referrers have been deleted by the same process.
+for i in 1 2 3; do mkdir -p $dir/store/$(basename $(p $i)); done
+nix-store --option in-memory-ref-graph true --delete $(p 1) $(p 2) $(p 3)
+(! nix-store --check-validity $(p 1))
+(! nix-store --check-validity $(p 2))
+[[ -z $(nix-store --option in-memory-ref-graph true -q --referrers $(p 4)) ]]
+[[ $(nix-store --option in-memory-ref-graph true -q --referrers $(p 9)) = $(p 4) ]]
+
+# A long-running process picks up the paths that other processes
+# register, and notices when they invalidate paths.
+if type -p python3 > /dev/null; then
+    extra=$(syntheticPath extra 1)
+    mkdir -p $dir/store/$(basename $extra)
+    python3 - $(p 5) $extra <<'PY'
+import struct, subprocess, sys
+
+start, extra = sys.argv[1], sys.argv[2]
+
+serve = subprocess.Popen(['nix-store', '--serve', '--option', 'in-memory-ref-graph', 'true'],
+    stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+def put(*xs):
+    for x in xs:
+        if isinstance(x, int):
+            serve.stdin.write(struct.pack('<Q', x))
+        else:
+            x = x.encode()
+            serve.stdin.write(struct.pack('<Q', len(x)) + x + b'\0' * (-len(x) % 8))
+    serve.stdin.flush()
+
+def getInt():
+    return struct.unpack('<Q', serve.stdout.read(8))[0]
+
+def getString():
+    n = getInt()
+    return serve.stdout.read(n + (-n % 8))[:n].decode()
+
+def closure(path):
+    put(7, 0, 1, path)
+    return {getString() for i in range(getInt())}
+
+put(0x390c9deb)
+assert getInt() == 0x5452eecb
+getInt()
+put(0x205)
+
+before = closure(start)
+
+subprocess.run(['nix-store', '--register-validity', '--hash-given'], check=True,
+    input='%s\n%s\n0\n\n1\n%s\n' % (extra, '0' * 64, start), universal_newlines=True)
+assert closure(extra) == before | {extra}
+
+subprocess.run(['nix-store', '--delete', extra], check=True)
+put(7, 0, 1, extra)
+assert serve.stdout.read(8) == b''
+assert serve.wait() != 0
+PY
+fi
@@ -0,0 +1,72 @@
+source common.sh
+
+clearStore
+
+rm -f $TEST_HOME/.cache/nix/source-cache-v1.sqlite
+
+src=$TEST_ROOT/source-cache
+rm -rf $src
+mkdir -p $src/sub
+echo foo > $src/foo
+echo bar > $src/sub/bar
+echo ignored > $src/ignored
+
+# Trees containing files modified in the last few seconds are not
+# cached, so backdate the files.
+backdate() {
+    touch -t 202001010000 "$@"
+}
+backdate $(find $src)
+
+expr="{ lit = \"\${$src}\"; filtered = builtins.filterSource (p: t: baseNameOf p != \"ignored\") $src; }"
+
+hits() {
+    nix-instantiate --eval -E "(builtins.fromJSON (builtins.readFile $TEST_ROOT/stats.json)).sourceCache.hits"
+}
+
+addCached() {
+    NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$TEST_ROOT/stats.json \
+        nix-instantiate --read-write-mode --option source-cache true "$@" --eval --strict -E "$expr"
+}
+
+# The first evaluation populates the cache, the second one uses it.
+res1=$(addCached)
+[[ $(hits) = 0 ]]
+[[ $(addCached) = "$res1" ]]
+[[ $(hits) = 2 ]]
+
+# Changing a file invalidates the entries that contain it.
+echo foo2 > $src/foo
+backdate $src/foo
+res2=$(addCached)
+[[ $res2 != "$res1" ]]
+[[ $(hits) = 0 ]]
+
+# ...but not if the filter excludes it.
+echo ignored2 > $src/ignored
+backdate $src/ignored
+[[ $(addCached -A filtered) = $(nix-instantiate --eval -E "$expr" -A filtered) ]]
+[[ $(hits) = 1 ]]
+
+# Garbage-collected paths are copied again.
+nix-store --gc
+[[ $(addCached -A lit) = $(nix-instantiate --eval -E "$expr" -A lit) ]]
+path=$(addCached -A lit | sed 's/"//g')
+[[ -e $path/sub/bar ]]
+
+# In verify mode, nothing is taken from the cache.
+addCached --option source-cache-verify true > /dev/null
+[[ $(hits) = 0 ]]
+
+# A file that was just modified could change again without changing
+# its fingerprint, so the trees that contain it are not cached.
+echo bar2 > $src/sub/bar
+addCached > /dev/null
+[[ $(addCached) = $(nix-instantiate --eval --strict -E "$expr") ]]
+[[ $(hits) = 0 ]]
+
+# On a miss, the filter is called only once per file.
+nix-instantiate --read-write-mode --option source-cache true --eval \
+    -E "builtins.filterSource (p: t: builtins.trace \"filter \${p}\" true) $src" \
+    2> $TEST_ROOT/source-cache-trace > /dev/null
+[[ $(grep -c "filter $src/foo\$" $TEST_ROOT/source-cache-trace) = 1 ]]
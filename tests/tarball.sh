@@ -10,19 +10,88 @@ mkdir -p $tarroot
 cp dependencies.nix $tarroot/default.nix
 cp config.nix dependencies.builder*.sh $tarroot/
 
-tarball=$TEST_ROOT/tarball.tar.xz
-(cd $TEST_ROOT && tar c tarball) | xz > $tarball
+test_tarball() {
+    local ext="$1"
+    local compressor="$2"
 
-nix-env -f file://$tarball -qa --out-path | grep -q dependencies
+    tarball=$TEST_ROOT/tarball.tar$ext
+    (cd $TEST_ROOT && tar c tarball) | $compressor > $tarball
 
-nix-build -o $TEST_ROOT/result file://$tarball
+    nix-env -f file://$tarball -qa --out-path | grep -q dependencies
 
-nix-build -o $TEST_ROOT/result '<foo>' -I foo=file://$tarball
+    nix-build -o $TEST_ROOT/result file://$tarball
 
-nix-build -o $TEST_ROOT/result -E "import (fetchTarball file://$tarball)"
+    nix-build -o $TEST_ROOT/result '<foo>' -I foo=file://$tarball
+
+    nix-build -o $TEST_ROOT/result -E "import (fetchTarball file://$tarball)"
+
+    nix-build -o $TEST_ROOT/result -E "import (fetchTarball file://$tarball)" --keep-tarballs --tarball-ttl 0
+
+    nix-prefetch-url --unpack file://$tarball
+}
+
+hash=$(nix hash-path $tarroot)
+
+test_tarball '' cat
+test_tarball .xz xz
+test_tarball .bz2 bzip2
+
+# Formats that we don't decode ourselves are unpacked by tar.
+for c in zstd:.zst lzip:.lz lzma:.lzma; do
+    if type -p ${c%:*} > /dev/null; then
+        test_tarball ${c#*:} ${c%:*}
+        path=$(nix-instantiate --eval --read-write-mode -E "fetchTarball file://$tarball" --tarball-ttl 0)
+        [[ $(nix hash-path $(echo $path | tr -d '"')) = $hash ]]
+    fi
+done
+
+test_tarball .gz gzip
+
+# Unpacking while downloading and unpacking a kept tarball yield
+# the same store path.
+path1=$(nix-instantiate --eval --read-write-mode -E "fetchTarball file://$tarball" --tarball-ttl 0)
+path2=$(nix-instantiate --eval --read-write-mode -E "fetchTarball file://$tarball" --tarball-ttl 0 --keep-tarballs)
+[[ $path1 = $path2 ]]
+[[ $(nix hash-path $(echo $path1 | tr -d '"')) = $hash ]]
+
+# Archive members may not be written through symlinks.
+(cd $TEST_ROOT && rm -rf evil && mkdir evil && ln -s / evil/link && tar cf evil.tar evil \
+    && rm evil/link && mkdir evil/link && touch evil/link/foo && tar rf evil.tar evil/link/foo)
+(! nix-instantiate --eval --read-write-mode -E "fetchTarball file://$TEST_ROOT/evil.tar")
 
 nix-instantiate --eval -E '1 + 2' -I fnord=file://no-such-tarball.tar.xz
 nix-instantiate --eval -E 'with <fnord/xyzzy>; 1 + 2' -I fnord=file://no-such-tarball.tar.xz
 (! nix-instantiate --eval -E '<fnord/xyzzy> 1' -I fnord=file://no-such-tarball.tar.xz)
 
 nix-instantiate --eval -E '<fnord/config.nix>' -I fnord=file://no-such-tarball.tar.xz -I fnord=.
+
+# If a tarball can't be downloaded anymore, the cached result is used.
+cp $tarball $TEST_ROOT/cached.tar.gz
+path1=$(nix-instantiate --eval --read-write-mode -E "fetchTarball file://$TEST_ROOT/cached.tar.gz" --tarball-ttl 0)
+rm $TEST_ROOT/cached.tar.gz
+[[ $(nix-instantiate --eval --read-write-mode -E "fetchTarball file://$TEST_ROOT/cached.tar.gz" --tarball-ttl 0 2> $TEST_ROOT/log) = $path1 ]]
+grep -q 'using cached result' $TEST_ROOT/log
+
+# The same holds if the server sends an error page, which must not be
+# mistaken for the tarball.
+if type -p python3 > /dev/null; then
+    rm -rf $TEST_ROOT/www
+    mkdir -p $TEST_ROOT/www
+    cp $tarball $TEST_ROOT/www/cached.tar.gz
+    port=$((20000 + RANDOM % 10000))
+    (cd $TEST_ROOT/www && exec python3 -m http.server $port --bind 127.0.0.1) > /dev/null 2>&1 &
+    pidServer=$!
+    trap "kill $pidServer" EXIT
+    for ((i = 0; i < 30; i++)); do
+        if (echo > /dev/tcp/127.0.0.1/$port) 2> /dev/null; then break; fi
+        sleep 1
+    done
+    url=http://127.0.0.1:$port/cached.tar.gz
+    path1=$(nix-instantiate --eval --read-write-mode -E "fetchTarball $url" --tarball-ttl 0)
+    rm $TEST_ROOT/www/cached.tar.gz
+    [[ $(nix-instantiate --eval --read-write-mode -E "fetchTarball $url" --tarball-ttl 0 2> $TEST_ROOT/log) = $path1 ]]
+    grep -q 'HTTP error 404' $TEST_ROOT/log
+    grep -q 'using cached result' $TEST_ROOT/log
+    kill $pidServer
+    trap "" EXIT
+fi
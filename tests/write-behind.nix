@@ -0,0 +1,12 @@
+{ n ? 1100 }:
+
+with import ./config.nix;
+
+mkDerivation {
+  name = "write-behind";
+  buildCommand = "mkdir $out";
+  deps = builtins.genList (i: mkDerivation {
+    name = "write-behind-${toString i}";
+    buildCommand = "echo ${toString i} > $out";
+  }) n;
+}
@@ -0,0 +1,23 @@
+source common.sh
+
+# Derivations written during evaluation are sent to the daemon in
+# batches (more than one, since there are more of them than fit in the
+# queue). The daemon must register them under the paths computed by
+# the client.
+clearStore
+
+startDaemon
+
+drvPath=$(nix-instantiate write-behind.nix)
+nix-store -qR $drvPath > $TEST_ROOT/write-behind-closure
+[[ $(grep -c 'write-behind-[0-9]*\.drv$' $TEST_ROOT/write-behind-closure) = 1100 ]]
+nix-store --check-validity $(cat $TEST_ROOT/write-behind-closure)
+
+[[ $(NIX_REMOTE="daemon?write-behind=false" nix-instantiate write-behind.nix) = $drvPath ]]
+
+# Commands that don't flush the queue at the end don't defer writes,
+# so a derivation path printed by 'nix eval' is valid.
+drvPath=$(nix eval --raw '(derivation { name = "write-behind-eval"; builder = "/bin/sh"; system = "x"; }).drvPath')
+nix-store --check-validity $drvPath
+
+killDaemon